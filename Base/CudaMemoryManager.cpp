@@ -1,22 +1,108 @@
 #include <StdAfx.h>
 #include "CudaMemoryManager.h"
+#include <algorithm>
 
 namespace CudaTracerLib {
 
+std::recursive_mutex CudaMemoryManager::s_mutex;
 std::map<void*, CudaMemoryEntry> CudaMemoryManager::alloced_entries;
-std::vector<CudaMemoryEntry> CudaMemoryManager::freed_entries;
+CudaMemoryTagStatistics CudaMemoryManager::s_tagStatistics[MEMORY_TAG_COUNT];
+size_t CudaMemoryManager::s_uLiveBytes = 0;
+size_t CudaMemoryManager::s_uPeakBytes = 0;
+size_t CudaMemoryManager::s_uBudget = 0;
+std::vector<CudaMemoryManager::EvictionEntry> CudaMemoryManager::s_evictionCallbacks;
+unsigned int CudaMemoryManager::s_uNextCallbackId = 0;
+bool CudaMemoryManager::s_bEvicting = false;
+static DeviceCudaAllocator g_deviceAllocator;
+ICudaAllocator* CudaMemoryManager::s_pAllocator = &g_deviceAllocator;
 
-cudaError_t CudaMemoryManager::Cuda_malloc_managed(void** v, size_t i, const std::string& callig_func)
+static thread_local CudaMemoryTag g_currentTag = MEMORY_TAG_OTHER;
+
+const char* getCudaMemoryTagName(CudaMemoryTag tag)
+{
+	switch (tag)
+	{
+	case MEMORY_TAG_GEOMETRY:
+		return "Geometry";
+	case MEMORY_TAG_BVH:
+		return "BVH";
+	case MEMORY_TAG_TEXTURES:
+		return "Textures";
+	case MEMORY_TAG_PHOTON_MAPS:
+		return "Photon maps";
+	case MEMORY_TAG_FRAMEBUFFERS:
+		return "Framebuffers";
+	default:
+		return "Other";
+	}
+}
+
+CudaMemoryTagScope::CudaMemoryTagScope(CudaMemoryTag tag)
+	: m_previous(g_currentTag)
+{
+	g_currentTag = tag;
+}
+
+CudaMemoryTagScope::~CudaMemoryTagScope()
+{
+	g_currentTag = m_previous;
+}
+
+CudaMemoryTag CudaMemoryManager::getCurrentScopeTag()
+{
+	return g_currentTag;
+}
+
+bool CudaMemoryManager::evict(size_t bytesNeeded)
+{
+	//allocations done by the callbacks themselves must not evict again
+	if (s_bEvicting)
+		return false;
+	s_bEvicting = true;
+	size_t freed = 0;
+	auto callbacks = s_evictionCallbacks;
+	for (auto& c : callbacks)
+	{
+		if (freed >= bytesNeeded)
+			break;
+		freed += c.clb(bytesNeeded - freed);
+	}
+	s_bEvicting = false;
+	return freed >= bytesNeeded;
+}
+
+cudaError_t CudaMemoryManager::Cuda_malloc_managed(void** v, size_t i, const std::string& callig_func, CudaMemoryTag tag)
 {
-	cudaError_t r = cudaMalloc(v, i);
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	if (tag == MEMORY_TAG_COUNT)
+		tag = g_currentTag;
+
+	if (s_uBudget != 0 && s_uLiveBytes + i > s_uBudget && !evict(s_uLiveBytes + i - s_uBudget))
+		throw std::runtime_error(format("Device memory budget of %llu bytes exceeded by allocation of %llu bytes in %s!", (unsigned long long)s_uBudget, (unsigned long long)i, callig_func.c_str()));
+
+	cudaError_t r = s_pAllocator->Malloc(v, i);
+	if (r == cudaErrorMemoryAllocation)
+	{
+		//clear the error state and retry once after the callbacks had a chance to release memory
+		cudaGetLastError();
+		if (evict(i))
+			r = s_pAllocator->Malloc(v, i);
+	}
 	if (r == cudaError_t::cudaSuccess)
 	{
 		CudaMemoryEntry e;
 		e.address = *v;
-		e.free_func = "";
 		e.length = i;
+		e.tag = tag;
 		e.malloc_func = callig_func;
 		alloced_entries[*v] = e;
+
+		auto& stats = s_tagStatistics[tag];
+		stats.liveBytes += i;
+		stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+		stats.numAllocations++;
+		s_uLiveBytes += i;
+		s_uPeakBytes = std::max(s_uPeakBytes, s_uLiveBytes);
 	}
 	else ThrowCudaErrors(r);
 	return r;
@@ -24,20 +110,120 @@ cudaError_t CudaMemoryManager::Cuda_malloc_managed(void** v, size_t i, const std
 
 cudaError_t CudaMemoryManager::Cuda_free_managed(void* v, const std::string& callig_func)
 {
-	cudaError_t r = cudaError_t::cudaSuccess;
-	if (alloced_entries.count(v))
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	auto it = alloced_entries.find(v);
+	//freed entries are removed, freeing twice therefore ends up here too
+	if (it == alloced_entries.end())
+		throw std::runtime_error("Trying to free cuda memory which was not allocated or was already freed in " + callig_func + "!");
+	auto& stats = s_tagStatistics[it->second.tag];
+	stats.liveBytes -= it->second.length;
+	stats.numAllocations--;
+	s_uLiveBytes -= it->second.length;
+	alloced_entries.erase(it);
+	cudaError_t r = s_pAllocator->Free(v);
+	ThrowCudaErrors(r);
+	return r;
+}
+
+void CudaMemoryManager::SetTag(void* v, CudaMemoryTag tag)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	auto it = alloced_entries.find(v);
+	if (it == alloced_entries.end())
+		throw std::runtime_error("Trying to tag cuda memory which was not allocated!");
+	auto& e = it->second;
+	auto& oldStats = s_tagStatistics[e.tag], &newStats = s_tagStatistics[tag];
+	oldStats.liveBytes -= e.length;
+	oldStats.numAllocations--;
+	newStats.liveBytes += e.length;
+	newStats.peakBytes = std::max(newStats.peakBytes, newStats.liveBytes);
+	newStats.numAllocations++;
+	e.tag = tag;
+}
+
+CudaMemoryTag CudaMemoryManager::GetTag(void* v)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	auto it = alloced_entries.find(v);
+	return it == alloced_entries.end() ? g_currentTag : it->second.tag;
+}
+
+void CudaMemoryManager::SetBudget(size_t bytes)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	s_uBudget = bytes;
+}
+
+size_t CudaMemoryManager::GetBudget()
+{
+	return s_uBudget;
+}
+
+unsigned int CudaMemoryManager::RegisterEvictionCallback(CudaMemoryTag tag, const CudaMemoryEvictionCallback& clb)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	EvictionEntry e;
+	e.id = s_uNextCallbackId++;
+	e.tag = tag;
+	e.clb = clb;
+	s_evictionCallbacks.push_back(e);
+	return e.id;
+}
+
+void CudaMemoryManager::UnregisterEvictionCallback(unsigned int id)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	s_evictionCallbacks.erase(std::remove_if(s_evictionCallbacks.begin(), s_evictionCallbacks.end(), [&](const EvictionEntry& e) {return e.id == id; }), s_evictionCallbacks.end());
+}
+
+void CudaMemoryManager::SetAllocator(ICudaAllocator* allocator)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	if (alloced_entries.size())
+		throw std::runtime_error("The allocator can not be changed while memory is allocated!");
+	s_pAllocator = allocator ? allocator : &g_deviceAllocator;
+	for (int i = 0; i < MEMORY_TAG_COUNT; i++)
+		s_tagStatistics[i] = CudaMemoryTagStatistics();
+	s_uLiveBytes = s_uPeakBytes = 0;
+}
+
+CudaMemoryTagStatistics CudaMemoryManager::GetStatistics(CudaMemoryTag tag)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	return s_tagStatistics[tag];
+}
+
+size_t CudaMemoryManager::GetLiveBytes()
+{
+	return s_uLiveBytes;
+}
+
+size_t CudaMemoryManager::GetPeakBytes()
+{
+	return s_uPeakBytes;
+}
+
+std::vector<CudaMemoryEntry> CudaMemoryManager::GetLiveAllocations()
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	std::vector<CudaMemoryEntry> r;
+	for (auto& e : alloced_entries)
+		r.push_back(e.second);
+	return r;
+}
+
+void CudaMemoryManager::PrintStatus(std::vector<std::string>& a_Buf)
+{
+	std::lock_guard<std::recursive_mutex> lock(s_mutex);
+	a_Buf.push_back(format("Device memory : %.2f [MB], peak %.2f [MB]", s_uLiveBytes / (1024.0f * 1024.0f), s_uPeakBytes / (1024.0f * 1024.0f)));
+	if (s_uBudget)
+		a_Buf.push_back(format("Device memory budget : %.2f [MB]", s_uBudget / (1024.0f * 1024.0f)));
+	for (int i = 0; i < MEMORY_TAG_COUNT; i++)
 	{
-		CudaMemoryEntry e = alloced_entries[v];
-		if (e.address == 0)
-			throw std::runtime_error("Trying to free cuda memory multiple times!");
-		//alloced_entries.erase(v);
-		e.free_func = callig_func;
-		freed_entries.push_back(e);
-		r = cudaFree(v);
-		ThrowCudaErrors(r);
+		auto& s = s_tagStatistics[i];
+		if (s.peakBytes)
+			a_Buf.push_back(format("  %s : %.2f [MB], peak %.2f [MB], %d allocations", getCudaMemoryTagName((CudaMemoryTag)i), s.liveBytes / (1024.0f * 1024.0f), s.peakBytes / (1024.0f * 1024.0f), s.numAllocations));
 	}
-	else throw std::runtime_error("Trying to free cuda memory without allocating it correctly!");
-	return r;
 }
 
 }
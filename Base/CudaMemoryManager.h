@@ -3,38 +3,183 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <mutex>
+#include <functional>
 #include <stdlib.h>
 #include "cuda_runtime.h"
 #include "Platform.h"
 
 namespace CudaTracerLib {
 
+//category of a device allocation used for the accounting
+enum CudaMemoryTag
+{
+	MEMORY_TAG_OTHER,
+	MEMORY_TAG_GEOMETRY,
+	MEMORY_TAG_BVH,
+	MEMORY_TAG_TEXTURES,
+	MEMORY_TAG_PHOTON_MAPS,
+	MEMORY_TAG_FRAMEBUFFERS,
+	MEMORY_TAG_COUNT,
+};
+
 struct CudaMemoryEntry
 {
 	void* address;
 	size_t length;
+	CudaMemoryTag tag;
 	std::string malloc_func;
-	std::string free_func;
 };
-class CudaMemoryManager
+
+struct CudaMemoryTagStatistics
+{
+	size_t liveBytes;
+	size_t peakBytes;
+	unsigned int numAllocations;
+
+	CudaMemoryTagStatistics()
+		: liveBytes(0), peakBytes(0), numAllocations(0)
+	{
+
+	}
+};
+
+//allocates the device memory for the memory manager
+class ICudaAllocator
+{
+public:
+	virtual ~ICudaAllocator()
+	{
+
+	}
+	virtual cudaError_t Malloc(void** v, size_t i) = 0;
+	virtual cudaError_t Free(void* v) = 0;
+};
+
+class DeviceCudaAllocator : public ICudaAllocator
+{
+public:
+	virtual cudaError_t Malloc(void** v, size_t i)
+	{
+		return cudaMalloc(v, i);
+	}
+	virtual cudaError_t Free(void* v)
+	{
+		return cudaFree(v);
+	}
+};
+
+//host memory with a fixed capacity, allows testing the accounting and the budget without a gpu
+class HostMockCudaAllocator : public ICudaAllocator
 {
+	size_t m_uCapacity;
+	size_t m_uUsed;
+	std::map<void*, size_t> m_allocations;
 public:
-	CTL_EXPORT static std::map<void*, CudaMemoryEntry> alloced_entries;
-	CTL_EXPORT static std::vector<CudaMemoryEntry> freed_entries;
+	HostMockCudaAllocator(size_t capacity)
+		: m_uCapacity(capacity), m_uUsed(0)
+	{
+
+	}
+	virtual cudaError_t Malloc(void** v, size_t i)
+	{
+		if (m_uUsed + i > m_uCapacity)
+			return cudaErrorMemoryAllocation;
+		*v = malloc(i ? i : 1);
+		m_allocations[*v] = i;
+		m_uUsed += i;
+		return cudaSuccess;
+	}
+	virtual cudaError_t Free(void* v)
+	{
+		auto it = m_allocations.find(v);
+		if (it == m_allocations.end())
+			return cudaErrorInvalidDevicePointer;
+		m_uUsed -= it->second;
+		m_allocations.erase(it);
+		free(v);
+		return cudaSuccess;
+	}
+	size_t getUsedBytes() const
+	{
+		return m_uUsed;
+	}
+};
+
+//callback trying to release at least the requested number of bytes, returns the number of bytes freed
+typedef std::function<size_t(size_t bytesNeeded)> CudaMemoryEvictionCallback;
+
+class CudaMemoryManager
+{
+	struct EvictionEntry
+	{
+		unsigned int id;
+		CudaMemoryTag tag;
+		CudaMemoryEvictionCallback clb;
+	};
+	//the eviction callbacks free memory themselves, therefore the lock has to be recursive
+	static std::recursive_mutex s_mutex;
+	static std::map<void*, CudaMemoryEntry> alloced_entries;
+	static CudaMemoryTagStatistics s_tagStatistics[MEMORY_TAG_COUNT];
+	static size_t s_uLiveBytes;
+	static size_t s_uPeakBytes;
+	static size_t s_uBudget;
+	static std::vector<EvictionEntry> s_evictionCallbacks;
+	static unsigned int s_uNextCallbackId;
+	static bool s_bEvicting;
+	static ICudaAllocator* s_pAllocator;
+
+	//invokes the eviction callbacks until bytesNeeded bytes were freed, returns false if that was not possible
+	static bool evict(size_t bytesNeeded);
 public:
-	CTL_EXPORT static cudaError_t Cuda_malloc_managed(void** v, size_t i, const std::string& callig_func);
-	template<typename T> static cudaError_t Cuda_malloc_managed(T** v, size_t i, const std::string& callig_func)
+	//allocations without an explicit tag use the tag of the innermost CudaMemoryTagScope of the thread
+	CTL_EXPORT static cudaError_t Cuda_malloc_managed(void** v, size_t i, const std::string& callig_func, CudaMemoryTag tag = MEMORY_TAG_COUNT);
+	template<typename T> static cudaError_t Cuda_malloc_managed(T** v, size_t i, const std::string& callig_func, CudaMemoryTag tag = MEMORY_TAG_COUNT)
 	{
-		return Cuda_malloc_managed((void**)v, i, callig_func);
+		return Cuda_malloc_managed((void**)v, i, callig_func, tag);
 	}
 	CTL_EXPORT static cudaError_t Cuda_free_managed(void* v, const std::string& callig_func);
 	template<typename T> static cudaError_t Cuda_free_managed(T* v, const std::string&callig_func)
 	{
 		return Cuda_free_managed((void*)v, callig_func);
 	}
+
+	//moves an existing allocation to another category
+	CTL_EXPORT static void SetTag(void* v, CudaMemoryTag tag);
+	CTL_EXPORT static CudaMemoryTag GetTag(void* v);
+	CTL_EXPORT static CudaMemoryTag getCurrentScopeTag();
+
+	//maximum number of live bytes, 0 for no limit
+	//allocations exceeding the budget first invoke the eviction callbacks and fail if not enough memory could be released
+	CTL_EXPORT static void SetBudget(size_t bytes);
+	CTL_EXPORT static size_t GetBudget();
+	//callbacks are invoked in the order of registration, also when the allocator itself runs out of memory
+	CTL_EXPORT static unsigned int RegisterEvictionCallback(CudaMemoryTag tag, const CudaMemoryEvictionCallback& clb);
+	CTL_EXPORT static void UnregisterEvictionCallback(unsigned int id);
+
+	//replaces the allocator, only valid while no memory is allocated, null restores the device allocator
+	CTL_EXPORT static void SetAllocator(ICudaAllocator* allocator);
+
+	CTL_EXPORT static CudaMemoryTagStatistics GetStatistics(CudaMemoryTag tag);
+	CTL_EXPORT static size_t GetLiveBytes();
+	CTL_EXPORT static size_t GetPeakBytes();
+	CTL_EXPORT static std::vector<CudaMemoryEntry> GetLiveAllocations();
+	CTL_EXPORT static void PrintStatus(std::vector<std::string>& a_Buf);
+};
+
+//sets the tag of all allocations of the current thread in its lifetime which do not specify one
+class CudaMemoryTagScope
+{
+	CudaMemoryTag m_previous;
+public:
+	CTL_EXPORT CudaMemoryTagScope(CudaMemoryTag tag);
+	CTL_EXPORT ~CudaMemoryTagScope();
 };
 
+CTL_EXPORT const char* getCudaMemoryTagName(CudaMemoryTag tag);
+
 #define CUDA_MALLOC(v,i) CudaMemoryManager::Cuda_malloc_managed(v, i, std::string(__func__))
+#define CUDA_MALLOC_TAGGED(v,i,tag) CudaMemoryManager::Cuda_malloc_managed(v, i, std::string(__func__), tag)
 #define CUDA_FREE(v) CudaMemoryManager::Cuda_free_managed(v, std::string(__func__))
 #define CUDA_MEMCPY_TO_HOST(dest,src,length) ThrowCudaErrors(cudaMemcpy(dest, src, length, cudaMemcpyDeviceToHost))
 #define CUDA_MEMCPY_TO_DEVICE(dest,src,length) ThrowCudaErrors(cudaMemcpy(dest, src, length, cudaMemcpyHostToDevice))
@@ -0,0 +1,303 @@
+#include <StdAfx.h>
+#include "ExrWriter.h"
+#include <Math/half.h>
+#include <Engine/SceneLoader/Mitsuba/miniz.h>
+#include <algorithm>
+#include <cstdio>
+
+namespace CudaTracerLib {
+
+//all values in the file are little endian like the host
+template<typename T> static void appendBytes(std::vector<unsigned char>& data, const T& val)
+{
+	size_t off = data.size();
+	data.resize(off + sizeof(T));
+	memcpy(&data[off], &val, sizeof(T));
+}
+
+static void appendString(std::vector<unsigned char>& data, const std::string& s)
+{
+	data.insert(data.end(), s.begin(), s.end());
+	data.push_back(0);
+}
+
+static void appendAttribute(std::vector<unsigned char>& header, const char* name, const char* type, const std::vector<unsigned char>& value)
+{
+	appendString(header, name);
+	appendString(header, type);
+	appendBytes(header, (int)value.size());
+	header.insert(header.end(), value.begin(), value.end());
+}
+
+template<typename T> static void appendAttribute(std::vector<unsigned char>& header, const char* name, const char* type, const T& val)
+{
+	std::vector<unsigned char> value;
+	appendBytes(value, val);
+	appendAttribute(header, name, type, value);
+}
+
+static void appendBox(std::vector<unsigned char>& header, const char* name, int w, int h)
+{
+	std::vector<unsigned char> box;
+	appendBytes(box, 0);
+	appendBytes(box, 0);
+	appendBytes(box, w - 1);
+	appendBytes(box, h - 1);
+	appendAttribute(header, name, "box2i", box);
+}
+
+void ExrImage::AddChannel(const std::string& name, ExrPixelType type, const float* data, unsigned int stride)
+{
+	auto it = std::find_if(m_channels.begin(), m_channels.end(), [&](const Channel& c) {return c.name == name; });
+	if (it == m_channels.end())
+	{
+		m_channels.push_back(Channel());
+		it = m_channels.end() - 1;
+	}
+	it->name = name;
+	it->type = type;
+	it->data.resize(m_width * m_height);
+	for (unsigned int i = 0; i < m_width * m_height; i++)
+		it->data[i] = data[i * stride];
+}
+
+void ExrImage::AddLayer(const std::string& layer, const std::vector<std::string>& channelNames, ExrPixelType type, const float* data)
+{
+	for (size_t i = 0; i < channelNames.size(); i++)
+		AddChannel(layer.empty() ? channelNames[i] : layer + "." + channelNames[i], type, data + i, (unsigned int)channelNames.size());
+}
+
+//predictor and byte reordering of the zip compression, the first halves of the values are stored in front of the second ones
+static void encodeZip(const std::vector<unsigned char>& raw, std::vector<unsigned char>& tmp, std::vector<unsigned char>& out)
+{
+	size_t n = raw.size();
+	tmp.resize(n);
+	size_t mid = (n + 1) / 2;
+	for (size_t i = 0; i < n; i++)
+		tmp[(i % 2) * mid + i / 2] = raw[i];
+	int p = tmp.size() ? tmp[0] : 0;
+	for (size_t i = 1; i < n; i++)
+	{
+		int t = tmp[i];
+		tmp[i] = (unsigned char)(t - p + (128 + 256));
+		p = t;
+	}
+	mz_ulong size = mz_compressBound((mz_ulong)n);
+	out.resize(size);
+	if (mz_compress2(&out[0], &size, n ? &tmp[0] : 0, (mz_ulong)n, MZ_BEST_SPEED) != MZ_OK)
+		throw std::runtime_error("Could not compress the exr chunk!");
+	//chunks which do not get smaller are stored uncompressed as required by the format
+	if (size >= n)
+		out = raw;
+	else out.resize(size);
+}
+
+void ExrImage::Write(const std::string& file, const ExrWriteSettings& settings) const
+{
+	if (m_width == 0 || m_height == 0 || m_channels.empty())
+		throw std::runtime_error("Can not write an empty exr image!");
+
+	//the channels have to be stored in alphabetical order
+	std::vector<const Channel*> channels;
+	bool longNames = false;
+	for (auto& c : m_channels)
+	{
+		channels.push_back(&c);
+		longNames |= c.name.size() > 31;
+	}
+	std::sort(channels.begin(), channels.end(), [](const Channel* a, const Channel* b) {return a->name < b->name; });
+
+	bool tiled = settings.tileSize != 0;
+	unsigned int linesPerChunk = settings.compression == EXR_COMPRESSION_ZIP ? 16 : 1;
+	unsigned int chunkW = tiled ? settings.tileSize : m_width, chunkH = tiled ? settings.tileSize : linesPerChunk;
+	unsigned int numChunksX = (m_width + chunkW - 1) / chunkW, numChunksY = (m_height + chunkH - 1) / chunkH;
+
+	std::vector<unsigned char> header;
+	appendBytes(header, 20000630);
+	appendBytes(header, 2 | (tiled ? 0x200 : 0) | (longNames ? 0x400 : 0));
+
+	std::vector<unsigned char> chlist;
+	for (auto* c : channels)
+	{
+		appendString(chlist, c->name);
+		appendBytes(chlist, (int)c->type);
+		//pLinear and three reserved bytes
+		appendBytes(chlist, 0);
+		appendBytes(chlist, 1);
+		appendBytes(chlist, 1);
+	}
+	chlist.push_back(0);
+	appendAttribute(header, "channels", "chlist", chlist);
+	appendAttribute(header, "compression", "compression", (unsigned char)settings.compression);
+	appendBox(header, "dataWindow", m_width, m_height);
+	appendBox(header, "displayWindow", m_width, m_height);
+	appendAttribute(header, "lineOrder", "lineOrder", (unsigned char)0);
+	appendAttribute(header, "pixelAspectRatio", "float", 1.0f);
+	std::vector<unsigned char> center;
+	appendBytes(center, 0.0f);
+	appendBytes(center, 0.0f);
+	appendAttribute(header, "screenWindowCenter", "v2f", center);
+	appendAttribute(header, "screenWindowWidth", "float", 1.0f);
+	if (tiled)
+	{
+		//single level, rounding mode is irrelevant
+		std::vector<unsigned char> desc;
+		appendBytes(desc, settings.tileSize);
+		appendBytes(desc, settings.tileSize);
+		desc.push_back(0);
+		appendAttribute(header, "tiles", "tiledesc", desc);
+	}
+	header.push_back(0);
+
+	FILE* f = fopen(file.c_str(), "wb");
+	if (!f)
+		throw std::runtime_error("Could not open file for writing the exr image : " + file);
+	auto write = [&](const void* data, size_t size)
+	{
+		if (size && fwrite(data, 1, size, f) != size)
+		{
+			fclose(f);
+			throw std::runtime_error("Could not write the exr image : " + file);
+		}
+	};
+
+	//the offset table is filled in after all chunks were written
+	std::vector<unsigned long long> offsets(numChunksX * numChunksY, 0);
+	write(&header[0], header.size());
+	write(&offsets[0], offsets.size() * sizeof(unsigned long long));
+	unsigned long long pos = header.size() + offsets.size() * sizeof(unsigned long long);
+
+	std::vector<unsigned char> raw, tmp, encoded, chunkHeader;
+	for (unsigned int cy = 0; cy < numChunksY; cy++)
+		for (unsigned int cx = 0; cx < numChunksX; cx++)
+		{
+			unsigned int x0 = cx * chunkW, y0 = cy * chunkH;
+			unsigned int w = std::min(chunkW, m_width - x0), h = std::min(chunkH, m_height - y0);
+			raw.clear();
+			for (unsigned int y = y0; y < y0 + h; y++)
+				for (auto* c : channels)
+				{
+					const float* row = &c->data[y * m_width + x0];
+					for (unsigned int x = 0; x < w; x++)
+					{
+						if (c->type == EXR_PIXEL_HALF)
+							appendBytes(raw, (unsigned short)half(row[x]).bits());
+						else appendBytes(raw, row[x]);
+					}
+				}
+
+			const std::vector<unsigned char>* data = &raw;
+			if (settings.compression != EXR_COMPRESSION_NONE)
+			{
+				encodeZip(raw, tmp, encoded);
+				data = &encoded;
+			}
+
+			chunkHeader.clear();
+			if (tiled)
+			{
+				appendBytes(chunkHeader, (int)cx);
+				appendBytes(chunkHeader, (int)cy);
+				appendBytes(chunkHeader, 0);
+				appendBytes(chunkHeader, 0);
+			}
+			else appendBytes(chunkHeader, (int)y0);
+			appendBytes(chunkHeader, (int)data->size());
+
+			offsets[cy * numChunksX + cx] = pos;
+			write(&chunkHeader[0], chunkHeader.size());
+			write(&(*data)[0], data->size());
+			pos += chunkHeader.size() + data->size();
+		}
+
+	if (fseek(f, (long)header.size(), SEEK_SET) != 0)
+	{
+		fclose(f);
+		throw std::runtime_error("Could not write the exr image : " + file);
+	}
+	write(&offsets[0], offsets.size() * sizeof(unsigned long long));
+	fclose(f);
+}
+
+AsyncExrWriter::AsyncExrWriter()
+	: m_bWriting(false), m_bShutdown(false)
+{
+	m_thread = std::thread(&AsyncExrWriter::run, this);
+}
+
+AsyncExrWriter::~AsyncExrWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_bShutdown = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void AsyncExrWriter::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_cond.wait(lock, [&]() {return !m_jobs.empty() || m_bShutdown; });
+		//pending images are still written on shutdown
+		if (m_jobs.empty())
+			return;
+		Job job;
+		std::swap(job, m_jobs.front());
+		m_jobs.pop_front();
+		m_bWriting = true;
+		lock.unlock();
+
+		std::string error;
+		try
+		{
+			job.img.Write(job.file, job.settings);
+		}
+		catch (std::exception& ex)
+		{
+			error = ex.what();
+		}
+
+		lock.lock();
+		if (error.size())
+			m_lastError = error;
+		m_bWriting = false;
+		m_cond.notify_all();
+	}
+}
+
+void AsyncExrWriter::Submit(ExrImage& img, const std::string& file, const ExrWriteSettings& settings)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_jobs.push_back(Job());
+		std::swap(m_jobs.back().img, img);
+		m_jobs.back().file = file;
+		m_jobs.back().settings = settings;
+	}
+	img.Clear();
+	m_cond.notify_all();
+}
+
+void AsyncExrWriter::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [&]() {return m_jobs.empty() && !m_bWriting; });
+	if (m_lastError.size())
+	{
+		std::string error = m_lastError;
+		m_lastError.clear();
+		throw std::runtime_error("Writing the exr image failed : " + error);
+	}
+}
+
+bool AsyncExrWriter::isBusy()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return !m_jobs.empty() || m_bWriting;
+}
+
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "Platform.h"
+
+namespace CudaTracerLib {
+
+//the values are the ones used in the file
+enum ExrPixelType
+{
+	EXR_PIXEL_HALF = 1,
+	EXR_PIXEL_FLOAT = 2,
+};
+
+enum ExrCompression
+{
+	EXR_COMPRESSION_NONE = 0,
+	//deflate of single scanlines
+	EXR_COMPRESSION_ZIPS = 2,
+	//deflate of blocks of 16 scanlines
+	EXR_COMPRESSION_ZIP = 3,
+};
+
+struct ExrWriteSettings
+{
+	ExrCompression compression;
+	//edge length of the tiles, 0 to write a scanline image
+	unsigned int tileSize;
+
+	ExrWriteSettings(ExrCompression compression = EXR_COMPRESSION_ZIP, unsigned int tileSize = 0)
+		: compression(compression), tileSize(tileSize)
+	{
+
+	}
+};
+
+//host image with an arbitrary number of named channels, layers use the usual "layer.channel" naming
+//the writer does not depend on OpenEXR, only single part images with one level are supported
+class ExrImage
+{
+public:
+	struct Channel
+	{
+		std::string name;
+		ExrPixelType type;
+		std::vector<float> data;
+	};
+private:
+	unsigned int m_width, m_height;
+	std::vector<Channel> m_channels;
+public:
+	ExrImage(unsigned int w = 0, unsigned int h = 0)
+		: m_width(w), m_height(h)
+	{
+
+	}
+
+	unsigned int getWidth() const
+	{
+		return m_width;
+	}
+	unsigned int getHeight() const
+	{
+		return m_height;
+	}
+	const std::vector<Channel>& getChannels() const
+	{
+		return m_channels;
+	}
+
+	//copies w * h values which are stride floats apart, the first row is the top one
+	//an existing channel with the same name is replaced
+	CTL_EXPORT void AddChannel(const std::string& name, ExrPixelType type, const float* data, unsigned int stride = 1);
+	//adds the channels layer.channelNames[i] from the interleaved data with channelNames.size() floats per pixel
+	//an empty layer name adds the channels without a prefix
+	CTL_EXPORT void AddLayer(const std::string& layer, const std::vector<std::string>& channelNames, ExrPixelType type, const float* data);
+	void Clear()
+	{
+		m_channels.clear();
+	}
+
+	//the chunks are encoded and written one after another, only one chunk is held in memory in encoded form
+	CTL_EXPORT void Write(const std::string& file, const ExrWriteSettings& settings = ExrWriteSettings()) const;
+};
+
+//writes images on a background thread, the caller only pays for copying the channels to the host
+class AsyncExrWriter
+{
+	struct Job
+	{
+		ExrImage img;
+		std::string file;
+		ExrWriteSettings settings;
+	};
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<Job> m_jobs;
+	bool m_bWriting, m_bShutdown;
+	std::string m_lastError;
+
+	void run();
+public:
+	CTL_EXPORT AsyncExrWriter();
+	CTL_EXPORT ~AsyncExrWriter();
+
+	//the image is moved into the queue, every submitted image is written in order
+	CTL_EXPORT void Submit(ExrImage& img, const std::string& file, const ExrWriteSettings& settings = ExrWriteSettings());
+	//waits until all submitted images are written, throws if one of the writes failed
+	CTL_EXPORT void Wait();
+	CTL_EXPORT bool isBusy();
+};
+
+}
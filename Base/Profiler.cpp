@@ -0,0 +1,226 @@
+#include <StdAfx.h>
+#include "Profiler.h"
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace CudaTracerLib {
+
+//returns the buffer of the thread to the profiler when the thread exits
+struct ProfilerThreadHandle
+{
+	Profiler::ThreadBuffer* buffer;
+
+	ProfilerThreadHandle()
+		: buffer(0)
+	{
+
+	}
+	~ProfilerThreadHandle()
+	{
+		if (buffer)
+			Profiler::getInstance().releaseThreadBuffer(buffer);
+	}
+};
+
+static thread_local ProfilerThreadHandle g_profilerThreadHandle;
+
+Profiler::Profiler()
+	: m_startTime(std::chrono::steady_clock::now()), m_bEnabled(true)
+{
+
+}
+
+Profiler::~Profiler()
+{
+	for (auto* buf : m_threads)
+		delete buf;
+}
+
+Profiler& Profiler::getInstance()
+{
+	static Profiler instance;
+	return instance;
+}
+
+ProfilerZoneId Profiler::RegisterZone(const char* category, const char* name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_zones.size(); i++)
+		if (m_zones[i].category == category && m_zones[i].name == name)
+			return (ProfilerZoneId)i;
+	ZoneDesc desc;
+	desc.category = category;
+	desc.name = name;
+	m_zones.push_back(desc);
+	return (ProfilerZoneId)(m_zones.size() - 1);
+}
+
+Profiler::ThreadBuffer* Profiler::getThreadBuffer()
+{
+	if (g_profilerThreadHandle.buffer)
+		return g_profilerThreadHandle.buffer;
+
+	//only taken once per thread, buffers of finished threads are reused
+	std::lock_guard<std::mutex> lock(m_mutex);
+	ThreadBuffer* buf = 0;
+	for (auto* b : m_threads)
+		if (!b->inUse)
+		{
+			buf = b;
+			break;
+		}
+	if (!buf)
+	{
+		buf = new ThreadBuffer();
+		buf->threadIdx = (unsigned int)m_threads.size();
+		buf->numEvents = 0;
+		buf->firstEvent = 0;
+		m_threads.push_back(buf);
+	}
+	buf->depth = 0;
+	buf->inUse = true;
+	g_profilerThreadHandle.buffer = buf;
+	return buf;
+}
+
+void Profiler::releaseThreadBuffer(ThreadBuffer* buf)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	buf->inUse = false;
+}
+
+unsigned int Profiler::BeginZone()
+{
+	return getThreadBuffer()->depth++;
+}
+
+void Profiler::EndZone(ProfilerZoneId zone, unsigned long long beginNs, unsigned int depth)
+{
+	ThreadBuffer* buf = getThreadBuffer();
+	buf->depth = depth;
+	unsigned long long n = buf->numEvents.load(std::memory_order_relaxed);
+	ProfilerEvent& e = buf->events[n % PROFILER_RING_SIZE];
+	e.beginNs = beginNs;
+	e.endNs = getTimeNs();
+	e.zone = zone;
+	e.depth = depth;
+	buf->numEvents.store(n + 1, std::memory_order_release);
+}
+
+void Profiler::Clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto* buf : m_threads)
+		buf->firstEvent = buf->numEvents.load(std::memory_order_acquire);
+}
+
+void Profiler::collectEvents(std::vector<std::pair<ProfilerEvent, unsigned int>>& events) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto* buf : m_threads)
+	{
+		unsigned long long end = buf->numEvents.load(std::memory_order_acquire);
+		unsigned long long begin = std::max(buf->firstEvent.load(), end > PROFILER_RING_SIZE ? end - PROFILER_RING_SIZE : 0ull);
+		//the oldest events can be overwritten while copying if the thread is recording, they are skipped
+		if (end - begin > PROFILER_RING_SIZE / 2)
+			begin = end - PROFILER_RING_SIZE / 2;
+		for (unsigned long long i = begin; i < end; i++)
+			events.push_back(std::make_pair(buf->events[i % PROFILER_RING_SIZE], buf->threadIdx));
+	}
+}
+
+std::vector<Profiler::ZoneStatistics> Profiler::getStatistics(const char* category) const
+{
+	std::vector<std::pair<ProfilerEvent, unsigned int>> events;
+	collectEvents(events);
+	std::vector<ZoneDesc> zones;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		zones = m_zones;
+	}
+
+	std::vector<ZoneStatistics> stats(zones.size());
+	for (size_t i = 0; i < zones.size(); i++)
+	{
+		stats[i].category = zones[i].category;
+		stats[i].name = zones[i].name;
+		stats[i].depth = UINT_MAX;
+		stats[i].count = 0;
+		stats[i].totalSec = 0;
+		stats[i].minSec = DBL_MAX;
+		stats[i].maxSec = 0;
+	}
+	for (auto& e : events)
+	{
+		auto& s = stats[e.first.zone];
+		double sec = (e.first.endNs - e.first.beginNs) / 1e9;
+		s.depth = std::min(s.depth, e.first.depth);
+		s.count++;
+		s.totalSec += sec;
+		s.minSec = std::min(s.minSec, sec);
+		s.maxSec = std::max(s.maxSec, sec);
+	}
+
+	std::vector<ZoneStatistics> res;
+	for (auto& s : stats)
+		if (s.count && (!category || s.category == category))
+			res.push_back(s);
+	return res;
+}
+
+std::string Profiler::ToString(const char* category) const
+{
+	auto stats = getStatistics(category);
+	std::ostringstream oss;
+	oss << "[" << std::endl;
+	for (auto& s : stats)
+	{
+		std::string indent(2 * s.depth, ' ');
+		oss << format("%s%s/%s : %d x {Avg = %3.3f[ms], Min = %3.3f[ms], Max = %3.3f[ms]}", indent.c_str(), s.category.c_str(), s.name.c_str(),
+			s.count, s.totalSec / s.count * 1000, s.minSec * 1000, s.maxSec * 1000) << std::endl;
+	}
+	oss << "]" << std::endl;
+	return oss.str();
+}
+
+static std::string escapeJson(const std::string& s)
+{
+	std::string r;
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			r += '\\';
+		r += c;
+	}
+	return r;
+}
+
+void Profiler::WriteChromeTrace(const std::string& file) const
+{
+	std::vector<std::pair<ProfilerEvent, unsigned int>> events;
+	collectEvents(events);
+	std::vector<ZoneDesc> zones;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		zones = m_zones;
+	}
+	std::ofstream out(file);
+	if (!out)
+		throw std::runtime_error("Could not open file for writing the trace : " + file);
+	//complete events, the timestamps are in microseconds
+	out << "{\"traceEvents\":[" << std::endl;
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		auto& e = events[i].first;
+		auto& z = zones[e.zone];
+		out << format("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}%s",
+			escapeJson(z.name).c_str(), escapeJson(z.category).c_str(), e.beginNs / 1000.0, (e.endNs - e.beginNs) / 1000.0, events[i].second, i + 1 < events.size() ? "," : "") << std::endl;
+	}
+	out << "],\"displayTimeUnit\":\"ns\"}" << std::endl;
+}
+
+}
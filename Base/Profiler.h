@@ -0,0 +1,138 @@
+#pragma once
+
+#include <Defines.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace CudaTracerLib {
+
+//number of events kept per thread, older events are overwritten
+#define PROFILER_RING_SIZE (1 << 16)
+
+typedef unsigned int ProfilerZoneId;
+
+struct ProfilerEvent
+{
+	unsigned long long beginNs;
+	unsigned long long endNs;
+	ProfilerZoneId zone;
+	//nesting level of the zone on its thread, 0 for top level zones
+	unsigned int depth;
+};
+
+//hierarchical profiler for host code
+//zones are registered once per call site, each thread records into its own ring buffer without taking a lock
+//kernel launches are asynchronous, zones around them only measure the gpu time if they synchronize
+class Profiler
+{
+public:
+	struct ZoneStatistics
+	{
+		std::string category;
+		std::string name;
+		//smallest nesting level the zone was recorded at
+		unsigned int depth;
+		unsigned int count;
+		double totalSec;
+		double minSec;
+		double maxSec;
+	};
+private:
+	struct ZoneDesc
+	{
+		std::string category;
+		std::string name;
+	};
+	struct ThreadBuffer
+	{
+		unsigned int threadIdx;
+		unsigned int depth;
+		bool inUse;
+		//number of events ever written, only incremented by the owning thread
+		std::atomic<unsigned long long> numEvents;
+		//events before this index were discarded by Clear
+		std::atomic<unsigned long long> firstEvent;
+		ProfilerEvent events[PROFILER_RING_SIZE];
+	};
+	friend struct ProfilerThreadHandle;
+
+	mutable std::mutex m_mutex;
+	std::vector<ZoneDesc> m_zones;
+	std::vector<ThreadBuffer*> m_threads;
+	std::chrono::steady_clock::time_point m_startTime;
+	std::atomic<bool> m_bEnabled;
+
+	ThreadBuffer* getThreadBuffer();
+	void releaseThreadBuffer(ThreadBuffer* buf);
+	//copies the valid events of all threads, the thread index is stored in the second component
+	void collectEvents(std::vector<std::pair<ProfilerEvent, unsigned int>>& events) const;
+public:
+	CTL_EXPORT Profiler();
+	CTL_EXPORT ~Profiler();
+	CTL_EXPORT static Profiler& getInstance();
+
+	//returns the same id for repeated registrations of a zone
+	CTL_EXPORT ProfilerZoneId RegisterZone(const char* category, const char* name);
+
+	unsigned long long getTimeNs() const
+	{
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_startTime).count();
+	}
+	bool isEnabled() const
+	{
+		return m_bEnabled.load(std::memory_order_relaxed);
+	}
+	void setEnabled(bool enabled)
+	{
+		m_bEnabled = enabled;
+	}
+
+	//returns the nesting level of the new zone
+	CTL_EXPORT unsigned int BeginZone();
+	CTL_EXPORT void EndZone(ProfilerZoneId zone, unsigned long long beginNs, unsigned int depth);
+
+	//discards all recorded events, the zones stay registered
+	CTL_EXPORT void Clear();
+	//statistics of all recorded zones, restricted to one category if not null
+	CTL_EXPORT std::vector<ZoneStatistics> getStatistics(const char* category = 0) const;
+	CTL_EXPORT std::string ToString(const char* category = 0) const;
+	//writes the recorded events in the json format of chrome://tracing
+	CTL_EXPORT void WriteChromeTrace(const std::string& file) const;
+};
+
+class ProfilerScope
+{
+	ProfilerZoneId m_zone;
+	unsigned long long m_beginNs;
+	unsigned int m_depth;
+	bool m_bActive;
+public:
+	ProfilerScope(ProfilerZoneId zone)
+		: m_zone(zone), m_bActive(Profiler::getInstance().isEnabled())
+	{
+		if (m_bActive)
+		{
+			Profiler& p = Profiler::getInstance();
+			m_depth = p.BeginZone();
+			m_beginNs = p.getTimeNs();
+		}
+	}
+	~ProfilerScope()
+	{
+		if (m_bActive)
+			Profiler::getInstance().EndZone(m_zone, m_beginNs, m_depth);
+	}
+};
+
+#define PROFILER_CONCAT_IMPL(A, B) A##B
+#define PROFILER_CONCAT(A, B) PROFILER_CONCAT_IMPL(A, B)
+
+//measures the enclosing scope, the zone is registered on the first execution of the call site only
+#define PROFILE_ZONE(CATEGORY, NAME) \
+	static const CudaTracerLib::ProfilerZoneId PROFILER_CONCAT(__profilerZone, __LINE__) = CudaTracerLib::Profiler::getInstance().RegisterZone(CATEGORY, NAME); \
+	CudaTracerLib::ProfilerScope PROFILER_CONCAT(__profilerScope, __LINE__)(PROFILER_CONCAT(__profilerZone, __LINE__))
+
+}
@@ -0,0 +1,271 @@
+#include <StdAfx.h>
+#include "RenderCheckpoint.h"
+#include "FileStream.h"
+#include <Engine/SceneLoader/Mitsuba/miniz.h>
+#include <cstdio>
+
+#ifdef ISWINDOWS
+#include <Windows.h>
+#endif
+
+namespace CudaTracerLib {
+
+static const char g_checkpointMagic[8] = { 'C', 'T', 'L', 'C', 'K', 'P', 'T', 0 };
+
+enum CheckpointFlags
+{
+	CHECKPOINT_COMPRESSED = 1,
+};
+
+struct CheckpointHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int flags;
+	unsigned long long payloadSize;
+	unsigned long long storedSize;
+};
+
+void RenderCheckpoint::Write(const std::string& name, const void* data, size_t size)
+{
+	auto& sec = m_sections[name];
+	sec.resize(size);
+	if (size)
+		memcpy(&sec[0], data, size);
+}
+
+const std::vector<unsigned char>& RenderCheckpoint::getSection(const std::string& name) const
+{
+	auto it = m_sections.find(name);
+	if (it == m_sections.end())
+		throw std::runtime_error("Checkpoint does not contain the section " + name + "!");
+	return it->second;
+}
+
+void RenderCheckpoint::Read(const std::string& name, void* data, size_t size) const
+{
+	auto& sec = getSection(name);
+	if (sec.size() != size)
+		throw std::runtime_error(format("Size of checkpoint section %s is %llu bytes instead of %llu, the checkpoint was created with different settings!", name.c_str(), (unsigned long long)sec.size(), (unsigned long long)size));
+	if (size)
+		memcpy(data, &sec[0], size);
+}
+
+size_t RenderCheckpoint::getSizeInBytes() const
+{
+	size_t n = 0;
+	for (auto& sec : m_sections)
+		n += sec.first.size() + sec.second.size();
+	return n;
+}
+
+template<typename T> static void appendBytes(std::vector<unsigned char>& data, const T* val, size_t count = 1)
+{
+	size_t off = data.size();
+	data.resize(off + sizeof(T) * count);
+	if (count)
+		memcpy(&data[off], val, sizeof(T) * count);
+}
+
+void RenderCheckpoint::Serialize(std::vector<unsigned char>& data, bool compress) const
+{
+	std::vector<unsigned char> payload;
+	payload.reserve(getSizeInBytes() + m_sections.size() * 12 + 4);
+	unsigned int numSections = (unsigned int)m_sections.size();
+	appendBytes(payload, &numSections);
+	for (auto& sec : m_sections)
+	{
+		unsigned int nameLength = (unsigned int)sec.first.size();
+		unsigned long long size = sec.second.size();
+		appendBytes(payload, &nameLength);
+		appendBytes(payload, sec.first.c_str(), nameLength);
+		appendBytes(payload, &size);
+		appendBytes(payload, sec.second.empty() ? 0 : &sec.second[0], sec.second.size());
+	}
+
+	CheckpointHeader header;
+	memcpy(header.magic, g_checkpointMagic, sizeof(g_checkpointMagic));
+	header.version = RENDER_CHECKPOINT_VERSION;
+	header.flags = compress ? CHECKPOINT_COMPRESSED : 0;
+	header.payloadSize = payload.size();
+	data.resize(sizeof(CheckpointHeader));
+	if (compress)
+	{
+		mz_ulong storedSize = mz_compressBound((mz_ulong)payload.size());
+		data.resize(sizeof(CheckpointHeader) + storedSize);
+		if (mz_compress2(&data[sizeof(CheckpointHeader)], &storedSize, &payload[0], (mz_ulong)payload.size(), MZ_BEST_SPEED) != MZ_OK)
+			throw std::runtime_error("Could not compress the checkpoint!");
+		data.resize(sizeof(CheckpointHeader) + storedSize);
+		header.storedSize = storedSize;
+	}
+	else
+	{
+		data.insert(data.end(), payload.begin(), payload.end());
+		header.storedSize = payload.size();
+	}
+	memcpy(&data[0], &header, sizeof(CheckpointHeader));
+}
+
+void RenderCheckpoint::Deserialize(const unsigned char* data, size_t size)
+{
+	CheckpointHeader header;
+	if (size < sizeof(CheckpointHeader))
+		throw std::runtime_error("Checkpoint is truncated!");
+	memcpy(&header, data, sizeof(CheckpointHeader));
+	if (memcmp(header.magic, g_checkpointMagic, sizeof(g_checkpointMagic)) != 0)
+		throw std::runtime_error("Data is not a checkpoint!");
+	if (header.version != RENDER_CHECKPOINT_VERSION)
+		throw std::runtime_error(format("Checkpoint version %d is not supported, expected %d!", header.version, RENDER_CHECKPOINT_VERSION));
+	if (sizeof(CheckpointHeader) + header.storedSize > size)
+		throw std::runtime_error("Checkpoint is truncated!");
+
+	const unsigned char* stored = data + sizeof(CheckpointHeader);
+	std::vector<unsigned char> uncompressed;
+	const unsigned char* payload = stored;
+	if (header.flags & CHECKPOINT_COMPRESSED)
+	{
+		uncompressed.resize((size_t)header.payloadSize);
+		mz_ulong payloadSize = (mz_ulong)header.payloadSize;
+		if (mz_uncompress(&uncompressed[0], &payloadSize, stored, (mz_ulong)header.storedSize) != MZ_OK || payloadSize != header.payloadSize)
+			throw std::runtime_error("Could not decompress the checkpoint!");
+		payload = &uncompressed[0];
+	}
+
+	size_t pos = 0;
+	auto read = [&](void* dest, size_t n)
+	{
+		if (pos + n > header.payloadSize)
+			throw std::runtime_error("Checkpoint is corrupt!");
+		if (n)
+			memcpy(dest, payload + pos, n);
+		pos += n;
+	};
+	m_sections.clear();
+	unsigned int numSections;
+	read(&numSections, sizeof(numSections));
+	for (unsigned int i = 0; i < numSections; i++)
+	{
+		unsigned int nameLength;
+		read(&nameLength, sizeof(nameLength));
+		std::string name(nameLength, ' ');
+		read(&name[0], nameLength);
+		unsigned long long sectionSize;
+		read(&sectionSize, sizeof(sectionSize));
+		auto& sec = m_sections[name];
+		sec.resize((size_t)sectionSize);
+		read(sec.empty() ? 0 : &sec[0], (size_t)sectionSize);
+	}
+}
+
+void RenderCheckpoint::WriteToFile(const std::string& file, bool compress) const
+{
+	std::vector<unsigned char> data;
+	Serialize(data, compress);
+	std::string tmpFile = file + ".tmp";
+	{
+		FileOutputStream out(tmpFile);
+		out.Write(data.data(), data.size());
+	}
+	//replace the previous checkpoint in a single step so that there is always a complete file on disk
+#ifdef ISWINDOWS
+	bool replaced = MoveFileExA(tmpFile.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	bool replaced = std::rename(tmpFile.c_str(), file.c_str()) == 0;
+#endif
+	if (!replaced)
+		throw std::runtime_error("Could not replace the checkpoint file " + file + "!");
+}
+
+void RenderCheckpoint::ReadFromFile(const std::string& file)
+{
+	MemInputStream in(file);
+	std::vector<unsigned char> data(in.getFileSize());
+	if (data.size())
+		in.Read(&data[0], data.size());
+	Deserialize(data.size() ? &data[0] : 0, data.size());
+}
+
+AsyncCheckpointWriter::AsyncCheckpointWriter()
+	: m_bHasJob(false), m_bWriting(false), m_bShutdown(false), m_bJobCompress(true)
+{
+	m_thread = std::thread(&AsyncCheckpointWriter::run, this);
+}
+
+AsyncCheckpointWriter::~AsyncCheckpointWriter()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_bShutdown = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void AsyncCheckpointWriter::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_cond.wait(lock, [&]() {return m_bHasJob || m_bShutdown; });
+		//pending checkpoints are still written on shutdown
+		if (!m_bHasJob)
+			return;
+		RenderCheckpoint job;
+		std::swap(job, m_job);
+		std::string file = m_jobFile;
+		bool compress = m_bJobCompress;
+		m_bHasJob = false;
+		m_bWriting = true;
+		lock.unlock();
+
+		std::string error;
+		try
+		{
+			job.WriteToFile(file, compress);
+		}
+		catch (std::exception& ex)
+		{
+			error = ex.what();
+		}
+
+		lock.lock();
+		if (error.size())
+			m_lastError = error;
+		m_bWriting = false;
+		m_cond.notify_all();
+	}
+}
+
+void AsyncCheckpointWriter::Submit(RenderCheckpoint& checkpoint, const std::string& file, bool compress)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		std::swap(m_job, checkpoint);
+		m_jobFile = file;
+		m_bJobCompress = compress;
+		m_bHasJob = true;
+	}
+	checkpoint.Clear();
+	m_cond.notify_all();
+}
+
+void AsyncCheckpointWriter::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [&]() {return !m_bHasJob && !m_bWriting; });
+	if (m_lastError.size())
+	{
+		std::string error = m_lastError;
+		m_lastError.clear();
+		throw std::runtime_error("Writing the checkpoint failed : " + error);
+	}
+}
+
+bool AsyncCheckpointWriter::isBusy()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_bHasJob || m_bWriting;
+}
+
+}
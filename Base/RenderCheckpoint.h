@@ -0,0 +1,97 @@
+#pragma once
+
+#include <Base/SynchronizedBuffer.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace CudaTracerLib {
+
+//files of other versions are rejected when reading, increase whenever sections are added or changed
+//2 : Image.Layout
+#define RENDER_CHECKPOINT_VERSION 2
+
+//state of a progressive rendering as named binary sections
+//all data is copied to the host when written to the checkpoint, the file can therefore be written on another thread
+class RenderCheckpoint
+{
+	std::map<std::string, std::vector<unsigned char>> m_sections;
+public:
+	CTL_EXPORT void Write(const std::string& name, const void* data, size_t size);
+	template<typename T> void WriteValue(const std::string& name, const T& val)
+	{
+		Write(name, &val, sizeof(T));
+	}
+	template<typename T> void WriteBuffer(const std::string& name, SynchronizedBuffer<T>& buf)
+	{
+		//kernels do not update the location flags, unless the host data was modified the device data is up to date
+		if (buf.isOnGPU())
+			buf.setOnGPU();
+		buf.Synchronize();
+		Write(name, buf.getLength() ? &buf[0] : 0, buf.getLength() * sizeof(T));
+	}
+
+	bool hasSection(const std::string& name) const
+	{
+		return m_sections.find(name) != m_sections.end();
+	}
+	//throws if the section does not exist
+	CTL_EXPORT const std::vector<unsigned char>& getSection(const std::string& name) const;
+	//the sizes have to match, otherwise the checkpoint was created with different settings
+	CTL_EXPORT void Read(const std::string& name, void* data, size_t size) const;
+	template<typename T> void ReadValue(const std::string& name, T& val) const
+	{
+		Read(name, &val, sizeof(T));
+	}
+	template<typename T> void ReadBuffer(const std::string& name, SynchronizedBuffer<T>& buf) const
+	{
+		if (buf.getLength() == 0)
+			return Read(name, 0, 0);
+		buf.Synchronize();
+		Read(name, &buf[0], buf.getLength() * sizeof(T));
+		buf.setOnCPU();
+		buf.Synchronize();
+	}
+
+	CTL_EXPORT size_t getSizeInBytes() const;
+	void Clear()
+	{
+		m_sections.clear();
+	}
+
+	//compression uses the fastest deflate level, the accumulated images compress well because of their constant exponents
+	CTL_EXPORT void Serialize(std::vector<unsigned char>& data, bool compress) const;
+	CTL_EXPORT void Deserialize(const unsigned char* data, size_t size);
+	//writes to a temporary file which replaces the target, an interrupted write does not destroy the last checkpoint
+	CTL_EXPORT void WriteToFile(const std::string& file, bool compress) const;
+	CTL_EXPORT void ReadFromFile(const std::string& file);
+};
+
+//writes checkpoints on a background thread, the caller only pays for copying the state to the host
+class AsyncCheckpointWriter
+{
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_bHasJob, m_bWriting, m_bShutdown;
+	RenderCheckpoint m_job;
+	std::string m_jobFile;
+	bool m_bJobCompress;
+	std::string m_lastError;
+
+	void run();
+public:
+	CTL_EXPORT AsyncCheckpointWriter();
+	CTL_EXPORT ~AsyncCheckpointWriter();
+
+	//a submitted checkpoint which was not started yet is replaced by the new one
+	CTL_EXPORT void Submit(RenderCheckpoint& checkpoint, const std::string& file, bool compress = true);
+	//waits until all submitted checkpoints are written, throws if one of the writes failed
+	CTL_EXPORT void Wait();
+	CTL_EXPORT bool isBusy();
+};
+
+}
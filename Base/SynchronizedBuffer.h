@@ -46,6 +46,11 @@ public:
 	{
 		m_location = DataLocation::GPU;
 	}
+	//category of the device memory in the accounting of the CudaMemoryManager
+	virtual void setMemoryTag(CudaMemoryTag tag)
+	{
+
+	}
 };
 
 template<typename T> class SynchronizedBuffer : public ISynchronizedBuffer
@@ -80,8 +85,10 @@ public:
 	virtual void Resize(unsigned int newLength)
 	{
 		Synchronize();
-		CUDA_FREE(m_deviceData);
-		CUDA_MALLOC(&m_deviceData, newLength * sizeof(T));
+		CudaMemoryTag tag = m_deviceData ? CudaMemoryManager::GetTag(m_deviceData) : CudaMemoryManager::getCurrentScopeTag();
+		if (m_deviceData)
+			CUDA_FREE(m_deviceData);
+		CUDA_MALLOC_TAGGED(&m_deviceData, newLength * sizeof(T), tag);
 		auto l = DMIN2(newLength, m_length);
 		if(l != 0)
 			CUDA_MEMCPY_TO_DEVICE(m_deviceData, m_hostData, l * sizeof(T));
@@ -115,6 +122,11 @@ public:
 		return m_hostData[idx];
 #endif
 	}
+	virtual void setMemoryTag(CudaMemoryTag tag) override
+	{
+		if (m_deviceData)
+			CudaMemoryManager::SetTag(m_deviceData, tag);
+	}
 	CUDA_FUNC_IN const T* getDevicePtr() const
 	{
 		return m_deviceData;
@@ -202,6 +214,11 @@ public:
 		for (auto buf : m_buffers)
 			buf->setOnGPU();
 	}
+	virtual void setMemoryTag(CudaMemoryTag tag) override
+	{
+		for (auto buf : m_buffers)
+			buf->setMemoryTag(tag);
+	}
 };
 
 }
\ No newline at end of file
@@ -1,8 +0,0 @@
-#include <StdAfx.h>
-#include "Timer.h"
-
-namespace CudaTracerLib {
-
-std::map<std::string, PerformanceTimer> PerformanceTimer::gStaticInstances;
-
-}
\ No newline at end of file
@@ -59,6 +59,27 @@ namespace CTVirtualHelper
 		}
 	};
 
+	//position of Tp in the type list
+	template < typename Tp, typename... List >
+	struct index_of;
+
+	template < typename Tp, typename... Rest >
+	struct index_of<Tp, Tp, Rest...> { enum { value = 0 }; };
+
+	template < typename Tp, typename Head, typename... Rest >
+	struct index_of<Tp, Head, Rest...> { enum { value = 1 + index_of<Tp, Rest...>::value }; };
+
+	//position of the type with the token in the type list, the length of the list if no type matches
+	template<typename T> CUDA_FUNC_IN unsigned int Type_Index(unsigned int token, unsigned int idx)
+	{
+		return token == T::TYPE() ? idx : idx + 1;
+	}
+
+	template<typename T, typename T2, typename... REST> CUDA_FUNC_IN unsigned int Type_Index(unsigned int token, unsigned int idx)
+	{
+		return token == T::TYPE() ? idx : Type_Index<T2, REST...>(token, idx + 1);
+	}
+
 	template<typename T, typename... ARGS> CUDA_FUNC_IN static bool Contains_Type()
 	{
 		return contains< T, ARGS... >::value;
@@ -113,6 +134,7 @@ struct BaseType
 template<typename BaseType, typename... Types> struct CudaVirtualAggregate
 {
 	enum { DATA_SIZE = CTVirtualHelper::Unifier<Types...>::result };
+	enum { NUM_TYPES = sizeof...(Types) };
 
 	static_assert(DATA_SIZE > 0, "CudaVirtualAggregate::Data too  small.");
 	static_assert(DATA_SIZE < 4096, "CudaVirtualAggregate::Data too large.");
@@ -184,6 +206,17 @@ public:
 		type = t;
 	}
 
+	//dense index of the stored type in [0, NUM_TYPES), NUM_TYPES if no type was set
+	CUDA_FUNC_IN unsigned int getTypeIndex() const
+	{
+		return CTVirtualHelper::Type_Index<Types...>(type, 0);
+	}
+
+	template<typename SpecializedType> CUDA_FUNC_IN static constexpr unsigned int getTypeIndex()
+	{
+		return CTVirtualHelper::index_of<SpecializedType, Types...>::value;
+	}
+
 	void SetVtable()
 	{
 		SetVtable<Types...>();
@@ -7,9 +7,13 @@
 #include "Material.h"
 #include "TriIntersectorData.h"
 #include "SpatialStructures/BVH/BVHRebuilder.h"
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib {
 
+//the bvh is restructured on the host once the refitted tree is this much worse than after the last restructure
+static const float RESTRUCTURE_COST_FACTOR = 1.3f;
+
 void AnimationFrame::serialize(FileOutputStream& a_Out)
 {
 	a_Out << (size_t)m_sHostConstructionData.size();
@@ -63,12 +67,16 @@ AnimatedMesh::AnimatedMesh(const std::string& path, IInStream& a_In, Stream<TriI
 	a_In >> m_sTriangles;
 	a_Stream5->UpdateInvalidated();
 	m_pBuilder = 0;
+	m_pDeviceRefitData = 0;
+	m_fRestructureCost = m_fRefitCost = 0;
 }
 
 void AnimatedMesh::FreeAnim(Stream<char>* a_Stream5)
 {
 	if (m_pBuilder)
 		delete m_pBuilder;
+	if (m_pDeviceRefitData)
+		CUDA_FREE(m_pDeviceRefitData);
 	a_Stream5->dealloc(m_sVertices);
 	a_Stream5->dealloc(m_sTriangles);
 	m_pAnimations.~vector();
@@ -84,6 +92,8 @@ void AnimatedMesh::CreateNewMesh(AnimatedMesh* A, Stream<TriIntersectorData>* a_
 	A->m_sNodeInfo = a_Stream2->malloc(m_sNodeInfo, true);
 	A->m_sIntInfo = a_Stream0->malloc(m_sIntInfo, true);
 	A->m_pBuilder = 0;
+	A->m_pDeviceRefitData = 0;
+	A->m_fRestructureCost = A->m_fRefitCost = 0;
 
 	A->k_Data = k_Data;
 	A->m_pAnimations = m_pAnimations;
@@ -160,6 +170,26 @@ public:
 	}
 };
 
+//sum of the child box areas relative to the root area, the same measure is accumulated by the refit kernel
+static float computeBVHCost(const BVHNodeData* nodes, unsigned int numNodes)
+{
+	float area = 0;
+	for (unsigned int i = 0; i < numNodes; i++)
+	{
+		Vec2i c = nodes[i].getChildren();
+		if (c.x != BVH_NO_NODE)
+			area += nodes[i].getLeft().Area();
+		if (c.y != BVH_NO_NODE)
+			area += nodes[i].getRight().Area();
+	}
+	return numNodes ? area / nodes[0].getBox().Area() : 0.0f;
+}
+
+template<typename T> static void uploadReference(StreamReference<T>& ref)
+{
+	ThrowCudaErrors(cudaMemcpy(ref.getDevice(), (T*)ref, ref.getDeviceSize(), cudaMemcpyHostToDevice));
+}
+
 void AnimatedMesh::k_ComputeState(unsigned int a_Anim, unsigned int a_Frame, float a_lerp, Stream<BVHNodeData>* a_BVHNodeStream, void* a_DeviceTmp, void* a_HostTmp)
 {
 	CTL_ASSERT(a_Anim < m_pAnimations.size());
@@ -167,6 +197,17 @@ void AnimatedMesh::k_ComputeState(unsigned int a_Anim, unsigned int a_Frame, flo
 	unsigned int n = (a_Frame + 1) % m_pAnimations[a_Anim].m_pFrames.size();
 	float4x4* m0 = (float4x4*)m_pAnimations[a_Anim].m_pFrames[a_Frame].m_sMatrices.getDevice();
 	float4x4* m1 = (float4x4*)m_pAnimations[a_Anim].m_pFrames[n].m_sMatrices.getDevice();
+
+	//refitting keeps all data on the device, only the root box and the cost are read back
+	if (m_pBuilder && m_fRefitCost <= m_fRestructureCost * RESTRUCTURE_COST_FACTOR)
+	{
+		PROFILE_ZONE("Animation", "Refit");
+		launchKernels(a_DeviceTmp, (AnimatedVertex*)m_sVertices.getDevice(), m0, m1, a_lerp, (uint3*)m_sTriangles.getDevice(), m_sTriInfo.getDevice());
+		launchRefitKernels(a_DeviceTmp, m_sLocalBox, m_fRefitCost);
+		return;
+	}
+
+	PROFILE_ZONE("Animation", "Restructure");
 	launchKernels(a_DeviceTmp, (AnimatedVertex*)m_sVertices.getDevice(), m0, m1, a_lerp, (uint3*)m_sTriangles.getDevice(), m_sTriInfo.getDevice());
 	ThrowCudaErrors(cudaMemcpy(a_HostTmp, (e_KernelAnimatedMesh::e_TmpVertex*)a_DeviceTmp, sizeof(e_KernelAnimatedMesh::e_TmpVertex) * k_Data.m_uVertexCount, cudaMemcpyDeviceToHost));
 	AnimProvider p(this, (e_KernelAnimatedMesh::e_TmpVertex*)a_HostTmp, this->m_sTriangles);
@@ -176,10 +217,12 @@ void AnimatedMesh::k_ComputeState(unsigned int a_Anim, unsigned int a_Frame, flo
 	else m_pBuilder = new BVHRebuilder(this, &p);
 	ThrowCudaErrors(cudaDeviceSynchronize());
 	m_sTriInfo.CopyFromDevice();
-	m_sNodeInfo.Invalidate();
-	m_sIntInfo.Invalidate();
-	m_sIndicesInfo.Invalidate();
+	//upload immediately instead of invalidating, a deferred upload would overwrite the results of following refits
+	uploadReference(m_sNodeInfo);
+	uploadReference(m_sIntInfo);
+	uploadReference(m_sIndicesInfo);
 	m_sLocalBox = m_pBuilder->getBox();
+	m_fRestructureCost = m_fRefitCost = computeBVHCost(m_sNodeInfo, m_sNodeInfo.getLength());
 	ThrowCudaErrors(cudaDeviceSynchronize());
 }
 
@@ -2,6 +2,7 @@
 #include "SpatialStructures/BVH/BVHRebuilder.h"
 #include "TriangleData.h"
 #include "TriIntersectorData.h"
+#include <Base/CudaMemoryManager.h>
 
 namespace CudaTracerLib {
 
@@ -67,4 +68,107 @@ void AnimatedMesh::launchKernels(void* a_DeviceTmp, AnimatedVertex* A, float4x4*
 	ThrowCudaErrors(cudaDeviceSynchronize());
 }
 
+__global__ void g_UpdateIntersectors(e_KernelAnimatedMesh::e_TmpVertex* a_Tmp, uint3* a_TriData, TriIntersectorData2* a_Indices, TriIntersectorData* a_IntData, unsigned int a_ICount)
+{
+	unsigned int N = blockIdx.x * blockDim.x + threadIdx.x;
+	if (N < a_ICount)
+	{
+		uint3 t = a_TriData[a_Indices[N].getIndex()];
+		a_IntData[N].setData(a_Tmp[t.x].m_fPos, a_Tmp[t.y].m_fPos, a_Tmp[t.z].m_fPos);
+	}
 }
+
+CUDA_FUNC_IN bool isInnerChild(int c)
+{
+	return c >= 0 && c != BVH_NO_NODE;
+}
+
+CUDA_ONLY_FUNC AABB d_LeafBox(e_KernelAnimatedMesh::e_TmpVertex* a_Tmp, uint3* a_TriData, TriIntersectorData2* a_Indices, unsigned int a_First)
+{
+	AABB box = AABB::Identity();
+	unsigned int i = a_First;
+	do
+	{
+		uint3 t = a_TriData[a_Indices[i].getIndex()];
+		box = box.Extend(a_Tmp[t.x].m_fPos).Extend(a_Tmp[t.y].m_fPos).Extend(a_Tmp[t.z].m_fPos);
+	} while (!a_Indices[i++].getFlag());
+	return box;
+}
+
+//the boxes of inner children are written by other threads, the volatile loads bypass the non coherent caches
+CUDA_ONLY_FUNC AABB d_LoadChildBox(const BVHNodeData* a_Node, int a_LocalIdx)
+{
+	const volatile float* a = (const volatile float*)(a_LocalIdx == 0 ? &a_Node->a : &a_Node->b), *c = (const volatile float*)&a_Node->c + 2 * a_LocalIdx;
+	return AABB(Vec3f(a[0], a[2], c[0]), Vec3f(a[1], a[3], c[1]));
+}
+
+//bottom up refit starting at the nodes with only leaf children, the last thread arriving at a node continues with it
+__global__ void g_RefitBVH(e_KernelAnimatedMesh::e_TmpVertex* a_Tmp, uint3* a_TriData, TriIntersectorData2* a_Indices, BVHNodeData* a_Nodes, unsigned int a_NCount, unsigned int* a_Counters, float* a_Area)
+{
+	unsigned int N = blockIdx.x * blockDim.x + threadIdx.x;
+	if (N >= a_NCount)
+		return;
+	Vec2i c = a_Nodes[N].getChildren();
+	if (isInnerChild(c.x) || isInnerChild(c.y))
+		return;
+
+	unsigned int nodeIdx = N;
+	while (true)
+	{
+		BVHNodeData* node = a_Nodes + nodeIdx;
+		c = node->getChildren();
+		AABB boxes[2];
+		float area = 0;
+		for (int i = 0; i < 2; i++)
+		{
+			if (c[i] == BVH_NO_NODE)
+				boxes[i] = AABB::Identity();
+			else
+			{
+				boxes[i] = c[i] < 0 ? d_LeafBox(a_Tmp, a_TriData, a_Indices, ~c[i]) : d_LoadChildBox(node, i);
+				area += boxes[i].Area();
+			}
+		}
+		node->setBox(boxes[0], boxes[1]);
+		atomicAdd(a_Area, area);
+
+		unsigned int parent = node->getParent();
+		if (parent == UINT_MAX)
+			return;
+		parent /= 4;
+		AABB box = boxes[0].Extend(boxes[1]);
+		if (a_Nodes[parent].getChildren()[0] == (int)nodeIdx * 4)
+			a_Nodes[parent].setLeft(box);
+		else a_Nodes[parent].setRight(box);
+		__threadfence();
+
+		Vec2i pc = a_Nodes[parent].getChildren();
+		unsigned int numInner = isInnerChild(pc.x) + isInnerChild(pc.y);
+		if (atomicAdd(a_Counters + parent, 1) + 1 < numInner)
+			return;
+		nodeIdx = parent;
+	}
+}
+
+void AnimatedMesh::launchRefitKernels(void* a_DeviceTmp, AABB& rootBox, float& cost)
+{
+	unsigned int numNodes = m_sNodeInfo.getLength(), numIndices = m_sIndicesInfo.getLength();
+	if (!m_pDeviceRefitData)
+		CUDA_MALLOC(&m_pDeviceRefitData, sizeof(unsigned int) * (numNodes + 1));
+	ThrowCudaErrors(cudaMemset(m_pDeviceRefitData, 0, sizeof(unsigned int) * (numNodes + 1)));
+	float* deviceArea = (float*)(m_pDeviceRefitData + numNodes);
+
+	auto* tmp = (e_KernelAnimatedMesh::e_TmpVertex*)a_DeviceTmp;
+	uint3* triData = (uint3*)m_sTriangles.getDevice();
+	g_UpdateIntersectors << <numIndices / 256 + 1, 256 >> >(tmp, triData, m_sIndicesInfo.getDevice(), m_sIntInfo.getDevice(), numIndices);
+	g_RefitBVH << <numNodes / 256 + 1, 256 >> >(tmp, triData, m_sIndicesInfo.getDevice(), m_sNodeInfo.getDevice(), numNodes, m_pDeviceRefitData, deviceArea);
+
+	BVHNodeData root;
+	float area;
+	ThrowCudaErrors(cudaMemcpy(&root, m_sNodeInfo.getDevice(), sizeof(BVHNodeData), cudaMemcpyDeviceToHost));
+	ThrowCudaErrors(cudaMemcpy(&area, deviceArea, sizeof(float), cudaMemcpyDeviceToHost));
+	rootBox = root.getBox();
+	cost = area / rootBox.Area();
+}
+
+}
\ No newline at end of file
@@ -76,6 +76,10 @@ public:
 	StreamReference<char> m_sVertices;
 	StreamReference<char> m_sTriangles;
 	BVHRebuilder* m_pBuilder;
+	//device scratch memory of the refit, one arrival counter per bvh node followed by the accumulated child box area
+	unsigned int* m_pDeviceRefitData;
+	//child box area relative to the root area after the last restructure and after the last refit
+	float m_fRestructureCost, m_fRefitCost;
 public:
 	CTL_EXPORT AnimatedMesh(const std::string& path, IInStream& a_In, Stream<TriIntersectorData>* a_Stream0, Stream<TriangleData>* a_Stream1, Stream<BVHNodeData>* a_Stream2, Stream<TriIntersectorData2>* a_Stream3, Stream<Material>* a_Stream4, Stream<char>* a_Stream5);
 	CTL_EXPORT void FreeAnim(Stream<char>* a_Stream5);
@@ -99,6 +103,8 @@ public:
 	}
 private:
 	void launchKernels(void* a_DeviceTmp, AnimatedVertex* A, float4x4* m0, float4x4* m1, float a_lerp, uint3* triData, TriangleData* triData2);
+	//updates the intersection data and the node boxes from the skinned vertices on the device, the topology is kept
+	void launchRefitKernels(void* a_DeviceTmp, AABB& rootBox, float& cost);
 };
 
 }
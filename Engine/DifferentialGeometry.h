@@ -20,6 +20,8 @@ struct DifferentialGeometry
 	unsigned char extraData;
 	unsigned char hasUVPartials;
 	unsigned char DUMMY[2];
+	//time of the ray which created the hit, in [0, 1)
+	float time;
 
 	CUDA_FUNC_IN DifferentialGeometry() {}
 
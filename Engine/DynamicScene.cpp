@@ -8,7 +8,9 @@
 #include "TriIntersectorData.h"
 #include <SceneTypes/Node.h>
 #include "MIPMap.h"
+#include "TextureTileCache.h"
 #include "SceneBVH.h"
+#include <Base/Profiler.h>
 #include <SceneTypes/Light.h>
 #include <Base/Buffer.h>
 #include<iomanip>
@@ -233,20 +235,39 @@ public:
 };
 
 DynamicScene::DynamicScene(Sensor* C, SceneInitData a_Data, IFileManager* fManager)
-	: m_uEnvMapIndex(UINT_MAX), m_pCamera(C), m_pHostTmpFloats(0), m_pFileManager(fManager)
+	: m_uEnvMapIndex(UINT_MAX), m_pCamera(C), m_pHostTmpFloats(0), m_pFileManager(fManager), m_pTextureCache(0), m_eTextureCompression(a_Data.m_eTextureCompression)
 {
-	m_pAnimStream = new Stream<char>(a_Data.m_uSizeAnimStream + (a_Data.m_bSupportEnvironmentMap ? (4096 * 4094 * 8) : 0));
-	m_pTriDataStream = new Stream<TriangleData>(a_Data.m_uNumTriangles);
-	m_pTriIntStream = new Stream<TriIntersectorData>(a_Data.m_uNumInt);
-	m_pBVHStream = new Stream<BVHNodeData>(a_Data.m_uNumBvhNodes);
-	m_pBVHIndicesStream = new Stream<TriIntersectorData2>(a_Data.m_uNumBvhIndices);
+	{
+		CudaMemoryTagScope tag(MEMORY_TAG_GEOMETRY);
+		m_pAnimStream = new Stream<char>(a_Data.m_uSizeAnimStream + (a_Data.m_bSupportEnvironmentMap ? (4096 * 4094 * 8) : 0));
+		m_pTriDataStream = new Stream<TriangleData>(a_Data.m_uNumTriangles);
+		m_pTriIntStream = new Stream<TriIntersectorData>(a_Data.m_uNumInt);
+		m_pMeshBuffer = new CachedBuffer<Mesh, KernelMesh>(a_Data.m_uNumMeshes, sizeof(AnimatedMesh));
+		m_pNodeStream = new Stream<Node>(a_Data.m_uNumNodes);
+	}
+	{
+		CudaMemoryTagScope tag(MEMORY_TAG_BVH);
+		m_pBVHStream = new Stream<BVHNodeData>(a_Data.m_uNumBvhNodes);
+		m_pBVHIndicesStream = new Stream<TriIntersectorData2>(a_Data.m_uNumBvhIndices);
+		m_pBVH = new SceneBVH(a_Data.m_uNumNodes);
+	}
+	{
+		CudaMemoryTagScope tag(MEMORY_TAG_TEXTURES);
+		m_pTextureBuffer = new CachedBuffer<MIPMap, KernelMIPMap>(a_Data.m_uNumTextures);
+		if (a_Data.m_uTextureCacheSize)
+		{
+			m_pTextureCache = new TextureTileCache(a_Data.m_uTextureCacheSize);
+			//under memory pressure the tile pool is shrunk, the tiles are reloaded on demand
+			m_uTextureCacheEvictionId = CudaMemoryManager::RegisterEvictionCallback(MEMORY_TAG_TEXTURES, [this](size_t bytesNeeded)
+			{
+				return m_pTextureCache->Shrink(bytesNeeded);
+			});
+		}
+	}
 	m_pMaterialBuffer = new MatStream(a_Data.m_uNumMaterials);
-	m_pMeshBuffer = new CachedBuffer<Mesh, KernelMesh>(a_Data.m_uNumMeshes, sizeof(AnimatedMesh));
-	m_pNodeStream = new Stream<Node>(a_Data.m_uNumNodes);
-	m_pTextureBuffer = new CachedBuffer<MIPMap, KernelMIPMap>(a_Data.m_uNumTextures);
 	m_pLightStream = new LightStream(a_Data.m_uNumLights);
 	m_pVolumes = new Stream<VolumeRegion>(128);
-	m_pBVH = new SceneBVH(a_Data.m_uNumNodes);
+	m_pVolumeBVH = new VolumeRegionBVH();
 	const int L = 1024 * 16, S = L * sizeof(Vec3f) * 5;
 	CUDA_MALLOC(&m_pDeviceTmpFloats, S);
 	m_pHostTmpFloats = (e_TmpVertex*)malloc(S);
@@ -268,6 +289,12 @@ DynamicScene::~DynamicScene()
 	for (auto ref : *m_pTextureBuffer)
 		ref->Free();
 	DEALLOC(m_pTextureBuffer)
+	if (m_pTextureCache)
+	{
+		CudaMemoryManager::UnregisterEvictionCallback(m_uTextureCacheEvictionId);
+		m_pTextureCache->Free();
+	}
+	DEALLOC(m_pTextureCache)
 	for (auto ref : *m_pMeshBuffer)
 		if (ref->m_uType == MESH_ANIMAT_TOKEN)
 			((AnimatedMesh*)ref.operator->())->FreeAnim(m_pAnimStream);
@@ -276,6 +303,8 @@ DynamicScene::~DynamicScene()
 	DEALLOC(m_pAnimStream)
 	DEALLOC(m_pLightStream)
 	DEALLOC(m_pVolumes)
+	m_pVolumeBVH->Free();
+	DEALLOC(m_pVolumeBVH)
 	CUDA_FREE(m_pDeviceTmpFloats);
 	free(m_pHostTmpFloats);
 #undef DEALLOC
@@ -415,22 +444,25 @@ BufferReference<MIPMap, KernelMIPMap> DynamicScene::LoadTexture(const std::strin
 	if (load)
 	{
 		path cmpFilePath(m_pFileManager->getCompiledTexturePath(rawFilePath.filename().string()));
+		//compressed versions are cached separately so that changing the setting does not require deleting the compiled files
+		if (m_eTextureCompression != TEXTURE_UNCOMPRESSED)
+			cmpFilePath += format(".bc%d", (int)m_eTextureCompression);
 		create_directories(path(cmpFilePath).parent_path());
 		time_t rawStamp = exists(rawFilePath) ? last_write_time(rawFilePath) : time(0);
 		time_t cmpStamp = exists(cmpFilePath) ? last_write_time(cmpFilePath) : 0;
 		if (cmpStamp == 0 || rawStamp != cmpStamp)
 		{
 			FileOutputStream a_Out(cmpFilePath.string().c_str());
-			MIPMap::CompileToBinary(rawFilePath.string().c_str(), a_Out, a_MipMap);
+			MIPMap::CompileToBinary(rawFilePath.string().c_str(), a_Out, a_MipMap, m_eTextureCompression);
 			a_Out.Close();
 			boost::filesystem::last_write_time(cmpFilePath, rawStamp);
 		}
 		FileInputStream I(cmpFilePath.string().c_str());
-		new(T)MIPMap(file, I);
+		new(T)MIPMap(file, I, m_pTextureCache);
 		I.Close();
 		T.Invalidate();
 	}
-	if (!T->getKernelData().m_pDeviceData)
+	if (!T->getKernelData().m_pDeviceData && !T->isPaged())
 		throw std::runtime_error(__FUNCTION__);
 	m_pTextureBuffer->UpdateInvalidated();
 	return T;
@@ -458,6 +490,18 @@ void DynamicScene::SetNodeTransform(const float4x4& mat, StreamReference<Node> n
 	});
 }
 
+void DynamicScene::SetNodeMotion(const float4x4& matStart, const float4x4& matEnd, StreamReference<Node> n)
+{
+	for (unsigned int i = 0; i < n.getLength(); i++)
+		m_pBVH->setMotion(n(i), matStart, matEnd);
+	n.Invalidate();
+	enumerateLights(n, [&](StreamReference<Light> l)
+	{
+		RecomputeShape(l->As<DiffuseLight>()->shapeSet, matStart);
+		l.Invalidate();
+	});
+}
+
 void DynamicScene::InvalidateNodesInBVH(StreamReference<Node> n)
 {
 	m_pBVH->invalidateNode(n);
@@ -487,6 +531,7 @@ void DynamicScene::ReloadTextures()
 
 bool DynamicScene::UpdateScene()
 {
+	PROFILE_ZONE("Scene", "UpdateScene");
 	//free material -> free textures, do not load textures twice!
 	for (size_t n_idx = 0; n_idx < m_sRemovedNodes.size(); n_idx++)
 	{
@@ -553,9 +598,22 @@ bool DynamicScene::UpdateScene()
 	m_pBVHStream->UpdateInvalidated();
 	m_pBVHIndicesStream->UpdateInvalidated();
 	m_pMeshBuffer->UpdateInvalidated();
+	//the majorant grids of the volumes are rebuilt on the host and have to be copied with the anim stream
+	bool volumesChanged = m_pVolumes->numElements() != m_pVolumeBVH->getNumVolumes();
+	m_pVolumes->UpdateInvalidated([&](StreamReference<VolumeRegion> l)
+	{
+		volumesChanged = true;
+		l->As()->Update();
+		if (l->Is<VolumeGrid>() && l->As<VolumeGrid>()->majorantGrid.dim.x)
+			l->As<VolumeGrid>()->majorantGrid.InvalidateDeviceData(m_pAnimStream);
+	});
+	if (volumesChanged)
+		m_pVolumeBVH->Build(m_pVolumes);
 	m_pAnimStream->UpdateInvalidated();
-	m_pVolumes->UpdateInvalidated([](StreamReference<VolumeRegion> l){l->As()->Update(); });
-	ReloadTextures();
+	{
+		PROFILE_ZONE("Scene", "Reload Textures");
+		ReloadTextures();
+	}
 	return m_pBVH->Build(m_pNodeStream, m_pMeshBuffer);
 }
 
@@ -570,6 +628,12 @@ void DynamicScene::AnimateMesh(StreamReference<Node> n, float t, unsigned int an
 	m_pBVH->invalidateNode(n);
 }
 
+void DynamicScene::UpdateTextureCache()
+{
+	if (m_pTextureCache)
+		m_pTextureCache->ResolveMisses();
+}
+
 KernelDynamicScene DynamicScene::getKernelSceneData(bool devicePointer)
 {
 	KernelDynamicScene r;
@@ -583,7 +647,7 @@ KernelDynamicScene DynamicScene::getKernelSceneData(bool devicePointer)
 	r.m_sNodeData = m_pNodeStream->getKernelData(devicePointer);
 	r.m_sTexData = m_pTextureBuffer->getKernelData(devicePointer);
 	r.m_sTriData = m_pTriDataStream->getKernelData(devicePointer);
-	r.m_sVolume = KernelAggregateVolume(m_pVolumes, devicePointer);
+	r.m_sVolume = KernelAggregateVolume(m_pVolumes, *m_pVolumeBVH, devicePointer);
 	r.m_sSceneBVH = m_pBVH->getData(devicePointer);
 	r.m_uEnvMapIndex = m_uEnvMapIndex;
 	r.m_sBox = getSceneBox();
@@ -634,7 +698,10 @@ size_t DynamicScene::getCudaBufferSize()
 		m_pLightStream->getDeviceSizeInBytes() +
 		m_pVolumes->getDeviceSizeInBytes();
 	for (Buffer<MIPMap, KernelMIPMap>::iterator it = m_pTextureBuffer->begin(); it != m_pTextureBuffer->end(); ++it)
-		i += it->getBufferSize();
+		if (!it->isPaged())
+			i += it->getBufferSize();
+	if (m_pTextureCache)
+		i += m_pTextureCache->getDeviceSizeInBytes();
 	return i;
 }
 
@@ -664,10 +731,24 @@ std::string DynamicScene::printInfo()
 	PRINT(m_pVolumes);
 	size_t l = 0;
 	for (Buffer<MIPMap, KernelMIPMap>::iterator it = m_pTextureBuffer->begin(); it != m_pTextureBuffer->end(); ++it)
-		l += it->getBufferSize();
+		if (!it->isPaged())
+			l += it->getBufferSize();
+	if (m_pTextureCache)
+		l += m_pTextureCache->getDeviceSizeInBytes();
 	float s = (float)l, per = s / (float)n * 100;
 	std::string texName = "Textures";
 	str << texName << std::setw(L - texName.size()) << std::setfill(' ') << std::right << per << "%, " << (s / (1024 * 1024)) << "[MB]\n";
+	if (m_pTextureCache)
+	{
+		std::vector<std::string> cacheInfo;
+		m_pTextureCache->PrintStatus(cacheInfo);
+		for (auto& line : cacheInfo)
+			str << line << "\n";
+	}
+	std::vector<std::string> memInfo;
+	CudaMemoryManager::PrintStatus(memInfo);
+	for (auto& line : memInfo)
+		str << line << "\n";
 	return str.str();
 }
 
@@ -22,6 +22,7 @@ class SceneBVH;
 struct Sensor;
 struct KernelMIPMap;
 class MIPMap;
+class TextureTileCache;
 class Mesh;
 template<typename H, typename D> class BufferRange;
 
@@ -54,9 +55,13 @@ private:
 	Stream<TriIntersectorData2>* m_pBVHIndicesStream;
 	MatStream* m_pMaterialBuffer;
 	CachedBuffer<MIPMap, KernelMIPMap>* m_pTextureBuffer;
+	TextureTileCache* m_pTextureCache;
+	unsigned int m_uTextureCacheEvictionId;
+	TextureCompression m_eTextureCompression;
 	CachedBuffer<Mesh, KernelMesh>* m_pMeshBuffer;
 	Stream<Node>* m_pNodeStream;
 	Stream<VolumeRegion>* m_pVolumes;
+	VolumeRegionBVH* m_pVolumeBVH;
 	Stream<char>* m_pAnimStream;
 	LightStream* m_pLightStream;
 	MeshCompilerManager m_sCmpManager;
@@ -112,6 +117,8 @@ public:
 	CTL_EXPORT void ReloadTextures();
 	CTL_EXPORT float4x4 GetNodeTransform(BufferReference<Node, Node> n);
 	CTL_EXPORT void SetNodeTransform(const float4x4& mat, BufferReference<Node, Node> n);
+	//Moves the node linearly from \ref matStart at shutter open to \ref matEnd at shutter close, lights attached to the node use \ref matStart
+	CTL_EXPORT void SetNodeMotion(const float4x4& matStart, const float4x4& matEnd, BufferReference<Node, Node> n);
 	CTL_EXPORT void AnimateMesh(BufferReference<Node, Node> n, float t, unsigned int anim);
 	//Updates the buffer contents, rebuilds the acceleration bvh and returns true when there was a change to geometry
 	CTL_EXPORT bool UpdateScene();
@@ -122,6 +129,13 @@ public:
 	//Tells the acceleration bvh that \ref mesh has been updated and all nodes using it will be invalidated
 	CTL_EXPORT void InvalidateMeshesInBVH(BufferReference<Mesh, KernelMesh> mesh);
 	CTL_EXPORT KernelDynamicScene getKernelSceneData(bool devicePointer = true);
+	//Loads the texture tiles which were missing in the last pass, has to be called between passes
+	CTL_EXPORT void UpdateTextureCache();
+	//Returns the cache used for paging textures, null if all textures are completely resident
+	TextureTileCache* getTextureCache()
+	{
+		return m_pTextureCache;
+	}
 	//Returns the accumulated size of all cuda allocations from buffers and textures
 	CTL_EXPORT size_t getCudaBufferSize();
 	CTL_EXPORT std::string printInfo();
@@ -3,25 +3,48 @@
 #include <stdexcept>
 #include <iostream>
 #include <Base/CudaMemoryManager.h>
+#include <Base/RenderCheckpoint.h>
 
 #define FREEIMAGE_LIB
 #include <FreeImage.h>
 
 namespace CudaTracerLib {
 
-Image::Image(int xRes, int yRes, RGBCOL* target)
-	: xResolution(xRes), yResolution(yRes), ISynchronizedBufferParent(m_pixelBuffer), m_pixelBuffer(xRes * yRes)
+Image::Image(int xRes, int yRes, RGBCOL* target, ImageLayout layout)
+	: xResolution(xRes), yResolution(yRes), m_layout(layout), m_uNumTilesX((xRes + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE),
+	  ISynchronizedBufferParent(m_pixelBuffer), m_pixelBuffer(getStorageLength(xRes, yRes, layout))
 {
-	CUDA_MALLOC(&m_filteredColorsDevice, sizeof(RGBE) * xRes * yRes);
+	m_pixelBuffer.setMemoryTag(MEMORY_TAG_FRAMEBUFFERS);
+	CUDA_MALLOC_TAGGED(&m_filteredColorsDevice, sizeof(RGBE) * xRes * yRes, MEMORY_TAG_FRAMEBUFFERS);
 	m_viewTarget = target;
 	ownsTarget = false;
 	if (!m_viewTarget)
 	{
-		CUDA_MALLOC(&m_viewTarget, sizeof(RGBCOL) * xRes * yRes);
+		CUDA_MALLOC_TAGGED(&m_viewTarget, sizeof(RGBCOL) * xRes * yRes, MEMORY_TAG_FRAMEBUFFERS);
 		ownsTarget = true;
 	}
 }
 
+void Image::SaveState(RenderCheckpoint& checkpoint)
+{
+	checkpoint.WriteValue("Image.Resolution", Vec2i(xResolution, yResolution));
+	checkpoint.WriteValue("Image.Layout", m_layout);
+	checkpoint.WriteBuffer("Image.PixelData", m_pixelBuffer);
+}
+
+void Image::LoadState(const RenderCheckpoint& checkpoint)
+{
+	Vec2i res;
+	checkpoint.ReadValue("Image.Resolution", res);
+	if (res.x != xResolution || res.y != yResolution)
+		throw std::runtime_error(format("Checkpoint resolution %dx%d does not match the image resolution %dx%d!", res.x, res.y, xResolution, yResolution));
+	ImageLayout layout;
+	checkpoint.ReadValue("Image.Layout", layout);
+	if (layout != m_layout)
+		throw std::runtime_error("Checkpoint was created for an image with a different layout!");
+	checkpoint.ReadBuffer("Image.PixelData", m_pixelBuffer);
+}
+
 void Image::Free()
 {
 	CUDA_FREE(m_filteredColorsDevice);
@@ -55,15 +55,9 @@ void Image::Splat(float sx, float sy, const Spectrum &_L)
 
 	splat(this, sx, sy, x, y, xResolution, yResolution, L, [](PixelData& ref, const Spectrum& L)
 	{
-		float rgb[3];
-		L.toLinearRGB(rgb[0], rgb[1], rgb[2]);
-#ifdef ISCUDA
-		for (int i = 0; i < 3; i++)
-			atomicAdd(ref.rgbSplat + i, rgb[i]);
-#else
-		for (int i = 0; i < 3; i++)
-			ref.rgbSplat[i] += rgb[i];
-#endif
+		Vec3f rgb;
+		L.toLinearRGB(rgb.x, rgb.y, rgb.z);
+		ref.addSplat(rgb);
 	});
 
 }
@@ -1,37 +1,120 @@
 #pragma once
 
 #include <Math/Spectrum.h>
+#include <Math/half.h>
 #include <Base/SynchronizedBuffer.h>
 
 struct FIBITMAP;
 
 namespace CudaTracerLib {
 
+class RenderCheckpoint;
+
+//stores the splatted radiance as half floats, reduces PixelData from 28 to 24 bytes
+//the splat sums lose precision after many passes, therefore this is only sensible for short renderings
+#ifndef IMAGE_HALF_SPLAT
+#define IMAGE_HALF_SPLAT 0
+#endif
+
+//edge length of the tiles of IMAGE_LAYOUT_TILED, equal to the block size of the block samplers
+#ifdef CUDA_RELEASE_BUILD
+#define IMAGE_TILE_SIZE 128
+#else
+#define IMAGE_TILE_SIZE 64
+#endif
+
+enum ImageLayout
+{
+	//row major
+	IMAGE_LAYOUT_LINEAR,
+	//row major tiles with the pixels of a tile in morton order, the pixels of a warp and of a sampler block are close in memory
+	IMAGE_LAYOUT_TILED,
+};
+
 struct PixelData
 {
 	CUDA_FUNC_IN PixelData()
 	{
 		rgb[0] = rgb[1] = rgb[2] = 0;
-		rgbSplat[0] = rgbSplat[1] = rgbSplat[2] = 0;
+		setSplat(Vec3f(0.0f));
 		weightSum = 0.0f;
 	}
 	float rgb[3];
+#if IMAGE_HALF_SPLAT
+	float weightSum;
+	//three half floats packed into one word which is updated with a single atomic operation
+	unsigned long long rgbSplatHalf;
+#else
 	float rgbSplat[3];
 	float weightSum;
+#endif
+	CUDA_FUNC_IN Vec3f getSplat() const
+	{
+#if IMAGE_HALF_SPLAT
+		return Vec3f(half((unsigned short)(rgbSplatHalf & 0xffff)).ToFloat(), half((unsigned short)((rgbSplatHalf >> 16) & 0xffff)).ToFloat(), half((unsigned short)((rgbSplatHalf >> 32) & 0xffff)).ToFloat());
+#else
+		return Vec3f(rgbSplat[0], rgbSplat[1], rgbSplat[2]);
+#endif
+	}
+	CUDA_FUNC_IN void setSplat(const Vec3f& v)
+	{
+#if IMAGE_HALF_SPLAT
+		rgbSplatHalf = packSplat(v);
+#else
+		rgbSplat[0] = v.x;
+		rgbSplat[1] = v.y;
+		rgbSplat[2] = v.z;
+#endif
+	}
+	//atomic on the device
+	CUDA_FUNC_IN void addSplat(const Vec3f& v)
+	{
+#if IMAGE_HALF_SPLAT
+#ifdef ISCUDA
+		unsigned long long old = rgbSplatHalf, assumed;
+		do
+		{
+			assumed = old;
+			PixelData tmp;
+			tmp.rgbSplatHalf = assumed;
+			old = atomicCAS(&rgbSplatHalf, assumed, packSplat(tmp.getSplat() + v));
+		} while (assumed != old);
+#else
+		setSplat(getSplat() + v);
+#endif
+#else
+#ifdef ISCUDA
+		atomicAdd(rgbSplat + 0, v.x);
+		atomicAdd(rgbSplat + 1, v.y);
+		atomicAdd(rgbSplat + 2, v.z);
+#else
+		for (int i = 0; i < 3; i++)
+			rgbSplat[i] += v[i];
+#endif
+#endif
+	}
 	CUDA_FUNC_IN Spectrum toSpectrum(float splatScale) const
 	{
 		float weight = weightSum != 0 ? weightSum : 1;
 		Spectrum s, s2;
+		Vec3f splat = getSplat();
 		s.fromLinearRGB(rgb[0], rgb[1], rgb[2]);
-		s2.fromLinearRGB(rgbSplat[0], rgbSplat[1], rgbSplat[2]);
+		s2.fromLinearRGB(splat.x, splat.y, splat.z);
 		return (s / weight + s2 * splatScale);
 	}
+private:
+#if IMAGE_HALF_SPLAT
+	CUDA_FUNC_IN static unsigned long long packSplat(const Vec3f& v)
+	{
+		return (unsigned long long)half(v.x).val | ((unsigned long long)half(v.y).val << 16) | ((unsigned long long)half(v.z).val << 32);
+	}
+#endif
 };
 
 class Image : public ISynchronizedBufferParent
 {
 public:
-	CTL_EXPORT Image(int xRes, int yRes, RGBCOL* target = 0);
+	CTL_EXPORT Image(int xRes, int yRes, RGBCOL* target = 0, ImageLayout layout = IMAGE_LAYOUT_LINEAR);
 	CTL_EXPORT void Free();
 
 	CUDA_FUNC_IN void getExtent(unsigned int& xRes, unsigned int &yRes) const
@@ -47,6 +130,10 @@ public:
 	{
 		return yResolution;
 	}
+	CUDA_FUNC_IN ImageLayout getLayout() const
+	{
+		return m_layout;
+	}
 
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST void AddSample(float sx, float sy, const Spectrum &L);
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST void ClearSample(int sx, int sy);
@@ -58,6 +145,10 @@ public:
 
 	CTL_EXPORT void Clear();
 
+	//stores and restores the accumulated samples, the resolution has to match
+	CTL_EXPORT void SaveState(RenderCheckpoint& checkpoint);
+	CTL_EXPORT void LoadState(const RenderCheckpoint& checkpoint);
+
 	//compute the maximum, minimum, average luminance and log average luminance of the filtered data
 	CTL_EXPORT void ComputeLuminanceInfo(Spectrum& avgColor, float& minLum, float& maxLum, float& avgLum, float& avgLogLum);
 
@@ -65,22 +156,52 @@ public:
 	{
 		return m_pixelBuffer[idx(x, y)];
 	}
+	//the pixels in storage order including the padding of the tiled layout, the order is equal for images with equal size and layout
+	CUDA_FUNC_IN unsigned int getNumStoredPixels() const
+	{
+		return m_pixelBuffer.getLength();
+	}
+	CUDA_FUNC_IN PixelData& getStoredPixelData(unsigned int i)
+	{
+		return m_pixelBuffer[i];
+	}
+	//the filtered and processed data are always row major, they are copied to the host and the view target as they are
 	CUDA_FUNC_IN RGBE& getFilteredData(int x, int y)
 	{
-		return m_filteredColorsDevice[idx(x, y)];
+		return m_filteredColorsDevice[y * xResolution + x];
 	}
 	CUDA_FUNC_IN RGBCOL& getProcessedData(int x, int y)
 	{
-		return m_viewTarget[idx(x, y)];
+		return m_viewTarget[y * xResolution + x];
 	}
 private:
 	FIBITMAP* toFreeImage(bool HDR);
-	CUDA_FUNC_IN int idx(int x, int y) const
+	CUDA_FUNC_IN static unsigned int spreadBits(unsigned int v)
+	{
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+	//index into m_pixelBuffer, the only buffer which uses m_layout
+	CUDA_FUNC_IN unsigned int idx(int x, int y) const
+	{
+		if (m_layout == IMAGE_LAYOUT_LINEAR)
+			return y * xResolution + x;
+		unsigned int tile = (y / IMAGE_TILE_SIZE) * m_uNumTilesX + x / IMAGE_TILE_SIZE;
+		return tile * IMAGE_TILE_SIZE * IMAGE_TILE_SIZE + (spreadBits(x % IMAGE_TILE_SIZE) | (spreadBits(y % IMAGE_TILE_SIZE) << 1));
+	}
+	static unsigned int getStorageLength(int xRes, int yRes, ImageLayout layout)
 	{
-		return y * xResolution + x;
+		if (layout == IMAGE_LAYOUT_LINEAR)
+			return xRes * yRes;
+		return ((xRes + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE) * ((yRes + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE) * IMAGE_TILE_SIZE * IMAGE_TILE_SIZE;
 	}
 
 	int xResolution, yResolution;
+	ImageLayout m_layout;
+	unsigned int m_uNumTilesX;
 	//Stage 1, directly from the Integrator, this is either on the host or device
 	SynchronizedBuffer<PixelData> m_pixelBuffer;
 	//Stage 2, reconstructed from Stage 1 by a Filter, located on device
@@ -3,13 +3,19 @@
 #include "MIPMapHelper.h"
 #include <Base/FileStream.h>
 #include <Base/CudaMemoryManager.h>
+#include "TextureTileCache.h"
 
 namespace CudaTracerLib {
 
-MIPMap::MIPMap(const std::string& a_InputFile, IInStream& a_In)
-	: m_pPath(a_InputFile)
+MIPMap::MIPMap(const std::string& a_InputFile, IInStream& a_In, TextureTileCache* tileCache)
+	: m_pDeviceData(0), m_bTiled(false), m_pTileCache(0), m_uTileCacheId(0), m_pPageTable(0), m_pTileRequests(0), m_pPath(a_InputFile)
 {
 	a_In >> m_uWidth;
+	if (m_uWidth == MIPMAP_TILED_MAGIC)
+	{
+		m_bTiled = true;
+		a_In >> m_uWidth;
+	}
 	a_In >> m_uHeight;
 	a_In >> m_uBpp;
 	a_In.operator>>(*(int*)&m_uType);
@@ -17,28 +23,161 @@ MIPMap::MIPMap(const std::string& a_InputFile, IInStream& a_In)
 	a_In.operator>>(*(int*)&m_uFilterMode);
 	a_In >> m_uLevels;
 	a_In >> m_uSize;
-	CUDA_MALLOC(&m_pDeviceData, m_uSize);
 	m_pHostData = (unsigned int*)malloc(m_uSize);
 	a_In.Read(m_pHostData, m_uSize);
-	ThrowCudaErrors(cudaMemcpy(m_pDeviceData, m_pHostData, m_uSize, cudaMemcpyHostToDevice));
 	a_In.Read(m_sOffsets, sizeof(m_sOffsets));
+	if (m_bTiled)
+		a_In.Read(m_uTileOffsets, sizeof(m_uTileOffsets));
 	a_In.Read(m_weightLut, sizeof(m_weightLut));
+#ifndef SPECTRAL_RENDERING
+	if (m_uType == vtSpectral)
+	{
+		free(m_pHostData);
+		throw std::runtime_error("The texture " + a_InputFile + " was compiled for the spectral build!");
+	}
+#endif
+
+	if (m_bTiled && tileCache)
+	{
+		//every tile of every level, the coarsest level and the levels which fit into a single tile are kept resident as fallback
+		KernelMIPMap layout = getKernelData();
+		unsigned int n = getTextureBlockWords(m_uType);
+		std::vector<TextureTileCache::TileDesc> tiles;
+		for (unsigned int level = 0; level < m_uLevels; level++)
+		{
+			unsigned int bw, bh, tw, th;
+			layout.getLevelBlocks(level, bw, bh);
+			layout.getTileDim(level, tw, th);
+			unsigned int numTiles = bw / tw * (bh / th);
+			for (unsigned int t = 0; t < numTiles; t++)
+			{
+				TextureTileCache::TileDesc desc;
+				desc.hostOffset = m_sOffsets[level] + t * tw * th * n;
+				desc.numWords = tw * th * n;
+				desc.pinned = numTiles == 1 || level == m_uLevels - 1;
+				tiles.push_back(desc);
+			}
+		}
+		m_pTileCache = tileCache;
+		m_uTileCacheId = tileCache->Register(m_pHostData, tiles, m_pPageTable, m_pTileRequests);
+	}
+	else
+	{
+		CUDA_MALLOC_TAGGED(&m_pDeviceData, m_uSize, MEMORY_TAG_TEXTURES);
+		ThrowCudaErrors(cudaMemcpy(m_pDeviceData, m_pHostData, m_uSize, cudaMemcpyHostToDevice));
+	}
 }
 
 void MIPMap::Free()
 {
-	CUDA_FREE(m_pDeviceData);
+	if (m_pTileCache)
+		m_pTileCache->Unregister(m_uTileCacheId);
+	else CUDA_FREE(m_pDeviceData);
 	free(m_pHostData);
 }
 
-void MIPMap::CompileToBinary(const std::string& in, const std::string& out, bool a_MipMap)
+static bool hasAlpha(const imgData& img)
+{
+	const RGBCOL* texels = (const RGBCOL*)img.d();
+	for (int i = 0; i < img.w() * img.h(); i++)
+		if (texels[i].w != 255)
+			return true;
+	return false;
+}
+
+//chooses the data type in which the texture is stored
+static Texture_DataType chooseDataType(const imgData& img, TextureCompression c)
+{
+	switch (c)
+	{
+	case TEXTURE_COMPRESS_BC1:
+		return vtBC1;
+	case TEXTURE_COMPRESS_BC4:
+		return vtBC4;
+	case TEXTURE_COMPRESS_BC5:
+		return vtBC5;
+	case TEXTURE_COMPRESS_BC6H:
+		return vtBC6H;
+	case TEXTURE_COMPRESS_AUTO:
+		break;
+	default:
+#ifdef SPECTRAL_RENDERING
+		//the alpha channel has no room next to the bins, these textures are upsampled at every lookup
+		if (img.t() == vtRGBCOL && !hasAlpha(img))
+			return vtSpectral;
+#endif
+		return img.t();
+	}
+	if (img.t() == vtRGBE)
+		return vtBC6H;
+	//none of the block formats is suited for alpha masks
+	if (hasAlpha(img))
+		return vtRGBCOL;
+	bool gray = true;
+	const RGBCOL* texels = (const RGBCOL*)img.d();
+	for (int i = 0; i < img.w() * img.h(); i++)
+		gray &= texels[i].x == texels[i].y && texels[i].y == texels[i].z;
+	return gray ? vtBC4 : vtBC1;
+}
+
+//converts the level to row by row stored blocks of the data type
+static void compressLevel(const imgData& img, Texture_DataType type, std::vector<unsigned int>& blocks)
+{
+	if (type == img.t())
+	{
+		blocks.assign((const unsigned int*)img.d(), (const unsigned int*)img.d() + img.w() * img.h());
+		return;
+	}
+#ifdef SPECTRAL_RENDERING
+	if (type == vtSpectral)
+	{
+		blocks.resize(img.w() * img.h());
+		for (int y = 0; y < img.h(); y++)
+			for (int x = 0; x < img.w(); x++)
+			{
+				Spectrum s = img.Load(x, y).saturate();
+				RGBCOL& c = *(RGBCOL*)&blocks[y * img.w() + x];
+				c = make_uchar4((unsigned char)(s[0] * 255.0f + 0.5f), (unsigned char)(s[1] * 255.0f + 0.5f), (unsigned char)(s[2] * 255.0f + 0.5f), (unsigned char)(s[3] * 255.0f + 0.5f));
+			}
+		return;
+	}
+#endif
+	unsigned int n = getTextureBlockWords(type), bw = max(img.w() / 4, 1), bh = max(img.h() / 4, 1);
+	blocks.resize(bw * bh * n);
+	Vec3f texels[16];
+	for (unsigned int by = 0; by < bh; by++)
+		for (unsigned int bx = 0; bx < bw; bx++)
+		{
+			for (unsigned int i = 0; i < 16; i++)
+			{
+				//levels smaller than a block repeat their texels
+				Spectrum s = img.Load((bx * 4 + i % 4) % img.w(), (by * 4 + i / 4) % img.h());
+				s.toLinearRGB(texels[i].x, texels[i].y, texels[i].z);
+			}
+			EncodeTextureBlock(type, texels, &blocks[(by * bw + bx) * n]);
+		}
+}
+
+//writes the blocks of the level in tiles, each tile is stored row by row
+static void writeTiled(FileOutputStream& a_Out, const KernelMIPMap& layout, unsigned int level, const std::vector<unsigned int>& blocks)
+{
+	unsigned int n = getTextureBlockWords(layout.m_uType), bw, bh, tw, th;
+	layout.getLevelBlocks(level, bw, bh);
+	layout.getTileDim(level, tw, th);
+	for (unsigned int ty = 0; ty < bh / th; ty++)
+		for (unsigned int tx = 0; tx < bw / tw; tx++)
+			for (unsigned int y = 0; y < th; y++)
+				a_Out.Write(&blocks[((ty * th + y) * bw + tx * tw) * n], tw * n * sizeof(unsigned int));
+}
+
+void MIPMap::CompileToBinary(const std::string& in, const std::string& out, bool a_MipMap, TextureCompression a_Compression)
 {
 	FileOutputStream o(out);
-	CompileToBinary(in, o, a_MipMap);
+	CompileToBinary(in, o, a_MipMap, a_Compression);
 	o.Close();
 }
 
-void MIPMap::CompileToBinary(const std::string& a_InputFile, FileOutputStream& a_Out, bool a_MipMap)
+void MIPMap::CompileToBinary(const std::string& a_InputFile, FileOutputStream& a_Out, bool a_MipMap, TextureCompression a_Compression)
 {
 	imgData data;
 	if (!parseImage(a_InputFile, data))
@@ -46,29 +185,53 @@ void MIPMap::CompileToBinary(const std::string& a_InputFile, FileOutputStream& a
 	if (popc(data.w()) != 1 || popc(data.h()) != 1)
 		data.RescaleToPowerOf2();
 
+	KernelMIPMap layout;
+	layout.m_uType = chooseDataType(data, a_Compression);
+	layout.m_uWidth = data.w();
+	layout.m_uHeight = data.h();
+	unsigned int n = getTextureBlockWords(layout.m_uType);
+
 	unsigned int nLevels = 1 + math::Log2Int(min(float(data.w()), float(data.h())));
 	//if(!a_MipMap)
 	//	nLevels = 1;
 	unsigned int size = 0;
-	for (unsigned int i = 0, j = data.w(), k = data.h(); i < nLevels; i++, j = j >> 1, k = k >> 1)
-		size += j * k * 4;
+	for (unsigned int i = 0; i < nLevels; i++)
+	{
+		unsigned int bw, bh;
+		layout.getLevelBlocks(i, bw, bh);
+		size += bw * bh * n * 4;
+	}
 
+	a_Out << (unsigned int)MIPMAP_TILED_MAGIC;
 	a_Out << data.w();
 	a_Out << data.h();
 	a_Out << (unsigned int)4;
-	a_Out << (int)data.t();
+	a_Out << (int)layout.m_uType;
 	a_Out << (int)TEXTURE_REPEAT;
 	a_Out << (int)TEXTURE_Anisotropic;
 	a_Out << nLevels;
 	a_Out << size;
-	a_Out.Write(data.d(), data.w() * data.h() * sizeof(RGBCOL));
+
+	unsigned int m_sOffsets[MAX_MIPS], m_uTileOffsets[MAX_MIPS];
+	unsigned int off = 0, numTiles = 0;
+	std::vector<unsigned int> blocks;
+	auto writeLevel = [&](unsigned int level, const imgData& img)
+	{
+		unsigned int bw, bh, tw, th;
+		layout.getLevelBlocks(level, bw, bh);
+		layout.getTileDim(level, tw, th);
+		m_sOffsets[level] = off;
+		off += bw * bh * n;
+		m_uTileOffsets[level] = numTiles;
+		numTiles += (bw / tw) * (bh / th);
+		compressLevel(img, layout.m_uType, blocks);
+		writeTiled(a_Out, layout, level, blocks);
+	};
+	writeLevel(0, data);
 
 	imgData tmpData;
 	tmpData.Allocate(data.w() * 2, data.h() * 2, data.t());
 	imgData* buffer[2] = { &data, &tmpData };
-	unsigned int m_sOffsets[MAX_MIPS];
-	m_sOffsets[0] = 0;
-	unsigned int off = data.w() * data.h();
 	for (unsigned int i = 1, j = data.w() / 2, k = data.h() / 2; i < nLevels; i++, j >>= 1, k >>= 1)
 	{
 		buffer[0]->SetInfo(j * 2, k * 2, buffer[0]->t()); buffer[1]->SetInfo(j, k, buffer[1]->t());
@@ -79,12 +242,11 @@ void MIPMap::CompileToBinary(const std::string& a_InputFile, FileOutputStream& a
 									  buffer[0]->Load(2 * s, 2 * t + 1) + buffer[0]->Load(2 * s + 1, 2 * t + 1));
 				buffer[1]->Set(v, s, t);
 			}
-		m_sOffsets[i] = off;
-		off += j * k;
-		a_Out.Write(buffer[1]->d(), j * k * sizeof(RGBCOL));
+		writeLevel(i, *buffer[1]);
 		swapk(buffer[0], buffer[1]);
 	}
 	a_Out.Write(m_sOffsets, sizeof(m_sOffsets));
+	a_Out.Write(m_uTileOffsets, sizeof(m_uTileOffsets));
 	for (int i = 0; i < MTS_MIPMAP_LUT_SIZE; ++i)
 	{
 		float r2 = (float)i / (float)(MTS_MIPMAP_LUT_SIZE - 1);
@@ -95,6 +257,43 @@ void MIPMap::CompileToBinary(const std::string& a_InputFile, FileOutputStream& a
 	tmpData.Free();
 }
 
+float MIPMap::ComputeCompressionError(const std::string& a_InputFile, TextureCompression a_Compression)
+{
+	imgData data;
+	if (!parseImage(a_InputFile, data))
+		throw std::runtime_error("Impossible to load texture file!");
+	if (popc(data.w()) != 1 || popc(data.h()) != 1)
+		data.RescaleToPowerOf2();
+	Texture_DataType type = chooseDataType(data, a_Compression);
+	if (type == data.t() || type == vtSpectral)
+	{
+		data.Free();
+		return 0.0f;
+	}
+	std::vector<unsigned int> blocks;
+	compressLevel(data, type, blocks);
+	unsigned int n = getTextureBlockWords(type), bw = max(data.w() / 4, 1), bh = max(data.h() / 4, 1);
+	double err = 0;
+	Vec3f decoded[16];
+	for (unsigned int by = 0; by < bh; by++)
+		for (unsigned int bx = 0; bx < bw; bx++)
+		{
+			DecodeTextureBlock(type, &blocks[(by * bw + bx) * n], decoded);
+			for (unsigned int i = 0; i < 16; i++)
+			{
+				int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+				//levels smaller than a block repeat their texels
+				if (x >= data.w() || y >= data.h())
+					continue;
+				Vec3f ref;
+				data.Load(x, y).toLinearRGB(ref.x, ref.y, ref.z);
+				err += distanceSquared(ref, decoded[i]);
+			}
+		}
+	data.Free();
+	return (float)std::sqrt(err / (3.0 * data.w() * data.h()));
+}
+
 KernelMIPMap MIPMap::getKernelData()
 {
 	KernelMIPMap r;
@@ -109,6 +308,11 @@ KernelMIPMap MIPMap::getKernelData()
 	r.m_uLevels = m_uLevels;
 	memcpy(r.m_sOffsets, m_sOffsets, sizeof(m_sOffsets));
 	memcpy(r.m_weightLut, m_weightLut, sizeof(m_weightLut));
+	r.m_bTiled = m_bTiled;
+	memcpy(r.m_uTileOffsets, m_uTileOffsets, sizeof(m_uTileOffsets));
+	r.m_pPageTable = m_pPageTable;
+	r.m_pTileRequests = m_pTileRequests;
+	r.m_pTilePool = m_pTileCache ? m_pTileCache->getDevicePoolAddress() : 0;
 	return r;
 }
 
@@ -1,6 +1,7 @@
 #include "StdAfx.h"
 #include "MIPMap.h"
 #include "MIPMapHelper.h"
+#include "TextureCompression.h"
 #include <Base/FileStream.h>
 #include <Base/CudaMemoryManager.h>
 #define FREEIMAGE_LIB
@@ -18,6 +19,62 @@ CUDA_FUNC_IN float hypot2(float a, float b)
 	return math::sqrt(a * a + b * b);
 }
 
+//all zero block which decodes to black for every data type
+CUDA_DEVICE unsigned int g_MissingTexelBlock[4] = { 0, 0, 0, 0 };
+
+const unsigned int* KernelMIPMap::texelAddress(unsigned int level, unsigned int& x, unsigned int& y) const
+{
+#ifdef ISCUDA
+	if (m_pPageTable)
+	{
+		unsigned int d = getTextureBlockDim(m_uType), n = getTextureBlockWords(m_uType);
+		const unsigned int* pool = *m_pTilePool;
+		//the coarsest level is always resident, therefore this loop always finds a texel
+		for (unsigned int l = level; l < m_uLevels; l++, x >>= 1, y >>= 1)
+		{
+			unsigned int tw, th, bw, bh, bx = x / d, by = y / d;
+			getLevelBlocks(l, bw, bh);
+			getTileDim(l, tw, th);
+			unsigned int tile = m_uTileOffsets[l] + (by / th) * (bw / tw) + bx / tw;
+			if (!m_pTileRequests[tile])
+				m_pTileRequests[tile] = 1;
+			unsigned int slot = m_pPageTable[tile];
+			if (slot != MIPMAP_TILE_NOT_RESIDENT)
+				return pool + slot * MIPMAP_TILE_SIZE * MIPMAP_TILE_SIZE + ((by % th) * tw + bx % tw) * n;
+		}
+		//never read the pool at an arbitrary slot, it belongs to another texture
+		x = y = 0;
+		return g_MissingTexelBlock;
+	}
+	return m_pDeviceData + getTexelOffset(level, x, y);
+#else
+	return m_pHostData + getTexelOffset(level, x, y);
+#endif
+}
+
+Spectrum KernelMIPMap::loadTexel(unsigned int level, unsigned int x, unsigned int y) const
+{
+	const unsigned int* data = texelAddress(level, x, y);
+	Spectrum s;
+	if (m_uType == vtRGBE)
+		s.fromRGBE(*(RGBE*)data);
+	else if (m_uType == vtRGBCOL)
+		s.fromRGBCOL(*(RGBCOL*)data);
+#ifdef SPECTRAL_RENDERING
+	else if (m_uType == vtSpectral)
+	{
+		RGBCOL c = *(RGBCOL*)data;
+		s[0] = c.x / 255.0f; s[1] = c.y / 255.0f; s[2] = c.z / 255.0f; s[3] = c.w / 255.0f;
+	}
+#endif
+	else
+	{
+		Vec3f rgb = decodeTextureBlock(m_uType, data, x % 4, y % 4);
+		s.fromLinearRGB(rgb.x, rgb.y, rgb.z, m_uType == vtBC6H ? Spectrum::EIlluminant : Spectrum::EReflectance);
+	}
+	return s;
+}
+
 Spectrum KernelMIPMap::Texel(unsigned int level, const Vec2f& a_UV) const
 {
 	Vec2f l;
@@ -27,17 +84,7 @@ Spectrum KernelMIPMap::Texel(unsigned int level, const Vec2f& a_UV) const
 	{
 		int w_level = m_uWidth >> level, h_level = m_uHeight >> level;
 		int x = math::clamp((int)l.x, 0, w_level - 1), y = math::clamp((int)l.y, 0, h_level - 1);
-		void* data;
-#ifdef ISCUDA
-		data = m_pDeviceData + (m_sOffsets[level] + y * w_level + x);
-#else
-		data = m_pHostData + (m_sOffsets[level] + y * w_level + x);
-#endif
-		Spectrum s;
-		if (m_uType == vtRGBE)
-			s.fromRGBE(*(RGBE*)data);
-		else s.fromRGBCOL(*(RGBCOL*)data);
-		return s;
+		return loadTexel(level, x, y);
 	}
 }
 
@@ -125,16 +172,12 @@ float KernelMIPMap::SampleAlpha(const Vec2f& uv) const
 	Vec2f l;
 	if (!WrapCoordinates(uv, Vec2f((float)m_uWidth, (float)m_uHeight), m_uWrapMode, &l))
 		return 0.0f;
-	unsigned int x = (unsigned int)l.x, y = (unsigned int)l.y, level = 0;
-	void* data;
-#ifdef ISCUDA
-	data = m_pDeviceData + (m_sOffsets[level] + y * (m_uWidth >> level) + x);
-#else
-	data = m_pHostData + (m_sOffsets[level] + y * (m_uWidth >> level) + x);
-#endif
-	if (m_uType == vtRGBE)
+	unsigned int x = DMIN2((unsigned int)l.x, m_uWidth - 1), y = DMIN2((unsigned int)l.y, m_uHeight - 1), level = 0;
+	//only the uncompressed 8 bit format stores alpha
+	if (m_uType != vtRGBCOL)
 		return 1.0f;
-	else return float(((RGBCOL*)data)->w) / 255.0f;
+	const void* data = texelAddress(level, x, y);
+	return float(((RGBCOL*)data)->w) / 255.0f;
 }
 
 Spectrum KernelMIPMap::Sample(const Vec2f& a_UV, float width) const
@@ -158,17 +201,7 @@ Spectrum KernelMIPMap::Sample(float width, int x, int y) const
 	int level = (int)math::clamp(l, 0.0f, float(m_uLevels - 1));
 	int w_level = m_uWidth >> level, h_level = m_uHeight >> level;
 	x = math::clamp(x, 0, w_level - 1); y = math::clamp(y, 0, h_level - 1);
-	void* data;
-#ifdef ISCUDA
-	data = m_pDeviceData + (m_sOffsets[level] + y * w_level + x);
-#else
-	data = m_pHostData + (m_sOffsets[level] + y * w_level + x);
-#endif
-	Spectrum s;
-	if (m_uType == vtRGBE)
-		s.fromRGBE(*(RGBE*)data);
-	else s.fromRGBCOL(*(RGBCOL*)data);
-	return s;
+	return loadTexel(level, x, y);
 }
 
 void KernelMIPMap::evalGradient(const Vec2f& uv, Spectrum* gradient) const
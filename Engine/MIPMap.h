@@ -1,11 +1,16 @@
 #pragma once
 #include "MIPMap_device.h"
+#include "TextureCompression.h"
 #include <Base/FixedString.h>
 
 namespace CudaTracerLib {
 
 class IInStream;
 class FileOutputStream;
+class TextureTileCache;
+
+//written at the start of compiled textures with a tiled layout, older files start with the width
+#define MIPMAP_TILED_MAGIC 0xffff0001
 
 class MIPMap
 {
@@ -20,14 +25,24 @@ class MIPMap
 	ImageWrap m_uWrapMode;
 	unsigned int m_sOffsets[MAX_MIPS];
 	float m_weightLut[MTS_MIPMAP_LUT_SIZE];
+	bool m_bTiled;
+	unsigned int m_uTileOffsets[MAX_MIPS];
+	//only set for textures which are paged by a cache, m_pDeviceData is null for these
+	TextureTileCache* m_pTileCache;
+	unsigned int m_uTileCacheId;
+	unsigned int* m_pPageTable;
+	unsigned char* m_pTileRequests;
 public:
 	ImageFilter m_uFilterMode;
 	std::string m_pPath;
 	MIPMap() = default;
-	CTL_EXPORT MIPMap(const std::string& a_InputFile, IInStream& a_In);
+	//if a cache is passed, tiled textures are paged through it instead of being completely resident on the device
+	CTL_EXPORT MIPMap(const std::string& a_InputFile, IInStream& a_In, TextureTileCache* tileCache = 0);
 	CTL_EXPORT void Free();
-	CTL_EXPORT static void CompileToBinary(const std::string& a_InputFile, FileOutputStream& a_Out, bool a_MipMap);
-	CTL_EXPORT static void CompileToBinary(const std::string& in, const std::string& out, bool a_MipMap);
+	CTL_EXPORT static void CompileToBinary(const std::string& a_InputFile, FileOutputStream& a_Out, bool a_MipMap, TextureCompression a_Compression = TEXTURE_UNCOMPRESSED);
+	CTL_EXPORT static void CompileToBinary(const std::string& in, const std::string& out, bool a_MipMap, TextureCompression a_Compression = TEXTURE_UNCOMPRESSED);
+	//root mean square error of the linear rgb values of the first level after compression, 0 if the texture would not be compressed
+	CTL_EXPORT static float ComputeCompressionError(const std::string& a_InputFile, TextureCompression a_Compression);
 	CTL_EXPORT static void CreateSphericalSkydomeTexture(const std::string& front, const std::string& back, const std::string& left, const std::string& right, const std::string& top, const std::string& bottom, const std::string& outFile);
 	CTL_EXPORT static void CreateRelaxedConeMap(const std::string& a_InputFile, FileOutputStream& Out);
 	CTL_EXPORT KernelMIPMap getKernelData();
@@ -39,6 +54,10 @@ public:
 	{
 		return m_uSize;
 	}
+	bool isPaged() const
+	{
+		return m_pTileCache != 0;
+	}
 };
 
 }
\ No newline at end of file
@@ -7,6 +7,10 @@ struct Spectrum;
 
 #define MAX_MIPS 16
 #define MTS_MIPMAP_LUT_SIZE 64
+//edge length of the tiles in which the levels of tiled textures are stored, smaller levels consist of a single tile
+//tiles of block compressed textures hold more texels, every tile is at most MIPMAP_TILE_SIZE^2 words
+#define MIPMAP_TILE_SIZE 64
+#define MIPMAP_TILE_NOT_RESIDENT 0xffffffff
 
 enum ImageWrap
 {
@@ -28,8 +32,31 @@ enum Texture_DataType
 {
 	vtRGBE,
 	vtRGBCOL,
+	//block compressed, 4x4 texels per block, see TextureCompression.h
+	vtBC1,
+	vtBC4,
+	vtBC5,
+	vtBC6H,
+	//the 4 bins of the spectral build with 8 bit each, upsampled from rgb when the texture is compiled
+	vtSpectral,
 };
 
+//edge length of the blocks in which the texels are stored, uncompressed textures use blocks of a single texel
+CUDA_FUNC_IN unsigned int getTextureBlockDim(Texture_DataType t)
+{
+	return t >= vtBC1 && t <= vtBC6H ? 4 : 1;
+}
+
+//size of a block in 32 bit words
+CUDA_FUNC_IN unsigned int getTextureBlockWords(Texture_DataType t)
+{
+	if (t == vtBC1 || t == vtBC4)
+		return 2;
+	else if (t == vtBC5 || t == vtBC6H)
+		return 4;
+	else return 1;
+}
+
 CUDA_FUNC_IN bool WrapCoordinates(const Vec2f& a_UV, const Vec2f& dim, ImageWrap w, Vec2f* loc)
 {
 	switch (w)
@@ -66,6 +93,47 @@ struct KernelMIPMap
 	unsigned int m_sOffsets[MAX_MIPS];
 	unsigned int m_uLevels;
 	float m_weightLut[MTS_MIPMAP_LUT_SIZE];
+	//tiled layout, the tiles of all levels are numbered consecutively starting at m_uTileOffsets[level]
+	bool m_bTiled;
+	unsigned int m_uTileOffsets[MAX_MIPS];
+	//demand paging, maps tiles to slots of the tile pool and records which tiles were accessed
+	//null if the whole texture is resident in m_pDeviceData
+	unsigned int* m_pPageTable;
+	unsigned char* m_pTileRequests;
+	//the pool is read through the address held by the cache because shrinking the cache reallocates it
+	unsigned int* const* m_pTilePool;
+
+	//number of blocks of the level in each dimension
+	CUDA_FUNC_IN void getLevelBlocks(unsigned int level, unsigned int& bw, unsigned int& bh) const
+	{
+		unsigned int d = getTextureBlockDim(m_uType);
+		bw = DMAX2((m_uWidth >> level) / d, 1u);
+		bh = DMAX2((m_uHeight >> level) / d, 1u);
+	}
+
+	//dimensions of the tiles of the level in blocks
+	CUDA_FUNC_IN void getTileDim(unsigned int level, unsigned int& tw, unsigned int& th) const
+	{
+		unsigned int bw, bh, n = getTextureBlockWords(m_uType);
+		getLevelBlocks(level, bw, bh);
+		unsigned int maxW = n > 2 ? MIPMAP_TILE_SIZE / 2 : MIPMAP_TILE_SIZE, maxH = MIPMAP_TILE_SIZE * MIPMAP_TILE_SIZE / (maxW * n);
+		tw = DMIN2(bw, maxW);
+		th = DMIN2(bh, maxH);
+	}
+
+	//offset in words of the block containing the texel in the complete data of the texture, valid for the host data and non paged device data
+	CUDA_FUNC_IN unsigned int getTexelOffset(unsigned int level, unsigned int x, unsigned int y) const
+	{
+		unsigned int d = getTextureBlockDim(m_uType), n = getTextureBlockWords(m_uType), bw, bh;
+		getLevelBlocks(level, bw, bh);
+		x /= d;
+		y /= d;
+		if (!m_bTiled)
+			return m_sOffsets[level] + (y * bw + x) * n;
+		unsigned int tw, th;
+		getTileDim(level, tw, th);
+		return m_sOffsets[level] + (((y / th) * (bw / tw) + x / tw) * tw * th + (y % th) * tw + x % tw) * n;
+	}
 
 	//Texture functions
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum Sample(const Vec2f& uv) const;
@@ -76,6 +144,10 @@ struct KernelMIPMap
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum Sample(float width, int x, int y) const;
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum eval(const Vec2f& uv, const Vec2f& d0, const Vec2f& d1) const;
 private:
+	//address of the block containing the texel
+	//on the device paged textures fall back to coarser levels if the tile of the requested level is not resident, x and y are changed to the texel which was found
+	CTL_EXPORT CUDA_DEVICE CUDA_HOST const unsigned int* texelAddress(unsigned int level, unsigned int& x, unsigned int& y) const;
+	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum loadTexel(unsigned int level, unsigned int x, unsigned int y) const;
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum Texel(unsigned int level, const Vec2f& a_UV) const;
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum triangle(unsigned int level, const Vec2f& a_UV) const;
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum evalEWA(unsigned int level, const Vec2f &uv, float A, float B, float C) const;
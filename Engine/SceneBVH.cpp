@@ -5,28 +5,33 @@
 #include <SceneTypes/Node.h>
 #include "SpatialStructures/BVH/SplitBVHBuilder.hpp"
 #include "SpatialStructures/BVH/BVHRebuilder.h"
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib {
 
 bool SceneBVH::Build(Stream<Node>* nodStream, Buffer<Mesh, KernelMesh>* mesh_buf)
 {
+	PROFILE_ZONE("BVH", "Scene BVH Build");
 	class provider : public ISpatialInfoProvider
 	{
 		Stream<Node>* a_Nodes;
 		Buffer<Mesh, KernelMesh>* mesh_buf;
-		StreamReference<float4x4> a_Transforms;
+		StreamReference<float4x4> a_Transforms, a_EndTransforms;
 	public:
-		provider(Stream<Node>* A, Buffer<Mesh, KernelMesh>* B, StreamReference<float4x4> C)
-			: a_Nodes(A), mesh_buf(B), a_Transforms(C)
+		provider(Stream<Node>* A, Buffer<Mesh, KernelMesh>* B, StreamReference<float4x4> C, StreamReference<float4x4> D)
+			: a_Nodes(A), mesh_buf(B), a_Transforms(C), a_EndTransforms(D)
 		{
 
 		}
 		virtual AABB getBox(unsigned int idx)
 		{
-			unsigned int mi = a_Nodes->operator()(idx)->m_uMeshIndex;
-			AABB box = mesh_buf->operator()(mi)->m_sLocalBox;
+			Node* node = a_Nodes->operator()(idx).operator->();
+			AABB box = mesh_buf->operator()(node->m_uMeshIndex)->m_sLocalBox;
 			float4x4 mat = *a_Transforms(idx);
-			return box.Transform(mat);
+			if (!node->m_uHasMotion)
+				return box.Transform(mat);
+			//the corners move linearly for interpolated matrices, so the union of both end boxes bounds the whole motion
+			return box.Transform(mat).Extend(box.Transform(*a_EndTransforms(idx)));
 		}
 		virtual void iterateObjects(std::function<void(unsigned int)> f)
 		{
@@ -39,7 +44,7 @@ bool SceneBVH::Build(Stream<Node>* nodStream, Buffer<Mesh, KernelMesh>* mesh_buf
 		m_pBuilder->SetEmpty();
 		return false;
 	}
-	provider p(nodStream, mesh_buf, tr_ref);
+	provider p(nodStream, mesh_buf, tr_ref, end_tr_ref);
 	bool modified = m_pBuilder->Build(&p);
 	if (modified)
 	{
@@ -49,20 +54,25 @@ bool SceneBVH::Build(Stream<Node>* nodStream, Buffer<Mesh, KernelMesh>* mesh_buf
 		m_pTransforms->UpdateInvalidated();
 		m_pInvTransforms->Invalidate();
 		m_pInvTransforms->UpdateInvalidated();
+		m_pEndTransforms->Invalidate();
+		m_pEndTransforms->UpdateInvalidated();
 	}
 	return modified;
 }
 
 SceneBVH::SceneBVH(size_t a_NodeCount)
+	: m_uNumMovingNodes(0)
 {
 	m_pNodes = new Stream<BVHNodeData>(a_NodeCount * 2);//largest binary tree has the same amount of inner nodes
 	m_pTransforms = new Stream<float4x4>(a_NodeCount);
 	m_pInvTransforms = new Stream<float4x4>(a_NodeCount);
+	m_pEndTransforms = new Stream<float4x4>(a_NodeCount);
 	tr_ref = m_pTransforms->malloc(m_pTransforms->getBufferLength());
 	iv_tr_ref = m_pInvTransforms->malloc(m_pInvTransforms->getBufferLength());
+	end_tr_ref = m_pEndTransforms->malloc(m_pEndTransforms->getBufferLength());
 	node_ref = m_pNodes->malloc(m_pNodes->getBufferLength());
 	for (unsigned int i = 0; i < a_NodeCount; i++)
-		*tr_ref(i) = *iv_tr_ref(i) = float4x4::Identity();
+		*tr_ref(i) = *iv_tr_ref(i) = *end_tr_ref(i) = float4x4::Identity();
 	m_pBuilder = new BVHRebuilder(node_ref(), node_ref.getLength(), (unsigned int)a_NodeCount, 0, 0);
 }
 
@@ -71,6 +81,7 @@ SceneBVH::~SceneBVH()
 	delete m_pNodes;
 	delete m_pTransforms;
 	delete m_pInvTransforms;
+	delete m_pEndTransforms;
 	delete m_pBuilder;
 }
 
@@ -83,25 +94,40 @@ void SceneBVH::setTransform(BufferReference<Node, Node> n, const float4x4& mat)
 	unsigned int nodeIdx = n.getIndex();
 	*m_pTransforms[0](nodeIdx).operator->() = mat;
 	*m_pInvTransforms[0](nodeIdx).operator->() = mat.inverse();
+	*m_pEndTransforms[0](nodeIdx).operator->() = mat;
 	m_pTransforms->Invalidate(nodeIdx, 1);
 	m_pInvTransforms->Invalidate(nodeIdx, 1);
+	m_pEndTransforms->Invalidate(nodeIdx, 1);
+	if (n->m_uHasMotion)
+		m_uNumMovingNodes--;
+	n->m_uHasMotion = false;
 	invalidateNode(n);
 }
 
+void SceneBVH::setMotion(BufferReference<Node, Node> n, const float4x4& matStart, const float4x4& matEnd)
+{
+	setTransform(n, matStart);
+	*m_pEndTransforms[0](n.getIndex()).operator->() = matEnd;
+	n->m_uHasMotion = true;
+	m_uNumMovingNodes++;
+}
+
 KernelSceneBVH SceneBVH::getData(bool devicePointer)
 {
 	KernelSceneBVH q;
 	q.m_uNumNodes = (unsigned int)m_pBuilder->getNumBVHNodesUsed();
+	q.m_uNumMovingNodes = m_uNumMovingNodes;
 	q.m_pNodes = m_pNodes->getKernelData(devicePointer).Data;
 	q.m_sStartNode = m_pBuilder->getStartNode();
 	q.m_pNodeTransforms = m_pTransforms->getKernelData(devicePointer).Data;
 	q.m_pInvNodeTransforms = m_pInvTransforms->getKernelData(devicePointer).Data;
+	q.m_pNodeEndTransforms = m_pEndTransforms->getKernelData(devicePointer).Data;
 	return q;
 }
 
 size_t SceneBVH::getDeviceSizeInBytes()
 {
-	return m_pNodes->getDeviceSizeInBytes() + m_pTransforms->getDeviceSizeInBytes() + m_pInvTransforms->getDeviceSizeInBytes();
+	return m_pNodes->getDeviceSizeInBytes() + m_pTransforms->getDeviceSizeInBytes() + m_pInvTransforms->getDeviceSizeInBytes() + m_pEndTransforms->getDeviceSizeInBytes();
 }
 
 const float4x4& SceneBVH::getNodeTransform(BufferReference<Node, Node> n)
@@ -130,6 +156,8 @@ void SceneBVH::addNode(BufferReference<Node, Node> n)
 
 void SceneBVH::removeNode(BufferReference<Node, Node> n)
 {
+	if (n->m_uHasMotion)
+		m_uNumMovingNodes--;
 	m_pBuilder->removeNode(n.getIndex());
 }
 
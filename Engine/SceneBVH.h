@@ -21,9 +21,11 @@ private:
 	Stream<BVHNodeData>* m_pNodes;
 	Stream<float4x4>* m_pTransforms;
 	Stream<float4x4>* m_pInvTransforms;
+	Stream<float4x4>* m_pEndTransforms;
 	BVHRebuilder* m_pBuilder;
+	unsigned int m_uNumMovingNodes;
 	BufferReference<BVHNodeData, BVHNodeData> node_ref;
-	BufferReference<float4x4, float4x4> tr_ref, iv_tr_ref;
+	BufferReference<float4x4, float4x4> tr_ref, iv_tr_ref, end_tr_ref;
 public:
 	CTL_EXPORT SceneBVH(size_t a_NodeCount);
 	CTL_EXPORT ~SceneBVH();
@@ -31,6 +33,8 @@ public:
 	CTL_EXPORT KernelSceneBVH getData(bool devicePointer = true);
 	CTL_EXPORT size_t getDeviceSizeInBytes();
 	CTL_EXPORT void setTransform(BufferReference<Node, Node> n, const float4x4& mat);
+	//the node moves linearly from matStart to matEnd during the exposure
+	CTL_EXPORT void setMotion(BufferReference<Node, Node> n, const float4x4& matStart, const float4x4& matEnd);
 	CTL_EXPORT void invalidateNode(BufferReference<Node, Node> n);
 	CTL_EXPORT void addNode(BufferReference<Node, Node> n);
 	CTL_EXPORT void removeNode(BufferReference<Node, Node> n);
@@ -9,9 +9,12 @@ struct KernelSceneBVH
 {
 	int m_sStartNode;
 	unsigned int m_uNumNodes;
+	unsigned int m_uNumMovingNodes;
 	BVHNodeData* m_pNodes;
 	float4x4* m_pNodeTransforms;
 	float4x4* m_pInvNodeTransforms;
+	//transforms at shutter close, equal to m_pNodeTransforms for static nodes
+	float4x4* m_pNodeEndTransforms;
 };
 
 }
\ No newline at end of file
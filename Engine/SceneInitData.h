@@ -1,4 +1,5 @@
 #pragma once
+#include "TextureCompression.h"
 
 namespace CudaTracerLib {
 
@@ -15,6 +16,10 @@ struct SceneInitData
 	unsigned int m_uSizeAnimStream;
 	unsigned int m_uNumMeshes;
 	bool m_bSupportEnvironmentMap;
+	//size of the device tile pool used for paging textures, 0 to keep all textures completely resident
+	size_t m_uTextureCacheSize;
+	//block compression applied when textures are compiled
+	TextureCompression m_eTextureCompression;
 
 	static SceneInitData CreateForSpecificMesh(unsigned int a_Triangles, unsigned int a_Int, unsigned int a_Nodes, unsigned int a_Indices, unsigned int a_Mats, unsigned int a_Lights, unsigned int a_SceneNodes, unsigned int a_SceneMeshes)
 	{
@@ -29,6 +34,8 @@ struct SceneInitData
 		r.m_uNumLights = a_Lights;
 		r.m_uNumMeshes = a_SceneMeshes;
 		r.m_uSizeAnimStream = 16;
+		r.m_uTextureCacheSize = 0;
+		r.m_eTextureCompression = TEXTURE_UNCOMPRESSED;
 		return r;
 	}
 
@@ -45,6 +52,8 @@ struct SceneInitData
 		r.m_uNumNodes = a_NumObjects;
 		r.m_uNumLights = a_NumLights;
 		r.m_uSizeAnimStream = a_AnimSize;
+		r.m_uTextureCacheSize = 0;
+		r.m_eTextureCompression = TEXTURE_UNCOMPRESSED;
 		return r;
 	}
 
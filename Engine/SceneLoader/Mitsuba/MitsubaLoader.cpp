@@ -3,7 +3,7 @@
 
 #include "Utils.h"
 #include <iostream>
-#include <boost/property_tree/xml_parser.hpp>
+#include "XMLStreamReader.h"
 #include "PropertyParser.h"
 #include "ObjectParser.h"
 
@@ -15,11 +15,12 @@ void ParseMitsubaScene(DynamicScene& scene, const std::string& scene_file, const
 	for (auto ent : cmd_def_storage)
 		S.def_storage.add(ent.first, ent.second);
 
-	boost::property_tree::ptree pt;
-	read_xml(scene_file, pt);
-	CudaTracerLib::XMLNode root("", pt);
+	//the elements of the scene are parsed one after another, only one of them is held in memory
+	XMLStreamReader reader(scene_file);
+	if (reader.getRootName() != "scene")
+		throw std::runtime_error("The root element of a mitsuba scene has to be scene : " + scene_file);
 
-	root.get_child_node("scene").iterate_child_nodes([&](const CudaTracerLib::XMLNode& n)
+	auto parseElement = [&](const CudaTracerLib::XMLNode& n)
 	{
 		if (n.name() == "include")
 		{
@@ -62,7 +63,12 @@ void ParseMitsubaScene(DynamicScene& scene, const std::string& scene_file, const
 			MediumParser::parse(n, S);
 		}
 		//else throw std::runtime_error("Unrecognized token : " + n.name());
-	});
+	};
+
+	std::string name;
+	boost::property_tree::ptree pt;
+	while (reader.next(name, pt))
+		parseElement(CudaTracerLib::XMLNode(name, pt));
 	scene.UpdateScene();
 
 	for (auto obj : S.nodes_to_remove)
@@ -2,202 +2,266 @@
 #include "ObjectParser.h"
 
 #include "miniz.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
 
 namespace CudaTracerLib {
 
-ShapeParser::ShapeParseResult ShapeParser::serialized(const XMLNode& node, ParserState& S)
+//decodes the submesh at data[0, size) and compiles it to compiled_submesh_filename
+static void compileSerializedSubmesh(const uint8_t* data, size_t size, const std::string& compiled_submesh_filename, bool flipNormals, bool faceNormals, float maxSmoothAngle)
 {
-	auto filename = S.map_asset_filepath(S.def_storage.prop_string(node, "filename"));
-	int submesh_index = S.def_storage.prop_int(node, "shapeIndex");
-	bool flipNormals = S.def_storage.prop_bool(node, "flipNormals", false);
-	bool faceNormals = S.def_storage.prop_bool(node, "faceNormals", false);
-	float maxSmoothAngle = S.def_storage.prop_float(node, "maxSmoothAngle", 0.0f);
-
-	auto name = boost::filesystem::path(filename).stem().string();
-	auto compiled_tar_folder = S.scene.getFileManager()->getCompiledMeshPath("") + name + "/";
-
-	auto get_compiled_submesh_filename = [&](size_t i)
+	enum DataPresentFlag : uint32_t
 	{
-		return compiled_tar_folder + std::to_string(i) + ".xmsh";
+		VertexNormals = 0x0001,
+		TextureCoords = 0x0002,
+		VertexColors = 0x0008,
+		UseFaceNormals = 0x0010,
+		SinglePrecision = 0x1000,
+		DoublePrecision = 0x2000,
 	};
 
-	if (!boost::filesystem::exists(compiled_tar_folder) || !boost::filesystem::exists(get_compiled_submesh_filename(0)))
+	//inflates from the file contents in memory
+	struct inflateStream
 	{
-		boost::filesystem::create_directory(compiled_tar_folder);
+		z_stream m_inflateStream;
+		inflateStream(const uint8_t* data, size_t size)
+		{
+			m_inflateStream.zalloc = Z_NULL;
+			m_inflateStream.zfree = Z_NULL;
+			m_inflateStream.opaque = Z_NULL;
+			m_inflateStream.avail_in = (uInt)size;
+			m_inflateStream.next_in = data;
+
+			int windowBits = 15;
+			auto retval = inflateInit2(&m_inflateStream, windowBits);
+			if (retval != Z_OK)
+				throw std::runtime_error("inflateInit2(): error " + std::to_string(retval));
+		}
 
-		enum DataPresentFlag : uint32_t
+		~inflateStream()
 		{
-			VertexNormals = 0x0001,
-			TextureCoords = 0x0002,
-			VertexColors = 0x0008,
-			UseFaceNormals = 0x0010,
-			SinglePrecision = 0x1000,
-			DoublePrecision = 0x2000,
-		};
+			inflateEnd(&m_inflateStream);
+		}
 
-		struct inflateStream
+		void read(void *ptr, size_t size)
 		{
-			std::ifstream& m_childStream;
-			size_t str_length;
-			z_stream m_inflateStream;
-			uint8_t m_inflateBuffer[32768];
-			inflateStream(std::ifstream& str)
-				:m_childStream(str)
-			{
-				size_t pos = m_childStream.tellg();
-				m_childStream.seekg(0, m_childStream.end);
-				str_length = m_childStream.tellg();
-				m_childStream.seekg(pos, m_childStream.beg);
-
-				m_inflateStream.zalloc = Z_NULL;
-				m_inflateStream.zfree = Z_NULL;
-				m_inflateStream.opaque = Z_NULL;
-				m_inflateStream.avail_in = 0;
-				m_inflateStream.next_in = Z_NULL;
-
-				int windowBits = 15;
-				auto retval = inflateInit2(&m_inflateStream, windowBits);
-				if (retval != Z_OK)
-					std::cout << "erro, ret : " << retval << std::endl;
+			uint8_t *targetPtr = (uint8_t *)ptr;
+			while (size > 0) {
+				m_inflateStream.avail_out = (uInt)size;
+				m_inflateStream.next_out = targetPtr;
+
+				int retval = inflate(&m_inflateStream, Z_NO_FLUSH);
+				switch (retval) {
+				case Z_STREAM_ERROR:
+					throw std::runtime_error("inflate(): stream error!");
+				case Z_NEED_DICT:
+					throw std::runtime_error("inflate(): need dictionary!");
+				case Z_DATA_ERROR:
+					throw std::runtime_error("inflate(): data error!");
+				case Z_MEM_ERROR:
+					throw std::runtime_error("inflate(): memory error!");
+				case Z_BUF_ERROR:
+					throw std::runtime_error("inflate(): truncated submesh!");
+				};
+
+				size_t outputSize = size - (size_t)m_inflateStream.avail_out;
+				targetPtr += outputSize;
+				size -= outputSize;
+
+				if (size > 0 && retval == Z_STREAM_END)
+					throw std::runtime_error("inflate(): attempting to read past the end of the stream!");
 			}
+		}
+	};
 
-			void read(void *ptr, size_t size)
+	uint16_t magic, version;
+	if (size < 4)
+		throw std::runtime_error("corrupt submesh in serialized mesh file");
+	memcpy(&magic, data, 2);
+	memcpy(&version, data + 2, 2);
+	//like before unused entries at the end of the offset table are skipped
+	if (magic == 0)
+		return;
+	if (magic != 1052)
+		throw std::runtime_error("corrupt submesh in serialized mesh file");
+	if (version != 3 && version != 4)
+		throw std::runtime_error("invalid version in serialized mesh file");
+
+	inflateStream comp_str(data + 4, size - 4);
+	DataPresentFlag flag;
+	comp_str.read(&flag, sizeof(flag));
+	std::string name = "default";
+	if (version == 4)
+	{
+		name = "";
+		char last_read;
+		do
+		{
+			comp_str.read(&last_read, sizeof(last_read));
+			name += last_read;
+		} while (last_read != 0);
+	}
+	uint64_t nVertices, nTriangles;
+	comp_str.read(&nVertices, sizeof(nVertices));
+	comp_str.read(&nTriangles, sizeof(nTriangles));
+
+	std::vector<Vec3f> positions(nVertices), normals(nVertices), colors(nVertices);
+	std::vector<Vec2f> uvcoords(nVertices);
+	std::vector<uint32_t> indices(nTriangles * 3);
+
+	bool isSingle = (flag & DataPresentFlag::DoublePrecision) != DataPresentFlag::DoublePrecision;
+
+	auto read_n_vector = [&](int dim, float* buffer)
+	{
+		if (isSingle)
+			comp_str.read((char*)buffer, sizeof(float) * dim * nVertices);
+		else
+		{
+			double* double_storage = (double*)alloca(dim * sizeof(double));
+			for (size_t i = 0; i < nVertices; i++)
 			{
-				uint8_t *targetPtr = (uint8_t *)ptr;
-				while (size > 0) {
-					if (m_inflateStream.avail_in == 0) {
-						size_t remaining = str_length - m_childStream.tellg();
-						m_inflateStream.next_in = m_inflateBuffer;
-						m_inflateStream.avail_in = (uInt)std::min(remaining, sizeof(m_inflateBuffer));
-						if (m_inflateStream.avail_in == 0)
-							std::cout << "more bytes req : " << size << std::endl;
-						m_childStream.read((char*)m_inflateBuffer, m_inflateStream.avail_in);
-					}
-
-					m_inflateStream.avail_out = (uInt)size;
-					m_inflateStream.next_out = targetPtr;
-
-					int retval = inflate(&m_inflateStream, Z_NO_FLUSH);
-					switch (retval) {
-					case Z_STREAM_ERROR:
-						throw std::runtime_error("inflate(): stream error!");
-					case Z_NEED_DICT:
-						throw std::runtime_error("inflate(): need dictionary!");
-					case Z_DATA_ERROR:
-						throw std::runtime_error("inflate(): data error!");
-					case Z_MEM_ERROR:
-						throw std::runtime_error("inflate(): memory error!");
-					};
-
-					size_t outputSize = size - (size_t)m_inflateStream.avail_out;
-					targetPtr += outputSize;
-					size -= outputSize;
-
-					if (size > 0 && retval == Z_STREAM_END)
-						throw std::runtime_error("inflate(): attempting to read past the end of the stream!");
-				}
+				comp_str.read((char*)double_storage, dim * sizeof(double));
+				for (int j = 0; j < dim; j++)
+					buffer[i * dim + j] = float(double_storage[j]);
 			}
-		};
+		}
+	};
+
+	read_n_vector(3, (float*)positions.data());
+	if ((flag & DataPresentFlag::VertexNormals) == DataPresentFlag::VertexNormals)
+		read_n_vector(3, (float*)normals.data());
+	if ((flag & DataPresentFlag::TextureCoords) == DataPresentFlag::TextureCoords)
+		read_n_vector(2, (float*)uvcoords.data());
+	else std::fill(uvcoords.begin(), uvcoords.end(), Vec2f(0.0f));
+	if ((flag & DataPresentFlag::VertexColors) == DataPresentFlag::VertexColors)
+		read_n_vector(3, (float*)colors.data());
+
+	comp_str.read((char*)indices.data(), sizeof(uint32_t) * nTriangles * 3);
+	for (size_t i = 0; i < nTriangles * 3; i += 3)
+		std::swap(indices[i + 0], indices[i + 2]);
 
-		std::ifstream ser_str(filename, std::ios::binary);
+	FileOutputStream fOut(compiled_submesh_filename);
+	fOut << (unsigned int)MeshCompileType::Static;
+	auto mat = Material(name.size() > 60 ? name.substr(0, 60) : name);
+	mat.bsdf = CreateAggregate<BSDFALL>(diffuse());
+	Mesh::CompileMesh(positions.data(), (int)positions.size(), normals.data(), uvcoords.data(), indices.data(), (int)indices.size(), mat, 0.0f, fOut, flipNormals, faceNormals, maxSmoothAngle);
+	fOut.Close();
+}
+
+//compiles all submeshes of the file, the submeshes are independent zlib streams and are decoded and compiled in parallel
+static void compileSerializedFile(const std::string& filename, const std::function<std::string(size_t)>& get_compiled_submesh_filename, bool flipNormals, bool faceNormals, float maxSmoothAngle)
+{
+	//the file is read once, the workers inflate from memory
+	std::ifstream ser_str(filename, std::ios::binary | std::ios::ate);
+	if (!ser_str)
+		throw std::runtime_error("could not open serialized mesh file : " + filename);
+	std::vector<uint8_t> data((size_t)ser_str.tellg());
+	ser_str.seekg(0, ser_str.beg);
+	ser_str.read((char*)data.data(), data.size());
+	ser_str.close();
 
-		uint16_t magic_maj, version_maj;
-		ser_str.read((char*)&magic_maj, 2);
-		if (magic_maj != 1052)
-			throw std::runtime_error("corrupt file");
-		ser_str.read((char*)&version_maj, 2);
+	uint16_t magic_maj, version_maj;
+	if (data.size() < 8)
+		throw std::runtime_error("corrupt file");
+	memcpy(&magic_maj, &data[0], 2);
+	if (magic_maj != 1052)
+		throw std::runtime_error("corrupt file");
+	memcpy(&version_maj, &data[2], 2);
 
-		ser_str.seekg(-4, ser_str.end);
-		uint32_t n_meshes;
-		ser_str.read((char*)&n_meshes, sizeof(n_meshes));
-		ser_str.seekg(-(sizeof(uint32_t) + (version_maj == 4 ? sizeof(uint64_t) : sizeof(uint32_t)) * n_meshes), ser_str.end);
-		std::vector<uint64_t> mesh_offsets(n_meshes);
+	uint32_t n_meshes;
+	memcpy(&n_meshes, &data[data.size() - sizeof(uint32_t)], sizeof(n_meshes));
+	size_t offset_size = version_maj == 4 ? sizeof(uint64_t) : sizeof(uint32_t);
+	if (sizeof(uint32_t) + offset_size * (size_t)n_meshes > data.size())
+		throw std::runtime_error("corrupt file");
+	size_t table_start = data.size() - sizeof(uint32_t) - offset_size * n_meshes;
+	std::vector<uint64_t> mesh_offsets(n_meshes + 1);
+	for (size_t i = 0; i < n_meshes; i++)
+	{
 		if (version_maj == 4)
-			ser_str.read((char*)mesh_offsets.data(), n_meshes * sizeof(uint64_t));
+			memcpy(&mesh_offsets[i], &data[table_start + i * offset_size], sizeof(uint64_t));
 		else
 		{
-			auto q = std::vector<uint32_t>(n_meshes);
-			ser_str.read((char*)q.data(), n_meshes * sizeof(uint32_t));
-			for (size_t i = 0; i < n_meshes; i++)
-				mesh_offsets[i] = q[i];
+			uint32_t q;
+			memcpy(&q, &data[table_start + i * offset_size], sizeof(uint32_t));
+			mesh_offsets[i] = q;
 		}
+	}
+	//the last submesh ends at the offset table
+	mesh_offsets[n_meshes] = table_start;
+	for (size_t i = 0; i < n_meshes; i++)
+		if (mesh_offsets[i] >= mesh_offsets[i + 1])
+			throw std::runtime_error("corrupt offset table in serialized mesh file");
+
+	//the existence of the first submesh marks the folder as compiled, it is therefore renamed only after all others are written
+	auto compiled_name = [&](size_t i)
+	{
+		return i == 0 ? get_compiled_submesh_filename(0) + ".tmp" : get_compiled_submesh_filename(i);
+	};
 
-		for (size_t num_submesh = 0; num_submesh < n_meshes; num_submesh++)
+	std::atomic<size_t> next_submesh(0);
+	std::mutex error_mutex;
+	std::exception_ptr error;
+	auto worker = [&]()
+	{
+		size_t i;
+		while ((i = next_submesh++) < n_meshes)
 		{
-			ser_str.seekg(mesh_offsets[num_submesh], ser_str.beg);
-			uint16_t magic, version;
-			ser_str.read((char*)&magic, 2);
-			if (magic == 0)
-				break;
-			ser_str.read((char*)&version, 2);
-			if (version != 3 && version != 4)
-				throw std::runtime_error("invalid version in serialized mesh file");
-
-			inflateStream comp_str(ser_str);
-			DataPresentFlag flag;
-			comp_str.read(&flag, sizeof(flag));
-			std::string name = "default";
-			if (version == 4)
+			try
+			{
+				compileSerializedSubmesh(&data[mesh_offsets[i]], mesh_offsets[i + 1] - mesh_offsets[i], compiled_name(i), flipNormals, faceNormals, maxSmoothAngle);
+			}
+			catch (...)
 			{
-				name = "";
-				char last_read;
-				do
-				{
-					comp_str.read(&last_read, sizeof(last_read));
-					name += last_read;
-				} while (last_read != 0);
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+				next_submesh = n_meshes;
 			}
-			uint64_t nVertices, nTriangles;
-			comp_str.read(&nVertices, sizeof(nVertices));
-			comp_str.read(&nTriangles, sizeof(nTriangles));
+		}
+	};
+	unsigned int num_threads = std::max(1u, std::min(std::thread::hardware_concurrency(), n_meshes));
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < num_threads; i++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (auto& t : threads)
+		t.join();
+	if (error)
+		std::rethrow_exception(error);
+	if (boost::filesystem::exists(compiled_name(0)))
+		boost::filesystem::rename(compiled_name(0), get_compiled_submesh_filename(0));
+}
 
-			std::vector<Vec3f> positions(nVertices), normals(nVertices), colors(nVertices);
-			std::vector<Vec2f> uvcoords(nVertices);
-			std::vector<uint32_t> indices(nTriangles * 3);
+ShapeParser::ShapeParseResult ShapeParser::serialized(const XMLNode& node, ParserState& S)
+{
+	auto filename = S.map_asset_filepath(S.def_storage.prop_string(node, "filename"));
+	int submesh_index = S.def_storage.prop_int(node, "shapeIndex");
+	bool flipNormals = S.def_storage.prop_bool(node, "flipNormals", false);
+	bool faceNormals = S.def_storage.prop_bool(node, "faceNormals", false);
+	float maxSmoothAngle = S.def_storage.prop_float(node, "maxSmoothAngle", 0.0f);
 
-			bool isSingle = true;
+	//scenes reference the same file once per submesh, the file system is only checked for the first reference
+	auto it = S.serialized_mesh_folders.find(filename);
+	if (it == S.serialized_mesh_folders.end())
+	{
+		auto name = boost::filesystem::path(filename).stem().string();
+		auto compiled_tar_folder = S.scene.getFileManager()->getCompiledMeshPath("") + name + "/";
+		auto get_compiled_submesh_filename = [&](size_t i)
+		{
+			return compiled_tar_folder + std::to_string(i) + ".xmsh";
+		};
 
-			auto read_n_vector = [&](int dim, float* buffer)
-			{
-				if (isSingle)
-					comp_str.read((char*)buffer, sizeof(float) * dim * nVertices);
-				else
-				{
-					double* double_storage = (double*)alloca(dim * sizeof(double));
-					for (size_t i = 0; i < nVertices; i++)
-					{
-						comp_str.read((char*)double_storage, dim * sizeof(double));
-						for (int j = 0; j < dim; j++)
-							buffer[i * dim + j] = float(double_storage[j]);
-					}
-				}
-			};
-
-			read_n_vector(3, (float*)positions.data());
-			if ((flag & DataPresentFlag::VertexNormals) == DataPresentFlag::VertexNormals)
-				read_n_vector(3, (float*)normals.data());
-			if ((flag & DataPresentFlag::TextureCoords) == DataPresentFlag::TextureCoords)
-				read_n_vector(2, (float*)uvcoords.data());
-			else std::fill(uvcoords.begin(), uvcoords.end(), Vec2f(0.0f));
-			if ((flag & DataPresentFlag::VertexColors) == DataPresentFlag::VertexColors)
-				read_n_vector(3, (float*)colors.data());
-
-			comp_str.read((char*)indices.data(), sizeof(uint32_t) * nTriangles * 3);
-			for (size_t i = 0; i < nTriangles * 3; i += 3)
-				std::swap(indices[i + 0], indices[i + 2]);
-
-			auto compiled_submesh_filename = get_compiled_submesh_filename(num_submesh);
-			FileOutputStream fOut(compiled_submesh_filename);
-			fOut << (unsigned int)MeshCompileType::Static;
-			auto mat = Material(name.size() > 60 ? name.substr(0, 60) : name);
-			mat.bsdf = CreateAggregate<BSDFALL>(diffuse());
-			Mesh::CompileMesh(positions.data(), (int)positions.size(), normals.data(), uvcoords.data(), indices.data(), (int)indices.size(), mat, 0.0f, fOut, flipNormals, faceNormals, maxSmoothAngle);
-			fOut.Close();
+		if (!boost::filesystem::exists(compiled_tar_folder) || !boost::filesystem::exists(get_compiled_submesh_filename(0)))
+		{
+			boost::filesystem::create_directory(compiled_tar_folder);
+			compileSerializedFile(filename, get_compiled_submesh_filename, flipNormals, faceNormals, maxSmoothAngle);
 		}
-		ser_str.close();
+		it = S.serialized_mesh_folders.insert(std::make_pair(filename, compiled_tar_folder)).first;
 	}
 
-	auto obj = S.scene.CreateNode(get_compiled_submesh_filename(submesh_index));
+	auto obj = S.scene.CreateNode(it->second + std::to_string(submesh_index) + ".xmsh");
 	parseGeneric(obj, node, S);
 	return obj;
 }
@@ -364,10 +364,34 @@ public:
 		else
 		{
 			auto max_dims = max(density_data.dims(), albedo_data.dims());
+			auto scaleF = Vec3f((float)max_dims.x, (float)max_dims.y, (float)max_dims.z);
+
+			//mostly empty volumes are stored in sparse grids if these need less memory than the dense ones
+			SparseVolGridData<float> sparseA, sparseS;
+			sparseA.Build(max_dims, 0.0f, [&](unsigned int x, unsigned int y, unsigned int z)
+			{
+				auto pos = Vec3f((float)x, (float)y, (float)z) / scaleF;
+				float density = density_data.eval(pos) * scale;
+				return density * (1.0f - albedo_data.eval(pos));
+			});
+			sparseS.Build(max_dims, 0.0f, [&](unsigned int x, unsigned int y, unsigned int z)
+			{
+				auto pos = Vec3f((float)x, (float)y, (float)z) / scaleF;
+				float density = density_data.eval(pos) * scale;
+				return albedo_data.eval(pos) * density;
+			});
+			size_t denseSize = 2 * sizeof(float) * max_dims.x * max_dims.y * max_dims.z;
+			if (sparseA.getSizeInBytes() + sparseS.getSizeInBytes() < denseSize)
+			{
+				auto G = VolumeGrid(f, vol_to_world, S.scene.getTempBuffer(), sparseA, sparseS);
+				G.sigAMax = G.sigSMax = 1.0f;
+				G.Update();
+				return CreateAggregate<VolumeRegion>(G);
+			}
+
 			auto G = VolumeGrid(f, vol_to_world, S.scene.getTempBuffer(), max_dims, max_dims, Vec3u(1));
 			G.sigAMax = G.sigSMax = 1.0f;
 
-			auto scaleF = Vec3f((float)max_dims.x, (float)max_dims.y, (float)max_dims.z);
 			for(unsigned int x = 0; x < max_dims.x; x++)
 				for(unsigned int y = 0; y < max_dims.y; y++)
 					for(unsigned int z = 0; z < max_dims.z; z++)
@@ -412,6 +412,8 @@ public:
 	bool create_interior_bssrdf;
 	bool create_exterior_bssrdf;
 	std::vector<StreamReference<Node>> nodes_to_remove;
+	//serialized mesh files whose submeshes were already compiled or found compiled in this load, mapped to the folder of the compiled submeshes
+	std::map<std::string, std::string> serialized_mesh_folders;
 
 	ParserState(DynamicScene& scene, const std::string& mitsuba_scene_xml_loc, bool assume_rotated_coords, bool create_exterior_bssrdf, bool create_interior_bssrdf)
 		: scene(scene), scenefile_location(mitsuba_scene_xml_loc), film_size(boost::none), create_exterior_bssrdf(create_exterior_bssrdf), create_interior_bssrdf(create_interior_bssrdf)
@@ -0,0 +1,309 @@
+#include <StdAfx.h>
+#include "XMLStreamReader.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace CudaTracerLib {
+
+static bool isXmlWhitespace(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool isNameChar(int c)
+{
+	return c != -1 && !isXmlWhitespace(c) && c != '/' && c != '>' && c != '=' && c != '<' && c != '"' && c != '\'';
+}
+
+static void appendUtf8(std::string& out, unsigned int cp)
+{
+	if (cp < 0x80)
+		out += (char)cp;
+	else if (cp < 0x800)
+	{
+		out += (char)(0xc0 | (cp >> 6));
+		out += (char)(0x80 | (cp & 0x3f));
+	}
+	else if (cp < 0x10000)
+	{
+		out += (char)(0xe0 | (cp >> 12));
+		out += (char)(0x80 | ((cp >> 6) & 0x3f));
+		out += (char)(0x80 | (cp & 0x3f));
+	}
+	else
+	{
+		out += (char)(0xf0 | (cp >> 18));
+		out += (char)(0x80 | ((cp >> 12) & 0x3f));
+		out += (char)(0x80 | ((cp >> 6) & 0x3f));
+		out += (char)(0x80 | (cp & 0x3f));
+	}
+}
+
+XMLStreamReader::XMLStreamReader(const std::string& file)
+	: m_stream(file, std::ios::binary), m_file(file), m_buffer(1 << 16), m_pos(0), m_end(0), m_line(1), m_finished(false)
+{
+	if (!m_stream)
+		throw std::runtime_error("Could not open xml file : " + file);
+
+	//utf8 byte order mark
+	tryConsume("\xef\xbb\xbf");
+	while (true)
+	{
+		skipWhitespace();
+		if (!skipMarkup())
+			break;
+	}
+	if (peek() != '<')
+		error("expected root element");
+	get();
+	m_rootName = readName();
+	bool empty;
+	readAttributes(m_rootAttributes, empty);
+	m_finished = empty;
+}
+
+bool XMLStreamReader::fill()
+{
+	if (!m_stream)
+		return false;
+	m_stream.read(&m_buffer[0], m_buffer.size());
+	m_pos = 0;
+	m_end = (size_t)m_stream.gcount();
+	return m_end != 0;
+}
+
+char XMLStreamReader::get()
+{
+	int c = peek();
+	if (c == -1)
+		error("unexpected end of file");
+	m_pos++;
+	if (c == '\n')
+		m_line++;
+	return (char)c;
+}
+
+bool XMLStreamReader::tryConsume(const char* str)
+{
+	//the strings are short, a refill can only happen at the first character
+	size_t n = strlen(str);
+	if (peek() == -1)
+		return false;
+	if (m_end - m_pos < n)
+	{
+		//move the remaining bytes to the front to have the whole string in the buffer
+		size_t rem = m_end - m_pos;
+		memmove(&m_buffer[0], &m_buffer[m_pos], rem);
+		m_pos = 0;
+		m_end = rem;
+		if (m_stream)
+		{
+			m_stream.read(&m_buffer[rem], m_buffer.size() - rem);
+			m_end += (size_t)m_stream.gcount();
+		}
+		if (m_end < n)
+			return false;
+	}
+	if (memcmp(&m_buffer[m_pos], str, n) != 0)
+		return false;
+	for (size_t i = 0; i < n; i++)
+		get();
+	return true;
+}
+
+void XMLStreamReader::expect(const char* str)
+{
+	if (!tryConsume(str))
+		error(std::string("expected ") + str);
+}
+
+void XMLStreamReader::skipWhitespace()
+{
+	while (isXmlWhitespace(peek()))
+		get();
+}
+
+void XMLStreamReader::skipUntil(const char* end)
+{
+	while (!tryConsume(end))
+		get();
+}
+
+void XMLStreamReader::error(const std::string& msg) const
+{
+	throw std::runtime_error("Error parsing xml file " + m_file + " in line " + std::to_string(m_line) + " : " + msg);
+}
+
+std::string XMLStreamReader::readName()
+{
+	std::string name;
+	while (isNameChar(peek()))
+		name += get();
+	if (name.empty())
+		error("expected a name");
+	return name;
+}
+
+void XMLStreamReader::readEntity(std::string& out)
+{
+	std::string ent;
+	char c;
+	while ((c = get()) != ';')
+	{
+		ent += c;
+		if (ent.size() > 10)
+			error("invalid entity");
+	}
+	if (ent == "lt")
+		out += '<';
+	else if (ent == "gt")
+		out += '>';
+	else if (ent == "amp")
+		out += '&';
+	else if (ent == "quot")
+		out += '"';
+	else if (ent == "apos")
+		out += '\'';
+	else if (ent.size() > 1 && ent[0] == '#')
+	{
+		bool hex = ent[1] == 'x' || ent[1] == 'X';
+		appendUtf8(out, (unsigned int)std::stoul(ent.substr(hex ? 2 : 1), 0, hex ? 16 : 10));
+	}
+	else error("unknown entity &" + ent + ";");
+}
+
+void XMLStreamReader::readAttributes(boost::property_tree::ptree& pt, bool& empty)
+{
+	boost::property_tree::ptree attribs;
+	while (true)
+	{
+		skipWhitespace();
+		if (tryConsume("/>"))
+		{
+			empty = true;
+			break;
+		}
+		if (tryConsume(">"))
+		{
+			empty = false;
+			break;
+		}
+		std::string name = readName();
+		skipWhitespace();
+		expect("=");
+		skipWhitespace();
+		char quote = get();
+		if (quote != '"' && quote != '\'')
+			error("expected a quoted attribute value");
+		std::string value;
+		char c;
+		while ((c = get()) != quote)
+		{
+			if (c == '&')
+				readEntity(value);
+			else value += c;
+		}
+		attribs.push_back(std::make_pair(name, boost::property_tree::ptree(value)));
+	}
+	if (!attribs.empty())
+		pt.push_back(std::make_pair("<xmlattr>", attribs));
+}
+
+bool XMLStreamReader::skipMarkup()
+{
+	if (tryConsume("<!--"))
+		skipUntil("-->");
+	else if (tryConsume("<?"))
+		skipUntil("?>");
+	else if (tryConsume("<!DOCTYPE"))
+	{
+		//internal subsets are not supported beyond skipping them
+		int depth = 0;
+		char c;
+		while ((c = get()) != '>' || depth)
+			depth += c == '[' ? 1 : (c == ']' ? -1 : 0);
+	}
+	else return false;
+	return true;
+}
+
+void XMLStreamReader::readElement(std::string& name, boost::property_tree::ptree& pt)
+{
+	expect("<");
+	name = readName();
+	pt.clear();
+	pt.data().clear();
+	bool empty;
+	readAttributes(pt, empty);
+	if (empty)
+		return;
+
+	//like read_xml all text including the whitespace between the children is concatenated into the data
+	while (true)
+	{
+		std::string& data = pt.data();
+		while (isXmlWhitespace(peek()))
+			data += get();
+		if (tryConsume("</"))
+		{
+			if (readName() != name)
+				error("mismatched closing tag of " + name);
+			skipWhitespace();
+			expect(">");
+			return;
+		}
+		else if (tryConsume("<![CDATA["))
+		{
+			while (!tryConsume("]]>"))
+				data += get();
+		}
+		else if (skipMarkup())
+			continue;
+		else if (peek() == '<')
+		{
+			std::string childName;
+			boost::property_tree::ptree child;
+			readElement(childName, child);
+			pt.push_back(std::make_pair(childName, boost::property_tree::ptree()))->second.swap(child);
+		}
+		else
+		{
+			while (peek() != '<')
+			{
+				char c = get();
+				if (c == '&')
+					readEntity(data);
+				else data += c;
+			}
+		}
+	}
+}
+
+bool XMLStreamReader::next(std::string& name, boost::property_tree::ptree& pt)
+{
+	while (!m_finished)
+	{
+		skipWhitespace();
+		if (skipMarkup())
+			continue;
+		if (tryConsume("</"))
+		{
+			if (readName() != m_rootName)
+				error("mismatched closing tag of " + m_rootName);
+			m_finished = true;
+			return false;
+		}
+		if (peek() != '<')
+		{
+			//text directly in the root element is not used by any of the parsers
+			while (peek() != '<')
+				get();
+			continue;
+		}
+		readElement(name, pt);
+		return true;
+	}
+	return false;
+}
+
+}
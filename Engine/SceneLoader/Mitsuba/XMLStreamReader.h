@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <boost/property_tree/ptree.hpp>
+
+namespace CudaTracerLib {
+
+//reads the children of the root element of an xml file one after another, only the current child is kept in memory
+//the trees have the layout of the ones created by boost::property_tree::read_xml, attributes are stored in <xmlattr>
+//comments, processing instructions and the doctype are skipped
+class XMLStreamReader
+{
+	std::ifstream m_stream;
+	std::string m_file;
+	std::vector<char> m_buffer;
+	size_t m_pos, m_end;
+	unsigned int m_line;
+	std::string m_rootName;
+	boost::property_tree::ptree m_rootAttributes;
+	bool m_finished;
+
+	bool fill();
+	int peek()
+	{
+		return m_pos < m_end || fill() ? (unsigned char)m_buffer[m_pos] : -1;
+	}
+	char get();
+	bool tryConsume(const char* str);
+	void expect(const char* str);
+	void skipWhitespace();
+	void skipUntil(const char* end);
+	void error(const std::string& msg) const;
+
+	std::string readName();
+	void readEntity(std::string& out);
+	void readAttributes(boost::property_tree::ptree& pt, bool& empty);
+	//skips comments and other markup which is not an element, returns false if the next token is not markup of this kind
+	bool skipMarkup();
+	void readElement(std::string& name, boost::property_tree::ptree& pt);
+public:
+	XMLStreamReader(const std::string& file);
+
+	const std::string& getRootName() const
+	{
+		return m_rootName;
+	}
+	const boost::property_tree::ptree& getRootAttributes() const
+	{
+		return m_rootAttributes;
+	}
+
+	//reads the next child element of the root, returns false after the end of the root element
+	bool next(std::string& name, boost::property_tree::ptree& pt);
+};
+
+}
@@ -3,11 +3,13 @@
 #include "BVHRebuilder.h"
 #include <Engine/SpatialStructures/BVH/SplitBVHBuilder.hpp>
 #include <Engine/Mesh.h>
+#include <Engine/TriIntersectorData.h>
+#include <Base/Profiler.h>
 #include <algorithm>
 
 namespace CudaTracerLib {
 
-#define NO_NODE 0x76543210
+#define NO_NODE BVH_NO_NODE
 
 //bvh tree rotations from
 //http://citeseerx.ist.psu.edu/viewdoc/download?doi=10.1.1.331.9382&rep=rep1&type=pdf
@@ -367,6 +369,7 @@ void BVHRebuilder::SetEmpty()
 
 bool BVHRebuilder::Build(ISpatialInfoProvider* data, bool invalidateAll)
 {
+	PROFILE_ZONE("BVH", "BVH Rebuild");
 	this->m_pData = data;
 	bool modified = false;
 	if (needsBuild() || invalidateAll)
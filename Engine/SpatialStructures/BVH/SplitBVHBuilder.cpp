@@ -1,5 +1,6 @@
 #include <StdAfx.h>
 #include "SplitBVHBuilder.hpp"
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib {
 
@@ -159,7 +160,8 @@ SplitBVHBuilder::~SplitBVHBuilder(void)
 
 //------------------------------------------------------------------------
 
-static std::vector<unsigned int> g_ObjIndices;
+//meshes are compiled on several threads by the scene loaders
+static thread_local std::vector<unsigned int> g_ObjIndices;
 unsigned int handleNode(std::vector<BVHNode>& nodes, BVHNode* n, IBVHBuilderCallback* clb, std::vector<int>& m_Indices, int level = 0, unsigned int parent = UINT_MAX)
 {
 	if (n->isLeaf())
@@ -218,6 +220,7 @@ void countNodes(std::vector<BVHNode>& nodes, BVHNode* n, unsigned int& innerC, u
 
 void SplitBVHBuilder::run(void)
 {
+	PROFILE_ZONE("BVH", "Split BVH Build");
 	// Initialize reference stack and determine root bounds.
 
 	NodeSpec rootSpec;
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "HashGrid.h"
-#include <Base/Timer.h>
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib {
 
@@ -166,6 +166,11 @@ public:
 		return idx;
 	}
 
+	CUDA_FUNC_IN bool hasCellEntries(const Vec3u& p) const
+	{
+		return m_mapBuffer[BaseType::hashMap.Hash(p)] < min(deviceDataIdx, numData);
+	}
+
 	template<typename CLB> CUDA_FUNC_IN void ForAllCellEntries(const Vec3u& p, CLB clb, unsigned int MAX_ENTRIES_PER_CELL = UINT_MAX)
 	{
 		unsigned int i0 = BaseType::hashMap.Hash(p), i = m_mapBuffer[i0], N = 0, lo = min(deviceDataIdx, numData);
@@ -269,8 +274,6 @@ public:
 
 	void PrepareForUse()
 	{
-		auto& Tt = GET_PERF_BLOCKS();
-
 		idxData = min(idxData, numData);
 		auto GP = m_gridSize.x * m_gridSize.y * m_gridSize.z;
 
@@ -278,16 +281,16 @@ public:
 		throw std::runtime_error("Use this from a cuda file please!");
 		/*
 		{
-		auto bl = Tt.StartBlock("sort");
+		PROFILE_ZONE("SpatialGrid", "Sort");
 		thrust::sort(thrust::device_ptr<Vec2u>(m_listBuffer.getDevicePtr()), thrust::device_ptr<Vec2u>(m_listBuffer.getDevicePtr() + idxData), __interal_spatialMap__::order());
 		m_listBuffer.Synchronize();
 		}
 		{
-		auto bl = Tt.StartBlock("reset");
+		PROFILE_ZONE("SpatialGrid", "Reset");
 		m_gridBuffer.Memset((unsigned char)0xff);
 		}
 		{
-		auto bl = Tt.StartBlock("build");
+		PROFILE_ZONE("SpatialGrid", "Build");
 		m_buffer1.Synchronize();
 		unsigned int i = 0;
 		while (i < idxData)
@@ -307,15 +310,15 @@ public:
 		*/
 #else
 		{
-			auto bl = Tt.StartBlock("sort");
+			PROFILE_ZONE("SpatialGrid", "Sort");
 			thrust::sort(thrust::device_ptr<Vec2u>(m_listBuffer.getDevicePtr()), thrust::device_ptr<Vec2u>(m_listBuffer.getDevicePtr() + idxData), __interal_spatialMap__::order());
 		}
 		{
-			auto bl = Tt.StartBlock("reset");
+			PROFILE_ZONE("SpatialGrid", "Reset");
 			ThrowCudaErrors(cudaMemset(m_gridBuffer.getDevicePtr(), 0xffffffff, GP));
 		}
 		{
-			auto bl = Tt.StartBlock("build");
+			PROFILE_ZONE("SpatialGrid", "Build");
 			const unsigned int N_THREAD = 10;
 			CudaSetToZero(m_deviceIdxCounter, sizeof(unsigned int));
 			__interal_spatialMap__::buildGrid<T, N_THREAD, 90> << <idxData / (32 * 6 * N_THREAD) + 1, dim3(32, 6) >> >
@@ -359,6 +362,11 @@ public:
 		return store(BaseType::hashMap.Transform(p), v);
 	}
 
+	CUDA_FUNC_IN bool hasCellEntries(const Vec3u& p) const
+	{
+		return m_gridBuffer[BaseType::hashMap.Hash(p)] < idxData;
+	}
+
 	template<typename CLB> CUDA_FUNC_IN void ForAllCellEntries(const Vec3u& p, CLB clb, unsigned int MAX_ENTRIES_PER_CELL = UINT_MAX)
 	{
 		unsigned int map_idx = m_gridBuffer[BaseType::hashMap.Hash(p)], i = 0;
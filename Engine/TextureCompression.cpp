@@ -0,0 +1,205 @@
+#include "StdAfx.h"
+#include "TextureCompression.h"
+#include <cstring>
+
+namespace CudaTracerLib {
+
+//end points of the line through the texels along their principal axis
+static void principalAxisEndpoints(const Vec3f* p, int n, Vec3f& e0, Vec3f& e1)
+{
+	Vec3f mean(0.0f);
+	for (int i = 0; i < n; i++)
+		mean += p[i];
+	mean /= float(n);
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < n; i++)
+	{
+		Vec3f d = p[i] - mean;
+		cov[0] += d.x * d.x; cov[1] += d.x * d.y; cov[2] += d.x * d.z;
+		cov[3] += d.y * d.y; cov[4] += d.y * d.z; cov[5] += d.z * d.z;
+	}
+	//a few steps of power iteration are sufficient for 16 points
+	Vec3f axis(1.0f);
+	for (int it = 0; it < 8; it++)
+	{
+		Vec3f a = Vec3f(cov[0] * axis.x + cov[1] * axis.y + cov[2] * axis.z,
+						cov[1] * axis.x + cov[3] * axis.y + cov[4] * axis.z,
+						cov[2] * axis.x + cov[4] * axis.y + cov[5] * axis.z);
+		float l = length(a);
+		if (l < 1e-12f)
+			break;
+		axis = a / l;
+	}
+	float tMin = 0, tMax = 0;
+	for (int i = 0; i < n; i++)
+	{
+		float t = dot(p[i] - mean, axis);
+		tMin = min(tMin, t);
+		tMax = max(tMax, t);
+	}
+	e0 = mean + axis * tMax;
+	e1 = mean + axis * tMin;
+}
+
+template<int N> static unsigned int closestIndex(const Vec3f (&palette)[N], const Vec3f& v)
+{
+	unsigned int best = 0;
+	float bestDist = FLT_MAX;
+	for (unsigned int i = 0; i < N; i++)
+	{
+		float d = distanceSquared(palette[i], v);
+		if (d < bestDist)
+		{
+			bestDist = d;
+			best = i;
+		}
+	}
+	return best;
+}
+
+static unsigned int encodeRGB565(const Vec3f& c)
+{
+	Vec3f q = math::clamp01(c);
+	return ((unsigned int)(q.x * 31.0f + 0.5f) << 11) | ((unsigned int)(q.y * 63.0f + 0.5f) << 5) | (unsigned int)(q.z * 31.0f + 0.5f);
+}
+
+static void encodeBC1(const Vec3f* texels, unsigned int* block)
+{
+	Vec3f e0, e1;
+	principalAxisEndpoints(texels, 16, e0, e1);
+	unsigned int c0 = encodeRGB565(e0), c1 = encodeRGB565(e1);
+	if (c0 < c1)
+		swapk(c0, c1);
+	block[0] = c0 | (c1 << 16);
+	block[1] = 0;
+	if (c0 == c1)
+		return;
+	//four color mode which requires c0 > c1
+	Vec3f a = decodeRGB565(c0), b = decodeRGB565(c1);
+	Vec3f palette[4] = { a, b, (a * 2.0f + b) / 3.0f, (a + b * 2.0f) / 3.0f };
+	for (unsigned int i = 0; i < 16; i++)
+		block[1] |= closestIndex(palette, texels[i]) << (2 * i);
+}
+
+static void encodeBC4(const float* values, unsigned int* block)
+{
+	float vMin = values[0], vMax = values[0];
+	for (int i = 1; i < 16; i++)
+	{
+		vMin = min(vMin, values[i]);
+		vMax = max(vMax, values[i]);
+	}
+	unsigned int a0 = (unsigned int)(math::clamp01(vMax) * 255.0f + 0.5f), a1 = (unsigned int)(math::clamp01(vMin) * 255.0f + 0.5f);
+	unsigned long long bits = 0;
+	if (a0 != a1)
+	{
+		//eight value mode which requires a0 > a1
+		float palette[8];
+		palette[0] = a0 / 255.0f;
+		palette[1] = a1 / 255.0f;
+		for (unsigned int i = 2; i < 8; i++)
+			palette[i] = float((8 - i) * a0 + (i - 1) * a1) / (7.0f * 255.0f);
+		for (unsigned int i = 0; i < 16; i++)
+		{
+			unsigned int best = 0;
+			for (unsigned int j = 1; j < 8; j++)
+				if (math::abs(palette[j] - values[i]) < math::abs(palette[best] - values[i]))
+					best = j;
+			bits |= (unsigned long long)best << (3 * i);
+		}
+	}
+	block[0] = a0 | (a1 << 8) | (unsigned int)((bits & 0xffff) << 16);
+	block[1] = (unsigned int)(bits >> 16);
+}
+
+static void insertBlockBits(unsigned int* block, unsigned int start, unsigned int count, unsigned int value)
+{
+	for (unsigned int i = 0; i < count; i++)
+		if ((value >> i) & 1)
+			block[(start + i) / 32] |= 1u << ((start + i) % 32);
+}
+
+static void encodeBC6H(const Vec3f* texels, unsigned int* block)
+{
+	//the end points are interpolated in the domain of the half float bit patterns which is roughly logarithmic
+	Vec3f h[16];
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+			h[i][c] = (float)half(math::clamp(texels[i][c], 0.0f, 65504.0f)).bits();
+	Vec3f e[2];
+	principalAxisEndpoints(h, 16, e[0], e[1]);
+	//inverse of unquantizeBC6H followed by the final scaling by 31 / 64
+	unsigned int q[2][3];
+	for (int j = 0; j < 2; j++)
+		for (int c = 0; c < 3; c++)
+			q[j][c] = (unsigned int)math::clamp((e[j][c] - 15.5f) / 31.0f + 0.5f, 0.0f, 1023.0f);
+
+	const unsigned int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	Vec3f palette[16];
+	for (unsigned int i = 0; i < 16; i++)
+		for (int c = 0; c < 3; c++)
+		{
+			unsigned int q0 = unquantizeBC6H(q[0][c]), q1 = unquantizeBC6H(q[1][c]);
+			palette[i][c] = float((((q0 * (64 - weights[i]) + q1 * weights[i] + 32) >> 6) * 31) >> 6);
+		}
+	unsigned int idx[16];
+	for (int i = 0; i < 16; i++)
+		idx[i] = closestIndex(palette, h[i]);
+	//the most significant bit of the anchor index is implicitly zero, the weights are symmetric
+	if (idx[0] >= 8)
+	{
+		for (int c = 0; c < 3; c++)
+			swapk(q[0][c], q[1][c]);
+		for (int i = 0; i < 16; i++)
+			idx[i] = 15 - idx[i];
+	}
+
+	memset(block, 0, 16);
+	insertBlockBits(block, 0, 5, 0x03);
+	for (int c = 0; c < 3; c++)
+	{
+		insertBlockBits(block, 5 + 10 * c, 10, q[0][c]);
+		insertBlockBits(block, 35 + 10 * c, 10, q[1][c]);
+	}
+	insertBlockBits(block, 65, 3, idx[0]);
+	for (unsigned int i = 1; i < 16; i++)
+		insertBlockBits(block, 64 + 4 * i, 4, idx[i]);
+}
+
+void EncodeTextureBlock(Texture_DataType type, const Vec3f* texels, unsigned int* block)
+{
+	float channel[16];
+	switch (type)
+	{
+	case vtBC1:
+		encodeBC1(texels, block);
+		break;
+	case vtBC4:
+		for (int i = 0; i < 16; i++)
+			channel[i] = (texels[i].x + texels[i].y + texels[i].z) / 3.0f;
+		encodeBC4(channel, block);
+		break;
+	case vtBC5:
+		for (int i = 0; i < 16; i++)
+			channel[i] = texels[i].x;
+		encodeBC4(channel, block);
+		for (int i = 0; i < 16; i++)
+			channel[i] = texels[i].y;
+		encodeBC4(channel, block + 2);
+		break;
+	case vtBC6H:
+		encodeBC6H(texels, block);
+		break;
+	default:
+		throw std::runtime_error("Texture data type is not block compressed!");
+	}
+}
+
+void DecodeTextureBlock(Texture_DataType type, const unsigned int* block, Vec3f* texels)
+{
+	for (unsigned int y = 0; y < 4; y++)
+		for (unsigned int x = 0; x < 4; x++)
+			texels[y * 4 + x] = decodeTextureBlock(type, block, x, y);
+}
+
+}
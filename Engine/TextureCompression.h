@@ -0,0 +1,132 @@
+#pragma once
+#include "MIPMap_device.h"
+#include <Math/half.h>
+
+namespace CudaTracerLib {
+
+//how MIPMap::CompileToBinary stores the texels of a texture
+enum TextureCompression
+{
+	TEXTURE_UNCOMPRESSED,
+	//BC4 for gray scale, BC6H for hdr and BC1 for all other textures, textures with an alpha channel are not compressed
+	TEXTURE_COMPRESS_AUTO,
+	TEXTURE_COMPRESS_BC1,
+	TEXTURE_COMPRESS_BC4,
+	//intended for normal maps, only red and green are stored and blue is reconstructed
+	TEXTURE_COMPRESS_BC5,
+	TEXTURE_COMPRESS_BC6H,
+};
+
+//decoders for the 4x4 texel blocks of the compressed Texture_DataTypes
+//the layout of the blocks follows the BC1, BC4 and BC5 formats, BC6H blocks are restricted to the single region mode 11 (unsigned)
+
+CUDA_FUNC_IN Vec3f decodeRGB565(unsigned int c)
+{
+	return Vec3f(float((c >> 11) & 31) / 31.0f, float((c >> 5) & 63) / 63.0f, float(c & 31) / 31.0f);
+}
+
+CUDA_FUNC_IN Vec3f decodeBC1(const unsigned int* block, unsigned int x, unsigned int y)
+{
+	unsigned int c0 = block[0] & 0xffff, c1 = block[0] >> 16;
+	unsigned int idx = (block[1] >> (2 * (y * 4 + x))) & 3;
+	Vec3f a = decodeRGB565(c0), b = decodeRGB565(c1);
+	if (idx == 0)
+		return a;
+	else if (idx == 1)
+		return b;
+	//the order of the end points selects between the four color and the three color mode
+	if (c0 > c1)
+		return idx == 2 ? (a * 2.0f + b) / 3.0f : (a + b * 2.0f) / 3.0f;
+	else return idx == 2 ? (a + b) / 2.0f : Vec3f(0.0f);
+}
+
+CUDA_FUNC_IN float decodeBC4(const unsigned int* block, unsigned int x, unsigned int y)
+{
+	unsigned int a0 = block[0] & 0xff, a1 = (block[0] >> 8) & 0xff;
+	//the 48 index bits follow the two end points
+	unsigned long long bits = ((unsigned long long)block[1] << 32) | block[0];
+	unsigned int idx = (unsigned int)(bits >> (16 + 3 * (y * 4 + x))) & 7;
+	if (idx == 0)
+		return a0 / 255.0f;
+	else if (idx == 1)
+		return a1 / 255.0f;
+	if (a0 > a1)
+		return float((8 - idx) * a0 + (idx - 1) * a1) / (7.0f * 255.0f);
+	else if (idx == 6)
+		return 0.0f;
+	else if (idx == 7)
+		return 1.0f;
+	else return float((6 - idx) * a0 + (idx - 1) * a1) / (5.0f * 255.0f);
+}
+
+CUDA_FUNC_IN Vec3f decodeBC5(const unsigned int* block, unsigned int x, unsigned int y)
+{
+	float r = decodeBC4(block, x, y), g = decodeBC4(block + 2, x, y);
+	//reconstruct the z component of the unit normal stored in [0, 1]
+	float nx = r * 2.0f - 1.0f, ny = g * 2.0f - 1.0f;
+	float nz = math::sqrt(DMAX2(0.0f, 1.0f - nx * nx - ny * ny));
+	return Vec3f(r, g, nz * 0.5f + 0.5f);
+}
+
+//extracts count <= 32 bits starting at bit start of a 128 bit block
+CUDA_FUNC_IN unsigned int extractBlockBits(const unsigned int* block, unsigned int start, unsigned int count)
+{
+	unsigned int word = start / 32, shift = start % 32;
+	unsigned long long v = block[word];
+	if (word < 3)
+		v |= (unsigned long long)block[word + 1] << 32;
+	return (unsigned int)((v >> shift) & ((1ull << count) - 1));
+}
+
+CUDA_FUNC_IN unsigned int unquantizeBC6H(unsigned int e)
+{
+	if (e == 0)
+		return 0;
+	else if (e == 1023)
+		return 0xffff;
+	else return ((e << 16) + 0x8000) >> 10;
+}
+
+CUDA_FUNC_IN Vec3f decodeBC6H(const unsigned int* block, unsigned int x, unsigned int y)
+{
+	//mode bits, 3 x 10 bits per end point, 63 index bits with 3 bits for the anchor texel 0
+	if ((block[0] & 0x1f) != 0x03)
+		return Vec3f(0.0f);
+	const unsigned int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	unsigned int t = y * 4 + x;
+	unsigned int w = weights[t == 0 ? extractBlockBits(block, 65, 3) : extractBlockBits(block, 64 + 4 * t, 4)];
+	Vec3f r;
+	for (int c = 0; c < 3; c++)
+	{
+		unsigned int q0 = unquantizeBC6H(extractBlockBits(block, 5 + 10 * c, 10)), q1 = unquantizeBC6H(extractBlockBits(block, 35 + 10 * c, 10));
+		unsigned int h = (((q0 * (64 - w) + q1 * w + 32) >> 6) * 31) >> 6;
+		r[c] = h ? half((unsigned short)h).ToFloat() : 0.0f;
+	}
+	return r;
+}
+
+//linear rgb of the texel at (x, y) inside the block
+CUDA_FUNC_IN Vec3f decodeTextureBlock(Texture_DataType type, const unsigned int* block, unsigned int x, unsigned int y)
+{
+	switch (type)
+	{
+	case vtBC1:
+		return decodeBC1(block, x, y);
+	case vtBC4:
+		return Vec3f(decodeBC4(block, x, y));
+	case vtBC5:
+		return decodeBC5(block, x, y);
+	case vtBC6H:
+		return decodeBC6H(block, x, y);
+	default:
+		return Vec3f(0.0f);
+	}
+}
+
+//compresses 16 texels given row by row in linear rgb into a block of getTextureBlockWords(type) words
+CTL_EXPORT void EncodeTextureBlock(Texture_DataType type, const Vec3f* texels, unsigned int* block);
+
+//reference decoder on the host, writes all 16 texels of the block row by row
+CTL_EXPORT void DecodeTextureBlock(Texture_DataType type, const unsigned int* block, Vec3f* texels);
+
+}
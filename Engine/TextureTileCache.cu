@@ -0,0 +1,284 @@
+#include "StdAfx.h"
+#include "TextureTileCache.h"
+#include <Base/CudaMemoryManager.h>
+#include <cstring>
+#include <algorithm>
+
+namespace CudaTracerLib {
+
+#define TILE_WORDS (MIPMAP_TILE_SIZE * MIPMAP_TILE_SIZE)
+
+CUDA_GLOBAL void scatterTiles(const unsigned int* staging, const unsigned int* slots, unsigned int* pool)
+{
+	const unsigned int* src = staging + blockIdx.x * TILE_WORDS;
+	unsigned int* dst = pool + slots[blockIdx.x] * TILE_WORDS;
+	for (unsigned int i = threadIdx.x; i < TILE_WORDS; i += blockDim.x)
+		dst[i] = src[i];
+}
+
+TextureTileCache::TextureTileCache(size_t sizeInBytes, unsigned int maxLoadsPerResolve)
+	: m_uNumSlots((unsigned int)(sizeInBytes / (TILE_WORDS * 4))), m_uMaxLoadsPerResolve(maxLoadsPerResolve), m_uFrame(0), m_uNumPinned(0)
+{
+	if (m_uNumSlots == 0)
+		throw std::runtime_error("Texture tile cache has to be able to hold at least one tile!");
+	CUDA_MALLOC(&m_pDevicePool, getDeviceSizeInBytes());
+	CUDA_MALLOC(&m_pDevicePoolAddress, sizeof(unsigned int*));
+	CUDA_MEMCPY_TO_DEVICE(m_pDevicePoolAddress, &m_pDevicePool, sizeof(unsigned int*));
+	CUDA_MALLOC(&m_pDeviceStaging, m_uMaxLoadsPerResolve * TILE_WORDS * 4);
+	CUDA_MALLOC(&m_pDeviceStagingSlots, m_uMaxLoadsPerResolve * 4);
+	m_hostStaging.resize(m_uMaxLoadsPerResolve * TILE_WORDS);
+	m_hostStagingSlots.resize(m_uMaxLoadsPerResolve);
+	m_slots.resize(m_uNumSlots);
+	m_freeSlots.resize(m_uNumSlots);
+	for (unsigned int i = 0; i < m_uNumSlots; i++)
+		m_freeSlots[i] = m_uNumSlots - 1 - i;
+}
+
+void TextureTileCache::Free()
+{
+	for (unsigned int i = 0; i < m_textures.size(); i++)
+		if (m_textures[i].used)
+			Unregister(i);
+	CUDA_FREE(m_pDevicePool);
+	CUDA_FREE(m_pDevicePoolAddress);
+	CUDA_FREE(m_pDeviceStaging);
+	CUDA_FREE(m_pDeviceStagingSlots);
+}
+
+unsigned int TextureTileCache::allocateSlot()
+{
+	if (m_freeSlots.size())
+	{
+		unsigned int slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+		return slot;
+	}
+	//do not evict tiles which were needed in this frame, that would only cause thrashing
+	if (m_lru.empty() || m_slots[m_lru.back()].lastUse == m_uFrame)
+		return MIPMAP_TILE_NOT_RESIDENT;
+	unsigned int slot = m_lru.back();
+	m_lru.pop_back();
+	auto& owner = m_textures[m_slots[slot].texture];
+	owner.pageTable[m_slots[slot].tile] = MIPMAP_TILE_NOT_RESIDENT;
+	owner.pageTableDirty = true;
+	m_lastStatistics.tilesEvicted++;
+	return slot;
+}
+
+void TextureTileCache::touchSlot(unsigned int slot)
+{
+	auto& s = m_slots[slot];
+	s.lastUse = m_uFrame;
+	if (!s.pinned)
+		m_lru.splice(m_lru.begin(), m_lru, s.lruPosition);
+}
+
+void TextureTileCache::stageTile(unsigned int texture, unsigned int tile, unsigned int slot, unsigned int stagingIdx)
+{
+	auto& tex = m_textures[texture];
+	const TileDesc& desc = tex.tiles[tile];
+	memcpy(&m_hostStaging[stagingIdx * TILE_WORDS], tex.hostData + desc.hostOffset, desc.numWords * 4);
+	m_hostStagingSlots[stagingIdx] = slot;
+
+	auto& s = m_slots[slot];
+	s.texture = texture;
+	s.tile = tile;
+	s.lastUse = m_uFrame;
+	s.pinned = desc.pinned;
+	if (s.pinned)
+		m_uNumPinned++;
+	else
+	{
+		m_lru.push_front(slot);
+		s.lruPosition = m_lru.begin();
+	}
+	tex.pageTable[tile] = slot;
+	tex.pageTableDirty = true;
+}
+
+void TextureTileCache::uploadStaged(unsigned int numStaged)
+{
+	if (numStaged == 0)
+		return;
+	CUDA_MEMCPY_TO_DEVICE(m_pDeviceStaging, &m_hostStaging[0], numStaged * TILE_WORDS * 4);
+	CUDA_MEMCPY_TO_DEVICE(m_pDeviceStagingSlots, &m_hostStagingSlots[0], numStaged * 4);
+	scatterTiles << <numStaged, 256 >> >(m_pDeviceStaging, m_pDeviceStagingSlots, m_pDevicePool);
+	ThrowCudaErrors(cudaGetLastError());
+}
+
+unsigned int TextureTileCache::Register(const unsigned int* hostData, const std::vector<TileDesc>& tiles, unsigned int*& devicePageTable, unsigned char*& deviceRequests)
+{
+	unsigned int id = 0;
+	while (id < m_textures.size() && m_textures[id].used)
+		id++;
+	if (id == m_textures.size())
+		m_textures.push_back(TextureEntry());
+
+	auto& tex = m_textures[id];
+	tex.used = true;
+	tex.hostData = hostData;
+	tex.tiles = tiles;
+	tex.pageTable.assign(tiles.size(), MIPMAP_TILE_NOT_RESIDENT);
+	tex.requests.assign(tiles.size(), 0);
+	CUDA_MALLOC_TAGGED(&tex.devicePageTable, tiles.size() * sizeof(unsigned int), MEMORY_TAG_TEXTURES);
+	CUDA_MALLOC_TAGGED(&tex.deviceRequests, tiles.size(), MEMORY_TAG_TEXTURES);
+	ThrowCudaErrors(cudaMemset(tex.deviceRequests, 0, tiles.size()));
+
+	unsigned int numStaged = 0;
+	for (unsigned int i = 0; i < tiles.size(); i++)
+	{
+		if (!tiles[i].pinned)
+			continue;
+		unsigned int slot = allocateSlot();
+		if (slot == MIPMAP_TILE_NOT_RESIDENT)
+			throw std::runtime_error("Texture tile cache is too small to hold the coarse levels of all textures!");
+		if (numStaged == m_uMaxLoadsPerResolve)
+		{
+			uploadStaged(numStaged);
+			numStaged = 0;
+		}
+		stageTile(id, i, slot, numStaged++);
+	}
+	uploadStaged(numStaged);
+
+	CUDA_MEMCPY_TO_DEVICE(tex.devicePageTable, &tex.pageTable[0], tiles.size() * sizeof(unsigned int));
+	tex.pageTableDirty = false;
+	devicePageTable = tex.devicePageTable;
+	deviceRequests = tex.deviceRequests;
+	return id;
+}
+
+void TextureTileCache::Unregister(unsigned int id)
+{
+	auto& tex = m_textures[id];
+	for (unsigned int tile = 0; tile < tex.pageTable.size(); tile++)
+	{
+		unsigned int slot = tex.pageTable[tile];
+		if (slot == MIPMAP_TILE_NOT_RESIDENT)
+			continue;
+		if (m_slots[slot].pinned)
+			m_uNumPinned--;
+		else m_lru.erase(m_slots[slot].lruPosition);
+		m_freeSlots.push_back(slot);
+	}
+	CUDA_FREE(tex.devicePageTable);
+	CUDA_FREE(tex.deviceRequests);
+	tex = TextureEntry();
+	tex.used = false;
+}
+
+void TextureTileCache::ResolveMisses()
+{
+	m_uFrame++;
+	m_lastStatistics = TextureTileCacheStatistics();
+
+	std::vector<std::pair<unsigned int, unsigned int>> misses;
+	for (unsigned int t = 0; t < m_textures.size(); t++)
+	{
+		auto& tex = m_textures[t];
+		if (!tex.used)
+			continue;
+		CUDA_MEMCPY_TO_HOST(&tex.requests[0], tex.deviceRequests, tex.requests.size());
+		bool anyRequest = false;
+		for (unsigned int tile = 0; tile < tex.requests.size(); tile++)
+		{
+			if (!tex.requests[tile])
+				continue;
+			anyRequest = true;
+			m_lastStatistics.tilesRequested++;
+			unsigned int slot = tex.pageTable[tile];
+			if (slot != MIPMAP_TILE_NOT_RESIDENT)
+			{
+				m_lastStatistics.tilesHit++;
+				touchSlot(slot);
+			}
+			else misses.push_back(std::make_pair(t, tile));
+		}
+		if (anyRequest)
+			ThrowCudaErrors(cudaMemset(tex.deviceRequests, 0, tex.requests.size()));
+	}
+
+	//the tiles of coarse levels are loaded first, they serve as fallback for the finer levels
+	std::stable_sort(misses.begin(), misses.end(), [&](const std::pair<unsigned int, unsigned int>& a, const std::pair<unsigned int, unsigned int>& b)
+	{
+		return m_textures[a.first].tiles[a.second].numWords < m_textures[b.first].tiles[b.second].numWords;
+	});
+
+	unsigned int numStaged = 0;
+	for (auto& miss : misses)
+	{
+		if (numStaged == m_uMaxLoadsPerResolve)
+			break;
+		unsigned int slot = allocateSlot();
+		if (slot == MIPMAP_TILE_NOT_RESIDENT)
+			break;
+		stageTile(miss.first, miss.second, slot, numStaged++);
+	}
+	uploadStaged(numStaged);
+	m_lastStatistics.tilesLoaded = numStaged;
+
+	for (auto& tex : m_textures)
+		if (tex.used && tex.pageTableDirty)
+		{
+			CUDA_MEMCPY_TO_DEVICE(tex.devicePageTable, &tex.pageTable[0], tex.pageTable.size() * sizeof(unsigned int));
+			tex.pageTableDirty = false;
+		}
+
+	m_lastStatistics.residentBytes = (size_t)(m_uNumSlots - m_freeSlots.size()) * TILE_WORDS * 4;
+}
+
+size_t TextureTileCache::Shrink(size_t bytesNeeded)
+{
+	const size_t tileBytes = TILE_WORDS * 4;
+	unsigned int numRemoved = (unsigned int)DMIN2((bytesNeeded + tileBytes - 1) / tileBytes, (size_t)m_uNumSlots);
+	unsigned int newNumSlots = DMAX2(m_uNumSlots - numRemoved, DMAX2(m_uNumPinned, 1u));
+	if (newNumSlots >= m_uNumSlots)
+		return 0;
+
+	size_t oldSize = getDeviceSizeInBytes();
+	CUDA_FREE(m_pDevicePool);
+	m_uNumSlots = newNumSlots;
+	CUDA_MALLOC_TAGGED(&m_pDevicePool, getDeviceSizeInBytes(), MEMORY_TAG_TEXTURES);
+	CUDA_MEMCPY_TO_DEVICE(m_pDevicePoolAddress, &m_pDevicePool, sizeof(unsigned int*));
+
+	m_lru.clear();
+	m_slots.assign(m_uNumSlots, Slot());
+	m_freeSlots.resize(m_uNumSlots);
+	for (unsigned int i = 0; i < m_uNumSlots; i++)
+		m_freeSlots[i] = m_uNumSlots - 1 - i;
+	m_uNumPinned = 0;
+
+	//the content of the old pool is lost, the pinned tiles are staged again from the host data
+	unsigned int numStaged = 0;
+	for (unsigned int t = 0; t < m_textures.size(); t++)
+	{
+		auto& tex = m_textures[t];
+		if (!tex.used)
+			continue;
+		std::fill(tex.pageTable.begin(), tex.pageTable.end(), MIPMAP_TILE_NOT_RESIDENT);
+		for (unsigned int i = 0; i < tex.tiles.size(); i++)
+		{
+			if (!tex.tiles[i].pinned)
+				continue;
+			if (numStaged == m_uMaxLoadsPerResolve)
+			{
+				uploadStaged(numStaged);
+				numStaged = 0;
+			}
+			stageTile(t, i, allocateSlot(), numStaged++);
+		}
+		CUDA_MEMCPY_TO_DEVICE(tex.devicePageTable, &tex.pageTable[0], tex.pageTable.size() * sizeof(unsigned int));
+		tex.pageTableDirty = false;
+	}
+	uploadStaged(numStaged);
+	return oldSize - getDeviceSizeInBytes();
+}
+
+void TextureTileCache::PrintStatus(std::vector<std::string>& a_Buf) const
+{
+	a_Buf.push_back(format("Texture cache hit rate : %.2f%%", m_lastStatistics.getHitRate() * 100.0f));
+	a_Buf.push_back(format("Texture cache resident : %.2f/%.2f [MB], %d pinned tiles", m_lastStatistics.residentBytes / (1024.0f * 1024.0f), getDeviceSizeInBytes() / (1024.0f * 1024.0f), m_uNumPinned));
+	a_Buf.push_back(format("Texture tiles loaded : %d, evicted : %d", m_lastStatistics.tilesLoaded, m_lastStatistics.tilesEvicted));
+}
+
+}
\ No newline at end of file
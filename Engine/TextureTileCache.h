@@ -0,0 +1,119 @@
+#pragma once
+#include "MIPMap_device.h"
+#include <vector>
+#include <list>
+#include <string>
+
+namespace CudaTracerLib {
+
+struct TextureTileCacheStatistics
+{
+	//number of distinct tiles accessed in the last pass and how many of those were resident
+	unsigned int tilesRequested;
+	unsigned int tilesHit;
+	unsigned int tilesLoaded;
+	unsigned int tilesEvicted;
+	size_t residentBytes;
+
+	TextureTileCacheStatistics()
+		: tilesRequested(0), tilesHit(0), tilesLoaded(0), tilesEvicted(0), residentBytes(0)
+	{
+
+	}
+
+	float getHitRate() const
+	{
+		return tilesRequested ? float(tilesHit) / float(tilesRequested) : 1.0f;
+	}
+};
+
+//fixed size pool of texture tiles on the device shared by all paged textures
+//the kernels record which tiles they accessed, the misses are loaded between passes evicting the least recently used tiles
+class TextureTileCache
+{
+public:
+	struct TileDesc
+	{
+		//offset and size in words in the host data of the texture
+		unsigned int hostOffset;
+		unsigned int numWords;
+		//pinned tiles are loaded on registration and never evicted
+		bool pinned;
+	};
+private:
+	struct TextureEntry
+	{
+		bool used;
+		const unsigned int* hostData;
+		std::vector<TileDesc> tiles;
+		std::vector<unsigned int> pageTable;
+		std::vector<unsigned char> requests;
+		unsigned int* devicePageTable;
+		unsigned char* deviceRequests;
+		bool pageTableDirty;
+	};
+	struct Slot
+	{
+		unsigned int texture;
+		unsigned int tile;
+		unsigned long long lastUse;
+		bool pinned;
+		std::list<unsigned int>::iterator lruPosition;
+	};
+
+	unsigned int m_uNumSlots;
+	unsigned int m_uMaxLoadsPerResolve;
+	unsigned int* m_pDevicePool;
+	//device copy of m_pDevicePool, the textures read the pool through it so shrinking the pool does not invalidate their kernel data
+	unsigned int** m_pDevicePoolAddress;
+	//loaded tiles are gathered in a staging buffer and copied to their slots with one kernel
+	std::vector<unsigned int> m_hostStaging;
+	std::vector<unsigned int> m_hostStagingSlots;
+	unsigned int* m_pDeviceStaging;
+	unsigned int* m_pDeviceStagingSlots;
+
+	std::vector<TextureEntry> m_textures;
+	std::vector<Slot> m_slots;
+	std::vector<unsigned int> m_freeSlots;
+	//most recently used slots at the front, pinned slots are not part of the list
+	std::list<unsigned int> m_lru;
+	unsigned long long m_uFrame;
+	unsigned int m_uNumPinned;
+	TextureTileCacheStatistics m_lastStatistics;
+
+	unsigned int allocateSlot();
+	void touchSlot(unsigned int slot);
+	void uploadStaged(unsigned int numStaged);
+	void stageTile(unsigned int texture, unsigned int tile, unsigned int slot, unsigned int stagingIdx);
+public:
+	//the pool holds sizeInBytes / (MIPMAP_TILE_SIZE^2 * 4) tiles of any data type
+	CTL_EXPORT TextureTileCache(size_t sizeInBytes, unsigned int maxLoadsPerResolve = 1024);
+	CTL_EXPORT void Free();
+
+	//adds a texture and loads its pinned tiles, returns the id used for unregistering
+	CTL_EXPORT unsigned int Register(const unsigned int* hostData, const std::vector<TileDesc>& tiles, unsigned int*& devicePageTable, unsigned char*& deviceRequests);
+	CTL_EXPORT void Unregister(unsigned int id);
+
+	//has to be called between passes, loads the tiles which were not resident in the last pass
+	CTL_EXPORT void ResolveMisses();
+
+	//reduces the pool by at least bytesNeeded keeping the pinned tiles, the other tiles are reloaded on demand
+	//returns the number of bytes freed which is 0 if the pool only holds pinned tiles
+	CTL_EXPORT size_t Shrink(size_t bytesNeeded);
+
+	const TextureTileCacheStatistics& getLastStatistics() const
+	{
+		return m_lastStatistics;
+	}
+	unsigned int* const* getDevicePoolAddress() const
+	{
+		return m_pDevicePoolAddress;
+	}
+	size_t getDeviceSizeInBytes() const
+	{
+		return (size_t)m_uNumSlots * MIPMAP_TILE_SIZE * MIPMAP_TILE_SIZE * 4;
+	}
+	CTL_EXPORT void PrintStatus(std::vector<std::string>& a_Buf) const;
+};
+
+}
\ No newline at end of file
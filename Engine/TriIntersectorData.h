@@ -39,6 +39,9 @@ public:
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST bool Intersect(const Ray& r, float* dist = 0, Vec2f* bary = 0) const;
 };
 
+//child index of an inner node without this child
+#define BVH_NO_NODE 0x76543210
+
 struct BVHNodeData
 {
 	//      nodes[innerOfs + 0 ] = Vec4f(c0.lo.x, c0.hi.x, c0.lo.y, c0.hi.y)
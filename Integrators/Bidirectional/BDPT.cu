@@ -107,6 +107,16 @@ __global__ void pathKernel(unsigned int w, unsigned int h, int xoff, int yoff, I
 		BPT(Vec2f(pixel.x + rng.randomFloat(), pixel.y + rng.randomFloat()), img, rng, w, h, use_mis, force_s, force_t, LScale);
 }
 
+void BDPT::DoRender(Image* I)
+{
+	//every pixel thread also traces a light sub path which is splatted anywhere in the image
+	//the splats are scaled by the number of passes, therefore converged blocks are not dropped from the launch
+	m_pBlockSampler->IterateBlocks([&](unsigned int block_idx, int x, int y, int bw, int bh)
+	{
+		RenderBlock(I, x, y, bw, bh);
+	});
+}
+
 void BDPT::RenderBlock(Image* I, int x, int y, int blockW, int blockH)
 {
 	pathKernel << < BLOCK_SAMPLER_LAUNCH_CONFIG >> >(w, h, x, y, *I,
@@ -20,6 +20,7 @@ public:
 					  << KEY_ResultMultiplier() << CreateInterval(1.0f, -FLT_MAX, FLT_MAX);
 	}
 protected:
+	CTL_EXPORT virtual void DoRender(Image* I);
 	CTL_EXPORT virtual void RenderBlock(Image* I, int x, int y, int blockW, int blockH);
 	CTL_EXPORT virtual void DebugInternal(Image* I, const Vec2i& pixel);
 };
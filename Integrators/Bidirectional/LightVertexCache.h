@@ -0,0 +1,216 @@
+#pragma once
+
+#include "VCMHelper.h"
+#include <Math/Compression.h>
+#include <Kernel/TraceResult.h>
+#include <Base/SynchronizedBuffer.h>
+#include <Engine/SpatialStructures/Grid/SpatialGridList.h>
+
+namespace CudaTracerLib {
+
+//the expected number of stored vertices per light sub path, used to size the cache
+#define LIGHT_VERTEX_CACHE_VERTICES_PER_PATH 4
+
+//stores all light sub path vertices traced in one pass as a structure of arrays
+//only the compact data needed for merging and the hit point are stored, the bsdf records for connections are rebuilt from the hit point
+class LightVertexCache : public ISynchronizedBufferParent
+{
+	unsigned int m_uNumVertices;
+	//keeps counting after the cache is full, the difference to m_uNumVertices is the number of dropped vertices
+	unsigned int m_uNumStored;
+	unsigned int m_uNumLightPaths;
+
+	SynchronizedBuffer<Vec3f> m_positionBuffer;
+	//dVCM, dVC, dVM
+	SynchronizedBuffer<Vec3f> m_misBuffer;
+	SynchronizedBuffer<Spectrum> m_throughputBuffer;
+	//compressed geometric normal, only used to reject vertices while merging
+	SynchronizedBuffer<unsigned short> m_normalBuffer;
+	//world space direction towards the previous vertex of the light sub path
+	SynchronizedBuffer<Vec3f> m_wiBuffer;
+	SynchronizedBuffer<unsigned int> m_pathLengthBuffer;
+	//triangle, node and barycentric coordinates which determine the material and the differential geometry
+	SynchronizedBuffer<TraceResult> m_hitBuffer;
+
+	//maps grid cells to the indices of the vertices stored in them
+	SpatialGridList_Linked<unsigned int> m_mergeGrid;
+public:
+	LightVertexCache(const Vec3u& gridSize, unsigned int numVertices)
+		: ISynchronizedBufferParent(m_positionBuffer, m_misBuffer, m_throughputBuffer, m_normalBuffer, m_wiBuffer, m_pathLengthBuffer, m_hitBuffer, m_mergeGrid),
+		m_uNumVertices(numVertices), m_uNumStored(0), m_uNumLightPaths(0),
+		m_positionBuffer(numVertices), m_misBuffer(numVertices), m_throughputBuffer(numVertices), m_normalBuffer(numVertices),
+		m_wiBuffer(numVertices), m_pathLengthBuffer(numVertices), m_hitBuffer(numVertices), m_mergeGrid(gridSize, numVertices)
+	{
+
+	}
+
+	void SetGridDimensions(const AABB& box)
+	{
+		m_mergeGrid.SetGridDimensions(box);
+	}
+
+	void ResetBuffer(unsigned int numLightPaths)
+	{
+		m_uNumStored = 0;
+		m_uNumLightPaths = numLightPaths;
+		m_mergeGrid.ResetBuffer();
+	}
+
+	CUDA_FUNC_IN unsigned int getNumEntries() const
+	{
+		return m_uNumVertices;
+	}
+
+	CUDA_FUNC_IN unsigned int getNumStoredEntries() const
+	{
+		return DMIN2(m_uNumStored, m_uNumVertices);
+	}
+
+	CUDA_FUNC_IN unsigned int getNumLightPaths() const
+	{
+		return m_uNumLightPaths;
+	}
+
+	CUDA_FUNC_IN bool isFull() const
+	{
+		return m_uNumStored >= m_uNumVertices;
+	}
+
+	//number of vertices of the last light pass which did not fit into the cache
+	CUDA_FUNC_IN unsigned int getNumDroppedEntries() const
+	{
+		return m_uNumStored > m_uNumVertices ? m_uNumStored - m_uNumVertices : 0;
+	}
+
+	CUDA_FUNC_IN unsigned int Store(const BPTVertex& v, const TraceResult& hit, const NormalizedT<Vec3f>& wi)
+	{
+#ifdef ISCUDA
+		unsigned int idx = atomicInc(&m_uNumStored, (unsigned int)-1);
+#else
+		unsigned int idx = Platform::Increment(&m_uNumStored);
+#endif
+		if (idx >= m_uNumVertices)
+			return 0xffffffff;
+
+		m_positionBuffer[idx] = v.bRec.dg.P;
+		m_misBuffer[idx] = Vec3f(v.dVCM, v.dVC, v.dVM);
+		m_throughputBuffer[idx] = v.throughput;
+		m_normalBuffer[idx] = NormalizedFloat3ToUchar2(v.bRec.dg.sys.n);
+		m_wiBuffer[idx] = wi;
+		m_pathLengthBuffer[idx] = v.subPathLength;
+		m_hitBuffer[idx] = hit;
+
+		m_mergeGrid.Store(v.bRec.dg.P, idx);
+		return idx;
+	}
+
+	//rebuilds the full vertex including the bsdf record the same way the light pass created it
+	CUDA_FUNC_IN BPTVertex getVertex(unsigned int idx) const
+	{
+		BPTVertex v;
+		const TraceResult& hit = m_hitBuffer[idx];
+		v.throughput = m_throughputBuffer[idx];
+		hit.getBsdfSample(-getWi(idx), m_positionBuffer[idx], v.bRec, ETransportMode::EImportance, &v.throughput);
+		v.mat = &hit.getMat();
+		v.subPathLength = m_pathLengthBuffer[idx];
+		Vec3f mis = m_misBuffer[idx];
+		v.dVCM = mis.x;
+		v.dVC = mis.y;
+		v.dVM = mis.z;
+		return v;
+	}
+
+	//chooses one of the stored vertices uniformly, returns 0xffffffff if the cache is empty
+	CUDA_FUNC_IN unsigned int sampleVertex(float sample) const
+	{
+		unsigned int n = getNumStoredEntries();
+		if (n == 0)
+			return 0xffffffff;
+		return DMIN2((unsigned int)(sample * n), n - 1);
+	}
+
+	CUDA_FUNC_IN const Vec3f& getPosition(unsigned int idx) const
+	{
+		return m_positionBuffer[idx];
+	}
+
+	CUDA_FUNC_IN const Vec3f& getMisWeights(unsigned int idx) const
+	{
+		return m_misBuffer[idx];
+	}
+
+	CUDA_FUNC_IN const Spectrum& getThroughput(unsigned int idx) const
+	{
+		return m_throughputBuffer[idx];
+	}
+
+	CUDA_FUNC_IN NormalizedT<Vec3f> getNormal(unsigned int idx) const
+	{
+		return Uchar2ToNormalizedFloat3(m_normalBuffer[idx]);
+	}
+
+	CUDA_FUNC_IN NormalizedT<Vec3f> getWi(unsigned int idx) const
+	{
+		return NormalizedT<Vec3f>(m_wiBuffer[idx]);
+	}
+
+	template<unsigned int MAX_ENTRIES_PER_CELL = UINT_MAX, typename CLB> CUDA_FUNC_IN void ForAllVertices(const Vec3f& min, const Vec3f& max, CLB clb)
+	{
+		m_mergeGrid.ForAll<MAX_ENTRIES_PER_CELL>(min, max, [&](const Vec3u& cell_idx, unsigned int e_idx, unsigned int v_idx)
+		{
+			clb(v_idx);
+		});
+	}
+};
+
+//connects the camera vertex to numConnections randomly chosen vertices of the cache
+//the estimator is scaled so that it matches connecting to all vertices of a single light sub path on average
+template<bool TEST_VISIBILITY = true> CUDA_FUNC_IN Spectrum connectToCachedVertices(const LightVertexCache& cache, const BPTSubPathState& cameraState, BSDFSamplingRecord& bRec, const Material& mat, Sampler& rng, int numConnections, float mMisVcWeightFactor, float mMisVmWeightFactor, bool use_mis)
+{
+	unsigned int numStored = cache.getNumStoredEntries();
+	if (numStored == 0 || numConnections <= 0 || cache.getNumLightPaths() == 0)
+		return Spectrum(0.0f);
+
+	Spectrum acc(0.0f);
+	for (int i = 0; i < numConnections; i++)
+	{
+		BPTVertex lv = cache.getVertex(cache.sampleVertex(rng.randomFloat()));
+		acc += lv.throughput * connectVertices<TEST_VISIBILITY>(lv, cameraState, bRec, mat, mMisVcWeightFactor, mMisVmWeightFactor, use_mis);
+	}
+	return acc * (float(numStored) / float(numConnections * cache.getNumLightPaths()));
+}
+
+//vertex merging with all light vertices of the current pass in the radius r around the camera vertex
+template<bool F_IS_GLOSSY> CUDA_FUNC_IN Spectrum mergeVertices(LightVertexCache& cache, BPTSubPathState& aCameraState, BSDFSamplingRecord& bRec, float r, const Material* mat, float mMisVcWeightFactor, bool use_mis)
+{
+	Spectrum Lp = Spectrum(0.0f);
+	auto surface_region = bRec.dg.ComputeOnSurfaceDiskBounds(r);
+	cache.ForAllVertices<200>(surface_region.minV, surface_region.maxV, [&](unsigned int v_idx)
+	{
+		float dist2 = distanceSquared(cache.getPosition(v_idx), bRec.dg.P);
+		Vec3f photonNormal = cache.getNormal(v_idx);
+		float wiDotGeoN = absdot(photonNormal, -aCameraState.r.dir());
+		if (dist2 < r * r && dot(photonNormal, bRec.dg.sys.n) > 0.1f && wiDotGeoN > 1e-2f)
+		{
+			bRec.wo = bRec.dg.toLocal(cache.getWi(v_idx));
+			float ke = Kernel::k<2>(math::sqrt(dist2), r);
+			Spectrum l = cache.getThroughput(v_idx);
+			if (F_IS_GLOSSY)
+				l *= mat->bsdf.f(bRec);
+
+			const Vec3f mis = cache.getMisWeights(v_idx);
+			const float cameraBsdfDirPdfW = pdf(*mat, bRec);
+			const float cameraBsdfRevPdfW = revPdf(*mat, bRec);
+			const float wLight = mis.x * mMisVcWeightFactor + mis.z * cameraBsdfDirPdfW;
+			const float wCamera = aCameraState.dVCM * mMisVcWeightFactor + aCameraState.dVM * cameraBsdfRevPdfW;
+			const float misWeight = 1.f / (wLight + 1.f + wCamera);
+
+			Lp += (use_mis ? misWeight : 1.0f) * ke * l / Frame::cosTheta(bRec.wo);
+		}
+	});
+	if (!F_IS_GLOSSY)
+		Lp *= mat->bsdf.f(bRec) / Frame::cosTheta(bRec.wo);
+	return Lp / float(cache.getNumLightPaths());
+}
+
+}
@@ -1,67 +1,73 @@
 #include "VCM.h"
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib {
 
-CUDA_DEVICE CudaStaticWrapper<VCMSurfMap> g_CurrentMap, g_NextMap;
+CUDA_DEVICE CudaStaticWrapper<LightVertexCache> g_LightVertexCacheDevice;
+static CudaStaticWrapper<LightVertexCache> g_LightVertexCacheHost;
+#ifdef ISCUDA
+#define g_LightVertexCache g_LightVertexCacheDevice
+#else
+#define g_LightVertexCache g_LightVertexCacheHost
+#endif
 
-CUDA_FUNC_IN void _VCM(const Vec2f& pixelPosition, Image& img, Sampler& rng, int w, int h, float a_Radius, int a_NumIteration, float nPhotons)
+CUDA_FUNC_IN void computeMisFactors(int w, int h, float a_Radius, float& mMisVmWeightFactor, float& mMisVcWeightFactor)
 {
-	float mLightSubPathCount = 1;
 	const float etaVCM = (PI * a_Radius * a_Radius) * w * h;
-	float mMisVmWeightFactor = 1;
-	float mMisVcWeightFactor = 1.0f / etaVCM;
+	mMisVmWeightFactor = 1;
+	mMisVcWeightFactor = 1.0f / etaVCM;
+}
 
-	BPTVertex lightPath[NUM_V_PER_PATH];
+CUDA_FUNC_IN void _VCM_LightPath(Image& img, Sampler& rng, int w, int h, float a_Radius)
+{
+	float mLightSubPathCount = 1, mMisVmWeightFactor, mMisVcWeightFactor;
+	computeMisFactors(w, h, a_Radius, mMisVmWeightFactor, mMisVcWeightFactor);
+
+	BPTVertex v;
 	BPTSubPathState lightPathState;
 	sampleEmitter(lightPathState, rng, mMisVcWeightFactor);
-	int emitterPathLength = 1, emitterVerticesStored = 0;
-	for (; emitterVerticesStored < NUM_V_PER_PATH && emitterPathLength < MAX_SUB_PATH_LENGTH; emitterPathLength++)
+	for (int emitterPathLength = 1; emitterPathLength < MAX_SUB_PATH_LENGTH; emitterPathLength++)
 	{
 		TraceResult r2 = traceRay(lightPathState.r);
 		if (!r2.hasHit())
 			break;
 
-		BPTVertex& v = lightPath[emitterVerticesStored];
 		r2.getBsdfSample(lightPathState.r, v.bRec, ETransportMode::EImportance, &lightPathState.throughput);
 
-		if (emitterPathLength > 1 || true)
-			lightPathState.dVCM *= r2.m_fDist * r2.m_fDist;
+		lightPathState.dVCM *= r2.m_fDist * r2.m_fDist;
 		lightPathState.dVCM /= math::abs(Frame::cosTheta(v.bRec.wi));
 		lightPathState.dVC /= math::abs(Frame::cosTheta(v.bRec.wi));
 		lightPathState.dVM /= math::abs(Frame::cosTheta(v.bRec.wi));
 
-		//store in list
 		if (r2.getMat().bsdf.hasComponent(ESmooth))
 		{
+			//store in the cache for connections and merging, vertices which do not fit are counted by the cache
 			v.dVCM = lightPathState.dVCM;
 			v.dVC = lightPathState.dVC;
 			v.dVM = lightPathState.dVM;
 			v.throughput = lightPathState.throughput;
 			v.mat = &r2.getMat();
 			v.subPathLength = emitterPathLength + 1;
-			emitterVerticesStored++;
+			g_LightVertexCache->Store(v, r2, -lightPathState.r.dir());
 
-#ifdef ISCUDA
-			auto ph = k_MISPhoton(v.throughput, -lightPathState.r.dir(), v.bRec.dg.sys.n, v.dVC, v.dVCM, v.dVM);
-			Vec3u cell_idx = g_NextMap->getHashGrid().Transform(v.bRec.dg.P);
-			ph.setPos(g_NextMap->getHashGrid(), cell_idx, v.bRec.dg.P);
-			if (g_NextMap->Store(cell_idx, ph) == 0xffffffff)
-				printf("VCM : not enough photon storage allocated!\n");
-#endif
-		}
-
-		//connect to camera
-		if (r2.getMat().bsdf.hasComponent(ESmooth))
+			//connect to camera
 			connectToCamera(lightPathState, v.bRec, r2.getMat(), img, rng, mLightSubPathCount, mMisVmWeightFactor, 1, true);
+		}
 
 		if (!sampleScattering(lightPathState, v.bRec, r2.getMat(), rng, mMisVcWeightFactor, mMisVmWeightFactor))
 			break;
 	}
+}
+
+CUDA_FUNC_IN void _VCM_CameraPath(const Vec2f& pixelPosition, Image& img, Sampler& rng, int w, int h, float a_Radius, int numConnections)
+{
+	float mLightSubPathCount = 1, mMisVmWeightFactor, mMisVcWeightFactor;
+	computeMisFactors(w, h, a_Radius, mMisVmWeightFactor, mMisVcWeightFactor);
 
 	BPTSubPathState cameraState;
 	sampleCamera(cameraState, rng, pixelPosition, mLightSubPathCount);
 	Spectrum acc(0.0f);
-	for (int camPathLength = 1; camPathLength <= NUM_V_PER_PATH; camPathLength++)
+	for (int camPathLength = 1; camPathLength <= MAX_SUB_PATH_LENGTH; camPathLength++)
 	{
 		TraceResult r2 = traceRay(cameraState.r);
 		if (!r2.hasHit())
@@ -88,25 +94,13 @@ CUDA_FUNC_IN void _VCM(const Vec2f& pixelPosition, Image& img, Sampler& rng, int
 
 		if (r2.getMat().bsdf.hasComponent(ESmooth))
 		{
-			//acc += cameraState.throughput * connectToLight(cameraState, bRec, r2.getMat(), rng, mMisVmWeightFactor, true);
-
-			for (int emitterVertexIdx = 0; emitterVertexIdx < emitterVerticesStored; emitterVertexIdx++)
-			{
-				BPTVertex lv = lightPath[emitterVertexIdx];
-				acc += cameraState.throughput * lv.throughput * connectVertices(lv, cameraState, bRec, r2.getMat(), mMisVcWeightFactor, mMisVmWeightFactor, true);
-			}
+			acc += cameraState.throughput * connectToCachedVertices(g_LightVertexCache, cameraState, bRec, r2.getMat(), rng, numConnections, mMisVcWeightFactor, mMisVmWeightFactor, true);
 
-			//scale by 2 to account for no merging in the first iteration
-#ifdef ISCUDA
-			if(a_NumIteration > 1)
-			{
-				Spectrum phL;
-				if (!r2.getMat().bsdf.hasComponent(EGlossy))
-					phL = L_Surface2<false>(g_CurrentMap, cameraState, bRec, a_Radius, &r2.getMat(), mMisVcWeightFactor, nPhotons, true);
-				else phL = L_Surface2<true>(g_CurrentMap, cameraState, bRec, a_Radius, &r2.getMat(), mMisVcWeightFactor, nPhotons, true);
-				acc += cameraState.throughput * (a_NumIteration == 2 ? 2 : 1) * phL;
-			}
-#endif
+			Spectrum phL;
+			if (!r2.getMat().bsdf.hasComponent(EGlossy))
+				phL = mergeVertices<false>(g_LightVertexCache, cameraState, bRec, a_Radius, &r2.getMat(), mMisVcWeightFactor, true);
+			else phL = mergeVertices<true>(g_LightVertexCache, cameraState, bRec, a_Radius, &r2.getMat(), mMisVcWeightFactor, true);
+			acc += cameraState.throughput * phL;
 		}
 
 		if (!sampleScattering(cameraState, bRec, r2.getMat(), rng, mMisVcWeightFactor, mMisVmWeightFactor))
@@ -116,33 +110,57 @@ CUDA_FUNC_IN void _VCM(const Vec2f& pixelPosition, Image& img, Sampler& rng, int
 	img.AddSample(pixelPosition.x, pixelPosition.y, acc);
 }
 
-__global__ void pathKernel(unsigned int w, unsigned int h, int xoff, int yoff, Image img, float a_Radius, int a_NumIteration, float nPhotons)
+__global__ void lightPathKernel(unsigned int w, unsigned int h, unsigned int numLightPaths, Image img, float a_Radius)
+{
+	unsigned int idx = threadIdx.x + blockDim.x * blockIdx.x;
+	if (idx < numLightPaths)
+	{
+		auto rng = g_SamplerData(idx);
+		_VCM_LightPath(img, rng, w, h, a_Radius);
+	}
+}
+
+__global__ void pathKernel(unsigned int w, unsigned int h, int xoff, int yoff, Image img, float a_Radius, int numConnections)
 {
 	Vec2i pixel = TracerBase::getPixelPos(xoff, yoff);
 	auto rng = g_SamplerData(TracerBase::getPixelIndex(xoff, yoff, w, h));
 	if (pixel.x < w && pixel.y < h)
-		_VCM(pixel, img, rng, w, h, a_Radius, a_NumIteration, nPhotons);
+		_VCM_CameraPath(pixel, img, rng, w, h, a_Radius, numConnections);
 }
 
 void VCM::RenderBlock(Image* I, int x, int y, int blockW, int blockH)
 {
 	float radius = getCurrentRadius(2);
-	pathKernel << < BLOCK_SAMPLER_LAUNCH_CONFIG >> >(w, h, x, y, *I, radius, m_uPassesDone, (float)(w * h));
+	pathKernel << < BLOCK_SAMPLER_LAUNCH_CONFIG >> >(w, h, x, y, *I, radius, m_sParameters.getValue(KEY_NumVertexConnections()));
 }
 
-void VCM::DoRender(Image* I)
+void VCM::doLightPass(Image* I)
 {
-	m_sPhotonMapsNext.ResetBuffer();
-	ThrowCudaErrors(cudaMemcpyToSymbol(g_CurrentMap, &m_sPhotonMapsCurrent, sizeof(m_sPhotonMapsCurrent)));
-	ThrowCudaErrors(cudaMemcpyToSymbol(g_NextMap, &m_sPhotonMapsNext, sizeof(m_sPhotonMapsNext)));
-
-	Tracer<true>::DoRender(I);
-	m_sPhotonMapsCurrent.setOnGPU();
-	ThrowCudaErrors(cudaMemcpyFromSymbol(&m_sPhotonMapsNext, g_NextMap, sizeof(m_sPhotonMapsNext)));
-	ThrowCudaErrors(cudaMemcpyFromSymbol(&m_sPhotonMapsCurrent, g_CurrentMap, sizeof(m_sPhotonMapsCurrent)));
+	unsigned int numLightPaths = w * h;
+	m_pLightVertexCache->ResetBuffer(numLightPaths);
+	ThrowCudaErrors(cudaMemcpyToSymbol(g_LightVertexCacheDevice, m_pLightVertexCache, sizeof(LightVertexCache)));
+
+	const unsigned int threadsPerBlock = 256;
+	lightPathKernel << < (numLightPaths + threadsPerBlock - 1) / threadsPerBlock, threadsPerBlock >> >(w, h, numLightPaths, *I, getCurrentRadius(2));
+
+	ThrowCudaErrors(cudaMemcpyFromSymbol(m_pLightVertexCache, g_LightVertexCacheDevice, sizeof(LightVertexCache)));
+	m_pLightVertexCache->setOnGPU();
+	memcpy(&g_LightVertexCacheHost, m_pLightVertexCache, sizeof(LightVertexCache));
+	//the camera pass has to use different random numbers than the light pass
+	generateNewRandomSequences();
+}
 
-	std::swap(m_sPhotonMapsNext, m_sPhotonMapsCurrent);
-	m_uPhotonsEmitted += w * h;
+void VCM::DoRender(Image* I)
+{
+	{
+		PROFILE_ZONE("VCM", "Light Pass");
+		doLightPass(I);
+	}
+	{
+		PROFILE_ZONE("VCM", "Camera Pass");
+		Tracer<true>::DoRender(I);
+	}
+	m_uPhotonsEmitted += m_pLightVertexCache->getNumLightPaths();
 }
 
 void VCM::StartNewTrace(Image* I)
@@ -155,15 +173,59 @@ void VCM::StartNewTrace(Image* I)
 	m_sEyeBox.minV -= Vec3f(r);
 	m_sEyeBox.maxV += Vec3f(r);
 	m_fInitialRadius = r;
-	m_sPhotonMapsCurrent.SetGridDimensions(m_sEyeBox);
-	m_sPhotonMapsNext.SetGridDimensions(m_sEyeBox);
+	m_pLightVertexCache->SetGridDimensions(m_sEyeBox);
+}
+
+void VCM::SaveCheckpoint(Image* I, RenderCheckpoint& checkpoint)
+{
+	Tracer<true>::SaveCheckpoint(I, checkpoint);
+	checkpoint.WriteValue("VCM.InitialRadius", m_fInitialRadius);
+	checkpoint.WriteValue("VCM.PhotonsEmitted", m_uPhotonsEmitted);
+}
+
+void VCM::RestoreCheckpoint(Image* I, const RenderCheckpoint& checkpoint)
+{
+	Tracer<true>::RestoreCheckpoint(I, checkpoint);
+	checkpoint.ReadValue("VCM.InitialRadius", m_fInitialRadius);
+	checkpoint.ReadValue("VCM.PhotonsEmitted", m_uPhotonsEmitted);
+}
+
+void VCM::Resize(unsigned int _w, unsigned int _h)
+{
+	Tracer<true>::Resize(_w, _h);
+	if (m_pLightVertexCache)
+	{
+		m_pLightVertexCache->Free();
+		delete m_pLightVertexCache;
+	}
+	m_pLightVertexCache = new LightVertexCache(Vec3u(250), _w * _h * LIGHT_VERTEX_CACHE_VERTICES_PER_PATH);
+}
+
+void VCM::PrintStatus(std::vector<std::string>& a_Buf) const
+{
+	a_Buf.push_back(Profiler::getInstance().ToString("VCM"));
+	if (m_pLightVertexCache)
+	{
+		a_Buf.push_back(format("Light paths per pass : %d", m_pLightVertexCache->getNumLightPaths()));
+		a_Buf.push_back(format("%.2f%% Light vertex cache", float(m_pLightVertexCache->getNumStoredEntries()) / m_pLightVertexCache->getNumEntries() * 100));
+		if (m_pLightVertexCache->getNumDroppedEntries())
+			a_Buf.push_back(format("Light vertex cache overflow : %d vertices dropped", m_pLightVertexCache->getNumDroppedEntries()));
+	}
 }
 
-int gridLength = 250;
-int numPhotons = 1024 * 1024 * MAX_SUB_PATH_LENGTH;
 VCM::VCM()
-	: m_sPhotonMapsCurrent(Vec3u(gridLength), numPhotons), m_sPhotonMapsNext(Vec3u(gridLength), numPhotons)
+	: m_pLightVertexCache(0)
+{
+	m_sParameters << KEY_NumVertexConnections() << CreateInterval(3, 0, INT_MAX);
+}
+
+VCM::~VCM()
 {
+	if (m_pLightVertexCache)
+	{
+		m_pLightVertexCache->Free();
+		delete m_pLightVertexCache;
+	}
 }
 
 }
\ No newline at end of file
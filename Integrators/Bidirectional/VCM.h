@@ -2,26 +2,35 @@
 
 #include <Kernel/Tracer.h>
 #include "VCMHelper.h"
+#include "LightVertexCache.h"
 
 namespace CudaTracerLib {
 
 class VCM : public Tracer<true>
 {
 public:
+	PARAMETER_KEY(int, NumVertexConnections)
+
 	CTL_EXPORT VCM();
+	CTL_EXPORT virtual ~VCM();
+	CTL_EXPORT virtual void Resize(unsigned int _w, unsigned int _h);
+	CTL_EXPORT virtual void PrintStatus(std::vector<std::string>& a_Buf) const;
+	CTL_EXPORT virtual void SaveCheckpoint(Image* I, RenderCheckpoint& checkpoint);
 protected:
 	CTL_EXPORT virtual void DoRender(Image* I);
 	CTL_EXPORT virtual void StartNewTrace(Image* I);
+	CTL_EXPORT virtual void RestoreCheckpoint(Image* I, const RenderCheckpoint& checkpoint);
 	CTL_EXPORT virtual void RenderBlock(Image* I, int x, int y, int blockW, int blockH);
 private:
-	//current will be used for lookup, next will be stored in
-	VCMSurfMap m_sPhotonMapsCurrent, m_sPhotonMapsNext;
+	//filled by the light pass and used for connections and merging by the camera pass of the same iteration
+	LightVertexCache* m_pLightVertexCache;
 	float m_fInitialRadius;
 	unsigned long long m_uPhotonsEmitted;
 	float getCurrentRadius(int exp)
 	{
 		return CudaTracerLib::getCurrentRadius(m_fInitialRadius, m_uPassesDone, (float)exp);
 	}
+	CTL_EXPORT void doLightPass(Image* I);
 };
 
 }
\ No newline at end of file
@@ -7,16 +7,6 @@
 
 namespace CudaTracerLib {
 
-struct k_MISPhoton : public PPPMPhoton
-{
-	float dVC, dVCM, dVM;
-	CUDA_FUNC_IN k_MISPhoton(){}
-	CUDA_FUNC_IN k_MISPhoton(const Spectrum& l, const NormalizedT<Vec3f>& wi, const NormalizedT<Vec3f>& n, float dvc, float dvcm, float dvm)
-		: PPPMPhoton(l, wi, n), dVC(dvc), dVCM(dvcm), dVM(dvm)
-	{
-	}
-};
-
 #define NUM_V_PER_PATH 5
 #define MAX_SUB_PATH_LENGTH 10
 
@@ -316,42 +306,4 @@ template<bool TEST_VISIBILITY = true> CUDA_FUNC_IN Spectrum connectVertices(BPTV
 	return Spectrum(0.0f);
 }
 
-typedef SpatialGridList_Linked<k_MISPhoton> VCMSurfMap;
-
-template<bool F_IS_GLOSSY> CUDA_FUNC_IN Spectrum L_Surface2(VCMSurfMap& g_CurrentMap, BPTSubPathState& aCameraState, BSDFSamplingRecord& bRec, float r, const Material* mat, float mMisVcWeightFactor, float nPhotons, bool use_mis)
-{
-	Spectrum Lp = Spectrum(0.0f);
-	auto surface_region = bRec.dg.ComputeOnSurfaceDiskBounds(r);
-#ifdef ISCUDA
-	g_CurrentMap.ForAll<200>(surface_region.minV, surface_region.maxV, [&](const Vec3u& cell_idx, unsigned int p_idx, const k_MISPhoton& ph)
-	{
-		float dist2 = distanceSquared(ph.getPos(g_CurrentMap.getHashGrid(), cell_idx), bRec.dg.P);
-		Vec3f photonNormal = ph.getNormal();
-		float wiDotGeoN = absdot(photonNormal, -aCameraState.r.dir());
-		if (dist2 < r * r && dot(photonNormal, bRec.dg.sys.n) > 0.1f && wiDotGeoN > 1e-2f)
-		{
-			bRec.wo = bRec.dg.toLocal(ph.getWi());
-			float cor_fac = math::abs(Frame::cosTheta(bRec.wi) / (wiDotGeoN * Frame::cosTheta(bRec.wo)));
-			float ke = Kernel::k<2>(math::sqrt(dist2), r);
-			Spectrum l = ph.getL();
-			if (F_IS_GLOSSY)
-				l *= mat->bsdf.f(bRec);
-
-			const float cameraBsdfDirPdfW = pdf(*mat, bRec);
-			const float cameraBsdfRevPdfW = revPdf(*mat, bRec);
-			const float wLight = ph.dVCM * mMisVcWeightFactor + ph.dVM * cameraBsdfDirPdfW;
-			const float wCamera = aCameraState.dVCM * mMisVcWeightFactor + aCameraState.dVM * cameraBsdfRevPdfW;
-			const float misWeight = 1.f / (wLight + 1.f + wCamera);
-
-			Lp += (use_mis ? misWeight : 1.0f) * ke * l / Frame::cosTheta(bRec.wo);//cor_fac;
-		}
-	});
-	if (!F_IS_GLOSSY)
-		Lp *= mat->bsdf.f(bRec) / Frame::cosTheta(bRec.wo);
-	return Lp / nPhotons;
-#else
-	return 1.0f;
-#endif
-}
-
 }
\ No newline at end of file
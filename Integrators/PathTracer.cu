@@ -2,25 +2,131 @@
 #include <Kernel/TraceHelper.h>
 #include <Kernel/TraceAlgorithms.h>
 #include <SceneTypes/Light.h>
+#include <Kernel/ParametricModels/GridModelBuffer.h>
+#include <Kernel/ParametricModels/GaussianMixtureModel.h>
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib {
 
 CUDA_ALIGN(16) CUDA_DEVICE unsigned int g_NextRayCounter;
 
-template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTrace(NormalizedT<Ray>& r, const NormalizedT<Ray>& rX, const NormalizedT<Ray>& rY, Sampler& rnd, int maxPathLength, int rrStartDepth)
+CUDA_DEVICE CudaStaticWrapper<PathTracer::GuidingBuffer> g_GuidingBuffer;
+CUDA_DEVICE float g_GuidingStoreProbability;
+
+//maximum number of vertices per path which are used to train the guiding distributions
+#define GUIDING_MAX_VERTICES 8
+//capacity of the training buffer independent of the image size, about 32 MB
+#define GUIDING_MAX_ENTRIES (1 << 21)
+
+//(cos theta, phi) maps the sphere area preserving onto the unit square, therefore the jacobian is constant
+CUDA_FUNC_IN Vec2f guidingDirToSquare(const Vec3f& d)
+{
+	float phi = math::atan2(d.y, d.x) / (2 * PI);
+	return Vec2f(math::clamp01((d.z + 1.0f) / 2.0f), phi < 0 ? phi + 1.0f : phi);
+}
+
+CUDA_FUNC_IN NormalizedT<Vec3f> guidingSquareToDir(const Vec2f& s)
+{
+	float z = 2.0f * s.x - 1.0f, r = math::safe_sqrt(1.0f - z * z), phi = 2.0f * PI * s.y;
+	return NormalizedT<Vec3f>(r * cosf(phi), r * sinf(phi), z);
+}
+
+//solid angle pdf of the guiding distribution, the mass outside of the unit square is never used
+CUDA_FUNC_IN float guidingPdf(const PathTracer::GuidingModel& model, const Vec3f& d)
+{
+	Vec2f s = guidingDirToSquare(d);
+	float pdf = model.pdf(VEC<float, 2>() % s.x % s.y, VEC<float, 2>() % 0.0f % 0.0f, VEC<float, 2>() % 1.0f % 1.0f) / (4 * PI);
+	return pdf < FLT_MAX ? pdf : 0.0f;
+}
+
+//one sample mis of bsdf and guiding distribution, returns f * cos / pdf with the pdf of the combined strategy
+CUDA_FUNC_IN Spectrum sampleGuided(BSDFSamplingRecord& bRec, const Material& mat, const PathTracer::GuidingModel& model, float alpha, float& pdf, Sampler& rnd)
+{
+	if (rnd.randomFloat() < alpha)
+	{
+		float gmm_pdf;
+		auto x = model.sample(rnd, VEC<float, 2>() % 0.0f % 0.0f, VEC<float, 2>() % 1.0f % 1.0f, gmm_pdf);
+		if (!(x(0) >= 0 && x(0) <= 1 && x(1) >= 0 && x(1) < 1))
+			return Spectrum(0.0f);
+		bRec.wo = bRec.dg.toLocal(guidingSquareToDir(Vec2f(x(0), x(1))));
+		bRec.sampledType = 0;
+		Spectrum f = mat.bsdf.f(bRec);
+		pdf = alpha * guidingPdf(model, bRec.getOutgoing()) + (1 - alpha) * mat.bsdf.pdf(bRec);
+		return pdf > 0 ? f / pdf : Spectrum(0.0f);
+	}
+	else
+	{
+		float bsdf_pdf;
+		Spectrum f = mat.bsdf.sample(bRec, bsdf_pdf, rnd.randomFloat2());
+		if (f.isZero())
+			return f;
+		pdf = alpha * guidingPdf(model, bRec.getOutgoing()) + (1 - alpha) * bsdf_pdf;
+		return f * (bsdf_pdf / pdf);
+	}
+}
+
+//UniformSampleOneLight with the mis weight computed for the guided scattering pdf
+CUDA_FUNC_IN Spectrum sampleOneLightGuided(BSDFSamplingRecord& bRec, const Material& mat, const PathTracer::GuidingModel& model, float alpha, Sampler& rnd)
+{
+	if (!g_SceneData.m_numLights)
+		return Spectrum(0.0f);
+	float light_pdf;
+	const Light* light = g_SceneData.sampleEmitter(light_pdf, rnd.randomFloat2());
+	if (light == 0)
+		return Spectrum(0.0f);
+	DirectSamplingRecord dRec(bRec.dg.P, bRec.dg.sys.n);
+	Spectrum value = light->sampleDirect(dRec, rnd.randomFloat2());
+	Spectrum retVal(0.0f);
+	if (!value.isZero())
+	{
+		auto oldWo = bRec.wo;
+		bRec.wo = bRec.dg.toLocal(dRec.d);
+		bRec.typeMask = EBSDFType(EAll & ~EDelta);
+		Spectrum bsdfVal = mat.bsdf.f(bRec);
+		if (!bsdfVal.isZero() && !g_SceneData.Occluded(Ray(dRec.ref, dRec.d, bRec.dg.time), 0, dRec.dist))
+		{
+			float weight = 1.0f;
+			if (dRec.measure != EDiscrete)
+			{
+				const float scatteringPdf = alpha * guidingPdf(model, dRec.d) + (1 - alpha) * mat.bsdf.pdf(bRec);
+				const float directPdf = (dRec.measure == EArea ? PdfAtoW(dRec.pdf, dRec.dist, dot(dRec.n, dRec.d)) : dRec.pdf) * light_pdf;
+				weight = MonteCarlo::PowerHeuristic(1, directPdf, 1, scatteringPdf);
+			}
+			retVal = value * bsdfVal * weight * Transmittance(Ray(dRec.ref, dRec.d), 0, dRec.dist);
+		}
+		bRec.typeMask = EAll;
+		bRec.wo = oldWo;
+	}
+	return retVal / light_pdf;
+}
+
+struct GuidingVertex
+{
+	Vec3f p;
+	Vec2f dir;
+	float pdf;
+	//the path state after the vertex, used to compute the incident radiance once the path is finished
+	Spectrum cl, cf;
+};
+
+template<bool DIRECT, bool GUIDING> CUDA_FUNC_IN Spectrum PathTrace(NormalizedT<Ray>& r, const NormalizedT<Ray>& rX, const NormalizedT<Ray>& rY, Sampler& rnd, int maxPathLength, int rrStartDepth, float guidingFraction)
 {
 	Spectrum cl = Spectrum(0.0f);   // accumulated color
 	Spectrum cf = Spectrum(1.0f);  // accumulated reflectance
 	int depth = 0;
 	bool specularBounce = false;
 	BSDFSamplingRecord bRec;
+	bRec.sampleHero(rnd);
 	KernelAggregateVolume& V = g_SceneData.m_sVolume;
 	MediumSamplingRecord mRec;
 	TraceResult r2;
 	float brdf_scattering_pdf = 0;
 	NormalizedT<Vec3f> last_nor;
+	GuidingVertex guidingVertices[GUIDING ? GUIDING_MAX_VERTICES : 1];
+	int numGuidingVertices = 0;
 	while (depth++ < maxPathLength)
 	{
+		bool guidingVertexAdded = false;
 		r2 = traceRay(r);
 		float minT, maxT;
 		bool isInMedium = V.IntersectP(r, 0, r2.m_fDist, &minT, &maxT);
@@ -38,7 +144,7 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTrace(NormalizedT<Ray>& r, const
 				{
 					PhaseFunctionSamplingRecord pRec(-r.dir(), dRec.d);
 					float p = V.p(mRec.p, pRec);
-					if (p != 0 && !g_SceneData.Occluded(Ray(dRec.ref, dRec.d), 0, dRec.dist))
+					if (p != 0 && !g_SceneData.Occluded(Ray(dRec.ref, dRec.d, r.time()), 0, dRec.dist))
 					{
 						const float bsdfPdf = p;//phase functions are normalized
 						const float weight = MonteCarlo::PowerHeuristic(1, dRec.pdf, 1, bsdfPdf);
@@ -76,13 +182,30 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTrace(NormalizedT<Ray>& r, const
 				cl += misWeight * cf * r2.Le(bRec.dg.P, bRec.dg.sys, -r.dir());
 			}
 
-			Spectrum f = r2.getMat().bsdf.sample(bRec, brdf_scattering_pdf, rnd.randomFloat2());
+			//only use the learned distribution if it has seen data, delta components can not be guided
+			const PathTracer::GuidingModel* guide = 0;
+			bool guidable = GUIDING && !r2.getMat().bsdf.hasComponent(EDelta);
+			if (guidable && g_GuidingBuffer->getMixtureModel(bRec.dg.P).isTrained())
+				guide = &g_GuidingBuffer->getMixtureModel(bRec.dg.P);
+
+			Spectrum f = guide ? sampleGuided(bRec, r2.getMat(), *guide, guidingFraction, brdf_scattering_pdf, rnd)
+							   : r2.getMat().bsdf.sample(bRec, brdf_scattering_pdf, rnd.randomFloat2());
 			last_nor = bRec.dg.sys.n;
 			if (DIRECT && r2.getMat().bsdf.hasComponent(ESmooth))
-				cl += cf * UniformSampleOneLight(bRec, r2.getMat(), rnd, true);
+				cl += cf * (guide ? sampleOneLightGuided(bRec, r2.getMat(), *guide, guidingFraction, rnd) : UniformSampleOneLight(bRec, r2.getMat(), rnd, true));
 			specularBounce = (bRec.sampledType & EDelta) != 0;
 			cf = cf * f;
-			r = NormalizedT<Ray>(bRec.dg.P, bRec.getOutgoing());
+			if (guidable && numGuidingVertices < GUIDING_MAX_VERTICES && !f.isZero() && brdf_scattering_pdf > 0)
+			{
+				GuidingVertex& v = guidingVertices[numGuidingVertices++];
+				v.p = bRec.dg.P;
+				v.dir = guidingDirToSquare(bRec.getOutgoing());
+				v.pdf = brdf_scattering_pdf;
+				v.cl = cl;
+				v.cf = cf;
+				guidingVertexAdded = true;
+			}
+			r = NormalizedT<Ray>(bRec.dg.P, bRec.getOutgoing(), r.time());
 		}
 
 		if (!mediumInteraction && !r2.hasHit())
@@ -93,6 +216,8 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTrace(NormalizedT<Ray>& r, const
 			if (rnd.randomFloat() >= cf.max())
 				break;
 			cf /= cf.max();
+			if (guidingVertexAdded)
+				guidingVertices[numGuidingVertices - 1].cf = cf;
 		}
 	}
 	if (!r2.hasHit())
@@ -109,6 +234,19 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTrace(NormalizedT<Ray>& r, const
 		}
 		cl += misWeight * cf * g_SceneData.EvalEnvironment(r);
 	}
+	//the paths used for training are selected uniformly, this only changes the number of samples of the learned distributions
+	if (GUIDING && rnd.randomFloat() < g_GuidingStoreProbability)
+	{
+		//train with the radiance arriving at each vertex from the sampled direction, weighted by the inverse sampling pdf
+		for (int i = 0; i < numGuidingVertices; i++)
+		{
+			const GuidingVertex& v = guidingVertices[i];
+			float throughput = v.cf.avg();
+			float Li = throughput > 0 ? (cl - v.cl).avg() / throughput : 0.0f;
+			if (Li > 0 && Li < FLT_MAX)
+				g_GuidingBuffer->StoreEntry(v.p, VEC<float, 2>() % v.dir.x % v.dir.y, Li / v.pdf);
+		}
+	}
 	return cl;
 }
 
@@ -121,8 +259,9 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTraceRegularization(NormalizedT<
 	int depth = 0;
 	bool specularBounce = false;
 	BSDFSamplingRecord bRec;
+	bRec.sampleHero(rnd);
 	//bool hadDelta = false;
-	while (traceRay(r.dir(), r.ori(), &r2) && depth++ < maxPathLength)
+	while (traceRay(r.dir(), r.ori(), &r2, r.time()) && depth++ < maxPathLength)
 	{
 		r2.getBsdfSample(r, bRec, ETransportMode::ERadiance);// return (Spectrum(bRec.map.sys.n) + Spectrum(1)) / 2.0f; //return bRec.map.sys.n;
 		if (depth == 1)
@@ -140,7 +279,7 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTraceRegularization(NormalizedT<
 				Light* l = (Light*)pRec.object;
 				float lDist = distance(pRec.p, bRec.dg.P);
 				Vec3f lDir = (pRec.p - bRec.dg.P) / lDist;
-				if (!(l->Is<DiffuseLight>() || l->Is<InfiniteLight>()) && !g_SceneData.Occluded(Ray(bRec.dg.P, lDir), 0, lDist))
+				if (!(l->Is<DiffuseLight>() || l->Is<InfiniteLight>()) && !g_SceneData.Occluded(Ray(bRec.dg.P, lDir, r.time()), 0, lDist))
 				{
 					float eps = atanf(g_fRMollifier / lDist);
 					float normalization = 1.0f / (2 * PI * (1 - cosf(eps)));
@@ -159,7 +298,7 @@ template<bool DIRECT> CUDA_FUNC_IN Spectrum PathTraceRegularization(NormalizedT<
 				cf = cf / cf.max();
 			else break;
 		}
-		r = NormalizedT<Ray>(bRec.dg.P, bRec.getOutgoing());
+		r = NormalizedT<Ray>(bRec.dg.P, bRec.getOutgoing(), r.time());
 		r2.Init();
 	}
 	//return hadDelta ? Spectrum(1, 0, 0) : Spectrum(0.0f);
@@ -176,19 +315,22 @@ void PathTracer::DebugInternal(Image* I, const Vec2i& p)
 	NormalizedT<Ray> r, rX, rY;
 	Spectrum throughput = g_SceneData.sampleSensorRay(r, rX, rY, Vec2f((float)p.x, (float)p.y), rng.randomFloat2());
 	int maxPathLength = m_sParameters.getValue(KEY_MaxPathLength()), rrStart = m_sParameters.getValue(KEY_RRStartDepth());
-	PathTrace<true>(r, rX, rY, rng, maxPathLength, rrStart);
+	PathTrace<true, false>(r, rX, rY, rng, maxPathLength, rrStart, 0.0f);
 }
 
-template<bool DIRECT, bool REGU> __global__ void pathKernel2(unsigned int w, unsigned int h, unsigned int xoff, unsigned int yoff, Image img, float m, int maxPathLength, int rrStart)
+template<bool DIRECT, bool REGU, bool GUIDING> __global__ void pathKernel2(unsigned int w, unsigned int h, unsigned int xoff, unsigned int yoff, Image img, float m, int maxPathLength, int rrStart, float guidingFraction)
 {
 	Vec2i pixel = TracerBase::getPixelPos(xoff, yoff);
 	auto rng = g_SamplerData(TracerBase::getPixelIndex(xoff, yoff, w, h));
-	if (pixel.x < w && pixel.y < h)
+	if (pixel.x < w && pixel.y < h && !g_ConvergenceMask.isConverged(pixel.x, pixel.y))
 	{
 		NormalizedT<Ray> r, rX, rY;
 		Vec2f pX = Vec2f(pixel.x, pixel.y) + rng.randomFloat2();
 		Spectrum imp = g_SceneData.sampleSensorRay(r, rX, rY, pX, rng.randomFloat2());
-		Spectrum col = imp * (REGU ? PathTraceRegularization<DIRECT>(r, rX, rY, rng, m, maxPathLength, rrStart) : PathTrace<DIRECT>(r, rX, rY, rng, maxPathLength, rrStart));
+		//only consume a dimension for the shutter time when there is something moving
+		if (g_SceneData.m_sSceneBVH.m_uNumMovingNodes)
+			r.time() = rX.time() = rY.time() = rng.randomFloat();
+		Spectrum col = imp * (REGU ? PathTraceRegularization<DIRECT>(r, rX, rY, rng, m, maxPathLength, rrStart) : PathTrace<DIRECT, GUIDING>(r, rX, rY, rng, maxPathLength, rrStart, guidingFraction));
 		img.AddSample(pX.x, pX.y, col);
 	}
 }
@@ -201,19 +343,102 @@ void PathTracer::RenderBlock(Image* I, int x, int y, int blockW, int blockH)
 	float radius2 = math::pow(math::pow(m_fInitialRadius, float(2)) / math::pow(float(m_uPassesDone), 0.5f * (1 - ALPHA)), 1.0f / 2.0f);
 
 	int maxPathLength = m_sParameters.getValue(KEY_MaxPathLength()), rrStart = m_sParameters.getValue(KEY_RRStartDepth());
+	float guidingFraction = m_sParameters.getValue(KEY_GuidingFraction());
 
 	if (m_sParameters.getValue(KEY_Regularization()))
 	{
 		if (m_sParameters.getValue(KEY_Direct()))
-			pathKernel2<true, true> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart);
-		else pathKernel2<false, true> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart);
+			pathKernel2<true, true, false> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart, guidingFraction);
+		else pathKernel2<false, true, false> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart, guidingFraction);
+	}
+	else if (m_pGuidingBuffer && m_sParameters.getValue(KEY_Guiding()))
+	{
+		if (m_sParameters.getValue(KEY_Direct()))
+			pathKernel2<true, false, true> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart, guidingFraction);
+		else pathKernel2<false, false, true> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart, guidingFraction);
 	}
 	else
 	{
 		if (m_sParameters.getValue(KEY_Direct()))
-			pathKernel2<true, false> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart);
-		else pathKernel2<false, false> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart);
+			pathKernel2<true, false, false> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart, guidingFraction);
+		else pathKernel2<false, false, false> << <BLOCK_SAMPLER_LAUNCH_CONFIG >> > (w, h, x, y, *I, radius2, maxPathLength, rrStart, guidingFraction);
+	}
+}
+
+void PathTracer::DoRender(Image* I)
+{
+	if (!m_sParameters.getValue(KEY_Guiding()) || m_sParameters.getValue(KEY_Regularization()))
+	{
+		Tracer<true>::DoRender(I);
+		return;
+	}
+
+	if (!m_pGuidingBuffer)
+	{
+		//the buffer is reset after each training step, the first pass assumes that every path stores GUIDING_MAX_VERTICES
+		auto range_min = VEC<float, 2>() % 0.0f % 0.0f, range_max = VEC<float, 2>() % 1.0f % 1.0f;
+		m_pGuidingBuffer = new GuidingBuffer(Vec3u(32), min(w * h * GUIDING_MAX_VERTICES, (unsigned int)GUIDING_MAX_ENTRIES), range_min, range_max);
+		m_pGuidingBuffer->SetGridDimensions(m_pScene->getSceneBox());
+		m_fGuidingStoreProbability = math::clamp01(float(m_pGuidingBuffer->getNumEntries()) / (w * h * GUIDING_MAX_VERTICES));
+	}
+
+	{
+		PROFILE_ZONE("PathTracer", "Trace Paths");
+		CopyToSymbol(g_GuidingBuffer, *m_pGuidingBuffer);
+		CopyToSymbol(g_GuidingStoreProbability, m_fGuidingStoreProbability);
+		Tracer<true>::DoRender(I);
+		CopyFromSymbol(*m_pGuidingBuffer, g_GuidingBuffer);
+		m_pGuidingBuffer->setOnGPU();
+	}
+	{
+		PROFILE_ZONE("PathTracer", "Train Guiding");
+		//select as many paths in the next pass as fit into the buffer, the margin accounts for the variation between passes
+		unsigned int numStored = m_pGuidingBuffer->getNumStoredEntries();
+		if (numStored)
+			m_fGuidingStoreProbability = math::clamp01(0.9f * m_fGuidingStoreProbability * m_pGuidingBuffer->getNumEntries() / numStored);
+		m_pGuidingBuffer->UpdateMixtureModels();
+		ThrowCudaErrors(cudaDeviceSynchronize());
+	}
+}
+
+void PathTracer::StartNewTrace(Image* I)
+{
+	Tracer<true>::StartNewTrace(I);
+	//the learned distributions are only valid for the scene they were trained on
+	if (m_pGuidingBuffer)
+	{
+		m_pGuidingBuffer->SetGridDimensions(m_pScene->getSceneBox());
+		m_pGuidingBuffer->ResetBuffer();
+		m_fGuidingStoreProbability = math::clamp01(float(m_pGuidingBuffer->getNumEntries()) / (w * h * GUIDING_MAX_VERTICES));
+	}
+}
+
+void PathTracer::Resize(unsigned int _w, unsigned int _h)
+{
+	Tracer<true>::Resize(_w, _h);
+	//the buffer is created with the new size in DoRender
+	FreeGuidingBuffer();
+}
+
+void PathTracer::PrintStatus(std::vector<std::string>& a_Buf) const
+{
+	if (m_pGuidingBuffer)
+		a_Buf.push_back(Profiler::getInstance().ToString("PathTracer"));
+}
+
+void PathTracer::FreeGuidingBuffer()
+{
+	if (m_pGuidingBuffer)
+	{
+		m_pGuidingBuffer->Free();
+		delete m_pGuidingBuffer;
 	}
+	m_pGuidingBuffer = 0;
+}
+
+PathTracer::~PathTracer()
+{
+	FreeGuidingBuffer();
 }
 
 }
\ No newline at end of file
@@ -4,23 +4,46 @@
 
 namespace CudaTracerLib {
 
+template<int D, typename Model> class GridModelBuffer;
+template<int D, int K> struct OnlineEMGaussianMixtureModel;
+
 class PathTracer : public Tracer<true>
 {
 public:
+	//the incident radiance of each cell is learned as a mixture over (cos theta, phi) in world space
+	typedef OnlineEMGaussianMixtureModel<2, 4> GuidingModel;
+	typedef GridModelBuffer<2, GuidingModel> GuidingBuffer;
+
 	PARAMETER_KEY(bool, Direct)
 	PARAMETER_KEY(bool, Regularization)
 	PARAMETER_KEY(int, MaxPathLength)
 	PARAMETER_KEY(int, RRStartDepth)
+	PARAMETER_KEY(bool, Guiding)
+	PARAMETER_KEY(float, GuidingFraction)
 	PathTracer()
+		: m_pGuidingBuffer(0), m_fGuidingStoreProbability(1.0f)
 	{
 		m_sParameters << KEY_Direct()				<< CreateSetBool(true)
 					  << KEY_Regularization()		<< CreateSetBool(false)
 					  << KEY_MaxPathLength()		<< CreateInterval<int>(50, 1, INT_MAX)
-					  << KEY_RRStartDepth()			<< CreateInterval(5, 1, INT_MAX);
+					  << KEY_RRStartDepth()			<< CreateInterval(5, 1, INT_MAX)
+					  << KEY_Guiding()				<< CreateSetBool(false)
+					  << KEY_GuidingFraction()		<< CreateInterval(0.5f, 0.0f, 1.0f);
 	}
+	CTL_EXPORT virtual ~PathTracer();
+	CTL_EXPORT virtual void Resize(unsigned int _w, unsigned int _h);
+	CTL_EXPORT virtual void PrintStatus(std::vector<std::string>& a_Buf) const;
 protected:
+	CTL_EXPORT virtual void DoRender(Image* I);
+	CTL_EXPORT virtual void StartNewTrace(Image* I);
 	CTL_EXPORT virtual void RenderBlock(Image* I, int x, int y, int blockW, int blockH);
 	CTL_EXPORT virtual void DebugInternal(Image* I, const Vec2i& pixel);
+private:
+	//created on the first pass with guiding enabled, the models are trained after every pass
+	GuidingBuffer* m_pGuidingBuffer;
+	//fraction of the paths whose vertices are stored for training, adapted after every pass to fill the buffer
+	float m_fGuidingStoreProbability;
+	CTL_EXPORT void FreeGuidingBuffer();
 };
 
 }
\ No newline at end of file
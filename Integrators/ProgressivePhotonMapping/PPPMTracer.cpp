@@ -1,7 +1,7 @@
 #include <StdAfx.h>
 #include <Base/Buffer.h>
 #include "PPPMTracer.h"
-#include <Base/Timer.h>
+#include <Base/Profiler.h>
 #include <Engine/DynamicScene.h>
 #include <SceneTypes/Node.h>
 #include <Engine/Mesh.h>
@@ -37,6 +37,8 @@ PPPMTracer::PPPMTracer()
 
 	m_uTotalPhotonsEmittedSurface = m_uTotalPhotonsEmittedVolume = -1;
 	unsigned int numPhotons = (m_uBlocksPerLaunch + 2) * PPM_slots_per_block;
+	m_sSurfaceMap.setMemoryTag(MEMORY_TAG_PHOTON_MAPS);
+	CudaMemoryTagScope tag(MEMORY_TAG_PHOTON_MAPS);
 	if (m_sParameters.getValue(KEY_N_FG_Samples()) != 0)
 		m_sSurfaceMapCaustic = new SurfaceMapT(Vec3u(250), numPhotons);
 	m_pVolumeEstimator = new PointStorage(150, numPhotons);
@@ -68,7 +70,7 @@ PPPMTracer::~PPPMTracer()
 
 void PPPMTracer::PrintStatus(std::vector<std::string>& a_Buf) const
 {
-	a_Buf.push_back(GET_PERF_BLOCKS().ToString());
+	a_Buf.push_back(Profiler::getInstance().ToString("PPPM"));
 	auto radParaSurf = ((EnumTracerParameter<PPM_Radius_Type>*)m_sParameters.operator[](KEY_RadiiComputationTypeSurf().name));
 	a_Buf.push_back("Surf Radius Scheme : " + radParaSurf->getStringValue());
 	auto radParaVol = ((EnumTracerParameter<PPM_Radius_Type>*)m_sParameters.operator[](KEY_RadiiComputationTypeVol().name));
@@ -98,18 +100,19 @@ void PPPMTracer::Resize(unsigned int _w, unsigned int _h)
 		delete m_pPixelBuffer;
 	}
 	m_pPixelBuffer = new SynchronizedBuffer<APPM_PixelData>(_w * _h);
+	m_pPixelBuffer->setMemoryTag(MEMORY_TAG_FRAMEBUFFERS);
 }
 
 void PPPMTracer::DoRender(Image* I)
 {
 	{
-		auto timer = START_PERF_BLOCK("Photon Pass");
+		PROFILE_ZONE("PPPM", "Photon Pass");
 		doPhotonPass(I);
 	}
 	m_uTotalPhotonsEmittedSurface += m_uPhotonEmittedPassSurface;
 	m_uTotalPhotonsEmittedVolume += m_uPhotonEmittedPassVolume;
 	{
-		auto timer = START_PERF_BLOCK("Camera Pass");
+		PROFILE_ZONE("PPPM", "Camera Pass");
 		Tracer<true>::DoRender(I);
 	}
 }
@@ -177,11 +180,48 @@ void PPPMTracer::StartNewTrace(Image* I)
 	if (m_sParameters.getValue(KEY_N_FG_Samples()) != 0)
 	{
 		if(!m_sSurfaceMapCaustic)
+		{
+			CudaMemoryTagScope tag(MEMORY_TAG_PHOTON_MAPS);
 			m_sSurfaceMapCaustic = new SurfaceMapT(Vec3u(250), m_sSurfaceMap.getNumEntries());
+		}
 		m_sSurfaceMapCaustic->SetGridDimensions(m_boxSurf);
 	}
 	m_pVolumeEstimator->StartNewRenderingBase(m_fInitialRadiusSurf, m_fInitialRadiusVol);
 	m_pVolumeEstimator->StartNewRendering(m_boxVol);
 }
 
+void PPPMTracer::SaveCheckpoint(Image* I, RenderCheckpoint& checkpoint)
+{
+	Tracer<true>::SaveCheckpoint(I, checkpoint);
+	checkpoint.WriteValue("PPPM.InitialRadiusSurf", m_fInitialRadiusSurf);
+	checkpoint.WriteValue("PPPM.InitialRadiusVol", m_fInitialRadiusVol);
+	checkpoint.WriteValue("PPPM.BoxSurf", m_boxSurf);
+	checkpoint.WriteValue("PPPM.BoxVol", m_boxVol);
+	checkpoint.WriteValue("PPPM.PhotonsEmittedPassSurface", m_uPhotonEmittedPassSurface);
+	checkpoint.WriteValue("PPPM.PhotonsEmittedPassVolume", m_uPhotonEmittedPassVolume);
+	checkpoint.WriteValue("PPPM.TotalPhotonsEmittedSurface", m_uTotalPhotonsEmittedSurface);
+	checkpoint.WriteValue("PPPM.TotalPhotonsEmittedVolume", m_uTotalPhotonsEmittedVolume);
+	checkpoint.WriteBuffer("PPPM.PixelData", *m_pPixelBuffer);
+}
+
+void PPPMTracer::RestoreCheckpoint(Image* I, const RenderCheckpoint& checkpoint)
+{
+	Tracer<true>::RestoreCheckpoint(I, checkpoint);
+	checkpoint.ReadValue("PPPM.InitialRadiusSurf", m_fInitialRadiusSurf);
+	checkpoint.ReadValue("PPPM.InitialRadiusVol", m_fInitialRadiusVol);
+	checkpoint.ReadValue("PPPM.BoxSurf", m_boxSurf);
+	checkpoint.ReadValue("PPPM.BoxVol", m_boxVol);
+	checkpoint.ReadValue("PPPM.PhotonsEmittedPassSurface", m_uPhotonEmittedPassSurface);
+	checkpoint.ReadValue("PPPM.PhotonsEmittedPassVolume", m_uPhotonEmittedPassVolume);
+	checkpoint.ReadValue("PPPM.TotalPhotonsEmittedSurface", m_uTotalPhotonsEmittedSurface);
+	checkpoint.ReadValue("PPPM.TotalPhotonsEmittedVolume", m_uTotalPhotonsEmittedVolume);
+	checkpoint.ReadBuffer("PPPM.PixelData", *m_pPixelBuffer);
+	//the eye hit point box is estimated stochastically, the photon maps have to use the one of the checkpoint
+	m_sSurfaceMap.SetGridDimensions(m_boxSurf);
+	if (m_sSurfaceMapCaustic)
+		m_sSurfaceMapCaustic->SetGridDimensions(m_boxSurf);
+	m_pVolumeEstimator->StartNewRenderingBase(m_fInitialRadiusSurf, m_fInitialRadiusVol);
+	m_pVolumeEstimator->StartNewRendering(m_boxVol);
+}
+
 }
\ No newline at end of file
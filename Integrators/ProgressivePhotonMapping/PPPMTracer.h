@@ -181,6 +181,7 @@ public:
 	CTL_EXPORT virtual ~PPPMTracer();
 	CTL_EXPORT virtual void Resize(unsigned int _w, unsigned int _h);
 	CTL_EXPORT virtual void PrintStatus(std::vector<std::string>& a_Buf) const;
+	CTL_EXPORT virtual void SaveCheckpoint(Image* I, RenderCheckpoint& checkpoint);
 	void getStartRadii(float& radSurf, float& radVol) const
 	{
 		radSurf = m_fInitialRadiusSurf;
@@ -203,6 +204,7 @@ public:
 protected:
 	CTL_EXPORT virtual void DoRender(Image* I);
 	CTL_EXPORT virtual void StartNewTrace(Image* I);
+	CTL_EXPORT virtual void RestoreCheckpoint(Image* I, const RenderCheckpoint& checkpoint);
 	CTL_EXPORT virtual void RenderBlock(Image* I, int x, int y, int blockW, int blockH);
 private:
 	CTL_EXPORT void doPhotonPass(Image* I);
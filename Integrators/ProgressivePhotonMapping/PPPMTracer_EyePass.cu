@@ -43,7 +43,7 @@ template<typename VolEstimator>  __global__ void k_EyePass(Vec2i off, int w, int
 {
 	BSDFSamplingRecord bRec;
 	Vec2i pixel = TracerBase::getPixelPos(off.x, off.y);
-	if (pixel.x < w && pixel.y < h)
+	if (pixel.x < w && pixel.y < h && !g_ConvergenceMask.isConverged(pixel.x, pixel.y))
 	{
 		auto rng = g_SamplerData(TracerBase::getPixelIndex(off.x, off.y, w, h));
 		auto adp_ent = a_AdpEntries(pixel.x, pixel.y);
@@ -2,7 +2,7 @@
 #include <Kernel/TraceHelper.h>
 #include <Kernel/TraceAlgorithms.h>
 #include <Math/half.h>
-#include <Base/Timer.h>
+#include <Base/Profiler.h>
 #include <Kernel/ParticleProcess.h>
 
 namespace CudaTracerLib {
@@ -170,21 +170,24 @@ void PPPMTracer::doPhotonPass(Image* I)
 	para.DIRECT = g_ParametersHost.DIRECT;
 	ThrowCudaErrors(cudaMemcpyToSymbol(g_ParametersDevice, &para, sizeof(para)));
 
-	while (!m_sSurfaceMap.isFull() && !m_pVolumeEstimator->isFull())
 	{
-		if (dynamic_cast<BeamGrid*>(m_pVolumeEstimator))
-			k_PhotonPass<BeamGrid> << < m_uBlocksPerLaunch, dim3(PPM_BlockX, PPM_BlockY, 1) >> >(PPM_Photons_Per_Thread, *I);
-		else if(dynamic_cast<PointStorage*>(m_pVolumeEstimator))
-			k_PhotonPass<PointStorage> << < m_uBlocksPerLaunch, dim3(PPM_BlockX, PPM_BlockY, 1) >> >(PPM_Photons_Per_Thread, *I);
-		else if (dynamic_cast<BeamBeamGrid*>(m_pVolumeEstimator))
-			k_PhotonPass<BeamBeamGrid> << < m_uBlocksPerLaunch, dim3(PPM_BlockX, PPM_BlockY, 1) >> >(PPM_Photons_Per_Thread, *I);
-
-		ThrowCudaErrors(cudaMemcpyFromSymbol(&m_sSurfaceMap, g_SurfaceMap, sizeof(m_sSurfaceMap)));
-		if (finalGathering)
-			ThrowCudaErrors(cudaMemcpyFromSymbol(m_sSurfaceMapCaustic, g_SurfaceMapCaustic, sizeof(*m_sSurfaceMapCaustic)));
-		ThrowCudaErrors(cudaMemcpyFromSymbol(m_pVolumeEstimator, g_VolEstimator, m_pVolumeEstimator->getSize()));
-
-		generateNewRandomSequences();
+		PROFILE_ZONE("PPPM", "Trace Photons");
+		while (!m_sSurfaceMap.isFull() && !m_pVolumeEstimator->isFull())
+		{
+			if (dynamic_cast<BeamGrid*>(m_pVolumeEstimator))
+				k_PhotonPass<BeamGrid> << < m_uBlocksPerLaunch, dim3(PPM_BlockX, PPM_BlockY, 1) >> >(PPM_Photons_Per_Thread, *I);
+			else if(dynamic_cast<PointStorage*>(m_pVolumeEstimator))
+				k_PhotonPass<PointStorage> << < m_uBlocksPerLaunch, dim3(PPM_BlockX, PPM_BlockY, 1) >> >(PPM_Photons_Per_Thread, *I);
+			else if (dynamic_cast<BeamBeamGrid*>(m_pVolumeEstimator))
+				k_PhotonPass<BeamBeamGrid> << < m_uBlocksPerLaunch, dim3(PPM_BlockX, PPM_BlockY, 1) >> >(PPM_Photons_Per_Thread, *I);
+
+			ThrowCudaErrors(cudaMemcpyFromSymbol(&m_sSurfaceMap, g_SurfaceMap, sizeof(m_sSurfaceMap)));
+			if (finalGathering)
+				ThrowCudaErrors(cudaMemcpyFromSymbol(m_sSurfaceMapCaustic, g_SurfaceMapCaustic, sizeof(*m_sSurfaceMapCaustic)));
+			ThrowCudaErrors(cudaMemcpyFromSymbol(m_pVolumeEstimator, g_VolEstimator, m_pVolumeEstimator->getSize()));
+
+			generateNewRandomSequences();
+		}
 	}
 	ThrowCudaErrors(cudaMemcpyFromSymbol(&m_uPhotonEmittedPassSurface, g_NumPhotonEmittedSurface, sizeof(m_uPhotonEmittedPassSurface)));
 	ThrowCudaErrors(cudaMemcpyFromSymbol(&m_uPhotonEmittedPassVolume, g_NumPhotonEmittedVolume, sizeof(m_uPhotonEmittedPassVolume)));
@@ -193,10 +196,13 @@ void PPPMTracer::doPhotonPass(Image* I)
 		m_sSurfaceMapCaustic->setOnGPU();
 	m_pVolumeEstimator->setOnGPU();
 
-	m_pVolumeEstimator->PrepareForRendering();
-	m_sSurfaceMap.PrepareForUse();
-	if (finalGathering)
-		m_sSurfaceMapCaustic->PrepareForUse();
+	{
+		PROFILE_ZONE("PPPM", "Build Photon Maps");
+		m_pVolumeEstimator->PrepareForRendering();
+		m_sSurfaceMap.PrepareForUse();
+		if (finalGathering)
+			m_sSurfaceMapCaustic->PrepareForUse();
+	}
 	size_t volLength, volCount;
 	m_pVolumeEstimator->getStatusInfo(volLength, volCount);
 	if (m_sParameters.getValue(KEY_AdaptiveAccProb()))
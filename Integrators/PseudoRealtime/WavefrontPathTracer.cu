@@ -5,188 +5,302 @@
 
 namespace CudaTracerLib {
 
-enum
-{
-	MaxBlockHeight = 6,
-};
-
-CUDA_DEVICE int g_NextRayCounterWPT;
 CUDA_DEVICE CudaStaticWrapper<WavefrontPathTracerBuffer> g_ray_buffer;
 CUDA_DEVICE DeviceDepthImage g_DepthImageWPT;
 
-__global__ void pathCreateKernelWPT(unsigned int w, unsigned int h, BlockSamplerBuffer blockBuf)
+//starts the camera paths of the pixels [pixelStart, pixelEnd), the caller ensures that the buffer has enough free slots
+__global__ void pathCreateKernelWPT(unsigned int w, unsigned int pixelStart, unsigned int pixelEnd, BlockSamplerBuffer blockBuf)
 {
-	__shared__ volatile int nextRayArray[MaxBlockHeight];
-	const int tidx = threadIdx.x;
-	volatile int& rayBase = nextRayArray[threadIdx.y];
-	do
-	{
-		if (tidx == 0)
-			rayBase = atomicAdd(&g_NextRayCounterWPT, blockDim.x);
+	unsigned int rayidx = pixelStart + blockIdx.x * blockDim.x + threadIdx.x;
+	if (rayidx >= pixelEnd)
+		return;
 
-		int rayidx = rayBase + tidx;
-		if (rayidx >= w * h)
-			break;
+	unsigned int x = rayidx % w, y = rayidx / w;
+	unsigned int numSamples = blockBuf.getNumSamplesPerPixel(x, y);
+	auto rng = g_SamplerData(rayidx);
 
-		int x = rayidx % w, y = rayidx / w;
-		unsigned int numSamples = blockBuf.getNumSamplesPerPixel(x, y);
-		auto rng = g_SamplerData(rayidx);
-
-		for (unsigned int i = 0; i < numSamples; i++)
-		{
-			NormalizedT<Ray> r;
-			Spectrum W = g_SceneData.sampleSensorRay(r, Vec2f(x, y) + rng.randomFloat2(), rng.randomFloat2());
-			WavefrontPTRayData dat;
-			dat.x = half((float)x);
-			dat.y = half((float)y);
-			dat.throughput = W;
-			dat.L = Spectrum(0.0f);
-			dat.dIdx = UINT_MAX;
-			dat.specular_bounce = true;
-			g_ray_buffer->insertPayloadElement(dat, r);
-		}
-	} while (true);
+	for (unsigned int i = 0; i < numSamples; i++)
+	{
+		NormalizedT<Ray> r;
+		Spectrum W = g_SceneData.sampleSensorRay(r, Vec2f(x, y) + rng.randomFloat2(), rng.randomFloat2());
+		WavefrontPTRayData dat;
+		dat.x = half((float)x);
+		dat.y = half((float)y);
+		dat.throughput = W;
+		dat.L = Spectrum(0.0f);
+		dat.dIdx = UINT_MAX;
+		dat.specular_bounce = true;
+		dat.depth = 0;
+		g_ray_buffer->insertPayloadElement(dat, r);
+	}
 }
 
-template<bool NEXT_EVENT_EST> __global__ void pathIterateKernel(Image I, int pathDepth, int iterationIdx, int maxPathDepth, int RRStartDepth, bool depthImage)
+//the bsdf calls of the shading, void selects the type at runtime
+template<typename BSDF_TYPE> struct WPTBSDFCaller
 {
-	WavefrontPTRayData payload;
-	NormalizedT<Ray> ray;
-	TraceResult res;
-	unsigned int rayIdx;
-	while (g_ray_buffer->tryFetchPayloadElement(payload, ray, res, &rayIdx))
+	CUDA_FUNC_IN static Spectrum sample(const BSDFALL& bsdf, BSDFSamplingRecord& bRec, float& pdf, const Vec2f& sample)
 	{
-		auto rng = g_SamplerData(rayIdx);
-		rng.skip(iterationIdx + 2);//plus the camera sample
-
-		if (NEXT_EVENT_EST && pathDepth > 0 && payload.dIdx != UINT_MAX)
-		{
-			traversalRay shadow_ray;
-			traversalResult shadow_ray_res;
-			if (g_ray_buffer->accessSecondaryRay(payload.dIdx, shadow_ray, shadow_ray_res))
-			{
-				if (shadow_ray_res.dist >= payload.dDist * (1 - 0.01f))
-					payload.L += payload.directF;
-			}
-			payload.dIdx = UINT_MAX;
-			payload.directF = 0.0f;
-		}
+		return bsdf.sampleAs<BSDF_TYPE>(bRec, pdf, sample);
+	}
+	CUDA_FUNC_IN static Spectrum f(const BSDFALL& bsdf, const BSDFSamplingRecord& bRec)
+	{
+		return bsdf.fAs<BSDF_TYPE>(bRec);
+	}
+	CUDA_FUNC_IN static float pdf(const BSDFALL& bsdf, const BSDFSamplingRecord& bRec)
+	{
+		return bsdf.pdfAs<BSDF_TYPE>(bRec);
+	}
+};
 
-		if (pathDepth == 0 && depthImage)
-			g_DepthImageWPT.Store((int)payload.x.ToFloat(), (int)payload.y.ToFloat(), res.m_fDist);
+template<> struct WPTBSDFCaller<void>
+{
+	CUDA_FUNC_IN static Spectrum sample(const BSDFALL& bsdf, BSDFSamplingRecord& bRec, float& pdf, const Vec2f& sample)
+	{
+		return bsdf.sample(bRec, pdf, sample);
+	}
+	CUDA_FUNC_IN static Spectrum f(const BSDFALL& bsdf, const BSDFSamplingRecord& bRec)
+	{
+		return bsdf.f(bRec);
+	}
+	CUDA_FUNC_IN static float pdf(const BSDFALL& bsdf, const BSDFSamplingRecord& bRec)
+	{
+		return bsdf.pdf(bRec);
+	}
+};
 
-		//if true the contribution will be added at the end of the loop body
-		bool path_terminated = (pathDepth + 1 == maxPathDepth);
+template<bool NEXT_EVENT_EST, typename BSDF_TYPE> CUDA_DEVICE void shadePathElement(Image& I, WavefrontPTRayData& payload, const NormalizedT<Ray>& ray, TraceResult& res, unsigned int rayIdx, int iterationIdx, int maxPathDepth, int RRStartDepth, bool depthImage)
+{
+	int pathDepth = payload.depth;
+	auto rng = g_SamplerData(rayIdx);
+	rng.skip(iterationIdx + 2);//plus the camera sample
 
-		if (res.hasHit())
+	if (NEXT_EVENT_EST && pathDepth > 0 && payload.dIdx != UINT_MAX)
+	{
+		traversalRay shadow_ray;
+		traversalResult shadow_ray_res;
+		if (g_ray_buffer->accessSecondaryRay(payload.dIdx, shadow_ray, shadow_ray_res))
 		{
-			BSDFSamplingRecord bRec;
-			res.getBsdfSample(ray, bRec, ETransportMode::ERadiance);
-
-			//account for emission
-			if (res.LightIndex() != UINT_MAX)
-			{
-				float misWeight = 1.0f;
-				if (!NEXT_EVENT_EST || pathDepth == 0 || payload.specular_bounce)
-					misWeight = 1.0f;
-				else
-				{
-					DirectSamplingRecord dRec = DirectSamplingRecFromRay(ray, res.m_fDist, Uchar2ToNormalizedFloat3((unsigned short)payload.prev_normal), bRec.dg.P, bRec.dg.n);
-					auto* light = g_SceneData.getLight(res);
-					float direct_pdf = light->pdfDirect(dRec) * g_SceneData.pdfEmitter(light);
-					misWeight = MonteCarlo::PowerHeuristic(1, payload.bsdf_pdf, 1, direct_pdf);
-				}
-				payload.L += misWeight * res.Le(bRec.dg.P, bRec.dg.sys, -ray.dir()) * payload.throughput;
-			}
+			if (shadow_ray_res.dist >= payload.dDist * (1 - 0.01f))
+				payload.L += payload.directF;
+		}
+		payload.dIdx = UINT_MAX;
+		payload.directF = 0.0f;
+	}
 
-			//do russian roulette
-			bool surviveRR = true;
-			if (pathDepth >= RRStartDepth)
-			{
-				if (rng.randomFloat() < payload.throughput.max())
-					payload.throughput /= payload.throughput.max();
-				else surviveRR = false;
-			}
+	if (pathDepth == 0 && depthImage)
+		g_DepthImageWPT.Store((int)payload.x.ToFloat(), (int)payload.y.ToFloat(), res.m_fDist);
 
-			if (pathDepth + 1 != maxPathDepth && surviveRR)
-			{
-				Spectrum f = res.getMat().bsdf.sample(bRec, payload.bsdf_pdf, rng.randomFloat2());
-				payload.specular_bounce = (bRec.sampledType & EDelta) != 0;
-				auto r_refl = NormalizedT<Ray>(bRec.dg.P, bRec.getOutgoing());
+	//if true the contribution will be added at the end of the loop body
+	bool path_terminated = (pathDepth + 1 == maxPathDepth);
 
-				payload.dIdx = UINT_MAX;
-				if (NEXT_EVENT_EST && res.getMat().bsdf.hasComponent(ESmooth))
-				{
-					DirectSamplingRecord dRec(bRec.dg.P, bRec.dg.sys.n);
-					Spectrum value = g_SceneData.sampleEmitterDirect(dRec, rng.randomFloat2());
-					if (!value.isZero())
-					{
-						bRec.typeMask = EBSDFType(EAll & ~EDelta);
-						bRec.wo = bRec.dg.toLocal(dRec.d);
-						Spectrum bsdfVal = res.getMat().bsdf.f(bRec);
-						const float bsdfPdf = res.getMat().bsdf.pdf(bRec);
-						const float directPdf = dRec.measure == EArea ? PdfAtoW(dRec.pdf, dRec.dist, dot(dRec.n, dRec.d)) : dRec.pdf;
-						const float weight = MonteCarlo::PowerHeuristic(1, directPdf, 1, bsdfPdf);
-						payload.directF = payload.throughput * value * bsdfVal * weight;
-						payload.dDist = dRec.dist;
-						if (!g_ray_buffer->insertSecondaryRay(NormalizedT<Ray>(bRec.dg.P, dRec.d), payload.dIdx))
-							payload.dIdx = UINT_MAX;
-					}
-				}
+	if (res.hasHit())
+	{
+		BSDFSamplingRecord bRec;
+		res.getBsdfSample(ray, bRec, ETransportMode::ERadiance);
 
-				payload.prev_normal = NormalizedFloat3ToUchar2(bRec.dg.sys.n);
-				payload.throughput *= f;
-				g_ray_buffer->insertPayloadElement(payload, r_refl);
-			}
-			else path_terminated = true;
-		}
-		else
+		//account for emission
+		if (res.LightIndex() != UINT_MAX)
 		{
-			path_terminated = true;
 			float misWeight = 1.0f;
 			if (!NEXT_EVENT_EST || pathDepth == 0 || payload.specular_bounce)
 				misWeight = 1.0f;
-			else if(g_SceneData.getEnvironmentMap() != 0)
+			else
 			{
-				DirectSamplingRecord dRec = DirectSamplingRecFromRay(ray, res.m_fDist, Uchar2ToNormalizedFloat3((unsigned short)payload.prev_normal), Vec3f(), NormalizedT<Vec3f>());
-				auto* light = g_SceneData.getEnvironmentMap();
+				DirectSamplingRecord dRec = DirectSamplingRecFromRay(ray, res.m_fDist, Uchar2ToNormalizedFloat3((unsigned short)payload.prev_normal), bRec.dg.P, bRec.dg.n);
+				auto* light = g_SceneData.getLight(res);
 				float direct_pdf = light->pdfDirect(dRec) * g_SceneData.pdfEmitter(light);
 				misWeight = MonteCarlo::PowerHeuristic(1, payload.bsdf_pdf, 1, direct_pdf);
 			}
-			payload.L += misWeight * payload.throughput * g_SceneData.EvalEnvironment(ray);
+			payload.L += misWeight * res.Le(bRec.dg.P, bRec.dg.sys, -ray.dir()) * payload.throughput;
 		}
 
-		if (path_terminated)
+		//do russian roulette
+		bool surviveRR = true;
+		if (pathDepth >= RRStartDepth)
 		{
-			I.AddSample(payload.x.ToFloat(), payload.y.ToFloat(), payload.L);
+			if (rng.randomFloat() < payload.throughput.max())
+				payload.throughput /= payload.throughput.max();
+			else surviveRR = false;
 		}
+
+		if (pathDepth + 1 != maxPathDepth && surviveRR)
+		{
+			Spectrum f = WPTBSDFCaller<BSDF_TYPE>::sample(res.getMat().bsdf, bRec, payload.bsdf_pdf, rng.randomFloat2());
+			payload.specular_bounce = (bRec.sampledType & EDelta) != 0;
+			auto r_refl = NormalizedT<Ray>(bRec.dg.P, bRec.getOutgoing());
+
+			payload.dIdx = UINT_MAX;
+			if (NEXT_EVENT_EST && res.getMat().bsdf.hasComponent(ESmooth))
+			{
+				DirectSamplingRecord dRec(bRec.dg.P, bRec.dg.sys.n);
+				Spectrum value = g_SceneData.sampleEmitterDirect(dRec, rng.randomFloat2());
+				if (!value.isZero())
+				{
+					bRec.typeMask = EBSDFType(EAll & ~EDelta);
+					bRec.wo = bRec.dg.toLocal(dRec.d);
+					Spectrum bsdfVal = WPTBSDFCaller<BSDF_TYPE>::f(res.getMat().bsdf, bRec);
+					const float bsdfPdf = WPTBSDFCaller<BSDF_TYPE>::pdf(res.getMat().bsdf, bRec);
+					const float directPdf = dRec.measure == EArea ? PdfAtoW(dRec.pdf, dRec.dist, dot(dRec.n, dRec.d)) : dRec.pdf;
+					const float weight = MonteCarlo::PowerHeuristic(1, directPdf, 1, bsdfPdf);
+					payload.directF = payload.throughput * value * bsdfVal * weight;
+					payload.dDist = dRec.dist;
+					if (!g_ray_buffer->insertSecondaryRay(NormalizedT<Ray>(bRec.dg.P, dRec.d), payload.dIdx))
+						payload.dIdx = UINT_MAX;
+				}
+			}
+
+			payload.prev_normal = NormalizedFloat3ToUchar2(bRec.dg.sys.n);
+			payload.throughput *= f;
+			payload.depth++;
+			g_ray_buffer->insertPayloadElement(payload, r_refl);
+		}
+		else path_terminated = true;
+	}
+	else
+	{
+		path_terminated = true;
+		float misWeight = 1.0f;
+		if (!NEXT_EVENT_EST || pathDepth == 0 || payload.specular_bounce)
+			misWeight = 1.0f;
+		else if(g_SceneData.getEnvironmentMap() != 0)
+		{
+			DirectSamplingRecord dRec = DirectSamplingRecFromRay(ray, res.m_fDist, Uchar2ToNormalizedFloat3((unsigned short)payload.prev_normal), Vec3f(), NormalizedT<Vec3f>());
+			auto* light = g_SceneData.getEnvironmentMap();
+			float direct_pdf = light->pdfDirect(dRec) * g_SceneData.pdfEmitter(light);
+			misWeight = MonteCarlo::PowerHeuristic(1, payload.bsdf_pdf, 1, direct_pdf);
+		}
+		payload.L += misWeight * payload.throughput * g_SceneData.EvalEnvironment(ray);
+	}
+
+	if (path_terminated)
+	{
+		I.AddSample(payload.x.ToFloat(), payload.y.ToFloat(), payload.L);
 	}
 }
 
+template<bool NEXT_EVENT_EST> __global__ void pathIterateKernel(Image I, int iterationIdx, int maxPathDepth, int RRStartDepth, bool depthImage)
+{
+	WavefrontPTRayData payload;
+	NormalizedT<Ray> ray;
+	TraceResult res;
+	unsigned int rayIdx;
+	while (g_ray_buffer->tryFetchPayloadElement(payload, ray, res, &rayIdx))
+		shadePathElement<NEXT_EVENT_EST, void>(I, payload, ray, res, rayIdx, iterationIdx, maxPathDepth, RRStartDepth, depthImage);
+}
+
+//bins the hits by the type of the bsdf, misses and hits without a bsdf use the last bin
+__global__ void computeMaterialKeysWPT()
+{
+	unsigned int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	WavefrontPTRayData payload;
+	traversalRay ray;
+	traversalResult res;
+	if (g_ray_buffer->accessPayloadElement(idx, payload, ray, res))
+	{
+		TraceResult r;
+		res.toResult(&r, g_SceneData);
+		g_ray_buffer->setSortKey(idx, r.hasHit() ? r.getMat().bsdf.getTypeIndex() : (unsigned int)BSDFALL::NUM_TYPES);
+	}
+}
+
+//shades the sorted elements [binStart, binEnd) which all have a bsdf of type BSDF_TYPE
+template<bool NEXT_EVENT_EST, typename BSDF_TYPE> __global__ void pathShadeBinKernel(Image I, unsigned int binStart, unsigned int binEnd, int iterationIdx, int maxPathDepth, int RRStartDepth, bool depthImage)
+{
+	WavefrontPTRayData payload;
+	NormalizedT<Ray> ray;
+	TraceResult res;
+	for (unsigned int idx = binStart + blockIdx.x * blockDim.x + threadIdx.x; idx < binEnd; idx += gridDim.x * blockDim.x)
+		if (g_ray_buffer->accessPayloadElement(idx, payload, ray, res))
+			shadePathElement<NEXT_EVENT_EST, BSDF_TYPE>(I, payload, ray, res, idx, iterationIdx, maxPathDepth, RRStartDepth, depthImage);
+}
+
+template<bool NEXT_EVENT_EST, typename BSDF_TYPE> static void launchShadeBin(Image* I, const std::vector<unsigned int>& binOffsets, unsigned int bin, int iterationIdx, int maxPathDepth, int RRStartDepth, bool depthImage)
+{
+	unsigned int start = binOffsets[bin], end = binOffsets[bin + 1];
+	if (start == end)
+		return;
+	const unsigned int block = 192, maxBlocks = 180 * 4;
+	unsigned int numBlocks = DMIN2((end - start + block - 1) / block, maxBlocks);
+	pathShadeBinKernel<NEXT_EVENT_EST, BSDF_TYPE> << <numBlocks, block >> >(*I, start, end, iterationIdx, maxPathDepth, RRStartDepth, depthImage);
+}
+
+template<bool NEXT_EVENT_EST, typename... TYPES> static void launchShadeBins(const CudaVirtualAggregate<BSDF, TYPES...>*, Image* I, const std::vector<unsigned int>& binOffsets, int iterationIdx, int maxPathDepth, int RRStartDepth, bool depthImage)
+{
+	int launches[] = { (launchShadeBin<NEXT_EVENT_EST, TYPES>(I, binOffsets, BSDFALL::getTypeIndex<TYPES>(), iterationIdx, maxPathDepth, RRStartDepth, depthImage), 0)... };
+	(void)launches;
+	launchShadeBin<NEXT_EVENT_EST, void>(I, binOffsets, BSDFALL::NUM_TYPES, iterationIdx, maxPathDepth, RRStartDepth, depthImage);
+}
+
 void WavefrontPathTracer::DoRender(Image* I)
 {
 	m_blockBuffer.Update(getBlockSampler());
 
+	//the buffer has to hold all samples of at least one pixel, the buffers for sorting are only allocated when needed
+	bool sortMaterials = m_sParameters.getValue(KEY_SortMaterials());
+	unsigned int maxSamples = m_blockBuffer.getMaxSamplesPerPixel();
+	int pathsInFlight = m_sParameters.getValue(KEY_PathsInFlight());
+	unsigned int bufferLength = DMAX2(pathsInFlight > 0 ? (unsigned int)pathsInFlight : w * h, maxSamples);
+	if (!m_ray_buf || m_ray_buf->getPayloadLength() != bufferLength || (sortMaterials && m_ray_buf->getNumSortBins() == 0))
+	{
+		if (m_ray_buf)
+		{
+			m_ray_buf->Free();
+			delete m_ray_buf;
+		}
+		//every path traces at most one shadow ray per iteration
+		m_ray_buf = new WavefrontPathTracerBuffer(bufferLength, bufferLength, sortMaterials ? BSDFALL::NUM_TYPES + 1 : 0);
+	}
+
 	int maxPathLength = m_sParameters.getValue(KEY_MaxPathLength()), rrStart = m_sParameters.getValue(KEY_RRStartDepth());
+	bool regenerate = m_sParameters.getValue(KEY_RegeneratePaths());
 
 	if (hasDepthBuffer())
 		CopyToSymbol(g_DepthImageWPT, getDeviceDepthBuffer());
 	m_ray_buf->StartFrame(g_SceneData.m_rayTraceEps);
-	CopyToSymbol(g_ray_buffer, *m_ray_buf);
-	ZeroSymbol(g_NextRayCounterWPT);
-	pathCreateKernelWPT << < dim3(180, 1, 1), dim3(32, 6, 1) >> >(w, h, m_blockBuffer);
-	CopyFromSymbol(*m_ray_buf, g_ray_buffer);
 
-	int pass = 0;
-	do
+	//fills the free slots with the camera paths of the next pixels
+	unsigned int nextPixel = 0;
+	auto generatePaths = [&]()
+	{
+		if (nextPixel >= w * h || maxSamples == 0)
+			return;
+		unsigned int n = DMIN2(w * h - nextPixel, m_ray_buf->getNumFreePayloadSlots() / maxSamples);
+		if (n == 0)
+			return;
+		CopyToSymbol(g_ray_buffer, *m_ray_buf);
+		pathCreateKernelWPT << <(n + 255) / 256, 256 >> >(w, nextPixel, nextPixel + n, m_blockBuffer);
+		CopyFromSymbol(*m_ray_buf, g_ray_buffer);
+		nextPixel += n;
+	};
+	generatePaths();
+
+	std::vector<unsigned int> binOffsets;
+	while (!m_ray_buf->isEmpty())
 	{
 		m_ray_buf->FinishIteration();
 		CopyToSymbol(g_ray_buffer, *m_ray_buf);
-		if (m_sParameters.getValue(KEY_Direct()))
-			pathIterateKernel<true> << < dim3(180, 1, 1), dim3(32, 6, 1) >> >(*I, pass, m_uPassesDone, maxPathLength, rrStart, hasDepthBuffer());
-		else pathIterateKernel<false> << < dim3(180, 1, 1), dim3(32, 6, 1) >> >(*I, pass, m_uPassesDone, maxPathLength, rrStart, hasDepthBuffer());
+		bool direct = m_sParameters.getValue(KEY_Direct());
+		if (sortMaterials)
+		{
+			//group the hits by bsdf type so that every warp executes a single bsdf, each group is shaded by a specialized kernel
+			unsigned int N = m_ray_buf->getNumPayloadElementsInQueue();
+			if (N)
+				computeMaterialKeysWPT << <(N + 255) / 256, 256 >> >();
+			m_ray_buf->SortPayload(binOffsets);
+			CopyToSymbol(g_ray_buffer, *m_ray_buf);
+			if (direct)
+				launchShadeBins<true>((const BSDFALL*)0, I, binOffsets, m_uPassesDone, maxPathLength, rrStart, hasDepthBuffer());
+			else launchShadeBins<false>((const BSDFALL*)0, I, binOffsets, m_uPassesDone, maxPathLength, rrStart, hasDepthBuffer());
+		}
+		else if (direct)
+			pathIterateKernel<true> << < dim3(180, 1, 1), dim3(32, 6, 1) >> >(*I, m_uPassesDone, maxPathLength, rrStart, hasDepthBuffer());
+		else pathIterateKernel<false> << < dim3(180, 1, 1), dim3(32, 6, 1) >> >(*I, m_uPassesDone, maxPathLength, rrStart, hasDepthBuffer());
 		CopyFromSymbol(*m_ray_buf, g_ray_buffer);
-	} while (!m_ray_buf->isEmpty() && ++pass < maxPathLength);
+
+		//paths are terminated by their own depth, new ones can be mixed into the wavefront
+		if (regenerate || m_ray_buf->isEmpty())
+			generatePaths();
+	}
 	ThrowCudaErrors(cudaDeviceSynchronize());
 }
 
@@ -19,6 +19,8 @@ struct WavefrontPTRayData
 	bool specular_bounce;
 	float bsdf_pdf;
 	unsigned int prev_normal;
+	//paths of different lengths are in flight at the same time when new camera paths are generated into free slots
+	unsigned int depth;
 };
 
 typedef DoubleRayBuffer<WavefrontPTRayData> WavefrontPathTracerBuffer;
@@ -29,13 +31,21 @@ public:
 	PARAMETER_KEY(bool, Direct)
 	PARAMETER_KEY(int, MaxPathLength)
 	PARAMETER_KEY(int, RRStartDepth)
+	PARAMETER_KEY(bool, SortMaterials)
+	//size of the ray buffer, 0 to use one path per pixel
+	PARAMETER_KEY(int, PathsInFlight)
+	//new camera paths are started as soon as slots get free, otherwise only after all paths of the wavefront terminated
+	PARAMETER_KEY(bool, RegeneratePaths)
 
 	WavefrontPathTracer()
 		: m_ray_buf(0)
 	{
 		m_sParameters << KEY_Direct()				<< CreateSetBool(true)
 					  << KEY_MaxPathLength()		<< CreateInterval<int>(50, 1, INT_MAX)
-					  << KEY_RRStartDepth()			<< CreateInterval(5, 1, INT_MAX);
+					  << KEY_RRStartDepth()			<< CreateInterval(5, 1, INT_MAX)
+					  << KEY_SortMaterials()		<< CreateSetBool(true)
+					  << KEY_PathsInFlight()		<< CreateInterval(0, 0, INT_MAX)
+					  << KEY_RegeneratePaths()		<< CreateSetBool(true);
 	}
 	~WavefrontPathTracer()
 	{
@@ -51,12 +61,13 @@ public:
 	{
 		Tracer<true>::Resize(w, h);
 
+		//the buffer is created with the current settings in DoRender
 		if (m_ray_buf)
 		{
 			m_ray_buf->Free();
 			delete m_ray_buf;
 		}
-		m_ray_buf = new WavefrontPathTracerBuffer(w * h, w * h);
+		m_ray_buf = 0;
 
 		m_blockBuffer.Resize(w, h);
 	}
@@ -10,9 +10,10 @@ class BlockSamplerBuffer
 private:
 	SynchronizedBuffer<signed char> m_buffer;
 	unsigned int n_x_dim;
+	unsigned int m_maxSamples;
 public:
 	BlockSamplerBuffer()
-		: m_buffer(1)
+		: m_buffer(1), m_maxSamples(1)
 	{
 
 	}
@@ -34,21 +35,33 @@ public:
 		if (!sampler)
 		{
 			m_buffer.Memset((unsigned char)1);
+			m_maxSamples = 1;
 			return;
 		}
 
 		m_buffer.Memset((unsigned char)0);
-		sampler->IterateBlocks([&](unsigned int idx, int x, int y, int w, int h)
+		sampler->IterateActiveBlocks([&](unsigned int idx, int x, int y, int w, int h)
 		{
 			unsigned int a = x / BLOCK_SAMPLER_BlockSize, b = y / BLOCK_SAMPLER_BlockSize;
 			m_buffer[b * n_x_dim + a]++;
 		});
 		m_buffer.setOnCPU();
 		m_buffer.Synchronize();
+		m_maxSamples = 0;
+		for (unsigned int i = 0; i < m_buffer.getLength(); i++)
+			m_maxSamples = DMAX2(m_maxSamples, (unsigned int)m_buffer[i]);
+	}
+
+	//upper bound of getNumSamplesPerPixel for all pixels, valid after Update
+	unsigned int getMaxSamplesPerPixel() const
+	{
+		return m_maxSamples;
 	}
 
 	CUDA_FUNC_IN unsigned int getNumSamplesPerPixel(unsigned int x, unsigned int y)
 	{
+		if (g_ConvergenceMask.isConverged(x, y))
+			return 0;
 		unsigned int a = x / BLOCK_SAMPLER_BlockSize, b = y / BLOCK_SAMPLER_BlockSize;
 		return m_buffer[b * n_x_dim + a];
 	}
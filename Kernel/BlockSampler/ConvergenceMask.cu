@@ -0,0 +1,123 @@
+#include "ConvergenceMask.h"
+#include <Kernel/PixelVarianceBuffer.h>
+#include <algorithm>
+
+namespace CudaTracerLib {
+
+CUDA_ALIGN(16) CUDA_CONST ConvergenceMaskData g_ConvergenceMaskDevice;
+CUDA_ALIGN(16) ConvergenceMaskData g_ConvergenceMaskHost;
+
+CUDA_GLOBAL void updateConvergenceMask(unsigned char* mask, PixelConvergenceMask::BlockStatistics* blockStatistics, PixelVarianceBuffer varBuffer, unsigned int w, unsigned int h, unsigned int numBlocksX, float threshold, int minPasses)
+{
+	unsigned int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
+	if (x < w && y < h)
+	{
+		unsigned int bIdx = (y / BLOCK_SAMPLER_BlockSize) * numBlocksX + x / BLOCK_SAMPLER_BlockSize;
+		auto& bInfo = blockStatistics[bIdx];
+		const PixelVarianceInfo& info = varBuffer(x, y);
+		//the error estimate needs the half buffer which gets a sample every second pass
+		if (info.iterations_done >= 2)
+		{
+			float e = info.computeError();
+			atomicAdd(&bInfo.errorSum, e);
+			atomicInc(&bInfo.numErrors, 0xffffffff);
+			if (threshold > 0 && info.iterations_done >= minPasses && e < threshold)
+				mask[y * w + x] = 1;
+		}
+		if (!mask[y * w + x])
+			atomicInc(&bInfo.numActive, 0xffffffff);
+	}
+}
+
+static unsigned int getNumBlocks(unsigned int n)
+{
+	return (n + BLOCK_SAMPLER_BlockSize - 1) / BLOCK_SAMPLER_BlockSize;
+}
+
+PixelConvergenceMask::PixelConvergenceMask(unsigned int w, unsigned int h)
+	: ISynchronizedBufferParent(m_mask, m_blockStatistics), m_mask(w * h), m_blockStatistics(getNumBlocks(w) * getNumBlocks(h)), m_width(w), m_height(h)
+{
+	Clear();
+}
+
+void PixelConvergenceMask::Clear()
+{
+	m_mask.Memset((unsigned char)0);
+	unsigned int nx = getNumBlocks(m_width), ny = getNumBlocks(m_height);
+	m_activePixels.resize(nx * ny);
+	for (unsigned int by = 0; by < ny; by++)
+		for (unsigned int bx = 0; bx < nx; bx++)
+			m_activePixels[by * nx + bx] = (DMIN2(m_width, (bx + 1) * BLOCK_SAMPLER_BlockSize) - bx * BLOCK_SAMPLER_BlockSize) * (DMIN2(m_height, (by + 1) * BLOCK_SAMPLER_BlockSize) - by * BLOCK_SAMPLER_BlockSize);
+	m_numActive = m_width * m_height;
+	m_averageError = -1.0f;
+}
+
+void PixelConvergenceMask::Update(const PixelVarianceBuffer& varBuffer, float threshold, unsigned int minPasses)
+{
+	const int cBlock = 16;
+	m_blockStatistics.Memset((unsigned char)0);
+	updateConvergenceMask << <dim3((m_width + cBlock - 1) / cBlock, (m_height + cBlock - 1) / cBlock), dim3(cBlock, cBlock) >> > (m_mask.getDevicePtr(), m_blockStatistics.getDevicePtr(), varBuffer, m_width, m_height, getNumBlocks(m_width), threshold, (int)DMAX2(minPasses, 2u));
+	ThrowCudaErrors(cudaDeviceSynchronize());
+	//the host copy of the mask is used by the host kernels and the checkpoints
+	m_mask.setOnGPU();
+	m_mask.Synchronize();
+	m_blockStatistics.setOnGPU();
+	m_blockStatistics.Synchronize();
+
+	double errorSum = 0;
+	unsigned int numErrors = 0;
+	m_numActive = 0;
+	for (unsigned int i = 0; i < m_blockStatistics.getLength(); i++)
+	{
+		auto& b = m_blockStatistics[i];
+		m_activePixels[i] = b.numActive;
+		m_numActive += b.numActive;
+		errorSum += b.errorSum;
+		numErrors += b.numErrors;
+	}
+	m_averageError = numErrors ? float(errorSum / numErrors) : -1.0f;
+}
+
+void PixelConvergenceMask::Bind()
+{
+	//without converged pixels the kernels do not have to read the mask
+	ConvergenceMaskData device, host;
+	device.mask = m_numActive == getNumPixels() ? 0 : m_mask.getDevicePtr();
+	host.mask = m_numActive == getNumPixels() ? 0 : &m_mask[0];
+	device.width = host.width = m_width;
+	ThrowCudaErrors(cudaMemcpyToSymbol(g_ConvergenceMaskDevice, &device, sizeof(device)));
+	g_ConvergenceMaskHost = host;
+}
+
+void PixelConvergenceMask::Unbind()
+{
+	ConvergenceMaskData data;
+	data.mask = 0;
+	data.width = 0;
+	ThrowCudaErrors(cudaMemcpyToSymbol(g_ConvergenceMaskDevice, &data, sizeof(data)));
+	g_ConvergenceMaskHost = data;
+}
+
+void PixelConvergenceMask::SaveState(RenderCheckpoint& checkpoint)
+{
+	checkpoint.WriteBuffer("ConvergenceMask.Mask", m_mask);
+	checkpoint.WriteValue("ConvergenceMask.AverageError", m_averageError);
+}
+
+void PixelConvergenceMask::LoadState(const RenderCheckpoint& checkpoint)
+{
+	checkpoint.ReadBuffer("ConvergenceMask.Mask", m_mask);
+	checkpoint.ReadValue("ConvergenceMask.AverageError", m_averageError);
+	unsigned int nx = getNumBlocks(m_width);
+	std::fill(m_activePixels.begin(), m_activePixels.end(), 0u);
+	m_numActive = 0;
+	for (unsigned int y = 0; y < m_height; y++)
+		for (unsigned int x = 0; x < m_width; x++)
+			if (!m_mask[y * m_width + x])
+			{
+				m_activePixels[(y / BLOCK_SAMPLER_BlockSize) * nx + x / BLOCK_SAMPLER_BlockSize]++;
+				m_numActive++;
+			}
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "IBlockSampler_device.h"
+#include <Base/SynchronizedBuffer.h>
+#include <Base/RenderCheckpoint.h>
+#include <vector>
+
+namespace CudaTracerLib {
+
+class PixelVarianceBuffer;
+
+//view of the convergence mask used by the kernels, a null mask marks all pixels as active
+struct ConvergenceMaskData
+{
+	const unsigned char* mask;
+	unsigned int width;
+
+	CUDA_FUNC_IN bool isConverged(unsigned int x, unsigned int y) const
+	{
+		return mask && mask[y * width + x];
+	}
+};
+
+extern CUDA_ALIGN(16) CUDA_CONST ConvergenceMaskData g_ConvergenceMaskDevice;
+CTL_EXPORT extern CUDA_ALIGN(16) ConvergenceMaskData g_ConvergenceMaskHost;
+
+#ifdef ISCUDA
+#define g_ConvergenceMask g_ConvergenceMaskDevice
+#else
+#define g_ConvergenceMask g_ConvergenceMaskHost
+#endif
+
+//per pixel flags of the pixels whose error estimate fell below a threshold, converged pixels do not receive samples anymore
+//the number of active pixels per block is used to remove fully converged blocks from the launch lists
+class PixelConvergenceMask : public ISynchronizedBufferParent
+{
+public:
+	struct BlockStatistics
+	{
+		unsigned int numActive;
+		unsigned int numErrors;
+		float errorSum;
+	};
+private:
+	SynchronizedBuffer<unsigned char> m_mask;
+	SynchronizedBuffer<BlockStatistics> m_blockStatistics;
+	std::vector<unsigned int> m_activePixels;
+	unsigned int m_width, m_height;
+	unsigned int m_numActive;
+	float m_averageError;
+public:
+	CTL_EXPORT PixelConvergenceMask(unsigned int w, unsigned int h);
+
+	//marks all pixels as active
+	CTL_EXPORT void Clear();
+
+	//pixels which have been sampled in at least minPasses passes and have an error below threshold are marked as converged
+	//the error is the one of PixelVarianceInfo::computeError which is clamped to 1e-2, smaller thresholds never converge
+	CTL_EXPORT void Update(const PixelVarianceBuffer& varBuffer, float threshold, unsigned int minPasses);
+
+	//makes the mask visible to the kernels through g_ConvergenceMask
+	CTL_EXPORT void Bind();
+	//all pixels are rendered by the following kernels
+	CTL_EXPORT static void Unbind();
+
+	unsigned int getNumActivePixels(unsigned int blockIdx) const
+	{
+		return m_activePixels[blockIdx];
+	}
+	unsigned int getNumActivePixels() const
+	{
+		return m_numActive;
+	}
+	unsigned int getNumPixels() const
+	{
+		return m_width * m_height;
+	}
+	//average error of all pixels with an error estimate, negative if there is none yet
+	float getAverageError() const
+	{
+		return m_averageError;
+	}
+
+	CTL_EXPORT void SaveState(RenderCheckpoint& checkpoint);
+	CTL_EXPORT void LoadState(const RenderCheckpoint& checkpoint);
+};
+
+}
@@ -40,6 +40,7 @@ public:
 	virtual void Free()
 	{
 		blockBuffer.Free();
+		IUserPreferenceSampler::Free();
 	}
 
 	virtual IBlockSampler* CreateForSize(unsigned int w, unsigned int h)
@@ -52,6 +53,22 @@ public:
 	virtual void AddPass(Image* img, TracerBase* tracer, const PixelVarianceBuffer& varBuffer);
 
 	virtual void IterateBlocks(iterate_blocks_clb_t clb)  const;
+
+	virtual void SaveState(RenderCheckpoint& checkpoint)
+	{
+		IBlockSampler::SaveState(checkpoint);
+		checkpoint.WriteValue("DifferenceBlockSampler.PassesDone", m_uPassesDone);
+		checkpoint.WriteBuffer("DifferenceBlockSampler.Blocks", blockBuffer);
+		checkpoint.Write("DifferenceBlockSampler.Indices", m_indices.data(), m_indices.size() * sizeof(int));
+	}
+
+	virtual void LoadState(const RenderCheckpoint& checkpoint)
+	{
+		IBlockSampler::LoadState(checkpoint);
+		checkpoint.ReadValue("DifferenceBlockSampler.PassesDone", m_uPassesDone);
+		checkpoint.ReadBuffer("DifferenceBlockSampler.Blocks", blockBuffer);
+		checkpoint.Read("DifferenceBlockSampler.Indices", m_indices.data(), m_indices.size() * sizeof(int));
+	}
 };
 
 }
@@ -6,6 +6,8 @@
 #include <Kernel/PixelVarianceBuffer.h>
 #include <vector>
 #include <Kernel/TracerSettings.h>
+#include <Base/RenderCheckpoint.h>
+#include "ConvergenceMask.h"
 
 namespace CudaTracerLib {
 
@@ -32,18 +34,33 @@ protected:
 	DynamicScene* m_pScene;
 	unsigned int xResolution, yResolution;
 	SynchronizedBuffer<BlockInfo> m_sBlockInfo;
+	PixelConvergenceMask m_convergenceMask;
 	IBlockSampler(unsigned int xResolution, unsigned int yResolution)
-		: xResolution(xResolution), yResolution(yResolution), m_sBlockInfo(getNumTotalBlocks())
+		: xResolution(xResolution), yResolution(yResolution), m_sBlockInfo(getNumTotalBlocks()), m_convergenceMask(xResolution, yResolution)
 	{
-
+		m_settings << KEY_PixelErrorThreshold() << CreateInterval(0.0f, 0.0f, FLT_MAX)
+			<< KEY_TargetError() << CreateInterval(0.0f, 0.0f, FLT_MAX)
+			<< KEY_MinConvergencePasses() << CreateInterval(16, 2, INT_MAX);
 	}
 public:
+	//error below which a pixel stops receiving samples, 0 to disable
+	PARAMETER_KEY(float, PixelErrorThreshold)
+	//the rendering has converged once the average error of all pixels is below this value, 0 to disable
+	PARAMETER_KEY(float, TargetError)
+	//number of passes in which a pixel has to be sampled before it can converge
+	PARAMETER_KEY(int, MinConvergencePasses)
+
 	virtual ~IBlockSampler()
 	{
 
 	}
 
-	virtual void Free() = 0;
+	//derived classes have to call this after freeing their own buffers
+	virtual void Free()
+	{
+		m_sBlockInfo.Free();
+		m_convergenceMask.Free();
+	}
 
 	virtual TracerParameterCollection& getParameterCollection()
 	{
@@ -57,20 +74,64 @@ public:
 	{
 		m_pScene = a_Scene;
 		m_sBlockInfo.Memset(BlockInfo());
+		m_convergenceMask.Clear();
 	}
 
+	//the convergence mask is updated last, the blocks of the pass just rendered are still the active ones before
 	virtual void AddPass(Image* img, TracerBase* tracer, const PixelVarianceBuffer& varBuffer)
 	{
-		IterateBlocks([&](unsigned int f_idx, int bx, int by, int bw, int bh)
+		IterateActiveBlocks([&](unsigned int f_idx, int bx, int by, int bw, int bh)
 		{
 			m_sBlockInfo[f_idx].passesDone++;
 		});
 		m_sBlockInfo.setOnCPU();
 		m_sBlockInfo.Synchronize();
+		float threshold = m_settings.getValue(KEY_PixelErrorThreshold()), target = m_settings.getValue(KEY_TargetError());
+		if (threshold > 0 || target > 0)
+			m_convergenceMask.Update(varBuffer, threshold, m_settings.getValue(KEY_MinConvergencePasses()));
 	}
 
+	//the blocks chosen for the next pass, this can include blocks in which all pixels have converged
 	virtual void IterateBlocks(iterate_blocks_clb_t clb) const = 0;
 
+	//the compacted list of blocks which have to be rendered in the next pass
+	void IterateActiveBlocks(iterate_blocks_clb_t clb) const
+	{
+		IterateBlocks([&](unsigned int f_idx, int x, int y, int bw, int bh)
+		{
+			if (m_convergenceMask.getNumActivePixels(f_idx))
+				clb(f_idx, x, y, bw, bh);
+		});
+	}
+
+	const PixelConvergenceMask& getConvergenceMask() const
+	{
+		return m_convergenceMask;
+	}
+	PixelConvergenceMask& getConvergenceMask()
+	{
+		return m_convergenceMask;
+	}
+
+	//true if all pixels converged or the average error is below the target error
+	bool isConverged() const
+	{
+		float target = m_settings.getValue(KEY_TargetError()), avgError = m_convergenceMask.getAverageError();
+		return m_convergenceMask.getNumActivePixels() == 0 || (target > 0 && avgError >= 0 && avgError <= target);
+	}
+
+	//stores and restores the per block state of a progressive rendering
+	virtual void SaveState(RenderCheckpoint& checkpoint)
+	{
+		checkpoint.WriteBuffer("BlockSampler.BlockInfo", m_sBlockInfo);
+		m_convergenceMask.SaveState(checkpoint);
+	}
+	virtual void LoadState(const RenderCheckpoint& checkpoint)
+	{
+		checkpoint.ReadBuffer("BlockSampler.BlockInfo", m_sBlockInfo);
+		m_convergenceMask.LoadState(checkpoint);
+	}
+
 	int getNumTotalBlocks() const
 	{
 		return getTotalBlocksXDim() * getTotalBlocksYDim();
@@ -128,11 +189,16 @@ public:
 
 protected:
 	//splits between sampling blocks deterministically and based on the weighting scheme present in indices
+	//converged blocks are skipped in the weighted part, their share is given to the next blocks
 	void MixedBlockIterate(const std::vector<int>& indices, iterate_blocks_clb_t clb, int passCounter, int frac_deterministic, int frac_weighted) const
 	{
-		for (int i = 0; i < getNumTotalBlocks() / frac_weighted; i++)
+		int numWeighted = getNumTotalBlocks() / frac_weighted;
+		for (size_t i = 0; i < indices.size() && numWeighted > 0; i++)
 		{
 			auto flattened_idx = indices[i];
+			if (!m_convergenceMask.getNumActivePixels(flattened_idx))
+				continue;
+			numWeighted--;
 			int block_x, block_y, x, y, bw, bh;
 			getIdxComponents(flattened_idx, block_x, block_y);
 
@@ -17,6 +17,7 @@ namespace CudaTracerLib {
 #define BLOCK_SAMPLER_NumBlocks dim3(2 * BLOCK_FACTOR, 4 * BLOCK_FACTOR)
 //the number of pixels in each block
 #define BLOCK_SAMPLER_BlockSize (32 * BLOCK_FACTOR)
+static_assert(BLOCK_SAMPLER_BlockSize == IMAGE_TILE_SIZE, "The tiles of the image have to match the blocks of the block sampler");
 
 //a launch configuration for a cuda kernel which implements the block sampler "interface"
 #define BLOCK_SAMPLER_LAUNCH_CONFIG BLOCK_SAMPLER_NumBlocks,BLOCK_SAMPLER_ThreadsPerBlock
@@ -18,7 +18,7 @@ public:
 
 	virtual void Free()
 	{
-
+		IUserPreferenceSampler::Free();
 	}
 
 	virtual IBlockSampler* CreateForSize(unsigned int w, unsigned int h)
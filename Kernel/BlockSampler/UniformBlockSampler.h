@@ -24,6 +24,7 @@ public:
 
 	virtual void Free()
 	{
+		IUserPreferenceSampler::Free();
 	}
 
 	virtual IBlockSampler* CreateForSize(unsigned int w, unsigned int h)
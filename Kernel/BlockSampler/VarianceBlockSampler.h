@@ -72,6 +72,7 @@ public:
 	virtual void Free()
 	{
 		m_blockInfo.Free();
+		IUserPreferenceSampler::Free();
 	}
 
 	virtual IBlockSampler* CreateForSize(unsigned int w, unsigned int h)
@@ -84,6 +85,22 @@ public:
 	virtual void AddPass(Image* img, TracerBase* tracer, const PixelVarianceBuffer& varBuffer);
 
 	virtual void IterateBlocks(iterate_blocks_clb_t clb)  const;
+
+	virtual void SaveState(RenderCheckpoint& checkpoint)
+	{
+		IBlockSampler::SaveState(checkpoint);
+		checkpoint.WriteValue("VarianceBlockSampler.PassesDone", m_uPassesDone);
+		checkpoint.WriteBuffer("VarianceBlockSampler.Blocks", m_blockInfo);
+		checkpoint.Write("VarianceBlockSampler.Indices", m_indices.data(), m_indices.size() * sizeof(int));
+	}
+
+	virtual void LoadState(const RenderCheckpoint& checkpoint)
+	{
+		IBlockSampler::LoadState(checkpoint);
+		checkpoint.ReadValue("VarianceBlockSampler.PassesDone", m_uPassesDone);
+		checkpoint.ReadBuffer("VarianceBlockSampler.Blocks", m_blockInfo);
+		checkpoint.Read("VarianceBlockSampler.Indices", m_indices.data(), m_indices.size() * sizeof(int));
+	}
 };
 
 }
\ No newline at end of file
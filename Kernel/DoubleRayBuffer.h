@@ -3,13 +3,42 @@
 #include <Defines.h>
 #include <Base/CudaMemoryManager.h>
 #include "TraceHelper.h"
+#include <vector>
 
 namespace CudaTracerLib {
 
+#ifdef __CUDACC__
+namespace __internal_doubleRayBuffer__
+{
+
+CUDA_GLOBAL void countSortKeys(const unsigned int* keys, unsigned int N, unsigned int* binCounters)
+{
+	unsigned int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx < N)
+		atomicAdd(binCounters + keys[idx], 1u);
+}
+
+//the bin counters hold the start offsets of the bins, the order inside a bin is arbitrary
+template<typename T> CUDA_GLOBAL void scatterSortKeys(const unsigned int* keys, unsigned int N, unsigned int* binCounters, const T* payload, const traversalRay* rays, const traversalResult* results, T* payload_dest, traversalRay* rays_dest, traversalResult* results_dest)
+{
+	unsigned int idx = blockIdx.x * blockDim.x + threadIdx.x;
+	if (idx < N)
+	{
+		unsigned int dest = atomicAdd(binCounters + keys[idx], 1u);
+		payload_dest[dest] = payload[idx];
+		rays_dest[dest] = rays[idx];
+		results_dest[dest] = results[idx];
+	}
+}
+
+}
+#endif
+
 //a buffer which stores payload elements associated with "primary" rays
 //each primary rays has the option to launch associated "secondary" rays.
 //The buffer is "double buffered" in the sense that it can be used to read
 //rays from it and in the same iteration write new ones to it.
+//Elements which are not inserted again are dropped, the live elements always form a dense prefix.
 template<typename T> class DoubleRayBuffer
 {
 	T* m_payload_buffer;
@@ -35,6 +64,15 @@ template<typename T> class DoubleRayBuffer
 	secondary_buf m_secondary_buf1;
 	secondary_buf m_secondary_buf2;
 
+	//payload elements reordered by SortPayload, they are read from here while the new elements are inserted into the primary buffers
+	T* m_sorted_payload_buffer;
+	traversalRay* m_sorted_ray_buffer;
+	traversalResult* m_sorted_res_buffer;
+	unsigned int* m_sort_keys;
+	unsigned int* m_sort_bin_counters;
+	unsigned int m_num_sort_bins;
+	bool m_read_sorted;
+
 	//number of payload elements and thereby number of primary rays
 	unsigned int m_payload_length;
 	//number of secondary rays
@@ -52,13 +90,36 @@ template<typename T> class DoubleRayBuffer
 
     //this is used to initialize the min ray distances
     float m_rayTraceEps;
+
+	CUDA_FUNC_IN const T* getReadPayloadBuffer() const
+	{
+		return m_read_sorted ? m_sorted_payload_buffer : m_payload_buffer;
+	}
+	CUDA_FUNC_IN const traversalRay* getReadRayBuffer() const
+	{
+		return m_read_sorted ? m_sorted_ray_buffer : m_payload_ray_buffer;
+	}
+	CUDA_FUNC_IN const traversalResult* getReadResBuffer() const
+	{
+		return m_read_sorted ? m_sorted_res_buffer : m_payload_res_buffer;
+	}
 public:
-	DoubleRayBuffer(unsigned int payload_length, unsigned int secondary_length)
-		: m_payload_length(payload_length), m_num_secondary_rays(secondary_length), m_fetch_index(0), m_insert_payload_index(0), m_insert_secondary_index(0), m_secondary_buf1(secondary_length), m_secondary_buf2(secondary_length)
+	//num_sort_bins > 0 allocates a second set of payload buffers which is used by SortPayload
+	DoubleRayBuffer(unsigned int payload_length, unsigned int secondary_length, unsigned int num_sort_bins = 0)
+		: m_payload_length(payload_length), m_num_secondary_rays(secondary_length), m_fetch_index(0), m_insert_payload_index(0), m_insert_secondary_index(0), m_secondary_buf1(secondary_length), m_secondary_buf2(secondary_length),
+		  m_sorted_payload_buffer(0), m_sorted_ray_buffer(0), m_sorted_res_buffer(0), m_sort_keys(0), m_sort_bin_counters(0), m_num_sort_bins(num_sort_bins), m_read_sorted(false)
 	{
 		CUDA_MALLOC(&m_payload_buffer, sizeof(T) * m_payload_length);
 		CUDA_MALLOC(&m_payload_ray_buffer, sizeof(traversalRay) * m_payload_length);
 		CUDA_MALLOC(&m_payload_res_buffer, sizeof(traversalResult) * m_payload_length);
+		if (m_num_sort_bins)
+		{
+			CUDA_MALLOC(&m_sorted_payload_buffer, sizeof(T) * m_payload_length);
+			CUDA_MALLOC(&m_sorted_ray_buffer, sizeof(traversalRay) * m_payload_length);
+			CUDA_MALLOC(&m_sorted_res_buffer, sizeof(traversalResult) * m_payload_length);
+			CUDA_MALLOC(&m_sort_keys, sizeof(unsigned int) * m_payload_length);
+			CUDA_MALLOC(&m_sort_bin_counters, sizeof(unsigned int) * m_num_sort_bins);
+		}
 	}
 
 	void Free()
@@ -68,6 +129,14 @@ public:
 		CUDA_FREE(m_payload_res_buffer);
 		m_secondary_buf1.Free();
 		m_secondary_buf2.Free();
+		if (m_num_sort_bins)
+		{
+			CUDA_FREE(m_sorted_payload_buffer);
+			CUDA_FREE(m_sorted_ray_buffer);
+			CUDA_FREE(m_sorted_res_buffer);
+			CUDA_FREE(m_sort_keys);
+			CUDA_FREE(m_sort_bin_counters);
+		}
 	}
 
 	void StartFrame(float rayTraceEps)
@@ -76,6 +145,7 @@ public:
 		m_insert_payload_index = 0;
 		m_insert_secondary_index = 0;
 		m_num_payload_elements = 0;
+		m_read_sorted = false;
         m_rayTraceEps = rayTraceEps;
 	}
 
@@ -90,8 +160,11 @@ public:
 
 		if (COMPUTE_INTERSCTIONS)
 		{
-			ThrowCudaErrors(cudaMemset(m_payload_res_buffer, 0, sizeof(traversalResult) * m_payload_length));
-			ThrowCudaErrors(cudaMemset(m_secondary_buf2.m_res_buffer, 0, sizeof(traversalResult) * m_num_secondary_rays));
+			//terminated elements are not inserted again, only the prefix of live elements is used
+			if (m_insert_payload_index)
+				ThrowCudaErrors(cudaMemset(m_payload_res_buffer, 0, sizeof(traversalResult) * m_insert_payload_index));
+			if (m_insert_secondary_index)
+				ThrowCudaErrors(cudaMemset(m_secondary_buf2.m_res_buffer, 0, sizeof(traversalResult) * m_insert_secondary_index));
 
 			//intersect [0, .., m_insert_payload_index] from payload buffer
 			__internal__IntersectBuffers(m_insert_payload_index, m_payload_ray_buffer, m_payload_res_buffer, skip_outer, false);
@@ -103,6 +176,7 @@ public:
 		m_num_payload_elements = m_insert_payload_index;
 		m_fetch_index = 0;
 		m_insert_payload_index = 0;
+		m_read_sorted = false;
 		//if we are not computing intersections (ie only refilling the buffer) we don't want to throw away the secondary rays
 		if (COMPUTE_INTERSCTIONS)
 		{
@@ -122,18 +196,80 @@ public:
 		return m_num_payload_elements;
 	}
 
-	CUDA_ONLY_FUNC bool tryFetchPayloadElement(T& payload_el, traversalRay& ray, traversalResult& res, unsigned int* idx = 0)
+	unsigned int getPayloadLength() const
+	{
+		return m_payload_length;
+	}
+
+	//number of elements which can still be inserted in this iteration, used to refill the buffer with new work after the old elements were processed
+	unsigned int getNumFreePayloadSlots() const
+	{
+		return m_payload_length - DMIN2(m_insert_payload_index, m_payload_length);
+	}
+
+	unsigned int getNumSortBins() const
+	{
+		return m_num_sort_bins;
+	}
+
+	//reorders the payload elements of this iteration by the keys set with setSortKey by a counting sort
+	//binOffsets receives the start of every bin and the number of elements as last entry
+	//the elements have to be accessed by index afterwards, the secondary rays are not affected
+	void SortPayload(std::vector<unsigned int>& binOffsets)
+	{
+		if (!m_num_sort_bins)
+			throw std::runtime_error("The ray buffer was not created for sorting!");
+		binOffsets.resize(m_num_sort_bins + 1);
+		unsigned int N = m_num_payload_elements;
+#ifndef __CUDACC__
+		throw std::runtime_error("Use this from a cuda file please!");
+#else
+		const unsigned int block = 256;
+		ThrowCudaErrors(cudaMemset(m_sort_bin_counters, 0, sizeof(unsigned int) * m_num_sort_bins));
+		if (N)
+			__internal_doubleRayBuffer__::countSortKeys << <(N + block - 1) / block, block >> >(m_sort_keys, N, m_sort_bin_counters);
+		//the number of bins is small, the scan is cheaper on the host than another launch
+		ThrowCudaErrors(cudaMemcpy(&binOffsets[0], m_sort_bin_counters, sizeof(unsigned int) * m_num_sort_bins, cudaMemcpyDeviceToHost));
+		unsigned int sum = 0;
+		for (unsigned int i = 0; i < m_num_sort_bins; i++)
+		{
+			unsigned int c = binOffsets[i];
+			binOffsets[i] = sum;
+			sum += c;
+		}
+		binOffsets[m_num_sort_bins] = sum;
+		ThrowCudaErrors(cudaMemcpy(m_sort_bin_counters, &binOffsets[0], sizeof(unsigned int) * m_num_sort_bins, cudaMemcpyHostToDevice));
+		if (N)
+			__internal_doubleRayBuffer__::scatterSortKeys<T> << <(N + block - 1) / block, block >> >(m_sort_keys, N, m_sort_bin_counters, m_payload_buffer, m_payload_ray_buffer, m_payload_res_buffer,
+																									m_sorted_payload_buffer, m_sorted_ray_buffer, m_sorted_res_buffer);
+		m_read_sorted = true;
+		m_fetch_index = 0;
+#endif
+	}
+
+	//key in [0, num_sort_bins) of the payload element idx, has to be set for all elements before calling SortPayload
+	CUDA_ONLY_FUNC void setSortKey(unsigned int idx, unsigned int key)
+	{
+		m_sort_keys[idx] = key;
+	}
+
+	CUDA_ONLY_FUNC bool accessPayloadElement(unsigned int payload_idx, T& payload_el, traversalRay& ray, traversalResult& res)
 	{
-		unsigned payload_idx = atomicInc(&m_fetch_index, UINT_MAX);
 		if (payload_idx >= m_num_payload_elements)
 			return false;
 
+		payload_el = getReadPayloadBuffer()[payload_idx];
+		ray = getReadRayBuffer()[payload_idx];
+		res = getReadResBuffer()[payload_idx];
+		return true;
+	}
+
+	CUDA_ONLY_FUNC bool tryFetchPayloadElement(T& payload_el, traversalRay& ray, traversalResult& res, unsigned int* idx = 0)
+	{
+		unsigned payload_idx = atomicInc(&m_fetch_index, UINT_MAX);
 		if (idx)
 			*idx = payload_idx;
-		payload_el = m_payload_buffer[payload_idx];
-		ray = m_payload_ray_buffer[payload_idx];
-		res = m_payload_res_buffer[payload_idx];
-		return true;
+		return accessPayloadElement(payload_idx, payload_el, ray, res);
 	}
 
 	CUDA_ONLY_FUNC bool insertPayloadElement(const T& payload_el, const traversalRay& ray, const traversalResult* res = 0, unsigned int* idx = 0)
@@ -176,6 +312,18 @@ public:
 	}
 
 	//helper functions to convert trivial structs to usable types
+	CUDA_ONLY_FUNC bool accessPayloadElement(unsigned int idx, T& payload_el, NormalizedT<Ray>& ray, TraceResult& res)
+	{
+		traversalRay r1;
+		traversalResult r2;
+		if (accessPayloadElement(idx, payload_el, r1, r2))
+		{
+			convert(r1, r2, ray, res);
+			return true;
+		}
+		else return false;
+	}
+
 	CUDA_ONLY_FUNC bool tryFetchPayloadElement(T& payload_el, NormalizedT<Ray>& ray, TraceResult& res, unsigned int* idx = 0)
 	{
 		traversalRay r1;
@@ -0,0 +1,66 @@
+#include <StdAfx.h>
+#include "ExrOutput.h"
+#include <Kernel/Tracer.h>
+#include <Base/Profiler.h>
+
+namespace CudaTracerLib
+{
+
+void CaptureExrLayers(TracerBase& tracer, Image& img, ExrImage& exr, const ExrLayerSettings& settings, const DeviceDepthImage* depth)
+{
+	PROFILE_ZONE("ImagePipeline", "CaptureExrLayers");
+	unsigned int w = img.getWidth(), h = img.getHeight();
+	exr = ExrImage(w, h);
+	std::vector<float> data(w * h * 3);
+
+	//kernels do not update the location flags, unless the host data was modified the device data is up to date
+	if (img.isOnGPU())
+		img.setOnGPU();
+	img.Synchronize();
+	float splatScale = tracer.getSplatScale();
+	for (unsigned int y = 0; y < h; y++)
+		for (unsigned int x = 0; x < w; x++)
+		{
+			float* rgb = &data[(y * w + x) * 3];
+			img.getPixelData(x, y).toSpectrum(splatScale).toLinearRGB(rgb[0], rgb[1], rgb[2]);
+		}
+	exr.AddLayer("", { "R", "G", "B" }, settings.beautyType, &data[0]);
+
+	if (settings.variance && tracer.isMultiPass())
+	{
+		auto& varBuffer = (PixelVarianceBuffer&)tracer.getPixelVarianceBuffer();
+		varBuffer.setOnGPU();
+		varBuffer.Synchronize();
+		for (unsigned int y = 0; y < h; y++)
+			for (unsigned int x = 0; x < w; x++)
+			{
+				auto& info = varBuffer(x, y);
+				data[y * w + x] = info.num_samples_var > 1 ? info.computeVariance() : 0.0f;
+			}
+		exr.AddChannel("variance.Y", settings.auxiliaryType, &data[0]);
+	}
+
+	if (depth && depth->m_pData)
+	{
+		if (depth->w != (int)w || depth->h != (int)h)
+			throw std::runtime_error("The depth image has to have the resolution of the image!");
+		CUDA_MEMCPY_TO_HOST(&data[0], depth->m_pData, w * h * sizeof(float));
+		//the depth is stored as float since the normalized values are close to 1
+		exr.AddChannel("depth.Z", EXR_PIXEL_FLOAT, &data[0]);
+	}
+
+	if (settings.debugVisualizers)
+	{
+		tracer.getDebugVisualizerManger().iterateAllVisualizers([&](IPixelDebugVisualizer* vis)
+		{
+			static const char* names[3][3] = { { "Y" }, { "R", "G" }, { "R", "G", "B" } };
+			unsigned int n = vis->getNumComponents();
+			if (n < 1 || n > 3)
+				return;
+			vis->getComponents(data);
+			exr.AddLayer(vis->getName(), std::vector<std::string>(names[n - 1], names[n - 1] + n), settings.auxiliaryType, &data[0]);
+		});
+	}
+}
+
+}
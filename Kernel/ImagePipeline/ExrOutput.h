@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Base/ExrWriter.h>
+
+namespace CudaTracerLib
+{
+
+class TracerBase;
+class Image;
+struct DeviceDepthImage;
+
+struct ExrLayerSettings
+{
+	ExrPixelType beautyType;
+	//the auxiliary layers are usually only inspected, half precision is enough for them
+	ExrPixelType auxiliaryType;
+	bool variance;
+	bool debugVisualizers;
+
+	ExrLayerSettings()
+		: beautyType(EXR_PIXEL_FLOAT), auxiliaryType(EXR_PIXEL_HALF), variance(true), debugVisualizers(true)
+	{
+
+	}
+};
+
+//copies the unfiltered linear rgb values of the accumulated samples to the channels R, G, B
+//the variance layer contains the per pass luminance variance, the depth layer the normalized depth of the optional depth image
+//every debug visualizer is stored as a layer with its name and one to three channels
+CTL_EXPORT void CaptureExrLayers(TracerBase& tracer, Image& img, ExrImage& exr, const ExrLayerSettings& settings = ExrLayerSettings(), const DeviceDepthImage* depth = 0);
+
+}
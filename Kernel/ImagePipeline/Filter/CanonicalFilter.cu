@@ -3,7 +3,20 @@
 namespace CudaTracerLib
 {
 
-CUDA_FUNC_IN Spectrum evalFilter(const Filter& filter, PixelData* P, float splatScale, int _x, int _y, int w, int h)
+bool SeparableFilterTable::Create(const Filter& f, SeparableFilterTable& table)
+{
+	table.rx = math::Floor2Int(f.As<FilterBase>()->xWidth);
+	table.ry = math::Floor2Int(f.As<FilterBase>()->yWidth);
+	if (table.rx < 0 || table.ry < 0 || table.rx > CANONICAL_FILTER_MAX_RADIUS || table.ry > CANONICAL_FILTER_MAX_RADIUS)
+		return false;
+	for (int d = 0; d <= table.rx; d++)
+		table.weightsX[d] = f.Evaluate((float)d, 0.0f);
+	for (int d = 0; d <= table.ry; d++)
+		table.weightsY[d] = f.Evaluate(0.0f, (float)d);
+	return true;
+}
+
+CUDA_FUNC_IN Spectrum evalFilter(const Filter& filter, Image& img, float splatScale, int _x, int _y, int w, int h)
 {
 	int x0 = max(0, math::Ceil2Int(_x - filter.As<FilterBase>()->xWidth));
 	int x1 = min(w - 1, math::Floor2Int(_x + filter.As<FilterBase>()->xWidth));
@@ -18,7 +31,7 @@ CUDA_FUNC_IN Spectrum evalFilter(const Filter& filter, PixelData* P, float splat
 		for (int x = x0; x <= x1; ++x)
 		{
 			float filterWt = filter.Evaluate((float)math::abs(x - _x), (float)math::abs(y - _y));
-			acc += P[y * w + x].toSpectrum(splatScale) * filterWt;
+			acc += img.getPixelData(x, y).toSpectrum(splatScale) * filterWt;
 			accFilter += filterWt;
 		}
 	}
@@ -30,15 +43,166 @@ CUDA_GLOBAL void rtm_Copy(Image img, int w, int h, float splatScale, Filter filt
 	int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
 	if (x < w && y < h)
 	{
-		Spectrum c = evalFilter(filter, &img.getPixelData(0, 0), splatScale, x, y, w, h);
+		Spectrum c = evalFilter(filter, img, splatScale, x, y, w, h);
 		img.getFilteredData(x, y) = c.toRGBE();
 	}
 }
 
-void CanonicalFilter::Apply(Image& img, int numPasses, float splatScale, const PixelVarianceBuffer& varBuffer)
+CUDA_GLOBAL void resolveSamples(Image img, int w, int h, float splatScale, Spectrum* resolved)
+{
+	int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
+	if (x < w && y < h)
+		resolved[y * w + x] = img.getPixelData(x, y).toSpectrum(splatScale);
+}
+
+//both passes normalize by the sum of the weights inside the image, the product of both equals the normalization of the 2D filter
+CUDA_GLOBAL void filterHorizontal(int w, int h, SeparableFilterTable table, const Spectrum* source, Spectrum* dest)
+{
+	int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
+	if (x < w && y < h)
+	{
+		int x0 = max(0, x - table.rx), x1 = min(w - 1, x + table.rx);
+		Spectrum acc(0.0f);
+		float accFilter = 0;
+		for (int xi = x0; xi <= x1; xi++)
+		{
+			float filterWt = table.getWeightX(xi - x);
+			acc += source[y * w + xi] * filterWt;
+			accFilter += filterWt;
+		}
+		dest[y * w + x] = acc / accFilter;
+	}
+}
+
+CUDA_GLOBAL void filterVertical(Image img, int w, int h, SeparableFilterTable table, const Spectrum* source)
+{
+	int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
+	if (x < w && y < h)
+	{
+		int y0 = max(0, y - table.ry), y1 = min(h - 1, y + table.ry);
+		Spectrum acc(0.0f);
+		float accFilter = 0;
+		for (int yi = y0; yi <= y1; yi++)
+		{
+			float filterWt = table.getWeightY(yi - y);
+			acc += source[yi * w + x] * filterWt;
+			accFilter += filterWt;
+		}
+		img.getFilteredData(x, y) = (acc / accFilter).toRGBE();
+	}
+}
+
+void CanonicalFilter::adaptBuffers(int w, int h)
+{
+	if (m_bufferW == w && m_bufferH == h)
+		return;
+	Free();
+	m_bufferW = w;
+	m_bufferH = h;
+	CUDA_MALLOC(&m_deviceResolvedData, w * h * sizeof(Spectrum));
+	CUDA_MALLOC(&m_deviceIntermediateData, w * h * sizeof(Spectrum));
+}
+
+void CanonicalFilter::ApplyDirect(Image& img, float splatScale)
 {
 	int block = 16, xResolution = img.getWidth(), yResolution = img.getHeight();
 	rtm_Copy << <dim3(xResolution / block + 1, yResolution / block + 1), dim3(block, block) >> >(img, (int)xResolution, (int)yResolution, splatScale, m_filter);
+}
+
+void CanonicalFilter::ApplySeparable(Image& img, float splatScale, const SeparableFilterTable& table)
+{
+	int block = 16, xResolution = img.getWidth(), yResolution = img.getHeight();
+	adaptBuffers(xResolution, yResolution);
+	dim3 gridDim(xResolution / block + 1, yResolution / block + 1), blockDim(block, block);
+	resolveSamples << <gridDim, blockDim >> >(img, xResolution, yResolution, splatScale, m_deviceResolvedData);
+	filterHorizontal << <gridDim, blockDim >> >(xResolution, yResolution, table, m_deviceResolvedData, m_deviceIntermediateData);
+	filterVertical << <gridDim, blockDim >> >(img, xResolution, yResolution, table, m_deviceIntermediateData);
+}
+
+//computes for every position the sum of the 1D filter weights which lie inside [0, n)
+static void computeNormalization(int n, int r, const float* weights, std::vector<float>& norm)
+{
+	norm.assign(n, 0.0f);
+	for (int i = 0; i < n; i++)
+		for (int j = max(0, i - r); j <= min(n - 1, i + r); j++)
+			norm[i] += weights[math::abs(j - i)];
+}
+
+void CanonicalFilter::ApplySeparableHost(Image& img, float splatScale, const SeparableFilterTable& table)
+{
+	const int w = img.getWidth(), h = img.getHeight(), N = w * h;
+	img.Synchronize();
+
+	m_hostResolvedData.resize(3 * N);
+	m_hostIntermediateData.resize(3 * N);
+	m_hostFilteredData.resize(N);
+	float* planes[3] = { &m_hostResolvedData[0], &m_hostResolvedData[N], &m_hostResolvedData[2 * N] };
+	float* tmpPlanes[3] = { &m_hostIntermediateData[0], &m_hostIntermediateData[N], &m_hostIntermediateData[2 * N] };
+
+	for (int y = 0; y < h; y++)
+		for (int x = 0; x < w; x++)
+		{
+			Spectrum s = img.getPixelData(x, y).toSpectrum(splatScale);
+			for (int c = 0; c < 3; c++)
+				planes[c][y * w + x] = s[c];
+		}
+
+	std::vector<float> normX, normY;
+	computeNormalization(w, table.rx, table.weightsX, normX);
+	computeNormalization(h, table.ry, table.weightsY, normY);
+
+	//the inner loops run over contiguous memory without dependencies so they can be vectorized by the compiler
+	for (int c = 0; c < 3; c++)
+	{
+		const float* src = planes[c];
+		float* tmp = tmpPlanes[c];
+		std::fill(tmp, tmp + N, 0.0f);
+		for (int y = 0; y < h; y++)
+		{
+			const float* srcRow = src + y * w;
+			float* tmpRow = tmp + y * w;
+			for (int d = -table.rx; d <= table.rx; d++)
+			{
+				const float wt = table.getWeightX(d);
+				const int x0 = max(0, -d), x1 = min(w, w - d);
+				for (int x = x0; x < x1; x++)
+					tmpRow[x] += wt * srcRow[x + d];
+			}
+		}
+
+		float* dst = planes[c];
+		std::fill(dst, dst + N, 0.0f);
+		for (int y = 0; y < h; y++)
+		{
+			float* dstRow = dst + y * w;
+			for (int d = max(-table.ry, -y); d <= min(table.ry, h - 1 - y); d++)
+			{
+				const float wt = table.getWeightY(d);
+				const float* tmpRow = tmp + (y + d) * w;
+				for (int x = 0; x < w; x++)
+					dstRow[x] += wt * tmpRow[x];
+			}
+			const float invNormY = 1.0f / normY[y];
+			for (int x = 0; x < w; x++)
+				dstRow[x] *= invNormY / normX[x];
+		}
+	}
+
+	for (int i = 0; i < N; i++)
+		m_hostFilteredData[i] = Spectrum(planes[0][i], planes[1][i], planes[2][i]).toRGBE();
+	CUDA_MEMCPY_TO_DEVICE(&img.getFilteredData(0, 0), &m_hostFilteredData[0], N * sizeof(RGBE));
+}
+
+void CanonicalFilter::Apply(Image& img, int numPasses, float splatScale, const PixelVarianceBuffer& varBuffer)
+{
+	SeparableFilterTable table;
+	bool useTable = m_settings.getValue(KEY_Separable()) && SeparableFilterTable::Create(m_filter, table);
+
+	if (!useTable)
+		ApplyDirect(img, splatScale);
+	else if (m_settings.getValue(KEY_FilterOnHost()))
+		ApplySeparableHost(img, splatScale, table);
+	else ApplySeparable(img, splatScale, table);
 
 	ThrowCudaErrors(cudaThreadSynchronize());
 }
@@ -2,26 +2,77 @@
 
 #include "Filter.h"
 #include <SceneTypes/Filter.h>
+#include <vector>
 
 namespace CudaTracerLib
 {
 
+//maximum integer radius for which the 1D weight tables are used, larger filters are evaluated directly
+#define CANONICAL_FILTER_MAX_RADIUS 16
+
+//all canonical filters are separable, f(x, y) = g(x) * h(y), which allows to precompute both 1D functions at the integer pixel offsets
+//the tables are built from f(d, 0) and f(0, d) so they are only correct up to a constant factor which cancels out in the normalization
+struct SeparableFilterTable
+{
+	float weightsX[CANONICAL_FILTER_MAX_RADIUS + 1];
+	float weightsY[CANONICAL_FILTER_MAX_RADIUS + 1];
+	int rx, ry;
+
+	CUDA_FUNC_IN float getWeightX(int d) const
+	{
+		return weightsX[d < 0 ? -d : d];
+	}
+
+	CUDA_FUNC_IN float getWeightY(int d) const
+	{
+		return weightsY[d < 0 ? -d : d];
+	}
+
+	//returns false if the filter is too wide to be represented by the tables
+	CTL_EXPORT static bool Create(const Filter& f, SeparableFilterTable& table);
+};
+
 class CanonicalFilter : public ImageSamplesFilter
 {
 private:
 	Filter m_filter;
+	int m_bufferW, m_bufferH;
+	Spectrum* m_deviceResolvedData;
+	Spectrum* m_deviceIntermediateData;
+	//host SoA buffers for the r, g, b planes
+	std::vector<float> m_hostResolvedData, m_hostIntermediateData;
+	std::vector<RGBE> m_hostFilteredData;
+
+	void adaptBuffers(int w, int h);
+	void ApplyDirect(Image& img, float splatScale);
+	void ApplySeparable(Image& img, float splatScale, const SeparableFilterTable& table);
+	void ApplySeparableHost(Image& img, float splatScale, const SeparableFilterTable& table);
 public:
+	PARAMETER_KEY(bool, Separable)
+	PARAMETER_KEY(bool, FilterOnHost)
+
 	CanonicalFilter(const Filter& f)
-		: m_filter(f)
+		: m_filter(f), m_bufferW(0), m_bufferH(0), m_deviceResolvedData(0), m_deviceIntermediateData(0)
 	{
+		m_settings	<< KEY_Separable()		<< CreateSetBool(true)
+					<< KEY_FilterOnHost()	<< CreateSetBool(false);
 	}
 	virtual void Free()
 	{
-
+		if (m_deviceResolvedData)
+		{
+			CUDA_FREE(m_deviceResolvedData);
+			CUDA_FREE(m_deviceIntermediateData);
+		}
+		m_deviceResolvedData = m_deviceIntermediateData = 0;
+		m_hostResolvedData.clear();
+		m_hostIntermediateData.clear();
+		m_hostFilteredData.clear();
+		m_bufferW = m_bufferH = 0;
 	}
 	virtual void Resize(int xRes, int yRes)
 	{
-
+		adaptBuffers(xRes, yRes);
 	}
 	virtual void Apply(Image& img, int numPasses, float splatScale, const PixelVarianceBuffer& varBuffer);
 	const Filter& getFilter() const
@@ -2,6 +2,9 @@
 #include <Kernel/TraceHelper.h>
 #include <Engine/DifferentialGeometry.h>
 #include <Engine/Material.h>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 namespace CudaTracerLib
 {
@@ -65,10 +68,31 @@ CUDA_DEVICE Spectrum loadFromShared(int x, int y, int x_off, int y_off, float* v
 	return g_cachedFeatureData[local_y * CACHE_SIZE + local_x];
 }*/
 
-CUDA_DEVICE float patchDistance(int p_x, int p_y, int q_x, int q_y, int F, int w, int h, int x_off, int y_off, float k, float sigma2Scale)
+//the distance term of a single pixel pair, the patch distance is the average of these over the patch
+CUDA_FUNC_IN float patchTerm(const Spectrum& c_p, const Spectrum& c_q, float var_p, float var_q, float k, float sigma2Scale)
 {
 	const float eps = 1e-10f;
 	const float alpha = 1.0f;
+	var_p *= sigma2Scale; var_q *= sigma2Scale;
+	float u_diff = math::sqr(c_p - c_q).avg();
+	return (u_diff - alpha * (var_p + min(var_p, var_q))) / (eps + k * k * (var_p + var_q));
+}
+
+CUDA_FUNC_IN float distanceToWeight(float d_range)
+{
+	const float weight = math::exp(-max(0.0f, d_range));
+	return weight < 0.05f ? 0.0f : weight;
+}
+
+//the number of patch offsets s in [-F, F] for which p + s and p + off + s are both inside [0, n)
+CUDA_FUNC_IN int numValidPatchOffsets(int p, int off, int F, int n)
+{
+	int lo = max(-F, max(-p, -p - off)), hi = min(F, min(n - 1 - p, n - 1 - p - off));
+	return max(0, hi - lo + 1);
+}
+
+CUDA_DEVICE float patchDistance(int p_x, int p_y, int q_x, int q_y, int F, int w, int h, int x_off, int y_off, float k, float sigma2Scale)
+{
 	float d_range = 0, weight = 0;;
 	for(int x = -F; x <= F; x++)
 		for (int y = -F; y <= F; y++)
@@ -80,10 +104,7 @@ CUDA_DEVICE float patchDistance(int p_x, int p_y, int q_x, int q_y, int F, int w
 			float var_p, var_q;
 			auto c_p = loadFromShared(p_x + x, p_y + y, x_off, y_off, &var_p);//.saturate();
 			auto c_q = loadFromShared(q_x + x, q_y + y, x_off, y_off, &var_q);//.saturate();
-			var_p *= sigma2Scale; var_q *= sigma2Scale;
-			float u_diff = math::sqr(c_p - c_q).avg();
-			float d = (u_diff - alpha * (var_p + min(var_p, var_q))) / (eps + k * k * (var_p + var_q));
-			d_range += d;
+			d_range += patchTerm(c_p, c_q, var_p, var_q, k, sigma2Scale);
 			weight++;
 		}
 
@@ -93,9 +114,7 @@ CUDA_DEVICE float patchDistance(int p_x, int p_y, int q_x, int q_y, int F, int w
 CUDA_DEVICE float weight(int p_x, int p_y, int q_x, int q_y, int w, int h, int x_off, int y_off, int F, float k, float sigma2Scale)
 {
 	const float d_range = patchDistance(p_x, p_y, q_x, q_y, F, w, h, x_off, y_off, k, sigma2Scale);
-
-	const float weight = math::exp(-max(0.0f, d_range));
-	return weight < 0.05f ? 0.0f : weight;
+	return distanceToWeight(d_range);
 }
 
 CUDA_GLOBAL void computeWeights(Image img, RGBE* deviceDataCached, NonLocalMeansFilter::FeatureData* deviceFeatueData, int R, int F, float k, float sigma2Scale, PixelVarianceBuffer varBuf, NonLocalMeansFilter::FilterWeightBuffer weightBuffer, int x_off, int y_off)
@@ -147,13 +166,152 @@ CUDA_GLOBAL void applyWeights(Image img, RGBE* deviceDataCached, NonLocalMeansFi
 	}
 }
 
-CUDA_GLOBAL void copyToCached(Image img, RGBE* deviceDataCached, float splatScale)
+CUDA_GLOBAL void copyToCached(Image img, RGBE* deviceDataCached, Spectrum* deviceColors, float* deviceVariances, PixelVarianceBuffer varBuf, float splatScale)
 {
 	int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y, w = img.getWidth(), h = img.getHeight();
 	if (x < img.getWidth() && y < img.getHeight())
 	{
 		auto c_p = img.getPixelData(x, y).toSpectrum(splatScale);
 		deviceDataCached[y * img.getWidth() + x] = c_p.toRGBE();
+		deviceColors[y * w + x] = c_p;
+		deviceVariances[y * w + x] = varBuf(x, y).computeVariance();
+	}
+}
+
+#define NLM_APRON_SIZE (NLM_TILE_SIZE + 2 * NLM_MAX_PATCH_RADIUS)
+
+//Computes the weights of all pixels in a tile for all offsets in [-R, R]^2.
+//Instead of summing the (2F+1)^2 terms of each patch the per pixel terms of one offset are computed once for the tile and its apron
+//and then summed with horizontal and vertical sliding windows, making the cost per pixel O(R^2) instead of O(R^2 * F^2).
+CUDA_GLOBAL void computeWeightsTiledKernel(const Spectrum* colors, const float* variances, int w, int h, NonLocalMeansFilter::PatchDistanceParameters para, const unsigned int* tileList, int numTilesX, NonLocalMeansFilter::FilterWeightBuffer weightBuffer)
+{
+	CUDA_SHARED float s_terms[NLM_APRON_SIZE * NLM_APRON_SIZE];
+	CUDA_SHARED float s_rowSums[NLM_APRON_SIZE * NLM_TILE_SIZE];
+
+	const int F = para.F, R = para.R, A = NLM_TILE_SIZE + 2 * F;
+	const unsigned int tile = tileList[blockIdx.x];
+	const int tx0 = (tile % numTilesX) * NLM_TILE_SIZE, ty0 = (tile / numTilesX) * NLM_TILE_SIZE;
+	const int tid = threadIdx.y * blockDim.x + threadIdx.x, nThreads = blockDim.x * blockDim.y;
+
+	for (int yo = -R; yo <= R; yo++)
+		for (int xo = -R; xo <= R; xo++)
+		{
+			for (int i = tid; i < A * A; i += nThreads)
+			{
+				int px = tx0 - F + i % A, py = ty0 - F + i / A, qx = px + xo, qy = py + yo;
+				float t = 0.0f;
+				if (px >= 0 && px < w && py >= 0 && py < h && qx >= 0 && qx < w && qy >= 0 && qy < h)
+					t = patchTerm(colors[py * w + px], colors[qy * w + qx], variances[py * w + px], variances[qy * w + qx], para.k, para.sigma2Scale);
+				s_terms[i] = t;
+			}
+			__syncthreads();
+
+			//horizontal window sums, one thread per apron row
+			if (tid < A)
+			{
+				float sum = 0.0f;
+				for (int lx = 0; lx < 2 * F; lx++)
+					sum += s_terms[tid * A + lx];
+				for (int lx = 0; lx < NLM_TILE_SIZE; lx++)
+				{
+					sum += s_terms[tid * A + lx + 2 * F];
+					s_rowSums[tid * NLM_TILE_SIZE + lx] = sum;
+					sum -= s_terms[tid * A + lx];
+				}
+			}
+			__syncthreads();
+
+			//vertical window sums, one thread per tile column
+			if (tid < NLM_TILE_SIZE)
+			{
+				int x = tx0 + tid, qx = x + xo;
+				float sum = 0.0f;
+				for (int ly = 0; ly < 2 * F; ly++)
+					sum += s_rowSums[ly * NLM_TILE_SIZE + tid];
+				for (int ly = 0; ly < NLM_TILE_SIZE; ly++)
+				{
+					sum += s_rowSums[(ly + 2 * F) * NLM_TILE_SIZE + tid];
+					int y = ty0 + ly, qy = y + yo;
+					if (x < w && y < h)
+					{
+						int n = numValidPatchOffsets(x, xo, F, w) * numValidPatchOffsets(y, yo, F, h);
+						bool validQ = qx >= 0 && qx < w && qy >= 0 && qy < h;
+						weightBuffer(x, y)(xo, yo) = validQ ? distanceToWeight(n != 0 ? sum / n : 0.0f) : 0.0f;
+					}
+					sum -= s_rowSums[ly * NLM_TILE_SIZE + tid];
+				}
+			}
+			__syncthreads();
+		}
+}
+
+//host version of computeWeightsTiledKernel for a single tile, the column sums are computed for all columns at once so the inner loops can be vectorized
+static void computeTileWeightsHost(const Spectrum* colors, const float* variances, int w, int h, const NonLocalMeansFilter::PatchDistanceParameters& para, unsigned int tile, int numTilesX, float* weights, float* terms, float* rowSums)
+{
+	const int F = para.F, R = para.R, A = NLM_TILE_SIZE + 2 * F, nWeights = math::sqr(2 * R + 1);
+	const int tx0 = (tile % numTilesX) * NLM_TILE_SIZE, ty0 = (tile / numTilesX) * NLM_TILE_SIZE;
+	const int tw = min(NLM_TILE_SIZE, w - tx0), th = min(NLM_TILE_SIZE, h - ty0);
+	float colSums[NLM_TILE_SIZE];
+
+	for (int yo = -R; yo <= R; yo++)
+		for (int xo = -R; xo <= R; xo++)
+		{
+			const int weightIdx = (yo + R) * (2 * R + 1) + (xo + R);
+			for (int ly = 0; ly < A; ly++)
+			{
+				int py = ty0 - F + ly, qy = py + yo;
+				bool validY = py >= 0 && py < h && qy >= 0 && qy < h;
+				for (int lx = 0; lx < A; lx++)
+				{
+					int px = tx0 - F + lx, qx = px + xo;
+					float t = 0.0f;
+					if (validY && px >= 0 && px < w && qx >= 0 && qx < w)
+						t = patchTerm(colors[py * w + px], colors[qy * w + qx], variances[py * w + px], variances[qy * w + qx], para.k, para.sigma2Scale);
+					terms[ly * A + lx] = t;
+				}
+
+				float sum = 0.0f;
+				for (int lx = 0; lx < 2 * F; lx++)
+					sum += terms[ly * A + lx];
+				for (int lx = 0; lx < NLM_TILE_SIZE; lx++)
+				{
+					sum += terms[ly * A + lx + 2 * F];
+					rowSums[ly * NLM_TILE_SIZE + lx] = sum;
+					sum -= terms[ly * A + lx];
+				}
+			}
+
+			std::fill(colSums, colSums + NLM_TILE_SIZE, 0.0f);
+			for (int ly = 0; ly < 2 * F; ly++)
+				for (int lx = 0; lx < NLM_TILE_SIZE; lx++)
+					colSums[lx] += rowSums[ly * NLM_TILE_SIZE + lx];
+			for (int ly = 0; ly < th; ly++)
+			{
+				for (int lx = 0; lx < NLM_TILE_SIZE; lx++)
+					colSums[lx] += rowSums[(ly + 2 * F) * NLM_TILE_SIZE + lx];
+
+				int y = ty0 + ly, qy = y + yo, n_y = numValidPatchOffsets(y, yo, F, h);
+				for (int lx = 0; lx < tw; lx++)
+				{
+					int x = tx0 + lx, qx = x + xo, n = numValidPatchOffsets(x, xo, F, w) * n_y;
+					bool validQ = qx >= 0 && qx < w && qy >= 0 && qy < h;
+					weights[(y * w + x) * nWeights + weightIdx] = validQ ? distanceToWeight(n != 0 ? colSums[lx] / n : 0.0f) : 0.0f;
+				}
+
+				for (int lx = 0; lx < NLM_TILE_SIZE; lx++)
+					colSums[lx] -= rowSums[ly * NLM_TILE_SIZE + lx];
+			}
+		}
+}
+
+CUDA_GLOBAL void computeTileVariances(const float* deviceVariances, int w, int h, int numTilesX, float* tileVariances)
+{
+	int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
+	if (x < w && y < h)
+	{
+		float v = deviceVariances[y * w + x];
+		if (!math::IsNaN(v))
+			atomicAdd(&tileVariances[(y / NLM_TILE_SIZE) * numTilesX + x / NLM_TILE_SIZE], v);
 	}
 }
 
@@ -181,6 +339,73 @@ CUDA_GLOBAL void initializeFeatureBuffer(NonLocalMeansFilter::FeatureData* devic
 	}
 }
 
+void NonLocalMeansFilter::computeDirtyTiles(const PixelVarianceBuffer& varBuffer, int w, int h, bool all, std::vector<unsigned int>& tiles)
+{
+	const int numTiles = m_numTilesX * m_numTilesY;
+	std::vector<float> tileVariances(numTiles);
+	ThrowCudaErrors(cudaMemset(m_deviceTileVariances, 0, numTiles * sizeof(float)));
+	computeTileVariances << <dim3(w / BLOCK_SIZE + 1, h / BLOCK_SIZE + 1), dim3(BLOCK_SIZE, BLOCK_SIZE) >> > (m_deviceVariances, w, h, m_numTilesX, m_deviceTileVariances);
+	CUDA_MEMCPY_TO_HOST(&tileVariances[0], m_deviceTileVariances, numTiles * sizeof(float));
+
+	const float threshold = m_settings.getValue(KEY_IncrementalVarianceThreshold());
+	tiles.clear();
+	for (int i = 0; i < numTiles; i++)
+	{
+		int tx = i % m_numTilesX, ty = i / m_numTilesX;
+		float numPixels = float(min(NLM_TILE_SIZE, w - tx * NLM_TILE_SIZE) * min(NLM_TILE_SIZE, h - ty * NLM_TILE_SIZE));
+		float var = tileVariances[i] / numPixels, prev_var = m_tileVariances[i];
+		if (all || prev_var < 0 || math::abs(var - prev_var) > threshold * max(prev_var, 1e-6f))
+		{
+			tiles.push_back(i);
+			m_tileVariances[i] = var;
+		}
+	}
+}
+
+void NonLocalMeansFilter::computeWeightsTiled(Image& img, const PatchDistanceParameters& para, const std::vector<unsigned int>& tiles)
+{
+	CUDA_MEMCPY_TO_DEVICE(m_deviceTileList, &tiles[0], tiles.size() * sizeof(unsigned int));
+	computeWeightsTiledKernel << <(unsigned int)tiles.size(), dim3(NLM_TILE_SIZE, 8) >> >(m_deviceColors, m_deviceVariances, img.getWidth(), img.getHeight(), para, m_deviceTileList, m_numTilesX, m_weightBuffer);
+	ThrowCudaErrors(cudaThreadSynchronize());
+}
+
+void NonLocalMeansFilter::computeWeightsTiledHost(Image& img, const PatchDistanceParameters& para, const std::vector<unsigned int>& tiles)
+{
+	const int w = img.getWidth(), h = img.getHeight(), nWeights = m_weightBuffer.n_weights_per_pixel;
+	m_hostColors.resize(w * h);
+	m_hostVariances.resize(w * h);
+	m_hostWeights.resize((size_t)w * h * nWeights);
+	CUDA_MEMCPY_TO_HOST(&m_hostColors[0], m_deviceColors, w * h * sizeof(Spectrum));
+	CUDA_MEMCPY_TO_HOST(&m_hostVariances[0], m_deviceVariances, w * h * sizeof(float));
+
+	std::atomic<unsigned int> nextTile(0);
+	auto worker = [&]()
+	{
+		std::vector<float> terms(NLM_APRON_SIZE * NLM_APRON_SIZE), rowSums(NLM_APRON_SIZE * NLM_TILE_SIZE);
+		unsigned int i;
+		while ((i = nextTile++) < tiles.size())
+			computeTileWeightsHost(&m_hostColors[0], &m_hostVariances[0], w, h, para, tiles[i], m_numTilesX, &m_hostWeights[0], &terms[0], &rowSums[0]);
+	};
+	std::vector<std::thread> threads;
+	unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+	for (unsigned int i = 0; i < numThreads; i++)
+		threads.push_back(std::thread(worker));
+	for (auto& t : threads)
+		t.join();
+
+	//only copy the rows of the updated tiles
+	for (auto tile : tiles)
+	{
+		int tx0 = (tile % m_numTilesX) * NLM_TILE_SIZE, ty0 = (tile / m_numTilesX) * NLM_TILE_SIZE;
+		int tw = min(NLM_TILE_SIZE, w - tx0), th = min(NLM_TILE_SIZE, h - ty0);
+		for (int y = ty0; y < ty0 + th; y++)
+		{
+			size_t off = ((size_t)y * w + tx0) * nWeights;
+			CUDA_MEMCPY_TO_DEVICE(m_weightBuffer.deviceWeightBuffer + off, &m_hostWeights[off], tw * nWeights * sizeof(float));
+		}
+	}
+}
+
 void NonLocalMeansFilter::Apply(Image& img, int numPasses, float splatScale, const PixelVarianceBuffer& varBuffer)
 {
 	const int R = 6, F = 3;
@@ -205,10 +430,27 @@ void NonLocalMeansFilter::Apply(Image& img, int numPasses, float splatScale, con
 	}
 
 	//copy the data to the cached version
-	copyToCached << <dim3(xResolution / BLOCK_SIZE + 1, yResolution / BLOCK_SIZE + 1), dim3(BLOCK_SIZE, BLOCK_SIZE) >> >(img, m_cachedImg, splatScale);
+	copyToCached << <dim3(xResolution / BLOCK_SIZE + 1, yResolution / BLOCK_SIZE + 1), dim3(BLOCK_SIZE, BLOCK_SIZE) >> >(img, m_cachedImg, m_deviceColors, m_deviceVariances, varBuffer, splatScale);
 	ThrowCudaErrors(cudaThreadSynchronize());
 
-	if (last_iter_weight_update + 1 != numPasses || (numPasses % n_update) == 0 || force_update)
+	bool consecutive_pass = last_iter_weight_update + 1 == numPasses;
+	bool periodic_update = !consecutive_pass || (numPasses % n_update) == 0 || force_update;
+	if (m_settings.getValue(KEY_TiledWeights()) && F <= NLM_MAX_PATCH_RADIUS)
+	{
+		//the incremental mode checks every pass which tiles changed enough to require new weights
+		bool incremental = m_settings.getValue(KEY_IncrementalUpdate());
+		if (periodic_update || incremental)
+		{
+			std::vector<unsigned int> tiles;
+			computeDirtyTiles(varBuffer, xResolution, yResolution, !incremental || !consecutive_pass || force_update, tiles);
+			PatchDistanceParameters para = { R, F, k, sigma2Scale };
+			if (tiles.size() && m_settings.getValue(KEY_ComputeWeightsOnHost()))
+				computeWeightsTiledHost(img, para, tiles);
+			else if (tiles.size())
+				computeWeightsTiled(img, para, tiles);
+		}
+	}
+	else if (periodic_update)
 	{
 		m_weightBuffer.ClearBuffer();
 		cudaFuncSetCacheConfig(computeWeights, cudaFuncCachePreferShared);
@@ -4,10 +4,16 @@
 #include <SceneTypes/Filter.h>
 #include <Math/half.h>
 #include <Math/Compression.h>
+#include <vector>
 
 namespace CudaTracerLib
 {
 
+//the size of the tiles the weights are computed in, the variance based incremental updates work on the same tiles
+#define NLM_TILE_SIZE 32
+//the maximum patch radius F supported by the tiled weight computation
+#define NLM_MAX_PATCH_RADIUS 4
+
 class NonLocalMeansFilter : public ImageSamplesFilter
 {
 public:
@@ -45,6 +51,8 @@ public:
 		{
 			if (deviceWeightBuffer)
 				CUDA_FREE(deviceWeightBuffer);
+			deviceWeightBuffer = 0;
+			R = F = -1;
 		}
 
 		void ClearBuffer()
@@ -94,22 +102,52 @@ public:
 			return f;
 		}
 	};
+	struct PatchDistanceParameters
+	{
+		int R, F;
+		float k, sigma2Scale;
+	};
 private:
 	RGBE* m_cachedImg;
 	FeatureData* m_featureBuffer;
 	FilterWeightBuffer m_weightBuffer;
 	int last_iter_weight_update;
+
+	//full precision copies of the pixel colors and variances used by the tiled weight computation
+	Spectrum* m_deviceColors;
+	float* m_deviceVariances;
+	int m_numTilesX, m_numTilesY;
+	unsigned int* m_deviceTileList;
+	float* m_deviceTileVariances;
+	//the average variance of each tile at the time its weights were computed
+	std::vector<float> m_tileVariances;
+
+	std::vector<Spectrum> m_hostColors;
+	std::vector<float> m_hostVariances;
+	std::vector<float> m_hostWeights;
+
+	void computeDirtyTiles(const PixelVarianceBuffer& varBuffer, int w, int h, bool all, std::vector<unsigned int>& tiles);
+	void computeWeightsTiled(Image& img, const PatchDistanceParameters& para, const std::vector<unsigned int>& tiles);
+	void computeWeightsTiledHost(Image& img, const PatchDistanceParameters& para, const std::vector<unsigned int>& tiles);
 public:
 	PARAMETER_KEY(float, k)
 	PARAMETER_KEY(float, sigma2Scale)
 	PARAMETER_KEY(int, UpdateWeightPeriodicity)
+	PARAMETER_KEY(bool, TiledWeights)
+	PARAMETER_KEY(bool, ComputeWeightsOnHost)
+	PARAMETER_KEY(bool, IncrementalUpdate)
+	PARAMETER_KEY(float, IncrementalVarianceThreshold)
 
 	NonLocalMeansFilter()
-		: m_cachedImg(0), last_iter_weight_update(-1)
+		: m_cachedImg(0), last_iter_weight_update(-1), m_deviceColors(0), m_deviceVariances(0), m_numTilesX(0), m_numTilesY(0), m_deviceTileList(0), m_deviceTileVariances(0)
 	{
 		m_settings	<< KEY_k()								<< CreateInterval(0.45f, 0.0f, FLT_MAX)
 					<< KEY_sigma2Scale()					<< CreateInterval(0.005f, 0.0f, FLT_MAX)
-					<< KEY_UpdateWeightPeriodicity()		<< CreateInterval(25, 0, INT_MAX);
+					<< KEY_UpdateWeightPeriodicity()		<< CreateInterval(25, 0, INT_MAX)
+					<< KEY_TiledWeights()					<< CreateSetBool(true)
+					<< KEY_ComputeWeightsOnHost()			<< CreateSetBool(false)
+					<< KEY_IncrementalUpdate()				<< CreateSetBool(false)
+					<< KEY_IncrementalVarianceThreshold()	<< CreateInterval(0.1f, 0.0f, FLT_MAX);
 	}
 	virtual void Free()
 	{
@@ -117,14 +155,27 @@ public:
 		{
 			CUDA_FREE(m_cachedImg);
 			CUDA_FREE(m_featureBuffer);
+			CUDA_FREE(m_deviceColors);
+			CUDA_FREE(m_deviceVariances);
+			CUDA_FREE(m_deviceTileList);
+			CUDA_FREE(m_deviceTileVariances);
+			m_cachedImg = 0;
 		}
 		m_weightBuffer.Free();
+		m_hostWeights.clear();
 	}
 	virtual void Resize(int xRes, int yRes)
 	{
 		Free();
+		m_numTilesX = (xRes + NLM_TILE_SIZE - 1) / NLM_TILE_SIZE;
+		m_numTilesY = (yRes + NLM_TILE_SIZE - 1) / NLM_TILE_SIZE;
 		CUDA_MALLOC(&m_cachedImg, xRes * yRes * sizeof(RGBE));
 		CUDA_MALLOC(&m_featureBuffer, xRes * yRes * sizeof(FeatureData));
+		CUDA_MALLOC(&m_deviceColors, xRes * yRes * sizeof(Spectrum));
+		CUDA_MALLOC(&m_deviceVariances, xRes * yRes * sizeof(float));
+		CUDA_MALLOC(&m_deviceTileList, m_numTilesX * m_numTilesY * sizeof(unsigned int));
+		CUDA_MALLOC(&m_deviceTileVariances, m_numTilesX * m_numTilesY * sizeof(float));
+		m_tileVariances.assign(m_numTilesX * m_numTilesY, -1.0f);
 		last_iter_weight_update = -1;
 	}
 	virtual void Apply(Image& img, int numPasses, float splatScale, const PixelVarianceBuffer& varBuffer);
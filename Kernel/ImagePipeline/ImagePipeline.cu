@@ -1,5 +1,6 @@
 #include "ImagePipeline.h"
 #include <Kernel/Tracer.h>
+#include <Base/Profiler.h>
 
 namespace CudaTracerLib
 {
@@ -53,6 +54,7 @@ CUDA_GLOBAL void applyGammaCorrectureToOutput(Image img, int w, int h)
 
 void applyImagePipeline(const TracerBase& tracer, Image& img, ImageSamplesFilter* filter, PostProcess* process)
 {
+	PROFILE_ZONE("Image", "Image Pipeline");
 	auto numPasses = tracer.getNumPassesDone();
 	auto splatScale = tracer.getSplatScale();
 	auto pixelVarianceBuffer = tracer.getPixelVarianceBuffer();
@@ -65,17 +67,23 @@ void applyImagePipeline(const TracerBase& tracer, Image& img, ImageSamplesFilter
 	else if(!filter) //copy to filtered data (Stage 2)
 	{
 		copySamplesToFiltered << <dim3(xResolution / block + 1, yResolution / block + 1), dim3(block, block) >> >(img, xResolution, yResolution, splatScale);
+		PROFILE_ZONE("Image", "Post Process");
 		process->Apply(img, numPasses, pixelVarianceBuffer);
 		applyGammaCorrectureToOutput << <dim3(xResolution / block + 1, yResolution / block + 1), dim3(block, block) >> >(img, xResolution, yResolution);
 	}
 	else if(!process) //only use filter, copy to output
 	{
+		PROFILE_ZONE("Image", "Filter");
 		filter->Apply(img, numPasses, splatScale, pixelVarianceBuffer);
 		copyFilteredToOutput << <dim3(xResolution / block + 1, yResolution / block + 1), dim3(block, block) >> >(img, xResolution, yResolution);
 	}
 	else //use both
 	{
-		filter->Apply(img, numPasses, splatScale, pixelVarianceBuffer);
+		{
+			PROFILE_ZONE("Image", "Filter");
+			filter->Apply(img, numPasses, splatScale, pixelVarianceBuffer);
+		}
+		PROFILE_ZONE("Image", "Post Process");
 		process->Apply(img, numPasses, pixelVarianceBuffer);
 		applyGammaCorrectureToOutput << <dim3(xResolution / block + 1, yResolution / block + 1), dim3(block, block) >> >(img, xResolution, yResolution);
 	}
@@ -27,6 +27,7 @@ inline void applyImagePipeline(TracerBase& tracer, Image& img, const Filter& F)
 {
 	CanonicalFilter f(F);
 	applyImagePipeline(tracer, img, &f);
+	f.Free();
 }
 
 }
\ No newline at end of file
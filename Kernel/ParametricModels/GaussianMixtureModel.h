@@ -12,7 +12,7 @@
 
 namespace CudaTracerLib {
 
-CUDA_FUNC_IN float randomNormal(CudaRNG& rng)
+template<typename RNG> CUDA_FUNC_IN float randomNormal(RNG& rng)
 {
 	float U1 = rng.randomFloat(), U2 = rng.randomFloat();
 	return math::sqrt(-2.0f * math::log(U1)) * cosf(2.0f * PI * U2);
@@ -51,7 +51,7 @@ template<int D, int K> struct GaussianMixtureModel
 			return pdf_coeff * math::exp(b);
 		}
 
-		CUDA_FUNC_IN vec sample(CudaRNG& rng) const
+		template<typename RNG> CUDA_FUNC_IN vec sample(RNG& rng) const
 		{
 			vec x;
 			for (int i = 0; i < D; i++)
@@ -95,21 +95,30 @@ template<int D, int K> struct GaussianMixtureModel
 		return p;
 	}
 
-	CUDA_FUNC_IN vec sample(CudaRNG& rng, const vec& range_min, const vec& range_max, float& pdf) const
+	//the rng can be any type with randomFloat, like CudaRNG or the samplers of the integrators
+	template<typename RNG> CUDA_FUNC_IN vec sample(RNG& rng, const vec& range_min, const vec& range_max, float& pdf) const
 	{
 		float U = rng.randomFloat();
 		float s = 0;
-		for (int i = 0; i < K; i++)
+		//the weights do not sum up to exactly one, the remainder belongs to the last component
+		int k = K - 1;
+		for (int i = 0; i < K - 1; i++)
 		{
 			if (s <= U && U < s + weights[i])
 			{
-				auto x = components[i].sample(rng);
-				pdf = this->pdf(x, range_min, range_max);
-				return x;
+				k = i;
+				break;
 			}
 			s += weights[i];
 		}
-		return vec();
+		auto x = components[k].sample(rng);
+		pdf = this->pdf(x, range_min, range_max);
+		return x;
+	}
+
+	CUDA_FUNC_IN bool isTrained() const
+	{
+		return true;
 	}
 
 	static GaussianMixtureModel<D, K> Random(CudaRNG& rng, const vec& mi, const vec& ma)
@@ -144,10 +153,14 @@ template<int D, int K> struct GaussianMixtureModel
 			{
 				float gamma[K];
 			};
-			std::vector<responsibilities> gamma;
+			responsibilities* gamma;
 			gamma_t(int N)
 			{
-				gamma = decltype(gamma)(N);
+				//reuse the storage of the previous fits on this thread instead of allocating for every call
+				static thread_local std::vector<responsibilities> storage;
+				if (storage.size() < (size_t)N)
+					storage.resize(N);
+				gamma = storage.data();
 			}
 			//data index, komponent index
 			float& operator()(int i, int k)
@@ -164,9 +177,10 @@ template<int D, int K> struct GaussianMixtureModel
 		return gmm;
 	}
 protected:
-	template<typename gamma_t> CUDA_FUNC_IN gamma_t computeGamma(const vec* samples, int N)
+	//computes the responsibilities and returns the log likelihood of the samples under the current parameters
+	template<typename gamma_t> CUDA_FUNC_IN float computeGamma(const vec* samples, int N, gamma_t& gamma)
 	{
-		gamma_t gamma(N);
+		float L = 0;
 		//compute gammas, iterate over all data points
 		for (int i = 0; i < N; i++)
 		{
@@ -179,10 +193,13 @@ protected:
 				sum += gamma(i, k);
 			}
 			//make the computed responsibilities relative by using the sum
+			float inv_sum = 1.0f / sum;
 			for (int k = 0; k < K; k++)
-				gamma(i, k) /= sum;
+				gamma(i, k) *= inv_sum;
+			//the sum is the pdf of the mixture
+			L += log(sum);
 		}
-		return gamma;
+		return L;
 	}
 	template<typename gamma_t> CUDA_FUNC_IN void updateTheta(const gamma_t& gamma, const vec* samples, int N)
 	{
@@ -221,13 +238,14 @@ protected:
 	{
 		int iter = 0;
 		const float eps = 0.0001f;
-		float L_old, L_new = computeL(samples, N);
+		gamma_t gamma(N);
+		//the e-step of the next iteration yields the likelihood of the updated parameters, no separate pass is necessary
+		float L_old, L_new = computeGamma(samples, N, gamma);
 		do
 		{
-			auto gamma = computeGamma<gamma_t>(samples, N);
 			updateTheta(gamma, samples, N);
 			L_old = L_new;
-			L_new = computeL(samples, N);
+			L_new = computeGamma(samples, N, gamma);
 		} while (math::abs(L_old - L_new) > eps * math::abs(L_new) && iter++ < 1000);
 		if(n_iterations_used)
 			*n_iterations_used = iter;
@@ -336,6 +354,12 @@ template <int D, int K> struct OnlineEMGaussianMixtureModel : public GaussianMix
 		return trainingHelper(*this);
 	}
 
+	//the randomly initialized model is not fit for sampling
+	CUDA_FUNC_IN bool isTrained() const
+	{
+		return num_samples > 0;
+	}
+
 	CUDA_FUNC_IN void Train(const vec* samples, const float* sample_weights, int N)
 	{
 		if (N < 3)
@@ -381,7 +405,8 @@ protected:
 		const float alpha = 0.7f;
 		float ny = math::pow(n, -alpha);
 
-		auto gamma = this->computeGamma<gamma_t>(samples, N);
+		gamma_t gamma(N);
+		this->computeGamma(samples, N, gamma);
 
 		for (int j = 0; j < K; j++)
 		{
@@ -6,6 +6,9 @@
 #include <Base/FixedSizeArray.h>
 #include <Base/CudaRandom.h>
 #include <qMatrixHelper.h>
+#include <vector>
+#include <atomic>
+#include <thread>
 
 namespace CudaTracerLib {
 
@@ -46,7 +49,7 @@ namespace __ParametricMixtureModelBuffer__
 						  blockIdx.y * blockDim.y + threadIdx.y,
 						  blockIdx.z * blockDim.z + threadIdx.z);
 		auto& grid = entryBuffer.getHashGrid();
-		if (idx.x < grid.m_gridDim.x && idx.y < grid.m_gridDim.y && idx.z < grid.m_gridDim.z)
+		if (idx.x < grid.m_gridDim.x && idx.y < grid.m_gridDim.y && idx.z < grid.m_gridDim.z && entryBuffer.hasCellEntries(idx))
 			updateCell(idx, entryBuffer, mixtureBuffer, range_min, range_max);
 	}
 
@@ -150,6 +153,18 @@ public:
 		return m_valueBuffer.Store(pos, entry(val, weight));
 	}
 
+	//capacity of the entry buffer
+	unsigned int getNumEntries() const
+	{
+		return m_valueBuffer.getNumEntries();
+	}
+
+	//number of entries stored since the last update, larger than the capacity if entries were dropped
+	unsigned int getNumStoredEntries() const
+	{
+		return m_valueBuffer.getNumStoredEntries();
+	}
+
 	CUDA_FUNC_IN const Model& getMixtureModel(const Vec3f& pos) const
 	{
 		return m_mixtureBuffer(pos);
@@ -175,13 +190,40 @@ public:
 			//do host-device synchronization and update models
 			m_mixtureBuffer.Synchronize();
 			m_valueBuffer.Synchronize();
+
+			//only the models of cells with new entries change, the list is reused over all updates on this thread
+			static thread_local std::vector<Vec3u> cellStorage;
+			//the workers have to access the list of this thread, not their own thread local one
+			auto& updateCells = cellStorage;
+			updateCells.clear();
 			auto L = m_valueBuffer.getHashGrid().m_gridDim;
 			for (unsigned int i = 0; i < L.x; i++)
 				for (unsigned int j = 0; j < L.y; j++)
 					for (unsigned int k = 0; k < L.z; k++)
-						__ParametricMixtureModelBuffer__::updateCell(Vec3u(i,j,k), m_valueBuffer, m_mixtureBuffer, range_min, range_max);
-			m_mixtureBuffer.setOnCPU();
-			m_mixtureBuffer.Synchronize();
+						if (m_valueBuffer.hasCellEntries(Vec3u(i, j, k)))
+							updateCells.push_back(Vec3u(i, j, k));
+
+			//the cells are independent, the training data of each one is kept on the stack of the worker
+			std::atomic<size_t> nextCell(0);
+			auto worker = [&]()
+			{
+				size_t i;
+				while ((i = nextCell++) < updateCells.size())
+					__ParametricMixtureModelBuffer__::updateCell(updateCells[i], m_valueBuffer, m_mixtureBuffer, range_min, range_max);
+			};
+			unsigned int numThreads = (unsigned int)std::min(updateCells.size() / 16 + 1, (size_t)std::max(1u, std::thread::hardware_concurrency()));
+			std::vector<std::thread> threads;
+			for (unsigned int i = 1; i < numThreads; i++)
+				threads.push_back(std::thread(worker));
+			worker();
+			for (auto& t : threads)
+				t.join();
+
+			if (updateCells.size())
+			{
+				m_mixtureBuffer.setOnCPU();
+				m_mixtureBuffer.Synchronize();
+			}
 		}
 
 		//clear the entry buffer for the next iteration
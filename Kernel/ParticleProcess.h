@@ -58,6 +58,7 @@ template<bool NEEDS_EMISSION_SAMPLE, bool PARTICIPATING_MEDIA = true, bool SUBSU
 
 	int depth = -1;
 	BSDFSamplingRecord bRec;
+	bRec.sampleHero(rng);
 
 	KernelAggregateVolume& V = g_SceneData.m_sVolume;
 	MediumSamplingRecord mRec;
@@ -3,6 +3,7 @@
 #include <map>
 #include <string>
 #include <limits>
+#include <vector>
 #include <Base/SynchronizedBuffer.h>
 #include <Math/Vector.h>
 #include <Math/Spectrum.h>
@@ -95,6 +96,10 @@ public:
 	{
 		return m_name;
 	}
+	//number of floats per pixel of the raw data
+	virtual unsigned int getNumComponents() const = 0;
+	//copies the scaled raw data to the host, getNumComponents() interleaved floats per pixel in row major order
+	virtual void getComponents(std::vector<float>& data) = 0;
 
 	enum class FeatureVisualizer
 	{
@@ -155,6 +160,23 @@ public:
 		m_buffer.Synchronize();
 	}
 
+	virtual unsigned int getNumComponents() const
+	{
+		return sizeof(T) / sizeof(float);
+	}
+
+	virtual void getComponents(std::vector<float>& data)
+	{
+		CopyFromGPU();
+		unsigned int n = getNumComponents();
+		data.resize(m_width * m_height * n);
+		for (unsigned int i = 0; i < m_width * m_height; i++)
+		{
+			T val = m_buffer[i] * m_uniform_scale;
+			memcpy(&data[i * n], &val, sizeof(T));
+		}
+	}
+
 	CUDA_FUNC_IN T& operator()(unsigned int x, unsigned int y)
 	{
 		return m_buffer[y * m_width + x];
@@ -12,7 +12,8 @@ CUDA_GLOBAL void updateVarianceBuffer(PixelVarianceBuffer buf, Image img, unsign
 	unsigned int x = threadIdx.x + blockDim.x * blockIdx.x, y = threadIdx.y + blockDim.y * blockIdx.y;
 	unsigned int b_x = x / BLOCK_SAMPLER_BlockSize, b_y = y / BLOCK_SAMPLER_BlockSize, bIdx = b_y * numTotalBlocksX + b_x;
 
-	if (x < img.getWidth() && y < img.getHeight() && g_BlockFlags[bIdx])
+	//converged pixels did not receive samples in this pass
+	if (x < img.getWidth() && y < img.getHeight() && g_BlockFlags[bIdx] && !g_ConvergenceMask.isConverged(x, y))
 	{
 		buf(x, y).updateMoments(img.getPixelData(x, y), splatScale, g_BlockFlags[bIdx]);
 	}
@@ -23,7 +24,7 @@ void PixelVarianceBuffer::AddPass(Image& img, float splatScale, const IBlockSamp
 	auto nBlocks = blockSampler->getNumTotalBlocks();
 	char* blockFlags = (char*)alloca(nBlocks);
 	Platform::SetMemory(blockFlags, nBlocks);
-	blockSampler->IterateBlocks([&](unsigned int i, int x, int y, int bw, int bh)
+	blockSampler->IterateActiveBlocks([&](unsigned int i, int x, int y, int bw, int bh)
 	{
 		blockFlags[i]++;
 	});
@@ -36,4 +37,22 @@ void PixelVarianceBuffer::AddPass(Image& img, float splatScale, const IBlockSamp
 	m_pixelBuffer.setOnGPU();
 }
 
+float PixelVarianceBuffer::computeAverageVariance() const
+{
+	auto& buf = ((PixelVarianceBuffer*)this)->m_pixelBuffer;
+	buf.Synchronize();
+	double sum = 0;
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < width * height; i++)
+	{
+		const PixelVarianceInfo& info = buf[i];
+		if (info.num_samples_var > 1)
+		{
+			sum += info.computeVariance();
+			n++;
+		}
+	}
+	return n ? float(sum / n) : -1.0f;
+}
+
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 #include <Engine/Image.h>
 #include <Base/SynchronizedBuffer.h>
+#include <Base/RenderCheckpoint.h>
 #include <Math/VarAccumulator.h>
 
 namespace CudaTracerLib
@@ -22,7 +23,8 @@ struct PixelVarianceInfo
 	{
 		Spectrum s, s2;
 		s.fromLinearRGB(pixel.rgb[0], pixel.rgb[1], pixel.rgb[2]);
-		s2.fromLinearRGB(pixel.rgbSplat[0], pixel.rgbSplat[1], pixel.rgbSplat[2]);
+		Vec3f splat = pixel.getSplat();
+		s2.fromLinearRGB(splat.x, splat.y, splat.z);
 		Spectrum new_pixel_sum = s + s2 * splatScale;//value of pixel after iteration
 		Spectrum estimator_val_1 = (new_pixel_sum - prev_I) / samplerPerformed;
 		prev_I = new_pixel_sum;
@@ -51,12 +53,23 @@ struct PixelVarianceInfo
 	}
 
 	//error metric from "A Hierarchical Automatic Stopping Condition for Monte Carlo Global Illumination" (2009)
+	//the relative error is undefined for zero mean pixels, these use the standard deviation of the estimator as absolute error
+	//NaN pixels get the error 1 so they are never considered converged
 	CUDA_FUNC_IN float computeError() const
 	{
 		Spectrum I = prev_I / weight;
 		Spectrum A = half_buffer / float(iterations_done / 2);
+		if (I.isNaN() || A.isNaN())
+			return 1.0f;
+		if (I.isZero())
+		{
+			float var = computeVariance();
+			if (math::IsNaN(var))
+				return 1.0f;
+			return var > 0 ? max(math::sqrt(var), 1e-2f) : 0.0f;
+		}
 		float e_p = (I - A).abs().sum() / math::sqrt(I.sum());
-		return I.isZero() || I.isNaN() || A.isNaN() ? 0.0f : max(e_p, 1e-2f);
+		return math::IsNaN(e_p) ? 1.0f : max(e_p, 1e-2f);
 	}
 };
 
@@ -85,6 +98,20 @@ public:
 
 	void AddPass(Image& img, float splatScale, const IBlockSampler* blockSampler);
 
+	void SaveState(RenderCheckpoint& checkpoint)
+	{
+		checkpoint.WriteValue("PixelVarianceBuffer.NumPasses", m_numPasses);
+		checkpoint.WriteBuffer("PixelVarianceBuffer.Pixels", m_pixelBuffer);
+	}
+	void LoadState(const RenderCheckpoint& checkpoint)
+	{
+		checkpoint.ReadValue("PixelVarianceBuffer.NumPasses", m_numPasses);
+		checkpoint.ReadBuffer("PixelVarianceBuffer.Pixels", m_pixelBuffer);
+	}
+
+	//average of the per pass variance over all pixels with at least two passes, negative if there are none
+	CTL_EXPORT float computeAverageVariance() const;
+
 	CUDA_FUNC_IN PixelVarianceInfo& operator()(unsigned int x, unsigned int y)
 	{
 		return m_pixelBuffer[y * width + x];
@@ -0,0 +1,222 @@
+#include <StdAfx.h>
+#include "RenderScheduler.h"
+#include "Tracer.h"
+#include <Engine/Image.h>
+#include <algorithm>
+#include <cmath>
+
+namespace CudaTracerLib {
+
+RenderScheduler::RenderScheduler(IRenderSchedulerTransport& transport, const RenderSchedulerSettings& settings)
+	: m_transport(transport), m_settings(settings), m_workers(transport.getNumWorkers()),
+	m_uPassesDone(0), m_uPassesInFlight(0), m_uPassesAtLastMerge(0), m_numWorkersFinished(0)
+{
+
+}
+
+double RenderScheduler::getElapsedSec() const
+{
+	auto now = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration_cast<std::chrono::microseconds>(now - m_startTime).count() / 1e6;
+}
+
+float RenderScheduler::getEstimatedVariance() const
+{
+	//the merged image is the average of all passes, its variance is the average per pass variance divided by the number of passes
+	double weightedVariance = 0;
+	unsigned int passes = 0;
+	for (auto& w : m_workers)
+		if (w.passVariance >= 0 && w.passesDone != 0)
+		{
+			weightedVariance += w.passVariance * w.passesDone;
+			passes += w.passesDone;
+		}
+	if (passes == 0)
+		return -1.0f;
+	return float(weightedVariance / passes / m_uPassesDone);
+}
+
+bool RenderScheduler::shouldStop() const
+{
+	if (m_uPassesDone + m_uPassesInFlight >= m_settings.maxPasses)
+		return true;
+	if (m_settings.deadlineSec > 0 && getElapsedSec() >= m_settings.deadlineSec)
+		return true;
+	if (m_settings.targetVariance > 0)
+	{
+		float var = getEstimatedVariance();
+		if (var >= 0 && var <= m_settings.targetVariance)
+			return true;
+	}
+	//every worker renders the whole image, all of them have to be converged
+	bool allConverged = true;
+	for (auto& w : m_workers)
+		allConverged &= w.converged;
+	return allConverged;
+}
+
+unsigned int RenderScheduler::computeAssignmentSize(const WorkerStatistics& worker) const
+{
+	unsigned int passesLeft = m_settings.maxPasses - m_uPassesDone - m_uPassesInFlight;
+
+	//the first assignment of each worker is a single pass to measure its speed
+	if (worker.passesPerSec <= 0)
+		return 1;
+
+	double n = worker.passesPerSec * m_settings.targetAssignmentSec;
+	if (m_settings.deadlineSec > 0)
+	{
+		//do not start work which would end after the deadline
+		double timeLeft = m_settings.deadlineSec - getElapsedSec();
+		n = std::min(n, worker.passesPerSec * timeLeft);
+		if (n < 1)
+			return 0;
+	}
+
+	//spread the remaining passes over all active workers so that the slowest worker does not get the tail alone
+	int numActive = 0;
+	double totalSpeed = 0;
+	for (auto& w : m_workers)
+		if (!w.finished)
+		{
+			numActive++;
+			totalSpeed += w.passesPerSec;
+		}
+	if (totalSpeed > 0)
+		n = std::min(n, std::ceil(passesLeft * worker.passesPerSec / totalSpeed));
+	else n = std::min(n, std::ceil(passesLeft / double(std::max(numActive, 1))));
+
+	return (unsigned int)std::max(1.0, std::min(std::floor(n), (double)passesLeft));
+}
+
+void RenderScheduler::startMerge()
+{
+	m_uPassesAtLastMerge = m_uPassesDone;
+	for (auto& w : m_workers)
+		w.mergePending = true;
+}
+
+void RenderScheduler::RunMaster()
+{
+	m_startTime = std::chrono::high_resolution_clock::now();
+	m_numWorkersFinished = 0;
+	bool mergeActive = false;
+
+	while (m_numWorkersFinished < (int)m_workers.size())
+	{
+		auto report = m_transport.receiveReport();
+		auto& worker = m_workers[report.worker];
+		double now = getElapsedSec();
+
+		if (report.numPasses != 0)
+		{
+			double speed = report.numPasses / std::max(now - worker.assignmentStartSec, 1e-6);
+			//smooth the measurement, the first assignment is too short to be reliable on its own
+			worker.passesPerSec = worker.passesPerSec > 0 ? 0.5 * (worker.passesPerSec + speed) : speed;
+			worker.passesDone += report.numPasses;
+			worker.raysTraced += report.numRays;
+			worker.timeSpentRenderingSec += report.timeSpentRenderingSec;
+			if (report.passVariance >= 0)
+				worker.passVariance = report.passVariance;
+			worker.converged = report.converged;
+			m_uPassesDone += report.numPasses;
+			if (m_progressClb)
+				m_progressClb(report.numPasses);
+		}
+		m_uPassesInFlight -= worker.passesAssigned;
+		worker.passesAssigned = 0;
+
+		//a merge is collective, all workers have to be told before any of them is allowed to finish
+		if (!mergeActive && m_settings.mergeInterval != 0 && m_numWorkersFinished == 0 &&
+			m_uPassesDone - m_uPassesAtLastMerge >= m_settings.mergeInterval && !shouldStop())
+		{
+			startMerge();
+			mergeActive = true;
+		}
+
+		RenderAssignment assignment;
+		assignment.numPasses = 0;
+		if (worker.mergePending)
+		{
+			worker.mergePending = false;
+			mergeActive = std::any_of(m_workers.begin(), m_workers.end(), [](const WorkerStatistics& w) {return w.mergePending; });
+			assignment.type = MergeImages;
+		}
+		else
+		{
+			unsigned int n = shouldStop() ? 0 : computeAssignmentSize(worker);
+			if (n == 0)
+			{
+				assignment.type = FinishRendering;
+				worker.finished = true;
+				m_numWorkersFinished++;
+			}
+			else
+			{
+				assignment.type = RenderPasses;
+				assignment.numPasses = n;
+				worker.passesAssigned = n;
+				m_uPassesInFlight += n;
+			}
+		}
+		worker.assignmentStartSec = getElapsedSec();
+		m_transport.sendAssignment(report.worker, assignment);
+	}
+}
+
+void RenderScheduler::PrintStatus(std::vector<std::string>& a_Buf) const
+{
+	a_Buf.push_back(format("Passes done : %d", m_uPassesDone));
+	float var = getEstimatedVariance();
+	if (var >= 0)
+		a_Buf.push_back(format("Estimated variance : %f", var));
+	for (size_t i = 0; i < m_workers.size(); i++)
+	{
+		auto& w = m_workers[i];
+		a_Buf.push_back(format("Worker %d : %d passes, %.2f passes/sec, %.2f MRays/sec", (int)i, w.passesDone, w.passesPerSec, w.getRaysPerSec() / 1e6));
+	}
+}
+
+void RunRenderWorker(IRenderSchedulerTransport& transport, int worker, TracerBase& tracer, Image& img, const std::function<void()>& merge, const std::function<void()>& clb)
+{
+	RenderWorkerReport report;
+	report.worker = worker;
+	report.numPasses = 0;
+	report.numRays = 0;
+	report.timeSpentRenderingSec = 0;
+	report.passVariance = -1.0f;
+	report.converged = false;
+
+	unsigned int passesDone = 0;
+	while (true)
+	{
+		transport.sendReport(report);
+		auto assignment = transport.receiveAssignment(worker);
+		if (assignment.type == FinishRendering)
+			break;
+
+		report.numPasses = 0;
+		report.numRays = 0;
+		report.timeSpentRenderingSec = 0;
+		if (assignment.type == MergeImages)
+		{
+			merge();
+			continue;
+		}
+
+		//passes after convergence would not render anything, they are still reported to finish the assignment
+		for (unsigned int i = 0; i < assignment.numPasses && !tracer.hasConverged(); i++)
+		{
+			tracer.DoPass(&img, !passesDone++ && !tracer.hasPendingCheckpoint());
+			report.numRays += tracer.getRaysInLastPass();
+			report.timeSpentRenderingSec += tracer.getLastTimeSpentRenderingSec();
+			if (clb)
+				clb();
+		}
+		report.numPasses = assignment.numPasses;
+		report.converged = tracer.hasConverged();
+		report.passVariance = tracer.isMultiPass() ? tracer.getPixelVarianceBuffer().computeAverageVariance() : -1.0f;
+	}
+}
+
+}
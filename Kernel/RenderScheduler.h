@@ -0,0 +1,210 @@
+#pragma once
+#include <Defines.h>
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+namespace CudaTracerLib {
+
+class TracerBase;
+class Image;
+
+//sent from a worker to the master after finishing an assignment, a report with 0 passes requests the first assignment
+struct RenderWorkerReport
+{
+	int worker;
+	//number of passes, traced rays and gpu time of the last assignment
+	unsigned int numPasses;
+	unsigned long long numRays;
+	float timeSpentRenderingSec;
+	//average variance of a single pass of the estimator over all pixels, negative if not available
+	float passVariance;
+	//the stop criterion of the block sampler of the worker is met
+	bool converged;
+};
+
+enum RenderAssignmentType
+{
+	RenderPasses,
+	MergeImages,
+	FinishRendering,
+};
+
+//sent from the master to a worker as answer to a report
+struct RenderAssignment
+{
+	RenderAssignmentType type;
+	unsigned int numPasses;
+};
+
+//the messages are plain structs so that they can be sent as raw bytes
+class IRenderSchedulerTransport
+{
+public:
+	virtual ~IRenderSchedulerTransport()
+	{
+
+	}
+	virtual int getNumWorkers() const = 0;
+	//master side, blocks until the report of any worker is available
+	virtual RenderWorkerReport receiveReport() = 0;
+	virtual void sendAssignment(int worker, const RenderAssignment& assignment) = 0;
+	//worker side
+	virtual void sendReport(const RenderWorkerReport& report) = 0;
+	virtual RenderAssignment receiveAssignment(int worker) = 0;
+};
+
+//transport between threads of one process, the master and each worker run on their own thread
+class LocalRenderSchedulerTransport : public IRenderSchedulerTransport
+{
+	std::mutex m_mutex;
+	std::condition_variable m_reportCondition;
+	std::condition_variable m_assignmentCondition;
+	std::deque<RenderWorkerReport> m_reports;
+	std::vector<std::deque<RenderAssignment>> m_assignments;
+public:
+	LocalRenderSchedulerTransport(int numWorkers)
+		: m_assignments(numWorkers)
+	{
+
+	}
+	virtual int getNumWorkers() const
+	{
+		return (int)m_assignments.size();
+	}
+	virtual RenderWorkerReport receiveReport()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_reports.empty())
+			m_reportCondition.wait(lock);
+		auto report = m_reports.front();
+		m_reports.pop_front();
+		return report;
+	}
+	virtual void sendAssignment(int worker, const RenderAssignment& assignment)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_assignments[worker].push_back(assignment);
+		m_assignmentCondition.notify_all();
+	}
+	virtual void sendReport(const RenderWorkerReport& report)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_reports.push_back(report);
+		m_reportCondition.notify_one();
+	}
+	virtual RenderAssignment receiveAssignment(int worker)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_assignments[worker].empty())
+			m_assignmentCondition.wait(lock);
+		auto assignment = m_assignments[worker].front();
+		m_assignments[worker].pop_front();
+		return assignment;
+	}
+};
+
+struct RenderSchedulerSettings
+{
+	//maximum number of passes rendered by all workers combined
+	unsigned int maxPasses;
+	//wall clock time in seconds after which no new work is handed out, <= 0 to disable
+	double deadlineSec;
+	//rendering stops when the estimated variance of the merged image falls below this value, <= 0 to disable
+	float targetVariance;
+	//desired duration of one assignment, shorter assignments balance better but require more communication
+	double targetAssignmentSec;
+	//number of passes rendered by all workers combined after which the images are merged, 0 to disable
+	unsigned int mergeInterval;
+
+	RenderSchedulerSettings(unsigned int maxPasses = 0xffffffff)
+		: maxPasses(maxPasses), deadlineSec(0), targetVariance(0), targetAssignmentSec(1.0), mergeInterval(0)
+	{
+
+	}
+};
+
+//master of a master/worker scheme which hands out passes on demand
+//the number of passes per assignment is chosen from the measured throughput of each worker so that all workers finish at roughly the same time
+class RenderScheduler
+{
+public:
+	struct WorkerStatistics
+	{
+		unsigned int passesDone;
+		unsigned long long raysTraced;
+		double timeSpentRenderingSec;
+		//wall clock throughput including the communication overhead, 0 if not yet measured
+		double passesPerSec;
+		float passVariance;
+		bool converged;
+		unsigned int passesAssigned;
+		double assignmentStartSec;
+		bool mergePending;
+		bool finished;
+
+		WorkerStatistics()
+			: passesDone(0), raysTraced(0), timeSpentRenderingSec(0), passesPerSec(0), passVariance(-1.0f), converged(false),
+			passesAssigned(0), assignmentStartSec(0), mergePending(false), finished(false)
+		{
+
+		}
+
+		double getRaysPerSec() const
+		{
+			return timeSpentRenderingSec > 0 ? raysTraced / timeSpentRenderingSec : 0.0;
+		}
+	};
+private:
+	IRenderSchedulerTransport& m_transport;
+	RenderSchedulerSettings m_settings;
+	std::vector<WorkerStatistics> m_workers;
+	std::chrono::high_resolution_clock::time_point m_startTime;
+	unsigned int m_uPassesDone;
+	unsigned int m_uPassesInFlight;
+	unsigned int m_uPassesAtLastMerge;
+	int m_numWorkersFinished;
+	std::function<void(unsigned int)> m_progressClb;
+
+	double getElapsedSec() const;
+	bool shouldStop() const;
+	unsigned int computeAssignmentSize(const WorkerStatistics& worker) const;
+	void startMerge();
+public:
+	CTL_EXPORT RenderScheduler(IRenderSchedulerTransport& transport, const RenderSchedulerSettings& settings);
+
+	//called on the master thread with the number of passes finished by a worker
+	void setProgressCallback(const std::function<void(unsigned int)>& clb)
+	{
+		m_progressClb = clb;
+	}
+
+	//hands out work until a stop criterion is met and every worker has been sent FinishRendering
+	CTL_EXPORT void RunMaster();
+
+	//estimated variance of the image merged from all workers, negative if no worker reported a variance
+	CTL_EXPORT float getEstimatedVariance() const;
+
+	CTL_EXPORT void PrintStatus(std::vector<std::string>& a_Buf) const;
+
+	const std::vector<WorkerStatistics>& getWorkerStatistics() const
+	{
+		return m_workers;
+	}
+
+	unsigned int getNumPassesDone() const
+	{
+		return m_uPassesDone;
+	}
+};
+
+//renders the assignments of the master until it sends FinishRendering, merge is invoked for every MergeImages assignment
+//clb is called after every pass, a checkpoint loaded into the tracer is resumed instead of starting a new rendering
+CTL_EXPORT void RunRenderWorker(IRenderSchedulerTransport& transport, int worker, TracerBase& tracer, Image& img, const std::function<void()>& merge, const std::function<void()>& clb = std::function<void()>());
+
+}
@@ -2,6 +2,7 @@
 
 #include "Sampler_device.h"
 #include "TraceHelper.h"
+#include <Base/RenderCheckpoint.h>
 
 namespace CudaTracerLib {
 
@@ -16,6 +17,20 @@ public:
 	virtual void Compute(RandomSamplerData& data)
 	{
 
+	}
+	//restarts the generator with a different seed, used to decorrelate multiple renderers of the same scene
+	virtual void Seed(unsigned int seed)
+	{
+
+	}
+	//stores and restores the position in the sequence
+	virtual void SaveState(RenderCheckpoint& checkpoint)
+	{
+
+	}
+	virtual void LoadState(const RenderCheckpoint& checkpoint)
+	{
+
 	}
 };
 
@@ -58,6 +73,21 @@ public:
 	{
 
 	}
+
+	virtual void Seed(unsigned int seed)
+	{
+		_obj.Seed(seed);
+	}
+
+	//the drivers only consist of random number generators and counters
+	virtual void SaveState(RenderCheckpoint& checkpoint)
+	{
+		checkpoint.Write("SamplingSequenceGenerator.State", &_obj, sizeof(Driver));
+	}
+	virtual void LoadState(const RenderCheckpoint& checkpoint)
+	{
+		checkpoint.Read("SamplingSequenceGenerator.State", &_obj, sizeof(Driver));
+	}
 };
 
 class IndependantSamplingSequenceGenerator
@@ -68,6 +98,10 @@ public:
 		: rng(7539414)
 	{
 	}
+	void Seed(unsigned int seed)
+	{
+		rng = CudaRNG(seed);
+	}
 	void NextPass()
 	{
 
@@ -94,6 +128,11 @@ public:
 		: n_strata(n_strata), rng(7539414), pass_idx(0)
 	{
 	}
+	void Seed(unsigned int seed)
+	{
+		rng = CudaRNG(seed);
+		pass_idx = 0;
+	}
 	void NextPass()
 	{
 		pass_idx++;
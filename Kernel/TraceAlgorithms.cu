@@ -52,7 +52,7 @@ CUDA_FUNC_IN Spectrum EstimateDirect(BSDFSamplingRecord bRec, const Material& ma
 		bRec.wo = bRec.dg.toLocal(dRec.d);
 		bRec.typeMask = flags;
 		Spectrum bsdfVal = mat.bsdf.f(bRec);
-		if (!bsdfVal.isZero() && !g_SceneData.Occluded(Ray(dRec.ref, dRec.d), 0, dRec.dist))
+		if (!bsdfVal.isZero() && !g_SceneData.Occluded(Ray(dRec.ref, dRec.d, bRec.dg.time), 0, dRec.dist))
 		{
 			float weight = 1.0f;
 			if (use_mis && dRec.measure != EDiscrete)//compute MIS weight
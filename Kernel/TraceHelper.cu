@@ -48,6 +48,7 @@ void traversalResult::toResult(TraceResult* tR, KernelDynamicScene& data) const
 	tR->m_fBaryCoords = Vec2f(x_disc, y_disc) / UINT16_MAX;
 	tR->m_nodeIdx = nodeIdx;
 	tR->m_triIdx = triIdx;
+	tR->m_fTime = 0.0f;
 }
 
 void traversalResult::fromResult(const TraceResult* tR, KernelDynamicScene& data)
@@ -85,17 +86,35 @@ CUDA_FUNC_IN void loadInvModl(int i, float4x4* o)
 #endif
 }
 
-template<bool USE_ALPHA> CUDA_FUNC_IN bool __traceRay_internal__(const Vec3f& dir, const Vec3f& ori, TraceResult* a_Result)
+//nodes with motion interpolate linearly between the transforms at shutter open and close
+CUDA_FUNC_IN void loadModl(int i, float time, const Node* N, float4x4* o)
+{
+	loadModl(i, o);
+	if (N->m_uHasMotion)
+		*o = *o * (1.0f - time) + g_SceneData.m_sSceneBVH.m_pNodeEndTransforms[i] * time;
+}
+
+CUDA_FUNC_IN void loadInvModl(int i, float time, const Node* N, float4x4* o)
+{
+	if (N->m_uHasMotion)
+	{
+		loadModl(i, time, N, o);
+		*o = o->inverse();
+	}
+	else loadInvModl(i, o);
+}
+
+template<bool USE_ALPHA> CUDA_FUNC_IN bool __traceRay_internal__(const Vec3f& dir, const Vec3f& ori, TraceResult* a_Result, float time)
 {
     float rayEps = g_SceneData.m_rayTraceEps;
-	return TracerayTemplate(Ray(ori, dir), a_Result->m_fDist, [&](int nodeIdx)
+	return TracerayTemplate(Ray(ori, dir, time), a_Result->m_fDist, [&](int nodeIdx)
 	{
 		Node* N = g_SceneData.m_sNodeData.Data + nodeIdx;
 		KernelMesh mesh = g_SceneData.m_sMeshData[N->m_uMeshIndex];
 		unsigned int meshBvhTriOff = mesh.m_uBVHTriangleOffset, meshBvhIndOff = mesh.m_uBVHIndicesOffset, meshTriOff = mesh.m_uTriangleOffset;
 		unsigned int nodeMatOff = N->m_uMaterialOffset;
 		float4x4 modl;
-		loadInvModl(nodeIdx, &modl);
+		loadInvModl(nodeIdx, time, N, &modl);
 		Vec3f d = modl.TransformDirection(dir), o = modl.TransformPoint(ori);
 		return TracerayTemplate(Ray(o, d), a_Result->m_fDist, [&](int triIdx)
 		{
@@ -171,12 +190,13 @@ template<bool USE_ALPHA> CUDA_FUNC_IN bool __traceRay_internal__(const Vec3f& di
 	}, t_SceneNodes, g_SceneData.m_sSceneBVH.m_pNodes, 0, g_SceneData.m_sSceneBVH.m_sStartNode);
 }
 
-bool traceRay(const Vec3f& dir, const Vec3f& ori, TraceResult* a_Result)
+bool traceRay(const Vec3f& dir, const Vec3f& ori, TraceResult* a_Result, float time)
 {
 	Platform::Increment(&g_RayTracedCounter);
+	a_Result->m_fTime = time;
 	if(!g_SceneData.m_sNodeData.UsedCount)
 		return false;
-	return g_SceneData.doAlphaMapping ? __traceRay_internal__<true>(dir, ori, a_Result) : __traceRay_internal__<false>(dir, ori, a_Result);
+	return g_SceneData.doAlphaMapping ? __traceRay_internal__<true>(dir, ori, a_Result, time) : __traceRay_internal__<false>(dir, ori, a_Result, time);
 }
 
 void UpdateKernel(DynamicScene* a_Scene, ISamplingSequenceGenerator& sampler)
@@ -185,6 +205,7 @@ void UpdateKernel(DynamicScene* a_Scene, ISamplingSequenceGenerator& sampler)
 
 	if (!a_Scene)
 		return;
+	a_Scene->UpdateTextureCache();
 	KernelDynamicScene a_Data = a_Scene->getKernelSceneData();
 
 	size_t offset;
@@ -271,12 +292,12 @@ void DeinitializeKernel()
 	g_SamplerDataHost->Free();
 }
 
-void fillDG(const Vec2f& bary, unsigned int triIdx, unsigned int nodeIdx, DifferentialGeometry& dg)
+void fillDG(const Vec2f& bary, unsigned int triIdx, unsigned int nodeIdx, DifferentialGeometry& dg, float time)
 {
-	float4x4 localToWorld, worldToLocal;
-	loadModl(nodeIdx, &localToWorld);
-	loadInvModl(nodeIdx, &worldToLocal);
+	float4x4 localToWorld;
+	loadModl(nodeIdx, time, g_SceneData.m_sNodeData.Data + nodeIdx, &localToWorld);
 	dg.bary = bary;
+	dg.time = time;
 	dg.hasUVPartials = false;
 #if defined(ISCUDA) && NUM_UV_SETS == 1 && defined(EXT_TRI)
 	int2 nme = tex1Dfetch(t_TriDataA, triIdx * 4 + 0);
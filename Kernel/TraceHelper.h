@@ -26,17 +26,17 @@ CTL_EXPORT extern CUDA_ALIGN(16) CudaStaticWrapper<SamplerData> g_SamplerDataHos
 #define g_SamplerData (*g_SamplerDataHost)
 #endif
 
-CTL_EXPORT CUDA_DEVICE CUDA_HOST bool traceRay(const Vec3f& dir, const Vec3f& ori, TraceResult* a_Result);
+CTL_EXPORT CUDA_DEVICE CUDA_HOST bool traceRay(const Vec3f& dir, const Vec3f& ori, TraceResult* a_Result, float time = 0.0f);
 
 CUDA_FUNC_IN TraceResult traceRay(const Ray& r)
 {
 	TraceResult r2;
 	r2.Init();
-	traceRay(r.dir(), r.ori(), &r2);
+	traceRay(r.dir(), r.ori(), &r2, r.time());
 	return r2;
 }
 
-CTL_EXPORT CUDA_DEVICE CUDA_HOST void fillDG(const Vec2f& bary, unsigned int triIdx, unsigned int nodeIdx, DifferentialGeometry& dg);
+CTL_EXPORT CUDA_DEVICE CUDA_HOST void fillDG(const Vec2f& bary, unsigned int triIdx, unsigned int nodeIdx, DifferentialGeometry& dg, float time = 0.0f);
 
 CTL_EXPORT void InitializeKernel();
 CTL_EXPORT void DeinitializeKernel();
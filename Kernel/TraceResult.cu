@@ -75,7 +75,7 @@ unsigned int TraceResult::getTriIndex() const
 
 void TraceResult::fillDG(DifferentialGeometry& dg) const
 {
-	CudaTracerLib::fillDG(m_fBaryCoords, m_triIdx, m_nodeIdx, dg);
+	CudaTracerLib::fillDG(m_fBaryCoords, m_triIdx, m_nodeIdx, dg, m_fTime);
 }
 
 unsigned int TraceResult::getMatIndex() const
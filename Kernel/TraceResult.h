@@ -20,6 +20,7 @@ struct TraceResult
 	Vec2f m_fBaryCoords;
 	unsigned int m_triIdx;
 	unsigned int m_nodeIdx;
+	float m_fTime;
 	CUDA_FUNC_IN bool hasHit() const
 	{
 		return m_triIdx != UINT_MAX;
@@ -29,6 +30,7 @@ struct TraceResult
 		m_fDist = FLT_MAX;
 		m_triIdx = UINT_MAX;
 		m_nodeIdx = UINT_MAX;
+		m_fTime = 0.0f;
 	}
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST unsigned int getMatIndex() const;
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum Le(const Vec3f& p, const Frame& sys, const NormalizedT<Vec3f>& w) const;
@@ -11,7 +11,7 @@
 namespace CudaTracerLib {
 
 TracerBase::TracerBase()
-	: m_pScene(0), m_pBlockSampler(0), m_pSamplingSequenceGenerator(0), m_pPixelVarianceBuffer(0), w(0xffffffff), h(0xffffffff)
+	: m_pScene(0), m_pBlockSampler(0), m_pSamplingSequenceGenerator(0), m_uSamplingSequenceSeed(7539414), m_pPixelVarianceBuffer(0), w(0xffffffff), h(0xffffffff), m_pPendingCheckpoint(0)
 {
 	ThrowCudaErrors(cudaEventCreate(&start));
 	ThrowCudaErrors(cudaEventCreate(&stop));
@@ -37,7 +37,10 @@ TracerBase::~TracerBase()
 		m_pSamplingSequenceGenerator = 0;
 	}
 	if (m_pBlockSampler)
+	{
+		m_pBlockSampler->Free();
 		delete m_pBlockSampler;
+	}
 	if (m_pPixelVarianceBuffer)
 	{
 		m_pPixelVarianceBuffer->Free();
@@ -46,6 +49,53 @@ TracerBase::~TracerBase()
 	m_pBlockSampler = 0;
 	m_pPixelVarianceBuffer = 0;
 	m_debugVisualizerManager.Free();
+	if (m_pPendingCheckpoint)
+	{
+		delete m_pPendingCheckpoint;
+		m_pPendingCheckpoint = 0;
+	}
+}
+
+void TracerBase::SaveCheckpoint(Image* I, RenderCheckpoint& checkpoint)
+{
+	if (!isMultiPass())
+		throw std::runtime_error("Only progressive tracers can be checkpointed!");
+	checkpoint.WriteValue("Tracer.PassesDone", m_uPassesDone);
+	checkpoint.WriteValue("Tracer.AccNumRaysTraced", m_uAccNumRaysTraced);
+	checkpoint.WriteValue("Tracer.AccRuntime", m_fAccRuntime);
+	checkpoint.WriteValue("Tracer.SamplingSequenceType", m_sParameters.getValue(KEY_SamplingSequenceType()));
+	checkpoint.WriteValue("Tracer.BlockSamplerType", m_sParameters.getValue(KEY_BlockSamplerType()));
+	I->SaveState(checkpoint);
+	m_pPixelVarianceBuffer->SaveState(checkpoint);
+	m_pBlockSampler->SaveState(checkpoint);
+	m_pSamplingSequenceGenerator->SaveState(checkpoint);
+}
+
+void TracerBase::LoadCheckpoint(const RenderCheckpoint& checkpoint)
+{
+	if (!isMultiPass())
+		throw std::runtime_error("Only progressive tracers can be checkpointed!");
+	//only keep the checkpoint, the tracer may not be initialized yet
+	if (m_pPendingCheckpoint)
+		delete m_pPendingCheckpoint;
+	m_pPendingCheckpoint = new RenderCheckpoint(checkpoint);
+}
+
+void TracerBase::RestoreCheckpoint(Image* I, const RenderCheckpoint& checkpoint)
+{
+	SamplingSequenceGeneratorTypes sequenceType;
+	BlockSamplerTypes blockSamplerType;
+	checkpoint.ReadValue("Tracer.SamplingSequenceType", sequenceType);
+	checkpoint.ReadValue("Tracer.BlockSamplerType", blockSamplerType);
+	if (sequenceType != m_sParameters.getValue(KEY_SamplingSequenceType()) || blockSamplerType != m_sParameters.getValue(KEY_BlockSamplerType()))
+		throw std::runtime_error("Checkpoint was created with a different sampling sequence generator or block sampler!");
+	checkpoint.ReadValue("Tracer.PassesDone", m_uPassesDone);
+	checkpoint.ReadValue("Tracer.AccNumRaysTraced", m_uAccNumRaysTraced);
+	checkpoint.ReadValue("Tracer.AccRuntime", m_fAccRuntime);
+	I->LoadState(checkpoint);
+	m_pPixelVarianceBuffer->LoadState(checkpoint);
+	m_pBlockSampler->LoadState(checkpoint);
+	m_pSamplingSequenceGenerator->LoadState(checkpoint);
 }
 
 void TracerBase::generateNewRandomSequences()
@@ -55,12 +105,13 @@ void TracerBase::generateNewRandomSequences()
 
 template<typename T> struct check_type_ssg
 {
-	void operator()(ISamplingSequenceGenerator*& gen, SamplingSequenceGeneratorTypes new_type, SamplingSequenceGeneratorTypes T_type)
+	void operator()(ISamplingSequenceGenerator*& gen, SamplingSequenceGeneratorTypes new_type, SamplingSequenceGeneratorTypes T_type, unsigned int seed)
 	{
 		if (dynamic_cast<SamplingSequenceGeneratorHost<T>*>(gen) == 0 && new_type == T_type)
 		{
 			delete gen;
 			gen = new SamplingSequenceGeneratorHost<T>();
+			gen->Seed(seed);
 		}
 	}
 };
@@ -68,8 +119,15 @@ void TracerBase::setCorrectSamplingSequenceGenerator()
 {
 	auto new_type = m_sParameters.getValue(KEY_SamplingSequenceType());
 
-	check_type_ssg<IndependantSamplingSequenceGenerator>()(m_pSamplingSequenceGenerator, new_type, Independent);
-	check_type_ssg<StratifiedSamplingSequenceGenerator>()(m_pSamplingSequenceGenerator, new_type, Stratified);
+	check_type_ssg<IndependantSamplingSequenceGenerator>()(m_pSamplingSequenceGenerator, new_type, Independent, m_uSamplingSequenceSeed);
+	check_type_ssg<StratifiedSamplingSequenceGenerator>()(m_pSamplingSequenceGenerator, new_type, Stratified, m_uSamplingSequenceSeed);
+}
+
+void TracerBase::setSamplingSequenceSeed(unsigned int seed)
+{
+	m_uSamplingSequenceSeed = seed;
+	if (m_pSamplingSequenceGenerator)
+		m_pSamplingSequenceGenerator->Seed(seed);
 }
 
 template<typename T> struct check_type_bst
@@ -78,6 +136,8 @@ template<typename T> struct check_type_bst
 	{
 		if (dynamic_cast<T*>(bSampler) == 0 && new_type == T_type)
 		{
+			if (bSampler)
+				bSampler->Free();
 			delete bSampler;
 			bSampler = new T(w, h);
 
@@ -8,6 +8,8 @@
 #include "TracerSettings.h"
 #include <Kernel/PixelVarianceBuffer.h>
 #include "PixelDebugVisualizers/PixelDebugVisualizer.h"
+#include <Base/Profiler.h>
+#include <Base/RenderCheckpoint.h>
 
 namespace CudaTracerLib {
 
@@ -158,6 +160,21 @@ public:
 	{
 		return m_debugVisualizerManager;
 	}
+	//sets the seed of the sampling sequence generator, renderers working on the same image have to use different seeds
+	CTL_EXPORT void setSamplingSequenceSeed(unsigned int seed);
+	//stores the accumulated state of a progressive rendering, has to be called between passes
+	CTL_EXPORT virtual void SaveCheckpoint(Image* I, RenderCheckpoint& checkpoint);
+	//the state is restored by the next call to DoPass(I, false) which then continues the rendering
+	CTL_EXPORT virtual void LoadCheckpoint(const RenderCheckpoint& checkpoint);
+	bool hasPendingCheckpoint() const
+	{
+		return m_pPendingCheckpoint != 0;
+	}
+	//true once the stop criterion of the block sampler is met, further passes do not render any pixels
+	virtual bool hasConverged() const
+	{
+		return false;
+	}
 protected:
 	float m_fLastRuntime;
 	unsigned int m_uLastNumRaysTraced;
@@ -171,12 +188,16 @@ protected:
 	IBlockSampler* m_pBlockSampler;
 	TracerParameterCollection m_sParameters;
 	ISamplingSequenceGenerator* m_pSamplingSequenceGenerator;
+	unsigned int m_uSamplingSequenceSeed;
 	PixelDebugVisualizerManager m_debugVisualizerManager;
+	RenderCheckpoint* m_pPendingCheckpoint;
 
 	virtual void DebugInternal(Image* I, const Vec2i& pixel)
 	{
 
 	}
+	//called after StartNewTrace when resuming, derived tracers restore the state they saved in SaveCheckpoint
+	CTL_EXPORT virtual void RestoreCheckpoint(Image* I, const RenderCheckpoint& checkpoint);
 	virtual void setCorrectSamplingSequenceGenerator();
 	virtual void setCorrectBlockSampler();
 	virtual void generateNewRandomSequences();
@@ -208,12 +229,14 @@ public:
 	}
 	virtual void DoPass(Image* I, bool a_NewTrace)
 	{
+		PROFILE_ZONE("Tracer", "DoPass");
 		setCorrectBlockSampler();
 		setCorrectSamplingSequenceGenerator();
 		ThrowCudaErrors(cudaEventRecord(start, 0));
 		// do not clear because of block samplers
 		//m_debugVisualizerManager.ClearAll();
-		if (a_NewTrace || !PROGRESSIVE)
+		bool resume = PROGRESSIVE && !a_NewTrace && m_pPendingCheckpoint;
+		if (a_NewTrace || !PROGRESSIVE || resume)
 		{
 			m_uPassesDone = 0;
 			m_uAccNumRaysTraced = 0;
@@ -225,13 +248,30 @@ public:
 				m_pPixelVarianceBuffer->Clear();
 			}
 			StartNewTrace(I);
+			if (resume)
+				RestoreCheckpoint(I, *m_pPendingCheckpoint);
+		}
+		if (m_pPendingCheckpoint)
+		{
+			delete m_pPendingCheckpoint;
+			m_pPendingCheckpoint = 0;
+		}
+		{
+			PROFILE_ZONE("Tracer", "Update Kernel");
+			UpdateKernel(m_pScene, *m_pSamplingSequenceGenerator);
+			if (PROGRESSIVE)
+				m_pBlockSampler->getConvergenceMask().Bind();
+			else PixelConvergenceMask::Unbind();
 		}
-		UpdateKernel(m_pScene, *m_pSamplingSequenceGenerator);
 		k_setNumRaysTraced(0);
 		m_uPassesDone++;
-		DoRender(I);
+		{
+			PROFILE_ZONE("Tracer", "Render");
+			DoRender(I);
+		}
 		if (PROGRESSIVE)
 		{
+			PROFILE_ZONE("Tracer", "Add Pass");
 			m_pPixelVarianceBuffer->AddPass(*I, getSplatScale(), m_pBlockSampler);
 			m_pBlockSampler->AddPass(I, this, *m_pPixelVarianceBuffer);
 		}
@@ -250,6 +290,10 @@ public:
 	{
 		return PROGRESSIVE;
 	}
+	virtual bool hasConverged() const
+	{
+		return PROGRESSIVE && m_pBlockSampler->isConverged();
+	}
 	virtual float getSplatScale() const
 	{
 		if (PROGRESSIVE)
@@ -282,7 +326,7 @@ protected:
 		BBBB
 
 		*/
-		m_pBlockSampler->IterateBlocks([&](unsigned int block_idx, int x, int y, int bw, int bh)
+		m_pBlockSampler->IterateActiveBlocks([&](unsigned int block_idx, int x, int y, int bw, int bh)
 		{
 			RenderBlock(I, x, y, bw, bh);
 		});
@@ -10,20 +10,22 @@ struct Ray
 private:
 	Vec3f origin;
 	Vec3f direction;
+	//in [0, 1) between shutter open and close, only used for nodes with motion
+	float m_time;
 public:
 
 	CUDA_FUNC Ray()
 	{
 	}
 
-	CUDA_FUNC_IN Ray(const Vec3f &orig, const Vec3f &dir)
-		: origin(orig), direction(dir)
+	CUDA_FUNC_IN Ray(const Vec3f &orig, const Vec3f &dir, float time = 0.0f)
+		: origin(orig), direction(dir), m_time(time)
 	{
 	}
 
 	CUDA_FUNC_IN Ray operator *(const float4x4& m) const
 	{
-		return Ray(m.TransformPoint(origin), m.TransformDirection(direction));
+		return Ray(m.TransformPoint(origin), m.TransformDirection(direction), m_time);
 	}
 
 	CUDA_FUNC_IN Vec3f operator()(float d) const
@@ -51,6 +53,16 @@ public:
 		return direction;
 	}
 
+	CUDA_FUNC_IN float time() const
+	{
+		return m_time;
+	}
+
+	CUDA_FUNC_IN float& time()
+	{
+		return m_time;
+	}
+
 	friend std::ostream& operator<< (std::ostream & os, const Ray& rhs)
 	{
 		os << "[" << rhs.origin << ", " << rhs.direction << "]";
@@ -66,13 +78,13 @@ template<> struct NormalizedT<Ray> : public Ray
 	}
 
 	CUDA_FUNC_IN explicit NormalizedT(const Ray& v)
-		: Ray(v.ori(), v.dir().normalized())
+		: Ray(v.ori(), v.dir().normalized(), v.time())
 	{
 
 	}
 
-	CUDA_FUNC_IN NormalizedT(const Vec3f& o, const NormalizedT<Vec3f>& d)
-		: Ray(o, d)
+	CUDA_FUNC_IN NormalizedT(const Vec3f& o, const NormalizedT<Vec3f>& d, float time = 0.0f)
+		: Ray(o, d, time)
 	{
 
 	}
@@ -131,7 +131,7 @@ void Spectrum::fromLinearRGB(float r, float g, float b, Spectrum::EConversionInt
 		result *= .86445f;
 	}
 	*this = result;
-	math::clampNegative();
+	clampNegative();
 }
 
 void Spectrum::toXYZ(float &x, float &y, float &z) const
@@ -287,7 +287,7 @@ void Spectrum::fromRGBE(RGBE rgbe, Spectrum::EConversionIntent intent)
 		float exp = ldexp((float) 1, (int) rgbe.w - (128+8));
 		fromLinearRGB(rgbe.x*exp, rgbe.y*exp, rgbe.z*exp, intent);
 	} else {
-		s[0] = s[1] = s[2] = 0.0f;
+		*this = Spectrum(0.0f);
 	}
 }
 
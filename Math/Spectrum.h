@@ -6,7 +6,16 @@
 
 namespace CudaTracerLib {
 
+#ifdef SPECTRAL_RENDERING
+//the spectrum is split into 4 equally sized bins, a path carries one wavelength in each bin
+//the wavelengths are rotations of a hero wavelength, see Spectrum::binWavelength and Dispersion::sample_eta
+#define SPECTRUM_SAMPLES 4
+//the bins are loaded and stored as a single vector
+#define SPECTRUM_ALIGN CUDA_ALIGN(16)
+#else
 #define SPECTRUM_SAMPLES 3
+#define SPECTRUM_ALIGN
+#endif
 
 #define SPECTRUM_MIN_WAVELENGTH   360
 #define SPECTRUM_MAX_WAVELENGTH   830
@@ -322,7 +331,7 @@ template<typename T, int N> CUDA_FUNC_IN TSpectrum<T, N> min(const TSpectrum<T,
 typedef uchar4 RGBCOL;
 typedef uchar4 RGBE;
 
-struct Spectrum : public TSpectrum<float, SPECTRUM_SAMPLES> {
+struct SPECTRUM_ALIGN Spectrum : public TSpectrum<float, SPECTRUM_SAMPLES> {
 public:
 	typedef TSpectrum<float, SPECTRUM_SAMPLES> Parent;
 
@@ -379,7 +388,7 @@ public:
 #if SPECTRUM_SAMPLES == 3
 		return 0.0f;
 #else
-		int index = Floor2Int((lambda - SPECTRUM_MIN_WAVELENGTH) *
+		int index = math::Floor2Int((lambda - SPECTRUM_MIN_WAVELENGTH) *
 			((float) SPECTRUM_SAMPLES / (float) SPECTRUM_RANGE));
 
 		if (index < 0 || index >= SPECTRUM_SAMPLES)
@@ -389,6 +398,14 @@ public:
 #endif
 	}
 
+	/**
+	 * \brief Wavelength at the relative position \a u in [0, 1) of bin \a i.
+	 * Using the same \a u for all bins gives the hero wavelength and its rotations.
+	 */
+	CUDA_FUNC_IN static float binWavelength(int i, float u) {
+		return SPECTRUM_MIN_WAVELENGTH + (i + u) * ((float) SPECTRUM_RANGE / (float) SPECTRUM_SAMPLES);
+	}
+
 	/// Return the luminance in candelas.
 	CTL_EXPORT CUDA_HOST CUDA_DEVICE float getLuminance() const;
 
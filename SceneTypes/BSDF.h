@@ -122,6 +122,19 @@ public:
 	{
 		return pdf_Helper::Caller<float>(this, bRec, measure);
 	}
+	//versions for callers which know the stored type, as used by the shading of material sorted hits
+	template<typename T> CUDA_FUNC_IN Spectrum sampleAs(BSDFSamplingRecord &bRec, float &pdf, const Vec2f &_sample) const
+	{
+		return As<T>()->sample(bRec, pdf, _sample);
+	}
+	template<typename T> CUDA_FUNC_IN Spectrum fAs(const BSDFSamplingRecord &bRec, EMeasure measure = ESolidAngle) const
+	{
+		return As<T>()->f(bRec, measure);
+	}
+	template<typename T> CUDA_FUNC_IN float pdfAs(const BSDFSamplingRecord &bRec, EMeasure measure = ESolidAngle) const
+	{
+		return As<T>()->pdf(bRec, measure);
+	}
 	CUDA_FUNC_IN unsigned int getType() const
 	{
 		return As()->getType();
@@ -197,6 +210,28 @@ public:
 		end_two_sided<true, true>((BSDFSamplingRecord&)bRec, flip);
 		return res;
 	}
+	//versions for callers which know the stored type, as used by the shading of material sorted hits
+	template<typename T> CUDA_FUNC_IN Spectrum sampleAs(BSDFSamplingRecord &bRec, float &pdf, const Vec2f &_sample) const
+	{
+		bool flip = start_two_sided<true, false>(bRec);
+		auto res = As<T>()->sample(bRec, pdf, _sample);
+		end_two_sided<true, true>(bRec, flip);
+		return res;
+	}
+	template<typename T> CUDA_FUNC_IN Spectrum fAs(const BSDFSamplingRecord &bRec, EMeasure measure = ESolidAngle) const
+	{
+		bool flip = start_two_sided<true, false>((BSDFSamplingRecord&)bRec);
+		auto res = As<T>()->f(bRec, measure);
+		end_two_sided<true, true>((BSDFSamplingRecord&)bRec, flip);
+		return res;
+	}
+	template<typename T> CUDA_FUNC_IN float pdfAs(const BSDFSamplingRecord &bRec, EMeasure measure = ESolidAngle) const
+	{
+		bool flip = start_two_sided<true, false>((BSDFSamplingRecord&)bRec);
+		float res = As<T>()->pdf(bRec, measure);
+		end_two_sided<true, true>((BSDFSamplingRecord&)bRec, flip);
+		return res;
+	}
 	CUDA_FUNC_IN unsigned int getType() const
 	{
 		return As()->getType();
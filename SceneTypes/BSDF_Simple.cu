@@ -195,6 +195,7 @@ Spectrum dielectric::sample(BSDFSamplingRecord &bRec, float &pdf, const Vec2f &s
 			bRec.wo = Frame::refract(bRec.wi, cosThetaT, eta, invEta);
 			bRec.eta = cosThetaT < 0 ? eta : invEta;
 			pdf = (1 - F) * eta_pdf;
+			eta_f.end_sample_eta(bRec);
 
 			float factor = (bRec.mode == ETransportMode::ERadiance)
 				? (cosThetaT < 0 ? invEta : eta) : 1.0f;
@@ -215,6 +216,7 @@ Spectrum dielectric::sample(BSDFSamplingRecord &bRec, float &pdf, const Vec2f &s
 		bRec.wo = Frame::refract(bRec.wi, cosThetaT, eta, invEta);
 		bRec.eta = cosThetaT < 0 ? eta : invEta;
 		pdf = 1.0f * eta_pdf;
+		eta_f.end_sample_eta(bRec);
 
 		float factor = (bRec.mode == ETransportMode::ERadiance)	? (cosThetaT < 0 ? invEta : eta) : 1.0f;
 
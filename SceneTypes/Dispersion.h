@@ -131,10 +131,22 @@ struct Dispersion : public CudaVirtualAggregate<DispersionBase, DispersionLinear
 			return calc_eta(600);
 		}
 
+#ifdef SPECTRAL_RENDERING
+		//the refracted direction is only valid for the hero wavelength, the other wavelengths of the packet are terminated
+		int hero;
+		float u;
+		pdf = heroSelection(bRec, sample, hero, u);
+		f_o = Spectrum(0.0f);
+		if (pdf == 0)
+			return calc_eta(600);
+		f_o[hero] = 1.0f / pdf;
+		return calc_eta(Spectrum::binWavelength(hero, u));
+#else
 		float w = bRec.f_i.SampleWavelength(f_o, pdf, sample);//wavelength in nm
 		for (int i = 0; i < SPECTRUM_SAMPLES; i++)
 			f_o[i] = bRec.f_i[i] != 0 ? f_o[i] / bRec.f_i[i] : 0;
 		return calc_eta(w);
+#endif
 	}
 
 	CUDA_FUNC_IN float f_eta(const BSDFSamplingRecord& bRec, Spectrum& f_o) const
@@ -147,9 +159,16 @@ struct Dispersion : public CudaVirtualAggregate<DispersionBase, DispersionLinear
 
 		float eta = Frame::sinTheta(bRec.wi) / Frame::sinTheta(bRec.wo);
 		float lambda = calc_lambda(eta);
+#ifdef SPECTRAL_RENDERING
+		f_o = Spectrum(0.0f);
+		int bin = lambdaBin(lambda);
+		if (bin != -1 && (bRec.hero < 0 || bin == (int)bRec.hero))
+			f_o[bin] = 1.0f;
+#else
 		f_o = bRec.f_i.FWavelength(lambda);
 		for (int i = 0; i < SPECTRUM_SAMPLES; i++)
 			f_o[i] = bRec.f_i[i] != 0 ? f_o[i] / bRec.f_i[i] : 0;
+#endif
 		return eta;
 	}
 
@@ -163,9 +182,66 @@ struct Dispersion : public CudaVirtualAggregate<DispersionBase, DispersionLinear
 
 		float eta = Frame::sinTheta(bRec.wi) / Frame::sinTheta(bRec.wo);
 		float lambda = calc_lambda(eta);
+#ifdef SPECTRAL_RENDERING
+		int bin = lambdaBin(lambda);
+		if (bin == -1)
+			pdf = 0.0f;
+		else if (bRec.hero >= 0)
+			pdf = bin == (int)bRec.hero ? (bRec.heroOnly ? 1.0f : 1.0f / SPECTRUM_SAMPLES) : 0.0f;
+		else pdf = heroPdf(bRec.f_i, bin);
+#else
 		pdf = bRec.f_i.PdfWavelength(lambda);
+#endif
 		return eta;
 	}
+
+	//marks the other bins of the path as terminated after a refraction sampled with sample_eta
+	CUDA_FUNC_IN void end_sample_eta(BSDFSamplingRecord& bRec) const
+	{
+#ifdef SPECTRAL_RENDERING
+		if (bRec.hero >= 0 && hasDispersion())
+			bRec.heroOnly = true;
+#endif
+	}
+
+#ifdef SPECTRAL_RENDERING
+	//the hero of the path is reused if the integrator sampled one, the selection probability is only accounted for at the first dispersive refraction
+	//otherwise a hero is chosen for this refraction alone
+	CUDA_FUNC_IN static float heroSelection(const BSDFSamplingRecord& bRec, float sample, int& hero, float& u)
+	{
+		if (bRec.hero >= 0)
+		{
+			hero = (int)bRec.hero;
+			u = bRec.hero - hero;
+			return bRec.heroOnly ? 1.0f : 1.0f / SPECTRUM_SAMPLES;
+		}
+		float cdf = 0;
+		hero = 0;
+		for (; hero < SPECTRUM_SAMPLES - 1; hero++)
+		{
+			float p = heroPdf(bRec.f_i, hero);
+			if (sample < cdf + p)
+				break;
+			cdf += p;
+		}
+		float pdf = heroPdf(bRec.f_i, hero);
+		u = pdf != 0 ? math::clamp01((sample - cdf) / pdf) : 0.0f;
+		return pdf;
+	}
+
+	//the hero is chosen proportional to the incoming spectrum if the integrator provides it
+	CUDA_FUNC_IN static float heroPdf(const Spectrum& f_i, int bin)
+	{
+		float sum = f_i.sum();
+		return f_i.isValid() && sum > 0 ? f_i[bin] / sum : 1.0f / SPECTRUM_SAMPLES;
+	}
+
+	CUDA_FUNC_IN static int lambdaBin(float lambda)
+	{
+		int bin = (int)math::floor((lambda - SPECTRUM_MIN_WAVELENGTH) * ((float)SPECTRUM_SAMPLES / (float)SPECTRUM_RANGE));
+		return bin >= 0 && bin < SPECTRUM_SAMPLES ? bin : -1;
+	}
+#endif
 };
 
 }
\ No newline at end of file
@@ -8,7 +8,7 @@
 namespace CudaTracerLib {
 
 Node::Node(unsigned int MeshIndex, Mesh* mesh, StreamReference<Material> mat)
-	: m_uInstanciatedMaterial(false)
+	: m_uInstanciatedMaterial(false), m_uHasMotion(false)
 {
 	m_uMeshIndex = MeshIndex;
 	m_uMaterialOffset = mat.getIndex();
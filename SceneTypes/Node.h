@@ -16,6 +16,8 @@ public:
 	unsigned int m_uMeshIndex;
 	unsigned int m_uMaterialOffset;
 	unsigned int m_uInstanciatedMaterial;
+	//the transform is interpolated between two keyframes, see SceneBVH::setMotion
+	unsigned int m_uHasMotion;
 	FixedSizeArray<unsigned int, MAX_AREALIGHT_NUM, true, 0xff> m_uLights;
 public:
 	Node() {}
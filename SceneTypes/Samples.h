@@ -177,9 +177,27 @@ struct BSDFSamplingRecord
 	unsigned int typeMask;
 	unsigned int sampledType;
 	Spectrum f_i;
-
+#ifdef SPECTRAL_RENDERING
+	/// Hero bin of the path plus the relative position of the wavelengths in their bins, negative if the integrator did not sample one
+	float hero;
+	/// Set once a dispersive refraction has terminated all bins except the hero
+	bool heroOnly;
+
+	CUDA_FUNC_IN BSDFSamplingRecord() : f_i(0.0f), hero(-1.0f), heroOnly(false) {}
+#else
 	CUDA_FUNC_IN BSDFSamplingRecord() : f_i(0.0f) {}
+#endif
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST NormalizedT<Vec3f> getOutgoing() const;
+
+	//samples the hero wavelength once at the start of a path, the record has to be kept for the whole path
+	//this does not consume a random number in the rgb build
+	template<typename SAMPLER> CUDA_FUNC_IN void sampleHero(SAMPLER& rng)
+	{
+#ifdef SPECTRAL_RENDERING
+		hero = math::clamp(rng.randomFloat() * SPECTRUM_SAMPLES, 0.0f, SPECTRUM_SAMPLES - 1e-4f);
+		heroOnly = false;
+#endif
+	}
 };
 
 }
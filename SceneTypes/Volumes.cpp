@@ -4,6 +4,7 @@
 #include <Base/CudaRandom.h>
 #include "Samples.h"
 #include <Math/MonteCarlo.h>
+#include <algorithm>
 
 namespace CudaTracerLib {
 
@@ -18,17 +19,97 @@ namespace CudaTracerLib {
 		a_Buffer->translate(data).Invalidate();
 	}
 
-	KernelAggregateVolume::KernelAggregateVolume(Stream<VolumeRegion>* D, bool devicePointer)
+	void VolumeGrid::InvalidateDeviceData(Stream<char>* a_Buffer)
 	{
-		m_uVolumeCount = 0;
+		DenseVolGrid<float>* grids[] = { &gridA, &gridS, &gridL, &grid };
+		for (auto* G : grids)
+			if (G->dim.x)
+				G->InvalidateDeviceData(a_Buffer);
+		if (sparseGridA.dim.x)
+			sparseGridA.InvalidateDeviceData(a_Buffer);
+		if (sparseGridS.dim.x)
+			sparseGridS.InvalidateDeviceData(a_Buffer);
+		if (majorantGrid.dim.x)
+			majorantGrid.InvalidateDeviceData(a_Buffer);
+		voxelDataChanged = true;
+	}
+
+	VolumeRegionBVH::VolumeRegionBVH()
+		: m_nodes(0), m_numNodes(0), m_numVolumes(0)
+	{
+
+	}
+
+	void VolumeRegionBVH::Free()
+	{
+		m_nodes.Free();
+		m_numNodes = m_numVolumes = 0;
+	}
+
+	//median split along the largest extent of the centers, every leaf contains one volume
+	static void buildVolumeBVH(std::vector<VolumeBVHNode>& nodes, unsigned int nodeIdx, std::vector<std::pair<unsigned int, AABB>>& volumes, size_t start, size_t end)
+	{
+		AABB box = AABB::Identity(), centers = AABB::Identity();
+		for (size_t i = start; i < end; i++)
+		{
+			box = box.Extend(volumes[i].second);
+			centers = centers.Extend(volumes[i].second.Center());
+		}
+		nodes[nodeIdx].box = box;
+		if (end - start == 1)
+		{
+			nodes[nodeIdx].child = UINT_MAX;
+			nodes[nodeIdx].volume = volumes[start].first;
+			return;
+		}
+
+		int dim = centers.Size().arg_max();
+		size_t mid = (start + end) / 2;
+		std::nth_element(volumes.begin() + start, volumes.begin() + mid, volumes.begin() + end, [&](const std::pair<unsigned int, AABB>& a, const std::pair<unsigned int, AABB>& b)
+		{
+			return a.second.Center()[dim] < b.second.Center()[dim];
+		});
+		unsigned int child = (unsigned int)nodes.size();
+		nodes[nodeIdx].child = child;
+		nodes[nodeIdx].volume = UINT_MAX;
+		nodes.resize(nodes.size() + 2);
+		buildVolumeBVH(nodes, child, volumes, start, mid);
+		buildVolumeBVH(nodes, child + 1, volumes, mid, end);
+	}
+
+	void VolumeRegionBVH::Build(Stream<VolumeRegion>* D)
+	{
+		std::vector<std::pair<unsigned int, AABB>> volumes;
 		for (Stream<VolumeRegion>::iterator it = D->begin(); it != D->end(); ++it)
+			volumes.push_back(std::make_pair((unsigned int)(*it).getIndex(), (*it)->WorldBound()));
+
+		std::vector<VolumeBVHNode> nodes;
+		if (volumes.size())
 		{
-			m_pVolumes[m_uVolumeCount] = *(*it);
-			m_uVolumeCount++;
+			nodes.reserve(2 * volumes.size() - 1);
+			nodes.resize(1);
+			buildVolumeBVH(nodes, 0, volumes, 0, volumes.size());
 		}
-		box = AABB::Identity();
-		for (unsigned int i = 0; i < m_uVolumeCount; i++)
-			box = box.Extend(D->operator()(i)->WorldBound());
+
+		m_numVolumes = (unsigned int)volumes.size();
+		m_numNodes = (unsigned int)nodes.size();
+		if (m_nodes.getLength() < m_numNodes)
+			m_nodes.Resize(m_numNodes);
+		if (m_numNodes)
+		{
+			memcpy(&m_nodes[0], &nodes[0], m_numNodes * sizeof(VolumeBVHNode));
+			m_nodes.setOnCPU();
+			m_nodes.Synchronize();
+		}
+	}
+
+	KernelAggregateVolume::KernelAggregateVolume(Stream<VolumeRegion>* D, VolumeRegionBVH& bvh, bool devicePointer)
+	{
+		//the leaves of the bvh store the indices of the volumes in the stream
+		m_uVolumeCount = bvh.getNumVolumes();
+		m_pVolumes = D->getKernelData(devicePointer).Data;
+		m_pNodes = bvh.getNodes(devicePointer);
+		box = m_uVolumeCount ? bvh.getNodes(false)[0].box : AABB::Identity();
 	}
 
-}
\ No newline at end of file
+}
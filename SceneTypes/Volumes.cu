@@ -3,6 +3,8 @@
 #include "Samples.h"
 #include <Engine/SpatialStructures/Grid/SpatialGridTraversal.h>
 #include <Math/MonteCarlo.h>
+#include <thread>
+#include <atomic>
 
 namespace CudaTracerLib {
 
@@ -85,22 +87,38 @@ bool HomogeneousVolumeDensity::sampleDistance(const Ray& ray, float minT, float
 
 VolumeGrid::VolumeGrid()
 	: BaseVolumeRegion(CreateAggregate<PhaseFunction>(IsotropicPhaseFunction()), float4x4::Identity()), sigAMin(0.0f), sigSMin(0.0f), leMin(0.0f), sigAMax(0.0f), sigSMax(0.0f), leMax(0.0f),
-	grid(), singleGrid(true)
+	grid(), singleGrid(true), sparseGrids(false), majorantGrid(), densityRangeGrid(), voxelDataChanged(false), integrator(EVolumeGridTracking)
 {
 	VolumeGrid::Update();
 }
 
 VolumeGrid::VolumeGrid(const PhaseFunction& func, const float4x4& ToWorld, Stream<char>* a_Buffer, Vec3u dim)
 	: BaseVolumeRegion(func, ToWorld), sigAMin(0.0f), sigSMin(0.0f), leMin(0.0f), sigAMax(0.0f), sigSMax(0.0f), leMax(0.0f),
-	  grid(a_Buffer, dim), singleGrid(true)
+	  grid(a_Buffer, dim), singleGrid(true), sparseGrids(false), majorantGrid(a_Buffer, getMajorantGridDims(dim)), densityRangeGrid(a_Buffer, getMajorantGridDims(dim)), voxelDataChanged(false), integrator(EVolumeGridTracking)
 {
+	//the voxel data is written after construction, the density ranges are computed by the first Update afterwards
+	Platform::SetMemory(densityRangeGrid.data.host, densityRangeGrid.getSizeInBytes());
 	VolumeGrid::Update();
+	voxelDataChanged = true;
 }
 
 VolumeGrid::VolumeGrid(const PhaseFunction& func, const float4x4& ToWorld, Stream<char>* a_Buffer, Vec3u dimA, Vec3u dimS, Vec3u dimL)
 	: BaseVolumeRegion(func, ToWorld), sigAMin(0.0f), sigSMin(0.0f), leMin(0.0f), sigAMax(0.0f), sigSMax(0.0f), leMax(0.0f),
-	  gridA(a_Buffer, dimA), gridS(a_Buffer, dimS), gridL(a_Buffer, dimL), singleGrid(false)
+	  gridA(a_Buffer, dimA), gridS(a_Buffer, dimS), gridL(a_Buffer, dimL), singleGrid(false), sparseGrids(false), majorantGrid(a_Buffer, getMajorantGridDims(max(dimA, dimS))),
+	  densityRangeGrid(a_Buffer, getMajorantGridDims(max(dimA, dimS))), voxelDataChanged(false), integrator(EVolumeGridTracking)
 {
+	Platform::SetMemory(densityRangeGrid.data.host, densityRangeGrid.getSizeInBytes());
+	VolumeGrid::Update();
+	voxelDataChanged = true;
+}
+
+VolumeGrid::VolumeGrid(const PhaseFunction& func, const float4x4& ToWorld, Stream<char>* a_Buffer, const SparseVolGridData<float>& dataA, const SparseVolGridData<float>& dataS)
+	: BaseVolumeRegion(func, ToWorld), sigAMin(0.0f), sigSMin(0.0f), leMin(0.0f), sigAMax(0.0f), sigSMax(0.0f), leMax(0.0f),
+	  singleGrid(false), sparseGridA(a_Buffer, dataA), sparseGridS(a_Buffer, dataS), sparseGrids(true), majorantGrid(a_Buffer, getMajorantGridDims(max(dataA.dim, dataS.dim))),
+	  densityRangeGrid(a_Buffer, getMajorantGridDims(max(dataA.dim, dataS.dim))), voxelDataChanged(false), integrator(EVolumeGridTracking)
+{
+	//the bricks are only visited once while building the sparse grids
+	setDensityRanges(dataA.brickRanges, dataA.dim, dataS.brickRanges, dataS.dim);
 	VolumeGrid::Update();
 }
 
@@ -108,7 +126,14 @@ void VolumeGrid::Update()
 {
 	BaseVolumeRegion::Update();
 	float dimf[] = { (float)grid.dim.x - 1, (float)grid.dim.y - 1, (float)grid.dim.z - 1 };
-	if (!singleGrid)
+	if (sparseGrids)
+	{
+		Vec3u d = max(sparseGridA.dim, sparseGridS.dim);
+		dimf[0] = float(d.x - 1);
+		dimf[1] = float(d.y - 1);
+		dimf[2] = float(d.z - 1);
+	}
+	else if (!singleGrid)
 	{
 		uint3 dims[] = {gridA.dim, gridS.dim, gridL.dim};
 		dimf[0] = dimf[1] = dimf[2] = 0;
@@ -124,6 +149,230 @@ void VolumeGrid::Update()
 	for (int i = 0; i < 3; i++)
 		m_stepSize = min(m_stepSize, size[i] / dimf[i]);
 	m_stepSize /= 2.0f;
+	if (voxelDataChanged)
+	{
+		updateDensityRanges();
+		voxelDataChanged = false;
+	}
+	updateMajorants();
+}
+
+Vec3u VolumeGrid::getMajorantGridDims(const Vec3u& dim)
+{
+	const unsigned int c = MAJORANT_CELL_SIZE;
+	return Vec3u((dim.x + c - 1) / c, (dim.y + c - 1) / c, (dim.z + c - 1) / c);
+}
+
+//minimum and maximum value of every block of SPARSE_VOL_LEAF_DIM^3 voxels, the blocks are independent and distributed over all cores
+template<typename GRID> static std::vector<Vec2f> computeBlockRanges(const GRID& G)
+{
+	const unsigned int L = SPARSE_VOL_LEAF_DIM;
+	Vec3u bDim = Vec3u((G.dim.x + L - 1) / L, (G.dim.y + L - 1) / L, (G.dim.z + L - 1) / L);
+	std::vector<Vec2f> ranges(bDim.x * bDim.y * bDim.z);
+	std::atomic<unsigned int> nextBlock(0);
+	auto worker = [&]()
+	{
+		unsigned int i;
+		while ((i = nextBlock++) < ranges.size())
+		{
+			Vec3u o = Vec3u(i % bDim.x, (i / bDim.x) % bDim.y, i / (bDim.x * bDim.y)) * L;
+			Vec3u e = min(o + Vec3u(L), G.dim);
+			float vMin = FLT_MAX, vMax = -FLT_MAX;
+			for (unsigned int z = o.z; z < e.z; z++)
+				for (unsigned int y = o.y; y < e.y; y++)
+					for (unsigned int x = o.x; x < e.x; x++)
+					{
+						float v = G.value(x, y, z);
+						vMin = min(vMin, v);
+						vMax = max(vMax, v);
+					}
+			ranges[i] = Vec2f(vMin, vMax);
+		}
+	};
+	unsigned int numThreads = (unsigned int)std::min(ranges.size() / 64 + 1, (size_t)std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < numThreads; i++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (auto& t : threads)
+		t.join();
+	return ranges;
+}
+
+//range of the values of the voxels which are used by sampleTrilinear for points in [lo, hi], combined from the ranges of the blocks containing them
+static Vec2f cellRange(const std::vector<Vec2f>& blocks, const Vec3u& dim, const Vec3f& lo, const Vec3f& hi)
+{
+	const unsigned int L = SPARSE_VOL_LEAF_DIM;
+	Vec3u bDim = Vec3u((dim.x + L - 1) / L, (dim.y + L - 1) / L, (dim.z + L - 1) / L);
+	Vec3u l, h;
+	for (int c = 0; c < 3; c++)
+	{
+		int a = (int)math::floor(lo[c] * dim[c] - 0.5f), b = (int)math::floor(hi[c] * dim[c] - 0.5f) + 1;
+		l[c] = (unsigned int)math::clamp(a, 0, (int)dim[c] - 1) / L;
+		h[c] = (unsigned int)math::clamp(b, 0, (int)dim[c] - 1) / L;
+	}
+	Vec2f r = Vec2f(FLT_MAX, -FLT_MAX);
+	for (unsigned int z = l.z; z <= h.z; z++)
+		for (unsigned int y = l.y; y <= h.y; y++)
+			for (unsigned int x = l.x; x <= h.x; x++)
+			{
+				const Vec2f& b = blocks[(z * bDim.y + y) * bDim.x + x];
+				r = Vec2f(min(r.x, b.x), max(r.y, b.y));
+			}
+	return r;
+}
+
+void VolumeGrid::updateDensityRanges()
+{
+	if (majorantGrid.dim.x == 0)
+		return;
+
+	if (sparseGrids)
+		setDensityRanges(computeBlockRanges(sparseGridA), sparseGridA.dim, computeBlockRanges(sparseGridS), sparseGridS.dim);
+	else if (singleGrid)
+	{
+		auto blocks = computeBlockRanges(grid);
+		setDensityRanges(blocks, grid.dim, blocks, grid.dim);
+	}
+	else setDensityRanges(computeBlockRanges(gridA), gridA.dim, computeBlockRanges(gridS), gridS.dim);
+}
+
+void VolumeGrid::setDensityRanges(const std::vector<Vec2f>& blocksA, const Vec3u& dimA, const std::vector<Vec2f>& blocksS, const Vec3u& dimS)
+{
+	const Vec3u& D = densityRangeGrid.dim;
+	for (unsigned int x = 0; x < D.x; x++)
+		for (unsigned int y = 0; y < D.y; y++)
+			for (unsigned int z = 0; z < D.z; z++)
+			{
+				Vec3f lo = Vec3f((float)x, (float)y, (float)z) / densityRangeGrid.dimF, hi = Vec3f((float)x + 1, (float)y + 1, (float)z + 1) / densityRangeGrid.dimF;
+				Vec2f a = cellRange(blocksA, dimA, lo, hi), s = cellRange(blocksS, dimS, lo, hi);
+				densityRangeGrid.getVar<Vec4f>()[(z * D.y + y) * D.x + x] = Vec4f(a.x, a.y, s.x, s.y);
+			}
+}
+
+//only uses the cached density ranges, changing the sigma ranges does not touch the voxel data
+void VolumeGrid::updateMajorants()
+{
+	if (majorantGrid.dim.x == 0)
+		return;
+
+	const Vec3u& D = majorantGrid.dim;
+	for (unsigned int i = 0; i < D.x * D.y * D.z; i++)
+	{
+		const Vec4f& r = densityRangeGrid.getVar<Vec4f>()[i];
+		float aMin = r.x, aMax = r.y, sMin = r.z, sMax = r.w;
+
+		//sigma_t is linear in both densities, the extrema are at the corners of the density ranges
+		float muMin = FLT_MAX, muMax = 0.0f;
+		for (int j = 0; j < SPECTRUM_SAMPLES; j++)
+		{
+			float a0 = sigAMin[j] + (sigAMax[j] - sigAMin[j]) * aMin, a1 = sigAMin[j] + (sigAMax[j] - sigAMin[j]) * aMax;
+			float s0 = sigSMin[j] + (sigSMax[j] - sigSMin[j]) * sMin, s1 = sigSMin[j] + (sigSMax[j] - sigSMin[j]) * sMax;
+			muMin = min(muMin, min(a0, a1) + min(s0, s1));
+			muMax = max(muMax, max(a0, a1) + max(s0, s1));
+		}
+		majorantGrid.getVar<Vec2f>()[i] = Vec2f(max(0.0f, min(muMin, muMax)), muMax);
+	}
+}
+
+//the trackers are only given a ray or a single sample, further random numbers are drawn from a generator seeded by a hash of them
+CUDA_FUNC_IN unsigned int hashTrackingSeed(const Ray& ray, float t)
+{
+	float v[] = { ray.ori().x, ray.ori().y, ray.ori().z, ray.dir().x, ray.dir().y, ray.dir().z, t };
+	unsigned int h = 2166136261u;
+	for (int i = 0; i < 7; i++)
+	{
+		unsigned int b;
+		memcpy(&b, v + i, sizeof(b));
+		h = (h ^ b) * 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+Spectrum VolumeGrid::residualRatioTracking(const Ray& ray, float t0, float t1) const
+{
+	Ray rayL = ray * WorldToVolume;
+	float Td = rayL.dir().length();
+	if (Td == 0)
+		return Spectrum(0.0f);
+	rayL.dir() = rayL.dir() / Td;
+	LinearCongruental_GENERATOR rng(hashTrackingSeed(ray, t0));
+	//the minimum extinction of a cell is integrated analytically, only the residual is tracked
+	Spectrum Tr(1.0f);
+	float tauControl = 0;
+	TraverseGridRay(rayL, t0 * Td, t1 * Td, AABB(Vec3f(0), Vec3f(1)), majorantGrid.dimF, [&](float minT, float rayT, float maxT, float cellEndT, Vec3u& cell_pos, bool& cancelTraversal)
+	{
+		const Vec2f& mu = majorant(cell_pos);
+		float mu_c = mu.x, mu_r = mu.y - mu.x;
+		tauControl += mu_c * (cellEndT - rayT) / Td;
+		if (mu_r <= 0)
+			return;
+		float tl = rayT;
+		while (true)
+		{
+			tl += -math::log(1 - rng.randomFloat()) / mu_r * Td;
+			if (tl >= cellEndT)
+				break;
+			Spectrum sig = sigma_t(ray(tl / Td), NormalizedT<Vec3f>(ray.dir()));
+			for (int i = 0; i < SPECTRUM_SAMPLES; i++)
+				Tr[i] *= math::clamp01(1 - (sig[i] - mu_c) / mu_r);
+			if (Tr.isZero())
+			{
+				cancelTraversal = true;
+				return;
+			}
+		}
+	});
+	Spectrum tau;
+	for (int i = 0; i < SPECTRUM_SAMPLES; i++)
+		tau[i] = Tr[i] > 0 ? tauControl - math::log(Tr[i]) : FLT_MAX;
+	return tau;
+}
+
+bool VolumeGrid::deltaTracking(const Ray& ray, float t0, float t1, float sample, float& t) const
+{
+	Ray rayL = ray * WorldToVolume;
+	float Td = rayL.dir().length();
+	if (Td == 0)
+		return false;
+	rayL.dir() = rayL.dir() / Td;
+	LinearCongruental_GENERATOR rng(hashTrackingSeed(ray, sample));
+	bool first = true, found = false;
+	//the first free path uses the given sample
+	auto nextFreePath = [&](float mu)
+	{
+		float u = first ? sample : rng.randomFloat();
+		first = false;
+		return -math::log(1 - u) / mu;
+	};
+	TraverseGridRay(rayL, t0 * Td, t1 * Td, AABB(Vec3f(0), Vec3f(1)), majorantGrid.dimF, [&](float minT, float rayT, float maxT, float cellEndT, Vec3u& cell_pos, bool& cancelTraversal)
+	{
+		float mu = majorant(cell_pos).y;
+		if (mu <= 0)
+			return;
+		//exponential free paths are memoryless, the tracking can restart at every cell boundary
+		float tl = rayT;
+		while (true)
+		{
+			tl += nextFreePath(mu) * Td;
+			if (tl >= cellEndT)
+				break;
+			float sig = sigma_t(ray(tl / Td), NormalizedT<Vec3f>(ray.dir())).avg();
+			if (rng.randomFloat() * mu < sig)
+			{
+				t = tl / Td;
+				found = true;
+				cancelTraversal = true;
+				return;
+			}
+		}
+	});
+	return found;
 }
 
 Spectrum VolumeGrid::tau(const Ray &ray, const float minT, const float maxT) const
@@ -133,6 +382,8 @@ Spectrum VolumeGrid::tau(const Ray &ray, const float minT, const float maxT) con
 	if (length == 0.f) return 0.f;
 	Ray rn(ray.ori(), ray.dir() / length);
 	if (!IntersectP(rn, minT * length, maxT * length, &t0, &t1)) return 0.0f;
+	if (useTracking())
+		return residualRatioTracking(rn, t0, t1);
 	return integrateDensity(rn, t0, t1);
 }
 
@@ -143,18 +394,12 @@ Spectrum VolumeGrid::integrateDensity(const Ray& ray, float t0, float t1) const
 	float minTL = t0 * Td, maxTL = t1 * Td;
 	rayL.dir() = normalize(rayL.dir());
 	float D_s = 0.0f, D_a = 0.0f;
-	auto dimF = singleGrid ? grid.dimF : max(gridS.dimF, gridA.dimF);
-	TraverseGridRay(rayL, minTL, maxTL, AABB(Vec3f(0), Vec3f(1)), dimF, [&](float minT, float rayT, float maxT, float cellEndT, Vec3u& cell_pos, bool& cancelTraversal)
+	TraverseGridRay(rayL, minTL, maxTL, AABB(Vec3f(0), Vec3f(1)), voxelDimF(), [&](float minT, float rayT, float maxT, float cellEndT, Vec3u& cell_pos, bool& cancelTraversal)
 	{
-		float d_s, d_a;
-		if (singleGrid)
-			d_s = d_a = grid.sampleTrilinear(grid.dimF * rayL(rayT)) + grid.sampleTrilinear(grid.dimF * rayL(cellEndT));
-		else
-		{
-			d_s = gridS.sampleTrilinear(gridS.dimF * rayL(rayT)) + gridS.sampleTrilinear(gridS.dimF * rayL(cellEndT));
-			d_a = gridA.sampleTrilinear(gridA.dimF * rayL(rayT)) + gridA.sampleTrilinear(gridA.dimF * rayL(cellEndT));
-		}
-		d_s /= 2; d_a /= 2;
+		float d_s, d_a, d_s2, d_a2;
+		densitiesLocal(rayL(rayT), d_a, d_s);
+		densitiesLocal(rayL(cellEndT), d_a2, d_s2);
+		d_s = (d_s + d_s2) / 2; d_a = (d_a + d_a2) / 2;
 		D_s += d_s * (cellEndT - rayT);
 		D_a += d_a * (cellEndT - rayT);
 	});
@@ -175,18 +420,12 @@ bool VolumeGrid::invertDensityIntegral(const Ray& ray, float t0, float t1, float
 	bool found = false;
 	densityAtMinT = sigma_t(ray(t0), NormalizedT<Vec3f>(rayL.dir())).avg();
 	float Lcl_To_World = (t1 - t0) / (maxTL - minTL);
-	auto dimF = singleGrid ? grid.dimF : max(gridS.dimF, gridA.dimF);
-	TraverseGridRay(rayL, minTL, maxTL, AABB(Vec3f(0), Vec3f(1)), dimF, [&](float minT, float rayT, float maxT, float cellEndT, Vec3u& cell_pos, bool& cancelTraversal)
+	TraverseGridRay(rayL, minTL, maxTL, AABB(Vec3f(0), Vec3f(1)), voxelDimF(), [&](float minT, float rayT, float maxT, float cellEndT, Vec3u& cell_pos, bool& cancelTraversal)
 	{
-		float d_s, d_a;
-		if (singleGrid)
-			d_s = d_a = grid.sampleTrilinear(grid.dimF * rayL(rayT)) + grid.sampleTrilinear(grid.dimF * rayL(cellEndT));
-		else
-		{
-			d_s = gridS.sampleTrilinear(gridS.dimF * rayL(rayT)) + gridS.sampleTrilinear(gridS.dimF * rayL(cellEndT));
-			d_a = gridA.sampleTrilinear(gridA.dimF * rayL(rayT)) + gridA.sampleTrilinear(gridA.dimF * rayL(cellEndT));
-		}
-		d_s /= 2; d_a /= 2;
+		float d_s, d_a, d_s2, d_a2;
+		densitiesLocal(rayL(rayT), d_a, d_s);
+		densitiesLocal(rayL(cellEndT), d_a2, d_s2);
+		d_s = (d_s + d_s2) / 2; d_a = (d_a + d_a2) / 2;
 		d_s = Spectrum(sigSMin + (sigSMax - sigSMin) * d_s).avg();
 		d_a = Spectrum(sigAMin + (sigAMax - sigAMin) * d_s).avg();
 
@@ -214,6 +453,26 @@ bool VolumeGrid::sampleDistance(const Ray& ray, float minT, float maxT, float sa
 	if (length == 0.f) return 0.f;
 	Ray rn(ray.ori(), ray.dir() / length);
 	if (!IntersectP(rn, minT * length, maxT * length, &t0, &t1)) return false;
+	if (useTracking())
+	{
+		//the free path is sampled for the average extinction, the ratios of transmittance and pdfs are exact while the values themselves are not computed
+		NormalizedT<Vec3f> w(-rn.dir());
+		float t;
+		bool success = deltaTracking(rn, t0, t1, sample, t);
+		mRec.pdfSuccess = 0;
+		if (success)
+		{
+			mRec.t = t / length;
+			mRec.p = rn(t);
+			mRec.sigmaS = sigma_s(mRec.p, w);
+			mRec.sigmaA = sigma_a(mRec.p, w);
+			mRec.pdfSuccess = (mRec.sigmaS + mRec.sigmaA).avg();
+		}
+		mRec.pdfSuccessRev = sigma_t(rn(t0), w).avg();
+		mRec.pdfFailure = 1.0f;
+		mRec.transmittance = Spectrum(1.0f);
+		return success && mRec.pdfSuccess > 0;
+	}
 	float integratedDensity, densityAtMinT, densityAtT;
 	float desiredDensity = -logf(1 - sample);
 	bool success = false;
@@ -236,7 +495,7 @@ bool KernelAggregateVolume::IntersectP(const Ray &ray, float minT, float maxT, f
 {
 	*t0 = FLT_MAX;
 	*t1 = -FLT_MAX;
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
+	auto f = [&](unsigned int i)
 	{
 		float a, b;
 		if (m_pVolumes[i].IntersectP(ray, minT, maxT, &a, &b))
@@ -244,47 +503,69 @@ bool KernelAggregateVolume::IntersectP(const Ray &ray, float minT, float maxT, f
 			*t0 = min(*t0, a);
 			*t1 = max(*t1, b);
 		}
-	}
+		return true;
+	};
+	iterateVolumes(ray, minT, maxT, f);
 	return (*t0 < *t1);
 }
 
 Spectrum KernelAggregateVolume::sigma_a(const Vec3f& p, const NormalizedT<Vec3f>& w) const
 {
 	Spectrum s = Spectrum(0.0f);
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
-			s += m_pVolumes[i].sigma_a(p, w);
+	auto f = [&](unsigned int i)
+	{
+		s += m_pVolumes[i].sigma_a(p, w);
+		return true;
+	};
+	iterateVolumes(p, f);
 	return s;
 }
 
 Spectrum KernelAggregateVolume::sigma_s(const Vec3f& p, const NormalizedT<Vec3f>& w) const
 {
 	Spectrum s = Spectrum(0.0f);
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
-			s += m_pVolumes[i].sigma_s(p, w);
+	auto f = [&](unsigned int i)
+	{
+		s += m_pVolumes[i].sigma_s(p, w);
+		return true;
+	};
+	iterateVolumes(p, f);
 	return s;
 }
 
 Spectrum KernelAggregateVolume::Lve(const Vec3f& p, const NormalizedT<Vec3f>& w) const
 {
 	Spectrum s = Spectrum(0.0f);
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
-			s += m_pVolumes[i].Lve(p, w);
+	auto f = [&](unsigned int i)
+	{
+		s += m_pVolumes[i].Lve(p, w);
+		return true;
+	};
+	iterateVolumes(p, f);
 	return s;
 }
 
 Spectrum KernelAggregateVolume::sigma_t(const Vec3f &p, const NormalizedT<Vec3f> &wo) const
 {
 	Spectrum s = Spectrum(0.0f);
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
-			s += m_pVolumes[i].sigma_t(p, wo);
+	auto f = [&](unsigned int i)
+	{
+		s += m_pVolumes[i].sigma_t(p, wo);
+		return true;
+	};
+	iterateVolumes(p, f);
 	return s;
 }
 
 Spectrum KernelAggregateVolume::tau(const Ray &ray, float minT, float maxT) const
 {
 	Spectrum s = Spectrum(0.0f);
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
-			s += m_pVolumes[i].tau(ray, minT, maxT);
+	auto f = [&](unsigned int i)
+	{
+		s += m_pVolumes[i].tau(ray, minT, maxT);
+		return true;
+	};
+	iterateVolumes(ray, minT, maxT, f);
 	return s;
 }
 
@@ -301,13 +582,14 @@ float KernelAggregateVolume::Sample(const Vec3f& p, PhaseFunctionSamplingRecord&
 float KernelAggregateVolume::p(const Vec3f& p, const PhaseFunctionSamplingRecord& pRec) const
 {
 	float ph = 0, sumWt = 0;
-	for(unsigned int i = 0; i < m_uVolumeCount; i++)
-		if (m_pVolumes[i].WorldBound().Contains(p))
-		{
-			float wt = m_pVolumes[i].sigma_s(p, pRec.wo).avg();
-			sumWt += wt;
-			ph += wt * m_pVolumes[i].As()->Func.Evaluate(pRec);
-		}
+	auto f = [&](unsigned int i)
+	{
+		float wt = m_pVolumes[i].sigma_s(p, pRec.wo).avg();
+		sumWt += wt;
+		ph += wt * m_pVolumes[i].As()->Func.Evaluate(pRec);
+		return true;
+	};
+	iterateVolumes(p, f);
 	return sumWt != 0 ? ph / sumWt : 0.0f;
 }
 
@@ -325,43 +607,36 @@ bool KernelAggregateVolume::sampleDistance(const Ray& ray, float minT, float max
 	else return false;
 }
 
-//http://stackoverflow.com/questions/7669057/find-nth-set-bit-in-an-int
-CUDA_FUNC_IN int ffsn(unsigned int v, int n) {
-	for (int i = 0; i<n - 1; i++) {
-		v &= v - 1; // remove the least significant bit
-	}
-	return v & ~(v - 1); // extract the least significant bit
-}
-
 const VolumeRegion* KernelAggregateVolume::sampleVolume(const Ray& ray, float minT, float maxT, float& sample, float& pdf) const
 {
-	if (m_uVolumeCount == 0)
-		return 0;
-	else if (m_uVolumeCount == 1)
-		return m_pVolumes[0].WorldBound().Intersect<true>(ray, &minT, &maxT) ? m_pVolumes : 0;
-
-	//find all intersecting volumes
+	//count all volumes whose bounds intersect the segment
 	unsigned int n = 0;
-	unsigned int flag = 0;
-	for (unsigned int i = 0; i < m_uVolumeCount; i++)
+	auto count = [&](unsigned int i)
 	{
-		float a = minT, b = maxT;
-		if (m_pVolumes[i].WorldBound().Intersect<true>(ray, &a, &b))
-		{
-			n++;
-			flag |= 1 << i;
-		}
-	}
-
+		n++;
+		return true;
+	};
+	iterateVolumes(ray, minT, maxT, count);
 	if (!n)
 		return 0;
 
-	//randomly (uniform) choose one
+	//randomly (uniform) choose one, the second traversal visits them in the same order
 	unsigned int nth;
 	MonteCarlo::sampleReuse(n, sample, nth);
-	int i = ffsn(flag, nth);
+	nth = min(nth, n - 1);
+	const VolumeRegion* vol = 0;
+	auto select = [&](unsigned int i)
+	{
+		if (nth-- == 0)
+		{
+			vol = m_pVolumes + i;
+			return false;
+		}
+		return true;
+	};
+	iterateVolumes(ray, minT, maxT, select);
 	pdf = 1.0f / n;
-	return m_pVolumes + i;
+	return vol;
 }
 
 }
@@ -4,7 +4,9 @@
 #include "PhaseFunction.h"
 #include <Base/VirtualFuncType.h>
 #include <Base/CudaMemoryManager.h>
+#include <Base/SynchronizedBuffer.h>
 #include <Math/Spectrum.h>
+#include <vector>
 
 //Implementation and interface copied from Mitsuba as well as PBRT.
 
@@ -149,6 +151,10 @@ public:
 	{
 		return idx.x < dim.x && idx.y < dim.y && idx.z < dim.z;
 	}
+	size_t getSizeInBytes() const
+	{
+		return sizeof(T) * dim.x * dim.y * dim.z;
+	}
 	CUDA_FUNC_IN T& value(unsigned int i, unsigned int j, unsigned int k)
 	{
 		return getVar<T>()[idx(i, j, k)];
@@ -184,13 +190,208 @@ public:
 	}
 };
 
+//layout of the sparse grids, leaf bricks of 8^3 voxels are referenced by internal nodes of 16^3 bricks
+//which are referenced by a dense root table, empty bricks and nodes are not stored and evaluate to the background value
+enum
+{
+	SPARSE_VOL_LEAF_LOG2 = 3,
+	SPARSE_VOL_INTERNAL_LOG2 = 4,
+	SPARSE_VOL_LEAF_DIM = 1 << SPARSE_VOL_LEAF_LOG2,
+	SPARSE_VOL_INTERNAL_DIM = 1 << SPARSE_VOL_INTERNAL_LOG2,
+	SPARSE_VOL_LEAF_SIZE = SPARSE_VOL_LEAF_DIM * SPARSE_VOL_LEAF_DIM * SPARSE_VOL_LEAF_DIM,
+	SPARSE_VOL_INTERNAL_SIZE = SPARSE_VOL_INTERNAL_DIM * SPARSE_VOL_INTERNAL_DIM * SPARSE_VOL_INTERNAL_DIM,
+	//edge length in voxels of the region of a root table entry
+	SPARSE_VOL_ROOT_LOG2 = SPARSE_VOL_LEAF_LOG2 + SPARSE_VOL_INTERNAL_LOG2,
+};
+
+//host side tree of a sparse grid, allows computing the memory requirements before the grid is allocated
+template<typename T> struct SparseVolGridData
+{
+	Vec3u dim, rootDim;
+	T background;
+	//the root table followed by the internal nodes, UINT_MAX marks empty entries
+	std::vector<unsigned int> nodes;
+	std::vector<T> bricks;
+	//minimum and maximum value of every brick including the empty ones, x is the fastest changing brick coordinate
+	std::vector<Vec2f> brickRanges;
+
+	//clb(x, y, z) returns the value of a voxel, bricks which only contain the background value are not stored
+	template<typename F> void Build(const Vec3u& d, const T& bg, const F& clb)
+	{
+		dim = d;
+		background = bg;
+		const unsigned int R = 1 << SPARSE_VOL_ROOT_LOG2;
+		rootDim = Vec3u((dim.x + R - 1) / R, (dim.y + R - 1) / R, (dim.z + R - 1) / R);
+		unsigned int numRoot = rootDim.x * rootDim.y * rootDim.z;
+		nodes.assign(numRoot, UINT_MAX);
+		bricks.clear();
+		Vec3u bDim = getBrickGridDims();
+		brickRanges.assign(bDim.x * bDim.y * bDim.z, Vec2f(background, background));
+		std::vector<T> brick(SPARSE_VOL_LEAF_SIZE);
+		for (unsigned int rz = 0; rz < rootDim.z; rz++)
+			for (unsigned int ry = 0; ry < rootDim.y; ry++)
+				for (unsigned int rx = 0; rx < rootDim.x; rx++)
+				{
+					unsigned int rootIdx = (rz * rootDim.y + ry) * rootDim.x + rx;
+					for (unsigned int iz = 0; iz < SPARSE_VOL_INTERNAL_DIM; iz++)
+						for (unsigned int iy = 0; iy < SPARSE_VOL_INTERNAL_DIM; iy++)
+							for (unsigned int ix = 0; ix < SPARSE_VOL_INTERNAL_DIM; ix++)
+							{
+								Vec3u o = Vec3u(((rx << SPARSE_VOL_INTERNAL_LOG2) + ix) << SPARSE_VOL_LEAF_LOG2, ((ry << SPARSE_VOL_INTERNAL_LOG2) + iy) << SPARSE_VOL_LEAF_LOG2, ((rz << SPARSE_VOL_INTERNAL_LOG2) + iz) << SPARSE_VOL_LEAF_LOG2);
+								if (o.x >= dim.x || o.y >= dim.y || o.z >= dim.z)
+									continue;
+								bool empty = true;
+								T vMin = FLT_MAX, vMax = -FLT_MAX;
+								for (unsigned int z = 0; z < SPARSE_VOL_LEAF_DIM; z++)
+									for (unsigned int y = 0; y < SPARSE_VOL_LEAF_DIM; y++)
+										for (unsigned int x = 0; x < SPARSE_VOL_LEAF_DIM; x++)
+										{
+											//voxels outside of the grid repeat the border like the clamped lookup
+											T v = clb(min(o.x + x, dim.x - 1), min(o.y + y, dim.y - 1), min(o.z + z, dim.z - 1));
+											brick[(z * SPARSE_VOL_LEAF_DIM + y) * SPARSE_VOL_LEAF_DIM + x] = v;
+											empty &= v == background;
+											vMin = min(vMin, v);
+											vMax = max(vMax, v);
+										}
+								if (empty)
+									continue;
+								brickRanges[((o.z >> SPARSE_VOL_LEAF_LOG2) * bDim.y + (o.y >> SPARSE_VOL_LEAF_LOG2)) * bDim.x + (o.x >> SPARSE_VOL_LEAF_LOG2)] = Vec2f(vMin, vMax);
+								if (nodes[rootIdx] == UINT_MAX)
+								{
+									nodes[rootIdx] = (unsigned int)(nodes.size() - numRoot) / SPARSE_VOL_INTERNAL_SIZE;
+									nodes.resize(nodes.size() + SPARSE_VOL_INTERNAL_SIZE, UINT_MAX);
+								}
+								nodes[numRoot + nodes[rootIdx] * SPARSE_VOL_INTERNAL_SIZE + (iz * SPARSE_VOL_INTERNAL_DIM + iy) * SPARSE_VOL_INTERNAL_DIM + ix] = (unsigned int)(bricks.size() / SPARSE_VOL_LEAF_SIZE);
+								bricks.insert(bricks.end(), brick.begin(), brick.end());
+							}
+				}
+	}
+
+	Vec3u getBrickGridDims() const
+	{
+		const unsigned int L = SPARSE_VOL_LEAF_DIM;
+		return Vec3u((dim.x + L - 1) / L, (dim.y + L - 1) / L, (dim.z + L - 1) / L);
+	}
+
+	unsigned int getNumBricks() const
+	{
+		return (unsigned int)(bricks.size() / SPARSE_VOL_LEAF_SIZE);
+	}
+
+	size_t getNodeSizeInBytes() const
+	{
+		//the bricks are aligned to 16 bytes
+		return (nodes.size() * sizeof(unsigned int) + 15) / 16 * 16;
+	}
+
+	size_t getSizeInBytes() const
+	{
+		return getNodeSizeInBytes() + bricks.size() * sizeof(T);
+	}
+};
+
+//sparse counterpart of DenseVolGrid, value(x, y, z) uses x as the fastest changing coordinate
+template<typename T> struct SparseVolGrid : public DenseVolGridBaseType
+{
+	Vec3u dim, rootDim;
+	Vec3f dimF;
+	T background;
+	unsigned int numRootNodes;
+	unsigned int brickOffset;
+	size_t sizeInBytes;
+
+	SparseVolGrid()
+		: dim(0), rootDim(0), dimF(0), numRootNodes(0), brickOffset(0), sizeInBytes(0)
+	{
+
+	}
+	SparseVolGrid(Stream<char>* a_Buffer, const SparseVolGridData<T>& tree)
+		: DenseVolGridBaseType(a_Buffer, Vec3u((unsigned int)tree.getSizeInBytes(), 1, 1), 1, 16), dim(tree.dim), rootDim(tree.rootDim), background(tree.background),
+		  numRootNodes(tree.rootDim.x * tree.rootDim.y * tree.rootDim.z), brickOffset((unsigned int)tree.getNodeSizeInBytes()), sizeInBytes(tree.getSizeInBytes())
+	{
+		dimF = Vec3f((float)dim.x, (float)dim.y, (float)dim.z);
+		memcpy(data.host, &tree.nodes[0], tree.nodes.size() * sizeof(unsigned int));
+		if (tree.bricks.size())
+			memcpy(data.host + brickOffset, &tree.bricks[0], tree.bricks.size() * sizeof(T));
+	}
+	size_t getSizeInBytes() const
+	{
+		return sizeInBytes;
+	}
+	//index of the brick containing the voxel, UINT_MAX for empty space
+	CUDA_FUNC_IN unsigned int brickIndex(unsigned int x, unsigned int y, unsigned int z) const
+	{
+		const unsigned int* nodes = *getVar<unsigned int>();
+		unsigned int node = nodes[((z >> SPARSE_VOL_ROOT_LOG2) * rootDim.y + (y >> SPARSE_VOL_ROOT_LOG2)) * rootDim.x + (x >> SPARSE_VOL_ROOT_LOG2)];
+		if (node == UINT_MAX)
+			return UINT_MAX;
+		const unsigned int m = SPARSE_VOL_INTERNAL_DIM - 1;
+		return nodes[numRootNodes + node * SPARSE_VOL_INTERNAL_SIZE + ((((z >> SPARSE_VOL_LEAF_LOG2) & m) * SPARSE_VOL_INTERNAL_DIM + ((y >> SPARSE_VOL_LEAF_LOG2) & m)) * SPARSE_VOL_INTERNAL_DIM + ((x >> SPARSE_VOL_LEAF_LOG2) & m))];
+	}
+	CUDA_FUNC_IN const T* brick(unsigned int idx) const
+	{
+		return (const T*)(*data + brickOffset) + idx * SPARSE_VOL_LEAF_SIZE;
+	}
+	CUDA_FUNC_IN T value(unsigned int x, unsigned int y, unsigned int z) const
+	{
+		x = min(x, dim.x - 1);
+		y = min(y, dim.y - 1);
+		z = min(z, dim.z - 1);
+		unsigned int b = brickIndex(x, y, z);
+		if (b == UINT_MAX)
+			return background;
+		const unsigned int m = SPARSE_VOL_LEAF_DIM - 1;
+		return brick(b)[((z & m) * SPARSE_VOL_LEAF_DIM + (y & m)) * SPARSE_VOL_LEAF_DIM + (x & m)];
+	}
+	CUDA_FUNC_IN T sampleTrilinear(const Vec3f& vsP) const
+	{
+		const Vec3f p = max(vsP - Vec3f(0.5f), Vec3f(0.0f));
+		const Vec3u corner = Vec3u((unsigned int)p.x, (unsigned int)p.y, (unsigned int)p.z);
+		const Vec3f w = p - Vec3f((float)corner.x, (float)corner.y, (float)corner.z);
+		const unsigned int m = SPARSE_VOL_LEAF_DIM - 1;
+		T v[8];
+		//all taps are in the same brick unless the corner is on the last voxel of a brick or the grid, then the tree is traversed once per tap
+		if ((corner.x & m) != m && (corner.y & m) != m && (corner.z & m) != m && corner.x + 1 < dim.x && corner.y + 1 < dim.y && corner.z + 1 < dim.z)
+		{
+			unsigned int b = brickIndex(corner.x, corner.y, corner.z);
+			if (b == UINT_MAX)
+				return background;
+			const T* B = brick(b) + ((corner.z & m) * SPARSE_VOL_LEAF_DIM + (corner.y & m)) * SPARSE_VOL_LEAF_DIM + (corner.x & m);
+			for (int i = 0; i < 8; i++)
+				v[i] = B[((i >> 2) & 1) * SPARSE_VOL_LEAF_DIM * SPARSE_VOL_LEAF_DIM + ((i >> 1) & 1) * SPARSE_VOL_LEAF_DIM + (i & 1)];
+		}
+		else
+		{
+			for (int i = 0; i < 8; i++)
+				v[i] = value(corner.x + (i & 1), corner.y + ((i >> 1) & 1), corner.z + ((i >> 2) & 1));
+		}
+		T x00 = v[0] * (1 - w.x) + v[1] * w.x, x10 = v[2] * (1 - w.x) + v[3] * w.x;
+		T x01 = v[4] * (1 - w.x) + v[5] * w.x, x11 = v[6] * (1 - w.x) + v[7] * w.x;
+		T y0 = x00 * (1 - w.y) + x10 * w.y, y1 = x01 * (1 - w.y) + x11 * w.y;
+		return y0 * (1 - w.z) + y1 * w.z;
+	}
+};
+
+//how VolumeGrid computes the optical thickness and samples distances
+enum EVolumeGridIntegrator
+{
+	//deterministic integration over all voxels along the ray, kept as reference
+	EVolumeGridDDA,
+	//delta tracking and residual ratio tracking against a coarse majorant grid
+	EVolumeGridTracking,
+};
+
 struct VolumeGrid : public BaseVolumeRegion//, public e_DerivedTypeHelper<2>
 {
 	TYPE_FUNC(2)
+	//edge length in voxels of the cells of the majorant grid
+	enum { MAJORANT_CELL_SIZE = 8 };
 public:
 	CTL_EXPORT VolumeGrid();
 	CTL_EXPORT VolumeGrid(const PhaseFunction& func, const float4x4& ToWorld, Stream<char>* a_Buffer, Vec3u dim);
 	CTL_EXPORT VolumeGrid(const PhaseFunction& func, const float4x4& ToWorld, Stream<char>* a_Buffer, Vec3u dimA, Vec3u dimS, Vec3u dimL);
+	//sparse absorption and scattering densities, the emission density is 0
+	CTL_EXPORT VolumeGrid(const PhaseFunction& func, const float4x4& ToWorld, Stream<char>* a_Buffer, const SparseVolGridData<float>& dataA, const SparseVolGridData<float>& dataS);
 
 	CUDA_FUNC_IN Spectrum sigma_a(const Vec3f& p, const NormalizedT<Vec3f>& w) const
 	{
@@ -240,8 +441,40 @@ public:
 	Spectrum sigAMin, sigAMax, sigSMin, sigSMax, leMin, leMax;
 	DenseVolGrid<float> gridA, gridS, gridL, grid;
 	bool singleGrid;
+	//if set only sparseGridA and sparseGridS are used
+	SparseVolGrid<float> sparseGridA, sparseGridS;
+	bool sparseGrids;
 	float m_stepSize;
+	//minimum and maximum extinction of all channels per coarse cell, built in Update from the current sigma ranges
+	DenseVolGrid<Vec2f> majorantGrid;
+	//minimum and maximum absorption and scattering density per coarse cell, only changes with the voxel data
+	DenseVolGrid<Vec4f> densityRangeGrid;
+	//set after the voxel data was modified, the density ranges are recomputed by the next Update
+	bool voxelDataChanged;
+	EVolumeGridIntegrator integrator;
+
+	//has to be called after modifying the voxel data of an uploaded volume, also marks the voxel data as changed
+	CTL_EXPORT void InvalidateDeviceData(Stream<char>* a_Buffer);
 private:
+	CTL_EXPORT static Vec3u getMajorantGridDims(const Vec3u& dim);
+	void updateDensityRanges();
+	void setDensityRanges(const std::vector<Vec2f>& blocksA, const Vec3u& dimA, const std::vector<Vec2f>& blocksS, const Vec3u& dimS);
+	void updateMajorants();
+
+	CUDA_FUNC_IN bool useTracking() const
+	{
+		return integrator == EVolumeGridTracking && majorantGrid.dim.x != 0;
+	}
+
+	CUDA_FUNC_IN const Vec2f& majorant(const Vec3u& cell) const
+	{
+		return majorantGrid.getVar<Vec2f>()[(cell.z * majorantGrid.dim.y + cell.y) * majorantGrid.dim.x + cell.x];
+	}
+
+	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum residualRatioTracking(const Ray& ray, float minT, float maxT) const;
+
+	CTL_EXPORT CUDA_DEVICE CUDA_HOST bool deltaTracking(const Ray& ray, float minT, float maxT, float sample, float& t) const;
+
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST Spectrum integrateDensity(const Ray& ray, float minT, float maxT) const;
 
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST bool invertDensityIntegral(const Ray& ray, float minT, float maxT, float desiredDensity,
@@ -253,39 +486,62 @@ private:
 		csP = math::clamp01(csP) * dimF;
 		return csP;
 	}
+	//resolution of the finest grid
+	CUDA_FUNC_IN Vec3f voxelDimF() const
+	{
+		if (sparseGrids)
+			return max(sparseGridS.dimF, sparseGridA.dimF);
+		return singleGrid ? grid.dimF : max(gridS.dimF, gridA.dimF);
+	}
+	//densities at a point in [0,1]^3
+	CUDA_FUNC_IN void densitiesLocal(const Vec3f& pl, float& a, float& s) const
+	{
+		if (sparseGrids)
+		{
+			a = sparseGridA.sampleTrilinear(sparseGridA.dimF * pl);
+			s = sparseGridS.sampleTrilinear(sparseGridS.dimF * pl);
+		}
+		else if (singleGrid)
+			a = s = grid.sampleTrilinear(grid.dimF * pl);
+		else
+		{
+			a = gridA.sampleTrilinear(gridA.dimF * pl);
+			s = gridS.sampleTrilinear(gridS.dimF * pl);
+		}
+	}
 	CUDA_FUNC_IN float densityA(const Vec3f& p) const
 	{
-		if (singleGrid)
+		if (sparseGrids)
+			return sparseGridA.sampleTrilinear(tr(p, sparseGridA.dimF));
+		else if (singleGrid)
 			return grid.sampleTrilinear(tr(p, grid.dimF));
 		else return gridA.sampleTrilinear(tr(p, gridA.dimF));
 	}
 	CUDA_FUNC_IN float densityS(const Vec3f& p) const
 	{
-		if (singleGrid)
+		if (sparseGrids)
+			return sparseGridS.sampleTrilinear(tr(p, sparseGridS.dimF));
+		else if (singleGrid)
 			return grid.sampleTrilinear(tr(p, grid.dimF));
 		else return gridS.sampleTrilinear(tr(p, gridS.dimF));
 	}
 	CUDA_FUNC_IN float densityL(const Vec3f& p) const
 	{
-		if (singleGrid)
+		if (sparseGrids)
+			return 0.0f;
+		else if (singleGrid)
 			return grid.sampleTrilinear(tr(p, grid.dimF));
 		else return gridL.sampleTrilinear(tr(p, gridL.dimF));
 	}
 	CUDA_FUNC_IN float densityT(const Vec3f& p) const
 	{
-		if (singleGrid)
-			return 2 * grid.sampleTrilinear(tr(p, grid.dimF));
-		else return gridA.sampleTrilinear(tr(p, gridA.dimF)) + gridS.sampleTrilinear(tr(p, gridS.dimF));
+		float a, s;
+		densityT(p, a, s);
+		return a + s;
 	}
 	CUDA_FUNC_IN void densityT(const Vec3f& p, float& a, float& s) const
 	{
-		if (singleGrid)
-			a = s = grid.sampleTrilinear(tr(p, grid.dimF));
-		else
-		{
-			a = gridA.sampleTrilinear(tr(p, gridA.dimF));
-			s = gridS.sampleTrilinear(tr(p, gridS.dimF));
-		};
+		densitiesLocal(math::clamp01(WorldToVolume.TransformPoint(p)), a, s);
 	}
 };
 
@@ -339,16 +595,121 @@ public:
 	}
 };
 
+//node of the bvh over the world bounds of the volumes, leaves contain exactly one volume
+struct VolumeBVHNode
+{
+	AABB box;
+	//index of the first child for inner nodes, the second one is stored directly after it
+	unsigned int child;
+	//index of the volume for leaves, UINT_MAX for inner nodes
+	unsigned int volume;
+
+	CUDA_FUNC_IN bool isLeaf() const
+	{
+		return volume != UINT_MAX;
+	}
+};
+
+//host side owner of the volume bvh, it is rebuilt completely when a volume changes
+class VolumeRegionBVH
+{
+	SynchronizedBuffer<VolumeBVHNode> m_nodes;
+	unsigned int m_numNodes;
+	unsigned int m_numVolumes;
+public:
+	CTL_EXPORT VolumeRegionBVH();
+	CTL_EXPORT void Free();
+	CTL_EXPORT void Build(Stream<VolumeRegion>* volumes);
+
+	unsigned int getNumNodes() const
+	{
+		return m_numNodes;
+	}
+	unsigned int getNumVolumes() const
+	{
+		return m_numVolumes;
+	}
+	const VolumeBVHNode* getNodes(bool devicePointer)
+	{
+		return m_numNodes == 0 ? 0 : (devicePointer ? m_nodes.getDevicePtr() : &m_nodes[0]);
+	}
+};
+
 struct KernelAggregateVolume
 {
-	enum{ MAX_VOL_COUNT = 16 };
+	//median splits bound the depth of the bvh by log2 of the number of volumes
+	enum{ MAX_STACK_DEPTH = 32 };
 public:
 	unsigned int m_uVolumeCount;
-	VolumeRegion m_pVolumes[MAX_VOL_COUNT];
+	const VolumeRegion* m_pVolumes;
+	const VolumeBVHNode* m_pNodes;
 	AABB box;
+private:
+	//calls f(volumeIdx) for all volumes whose world bound contains p until f returns false
+	template<typename F> CUDA_FUNC_IN void iterateVolumes(const Vec3f& p, F& f) const
+	{
+		if (m_uVolumeCount == 0)
+			return;
+		unsigned int stack[MAX_STACK_DEPTH];
+		int stackPos = 0;
+		stack[stackPos++] = 0;
+		while (stackPos)
+		{
+			const VolumeBVHNode& node = m_pNodes[stack[--stackPos]];
+			if (!node.box.Contains(p))
+				continue;
+			if (node.isLeaf())
+			{
+				if (!f(node.volume))
+					return;
+			}
+			else
+			{
+				stack[stackPos++] = node.child + 1;
+				stack[stackPos++] = node.child;
+			}
+		}
+	}
+
+	//calls f(volumeIdx) for all volumes whose world bound overlaps the ray segment until f returns false
+	//nearer children are visited first, the volumes are therefore roughly ordered by their entry distance
+	template<typename F> CUDA_FUNC_IN void iterateVolumes(const Ray& ray, float minT, float maxT, F& f) const
+	{
+		if (m_uVolumeCount == 0)
+			return;
+		float a = minT, b = maxT;
+		if (!m_pNodes[0].box.Intersect<true>(ray, &a, &b))
+			return;
+		unsigned int stack[MAX_STACK_DEPTH];
+		int stackPos = 0;
+		stack[stackPos++] = 0;
+		while (stackPos)
+		{
+			const VolumeBVHNode& node = m_pNodes[stack[--stackPos]];
+			if (node.isLeaf())
+			{
+				if (!f(node.volume))
+					return;
+				continue;
+			}
+			float a0 = minT, b0 = maxT, a1 = minT, b1 = maxT;
+			bool hit0 = m_pNodes[node.child].box.Intersect<true>(ray, &a0, &b0);
+			bool hit1 = m_pNodes[node.child + 1].box.Intersect<true>(ray, &a1, &b1);
+			if (hit0 && hit1)
+			{
+				bool firstNear = a0 <= a1;
+				stack[stackPos++] = firstNear ? node.child + 1 : node.child;
+				stack[stackPos++] = firstNear ? node.child : node.child + 1;
+			}
+			else if (hit0)
+				stack[stackPos++] = node.child;
+			else if (hit1)
+				stack[stackPos++] = node.child + 1;
+		}
+	}
 public:
 	CUDA_FUNC_IN KernelAggregateVolume(){}
-	CTL_EXPORT KernelAggregateVolume(Stream<VolumeRegion>* D, bool devicePointer = true);
+	CTL_EXPORT KernelAggregateVolume(Stream<VolumeRegion>* D, VolumeRegionBVH& bvh, bool devicePointer = true);
 
 	///Calculates the intersection of the ray with the bound of the volume
 	CTL_EXPORT CUDA_DEVICE CUDA_HOST bool IntersectP(const Ray &ray, float minT, float maxT, float *t0, float *t1) const;
@@ -388,11 +749,14 @@ public:
 
 	CUDA_FUNC_IN bool IsInVolume(const Vec3f& p) const
 	{
-		for (unsigned int i = 0; i < m_uVolumeCount; i++)
-			if (m_pVolumes[i].As()->insideWorld(p))
-				return true;
-		return false;
+		bool inside = false;
+		auto f = [&](unsigned int i)
+		{
+			inside = m_pVolumes[i].As()->insideWorld(p);
+			return !inside;
+		};
+		iterateVolumes(p, f);
+		return inside;
 	}
 };
-
 }
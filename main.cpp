@@ -7,6 +7,11 @@
 #include <boost/optional.hpp>
 #include <boost/progress.hpp>
 #include <algorithm>
+#include <memory>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include <thread>
 #include <Engine/Core.h>
 #include <Engine/DynamicScene.h>
 #include <SceneTypes/Node.h>
@@ -21,6 +26,10 @@
 #include <Integrators/ProgressivePhotonMapping/PPPMTracer.h>
 #include <Integrators/PseudoRealtime/WavefrontPathTracer.h>
 #include <Kernel/ImagePipeline/ImagePipeline.h>
+#include <Kernel/ImagePipeline/ExrOutput.h>
+#include <Kernel/RenderScheduler.h>
+#include <Base/Profiler.h>
+#include <Base/RenderCheckpoint.h>
 #include <Engine/SceneLoader/Mitsuba/MitsubaLoader.h>
 //for multiple GPU ray tracing
 #include <mpi.h>
@@ -56,10 +65,37 @@ struct options
     std::string scene_file;
     int n_passes;
     TracerBase* tracer;
+    //merge all ranks into rank 0 every n passes and write an intermediate image, 0 to only merge at the end
+    int merge_interval;
+    //hand out the passes on demand based on the measured speed of each rank
+    bool rebalance;
+    //stop handing out passes after this many seconds, 0 to disable
+    double deadline;
+    //stop as soon as the estimated variance of the merged image is below this value, 0 to disable
+    double target_variance;
+    //pixels with an error estimate below this value stop receiving samples and rendering stops once the average error is below it, 0 to disable
+    double target_error;
+    //chrome trace of the profiled zones written at the end, empty to disable
+    std::string trace_file;
+    //the progressive state is written to this file periodically and resumed from it if it exists, empty to disable
+    std::string checkpoint_file;
+    double checkpoint_interval;
+    //stores the accumulation buffer in tiles matching the blocks of the block sampler
+    bool tiled_framebuffer;
+    //additionally writes the results as multi layer exr images
+    bool write_exr;
 };
 boost::optional<options> parse_arguments(int ac, char** av)
 {
     options opt;
+    opt.merge_interval = 0;
+    opt.rebalance = true;
+    opt.deadline = 0;
+    opt.target_variance = 0;
+    opt.target_error = 0;
+    opt.checkpoint_interval = 300;
+    opt.tiled_framebuffer = false;
+    opt.write_exr = false;
 
     auto is_number = [](const std::string& s)
     {
@@ -69,6 +105,21 @@ boost::optional<options> parse_arguments(int ac, char** av)
 
     std::vector<std::string> tracers = { "direct", "PT", "PT_Wave", "BDPT", "PPPM" };
 
+    auto parse_float = [](const std::string& arg, const std::string& prefix, double& val)
+    {
+        if (arg.compare(0, prefix.size(), prefix) != 0)
+            return false;
+        try
+        {
+            val = std::stod(arg.substr(prefix.size()));
+            return true;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    };
+
     auto print_error = [&](const std::string& arg)
     {
         //print error message
@@ -76,14 +127,54 @@ boost::optional<options> parse_arguments(int ac, char** av)
         std::cout << "accepts 4 arguments : data path, scene file path, number of passes and tracer type {";
         for (auto& t : tracers)
             std::cout << t << ", ";
-        std::cout << "}" << std::endl << arg << " could not be used, exiting now" << std::endl;
+        std::cout << "}" << std::endl;
+        std::cout << "optional : --merge=n to merge all MPI processes every n passes, --static to split the passes equally," << std::endl;
+        std::cout << "           --deadline=sec to stop after a number of seconds, --variance=v to stop at an estimated variance," << std::endl;
+        std::cout << "           --error=e to stop sampling converged pixels and stop at an average pixel error," << std::endl;
+        std::cout << "           --trace=file to write a chrome trace of the profiled zones," << std::endl;
+        std::cout << "           --checkpoint=file to resume from and periodically save to a checkpoint, --checkpoint_interval=sec," << std::endl;
+        std::cout << "           --tiled to use a tiled framebuffer layout, --exr to also write multi layer exr images" << std::endl;
+        std::cout << arg << " could not be used, exiting now" << std::endl;
     };
 
     int n_args_used = 0;
     for (int i = 1; i < ac; i++)
     {
         std::string arg = av[i];
-        if (boost::filesystem::is_directory(boost::filesystem::path(arg)))
+        const std::string merge_prefix = "--merge=";
+        if (arg.compare(0, merge_prefix.size(), merge_prefix) == 0 && is_number(arg.substr(merge_prefix.size())))
+        {
+            opt.merge_interval = std::stoi(arg.substr(merge_prefix.size()));
+            continue;
+        }
+        else if (arg == "--static")
+        {
+            opt.rebalance = false;
+            continue;
+        }
+        else if (arg == "--tiled")
+        {
+            opt.tiled_framebuffer = true;
+            continue;
+        }
+        else if (arg == "--exr")
+        {
+            opt.write_exr = true;
+            continue;
+        }
+        else if (parse_float(arg, "--deadline=", opt.deadline) || parse_float(arg, "--variance=", opt.target_variance) || parse_float(arg, "--error=", opt.target_error) || parse_float(arg, "--checkpoint_interval=", opt.checkpoint_interval))
+            continue;
+        else if (arg.compare(0, 13, "--checkpoint=") == 0)
+        {
+            opt.checkpoint_file = arg.substr(13);
+            continue;
+        }
+        else if (arg.compare(0, 8, "--trace=") == 0)
+        {
+            opt.trace_file = arg.substr(8);
+            continue;
+        }
+        else if (boost::filesystem::is_directory(boost::filesystem::path(arg)))
             opt.data_path = arg + "/";
         else if (boost::filesystem::is_regular_file(boost::filesystem::path(arg)))
             opt.scene_file = arg;
@@ -121,10 +212,162 @@ boost::optional<options> parse_arguments(int ac, char** av)
     return opt;
 }
 
+//sends the scheduler messages as raw bytes over a duplicated communicator so that they can not interfere with the image reduction
+//the master runs on its own thread on rank 0, which requires MPI_THREAD_MULTIPLE
+class MPIRenderSchedulerTransport : public IRenderSchedulerTransport
+{
+    enum { TAG_REPORT = 1, TAG_ASSIGNMENT = 2 };
+    MPI_Comm comm;
+    int size;
+public:
+    MPIRenderSchedulerTransport(MPI_Comm parent)
+    {
+        MPI_Comm_dup(parent, &comm);
+        MPI_Comm_size(comm, &size);
+    }
+    ~MPIRenderSchedulerTransport()
+    {
+        MPI_Comm_free(&comm);
+    }
+    virtual int getNumWorkers() const
+    {
+        return size;
+    }
+    virtual RenderWorkerReport receiveReport()
+    {
+        RenderWorkerReport report;
+        MPI_Recv(&report, sizeof(report), MPI_BYTE, MPI_ANY_SOURCE, TAG_REPORT, comm, MPI_STATUS_IGNORE);
+        return report;
+    }
+    virtual void sendAssignment(int worker, const RenderAssignment& assignment)
+    {
+        MPI_Send((void*)&assignment, sizeof(assignment), MPI_BYTE, worker, TAG_ASSIGNMENT, comm);
+    }
+    virtual void sendReport(const RenderWorkerReport& report)
+    {
+        MPI_Send((void*)&report, sizeof(report), MPI_BYTE, 0, TAG_REPORT, comm);
+    }
+    virtual RenderAssignment receiveAssignment(int worker)
+    {
+        RenderAssignment assignment;
+        MPI_Recv(&assignment, sizeof(assignment), MPI_BYTE, 0, TAG_ASSIGNMENT, comm, MPI_STATUS_IGNORE);
+        return assignment;
+    }
+};
+
+//number of pixels which are reduced with one MPI call, bounds the size of the transfer buffers
+const int MPI_REDUCE_CHUNK_PIXELS = 1 << 16;
+//rgb, splat and weight sum, the splat is transferred as float also if it is stored as half
+const int PIXEL_DATA_FLOATS = 7;
+
+//sums the accumulation buffers of all MPI processes into the pixel buffer of target on rank 0
+//the splat buffers are normalized differently by each tracer, therefore they are scaled with the local splat scale and
+//number of passes before the summation and normalized with the splat scale of rank 0 and the total number of passes afterwards
+//the image is reduced in chunks with two transfers in flight so that packing and unpacking overlaps with the communication
+//the pixels are reduced in storage order, both images need the same layout
+void reduceImage(int rank, TracerBase& tracer, Image& local, Image* target)
+{
+    if (target && target->getLayout() != local.getLayout())
+        throw std::runtime_error("The images to reduce have to use the same layout!");
+    const int n_pixels = local.getNumStoredPixels();
+    int local_passes = tracer.getNumPassesDone(), total_passes = 0;
+    MPI_Reduce(&local_passes, &total_passes, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    //the kernels do not update the location flags, the data is always on the device after rendering
+    local.setOnGPU();
+    local.Synchronize();
+    float local_splat_weight = local_passes ? tracer.getSplatScale() * local_passes : 0.0f;
+    float target_splat_scale = rank == 0 ? tracer.getSplatScale() * total_passes : 0.0f;
+    float target_splat_norm = target_splat_scale > 0 && std::isfinite(target_splat_scale) ? 1.0f / target_splat_scale : 0.0f;
+
+    std::vector<float> send_buffer[2], recv_buffer[2];
+    MPI_Request requests[2] = { MPI_REQUEST_NULL, MPI_REQUEST_NULL };
+    int chunk_start[2] = { 0, 0 }, chunk_size[2] = { 0, 0 };
+    for (int b = 0; b < 2; b++)
+    {
+        send_buffer[b].resize(MPI_REDUCE_CHUNK_PIXELS * PIXEL_DATA_FLOATS);
+        if (rank == 0)
+            recv_buffer[b].resize(MPI_REDUCE_CHUNK_PIXELS * PIXEL_DATA_FLOATS);
+    }
+
+    auto finish_chunk = [&](int b)
+    {
+        if (requests[b] == MPI_REQUEST_NULL)
+            return;
+        MPI_Wait(&requests[b], MPI_STATUS_IGNORE);
+        if (rank != 0)
+            return;
+        for (int i = 0; i < chunk_size[b]; i++)
+        {
+            int p = chunk_start[b] + i;
+            const float* src = &recv_buffer[b][i * PIXEL_DATA_FLOATS];
+            PixelData& dst = target->getStoredPixelData(p);
+            for (int j = 0; j < 3; j++)
+                dst.rgb[j] = src[j];
+            dst.setSplat(Vec3f(src[3], src[4], src[5]) * target_splat_norm);
+            dst.weightSum = src[6];
+        }
+    };
+
+    for (int start = 0, chunk = 0; start < n_pixels; start += MPI_REDUCE_CHUNK_PIXELS, chunk++)
+    {
+        int b = chunk % 2;
+        finish_chunk(b);
+        chunk_start[b] = start;
+        chunk_size[b] = std::min(MPI_REDUCE_CHUNK_PIXELS, n_pixels - start);
+        for (int i = 0; i < chunk_size[b]; i++)
+        {
+            const PixelData& src = local.getStoredPixelData(start + i);
+            float* dst = &send_buffer[b][i * PIXEL_DATA_FLOATS];
+            Vec3f splat = src.getSplat();
+            for (int j = 0; j < 3; j++)
+            {
+                dst[j] = local_passes ? src.rgb[j] : 0.0f;
+                dst[3 + j] = splat[j] * local_splat_weight;
+            }
+            dst[6] = local_passes ? src.weightSum : 0.0f;
+        }
+        MPI_Ireduce(send_buffer[b].data(), rank == 0 ? recv_buffer[b].data() : 0, chunk_size[b] * PIXEL_DATA_FLOATS, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD, &requests[b]);
+    }
+    finish_chunk(0);
+    finish_chunk(1);
+
+    if (rank == 0)
+    {
+        target->setOnCPU();
+        target->Synchronize();
+    }
+}
+
+//splits n passes between the processes proportionally to their measured speed using the largest remainder method
+std::vector<int> distributePasses(int n, const std::vector<double>& passes_per_sec)
+{
+    int size = (int)passes_per_sec.size();
+    double total_speed = 0;
+    for (double s : passes_per_sec)
+        total_speed += s;
+
+    std::vector<int> passes(size, 0);
+    std::vector<std::pair<double, int>> remainders(size);
+    int assigned = 0;
+    for (int i = 0; i < size; i++)
+    {
+        double share = total_speed > 0 ? n * passes_per_sec[i] / total_speed : double(n) / size;
+        passes[i] = (int)share;
+        assigned += passes[i];
+        remainders[i] = std::make_pair(share - passes[i], -i);
+    }
+    //ties are resolved in favor of lower ranks so that rank 0 always renders if there are passes left
+    std::sort(remainders.begin(), remainders.end(), std::greater<std::pair<double, int>>());
+    for (int i = 0; assigned < n; i = (i + 1) % size, assigned++)
+        passes[-remainders[i].second]++;
+    return passes;
+}
+
 int main(int ac, char** av)
 {
-    int size, rank;
-    MPI_Init(&ac, &av);
+    int size, rank, thread_support;
+    MPI_Init_thread(&ac, &av, MPI_THREAD_MULTIPLE, &thread_support);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     auto opt_options = parse_arguments(ac, av);
@@ -147,45 +390,185 @@ int main(int ac, char** av)
         height = img_size.get().y;
     }
 
-    Image outImage(width, height);
+    ImageLayout layout = options.tiled_framebuffer ? IMAGE_LAYOUT_TILED : IMAGE_LAYOUT_LINEAR;
+    Image outImage(width, height, 0, layout);
 
     options.tracer->Resize(width, height);
+    if (options.target_error > 0 && options.tracer->isMultiPass())
+    {
+        auto& sampler_settings = options.tracer->getBlockSampler()->getParameterCollection();
+        sampler_settings.setValue(IBlockSampler::KEY_PixelErrorThreshold(), (float)options.target_error);
+        sampler_settings.setValue(IBlockSampler::KEY_TargetError(), (float)options.target_error);
+    }
     options.tracer->InitializeScene(&scene);
     scene.UpdateScene();
 
-    boost::progress_display show_progress(options.n_passes);
-	//each GPU gtes roughly equal iterations, i.e. passes.
-	int pass_per_GPU[size];
-	int divisor   = options.n_passes / size;
-	int remainder = options.n_passes % size;
-	for(int i = 0; i < size; i++)
-		pass_per_GPU[i] = divisor;
-	// if options.n_passes is not integer times of MPI size, let the first
-	// remainder MPI processes get the remainder samples. We have a
-	// hypothesis that each pass has almost equal compute time. 
-	if(remainder) {
-		for(int i = 0; i < remainder; i++)
-			pass_per_GPU[i] += 1;
-	}
-    for (int i = 0; i < pass_per_GPU[rank]; i++)
-    {
-        options.tracer->DoPass(&outImage, !i);
-        ++show_progress;
-    }
-
-    //MPI process rank 0 gather other MPI process's rendering results.
-    if(rank == 0) {// receive from other GPU's results
-    }
-    else {// send local GPU's results to MPI process rank 0 (GPU 0)
-    }
-    //other code 
-    //
-    //other code
-	
-    if(rank ==0) {
-	applyImagePipeline(*options.tracer, outImage, CreateAggregate<Filter>(BoxFilter(0.5f, 0.5f)));
-	outImage.WriteDisplayImage("result.png");
+    //every process has to use different random numbers, otherwise all processes would compute the same image
+    options.tracer->setSamplingSequenceSeed(7539414u + 7919u * (unsigned int)rank);
+
+    //every process writes and resumes its own checkpoint
+    std::string checkpoint_file = options.checkpoint_file;
+    if (!checkpoint_file.empty() && size != 1)
+        checkpoint_file += "." + std::to_string(rank);
+    if (!checkpoint_file.empty() && !options.tracer->isMultiPass())
+    {
+        std::cout << "checkpoints are only supported for progressive tracers" << std::endl;
+        checkpoint_file.clear();
+    }
+    if (!checkpoint_file.empty() && boost::filesystem::is_regular_file(checkpoint_file))
+    {
+        RenderCheckpoint checkpoint;
+        checkpoint.ReadFromFile(checkpoint_file);
+        options.tracer->LoadCheckpoint(checkpoint);
+        std::cout << "resuming from " << checkpoint_file << std::endl;
+    }
+    AsyncCheckpointWriter checkpoint_writer;
+    double last_checkpoint = MPI_Wtime();
+    auto write_checkpoint = [&](bool force)
+    {
+        if (checkpoint_file.empty() || (!force && MPI_Wtime() - last_checkpoint < options.checkpoint_interval))
+            return;
+        RenderCheckpoint checkpoint;
+        options.tracer->SaveCheckpoint(&outImage, checkpoint);
+        checkpoint_writer.Submit(checkpoint, checkpoint_file);
+        last_checkpoint = MPI_Wtime();
+    };
+
+    std::unique_ptr<boost::progress_display> show_progress;
+    std::unique_ptr<Image> mergedImage;
+    if (rank == 0)
+    {
+        show_progress.reset(new boost::progress_display(options.n_passes));
+        mergedImage.reset(new Image(width, height, 0, layout));
+    }
+
+    //the exr images are encoded and written while the rendering continues
+    AsyncExrWriter exr_writer;
+    auto write_exr = [&](const std::string& file)
+    {
+        if (!options.write_exr)
+            return;
+        ExrImage exr;
+        CaptureExrLayers(*options.tracer, *mergedImage, exr);
+        exr_writer.Submit(exr, file);
+    };
+
+    auto merge_intermediate = [&]()
+    {
+        reduceImage(rank, *options.tracer, outImage, mergedImage.get());
+        if (rank == 0)
+        {
+            applyImagePipeline(*options.tracer, *mergedImage, CreateAggregate<Filter>(BoxFilter(0.5f, 0.5f)));
+            mergedImage->WriteDisplayImage("result_intermediate.png");
+            write_exr("result_intermediate.exr");
+        }
+    };
+
+    bool dynamic_scheduling = options.rebalance && (size == 1 || thread_support >= MPI_THREAD_MULTIPLE);
+    if (rank == 0 && options.rebalance && !dynamic_scheduling)
+        std::cout << "MPI_THREAD_MULTIPLE is not supported, falling back to rebalancing after fixed rounds" << std::endl;
+    if (rank == 0 && !dynamic_scheduling && (options.deadline > 0 || options.target_variance > 0))
+        std::cout << "deadline and variance target are only supported with dynamic scheduling" << std::endl;
+
+    if (dynamic_scheduling)
+    {
+        //rank 0 runs the master on a second thread and renders on the main thread like every other rank
+        std::unique_ptr<IRenderSchedulerTransport> transport;
+        if (size == 1)
+            transport.reset(new LocalRenderSchedulerTransport(1));
+        else transport.reset(new MPIRenderSchedulerTransport(MPI_COMM_WORLD));
+
+        RenderSchedulerSettings settings(options.n_passes);
+        settings.deadlineSec = options.deadline;
+        settings.targetVariance = (float)options.target_variance;
+        settings.mergeInterval = options.merge_interval * size;
+
+        std::unique_ptr<RenderScheduler> scheduler;
+        std::thread master;
+        if (rank == 0)
+        {
+            scheduler.reset(new RenderScheduler(*transport, settings));
+            scheduler->setProgressCallback([&](unsigned int n) { (*show_progress) += n; });
+            master = std::thread([&]() { scheduler->RunMaster(); });
+        }
+
+        RunRenderWorker(*transport, rank, *options.tracer, outImage, merge_intermediate, [&]() { write_checkpoint(false); });
+
+        if (rank == 0)
+        {
+            master.join();
+            std::vector<std::string> status;
+            scheduler->PrintStatus(status);
+            for (auto& line : status)
+                std::cout << line << std::endl;
+        }
     }
+    else
+    {
+        //the passes are rendered in rounds, after each round the processes exchange their speed and optionally merge their images
+        //without merging and redistribution all passes are split equally in a single round
+        int passes_per_round = options.n_passes;
+        if (options.merge_interval > 0)
+            passes_per_round = options.merge_interval * size;
+        else if (options.rebalance)
+            passes_per_round = std::max(size, options.n_passes / 4);
+
+        std::vector<double> passes_per_sec(size, 1.0);
+        int passes_remaining = options.n_passes, local_passes_done = 0;
+        while (passes_remaining > 0)
+        {
+            auto round_passes = distributePasses(std::min(passes_per_round, passes_remaining), passes_per_sec);
+
+            double round_start = MPI_Wtime();
+            int rendered_passes = 0;
+            for (; rendered_passes < round_passes[rank] && !options.tracer->hasConverged(); rendered_passes++)
+            {
+                options.tracer->DoPass(&outImage, !local_passes_done++ && !options.tracer->hasPendingCheckpoint());
+                if (show_progress)
+                    ++(*show_progress);
+                write_checkpoint(false);
+            }
+            double local_speed = rendered_passes / std::max(MPI_Wtime() - round_start, 1e-6);
+
+            std::vector<double> measured_speed(size);
+            MPI_Allgather(&local_speed, 1, MPI_DOUBLE, measured_speed.data(), 1, MPI_DOUBLE, MPI_COMM_WORLD);
+            for (int r = 0; r < size; r++)
+            {
+                //processes which did not render in this round keep their previous estimate
+                if (options.rebalance && measured_speed[r] > 0)
+                    passes_per_sec[r] = measured_speed[r];
+                passes_remaining -= round_passes[r];
+                if (show_progress && r != 0)
+                    (*show_progress) += round_passes[r];
+            }
+
+            //all processes stop once every one of them has converged
+            int local_converged = options.tracer->hasConverged() ? 1 : 0, all_converged = 0;
+            MPI_Allreduce(&local_converged, &all_converged, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+            if (all_converged)
+                break;
+
+            if (options.merge_interval > 0 && passes_remaining > 0)
+                merge_intermediate();
+        }
+    }
+
+    write_checkpoint(true);
+    checkpoint_writer.Wait();
+
+    //MPI process rank 0 gathers the rendering results of all processes
+    reduceImage(rank, *options.tracer, outImage, mergedImage.get());
+    if (rank == 0)
+    {
+        applyImagePipeline(*options.tracer, *mergedImage, CreateAggregate<Filter>(BoxFilter(0.5f, 0.5f)));
+        mergedImage->WriteDisplayImage("result.png");
+        write_exr("result.exr");
+        exr_writer.Wait();
+        mergedImage->Free();
+    }
+
+    if (!options.trace_file.empty())
+        Profiler::getInstance().WriteChromeTrace(size == 1 ? options.trace_file : options.trace_file + "." + std::to_string(rank));
 
     outImage.Free();
     DeInitializeCuda4Tracer();